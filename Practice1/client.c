@@ -1,32 +1,57 @@
+#define _GNU_SOURCE // pthread_tryjoin_np()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/random.h>
+#include "../common/lzcodec.h"
+#include "../common/crc32c.h"
+#include "../common/tls.h"
+#include "../common/tcptune.h"
 
 #define PORT 65432
 #define SERVER_IP "127.0.0.1"
 #define REQUEST_FILE "source_file.txt"
 #define SAVE_AS_FILE "received_source_file.txt"
 #define BUFFER_SIZE 4096
+#define STREAM_BUFFER_SIZE (256 * 1024) // Receive buffer of each parallel stream
+#define MIN_RANGE_SIZE (1024 * 1024)    // Files are not split into ranges smaller than this
+#define MAX_STREAMS 64
+
+// One byte range fetched over its own TCP connection
+struct range_task
+{
+    const char *filename;
+    int out_fd;
+    long long offset;
+    long long length;
+    long long received;
+    uint32_t crc; // CRC32C of the bytes written so far
+    int ok;
+};
+
+static long long total_received = 0; // Updated atomically by every stream
+static long long total_wire = 0;     // Bytes that crossed the network (compressed size)
+static int use_compression = 0;      // -z: ask the server for an lz-compressed body
+static int use_checksum = 1;         // Verify every range against the server's CRC32C (-k disables)
+static uint8_t *tls_psk;             // -T: shared key; the body is then requested encrypted
+static size_t tls_psk_len;
+static int tls_mode_reported;
 
 /**
- * @brief Initializes and runs the TCP client for file transfer.
+ * @brief Opens a TCP connection to the server.
+ * @return Connected socket, or -1 on error.
  */
-int main()
+static int connect_to_server()
 {
-    int sock = 0;
+    int sock;
     struct sockaddr_in serv_addr;
-    char header_buffer[1024] = {0};
-    char file_buffer[BUFFER_SIZE];
-    long long file_size = 0;
-    long long bytes_received = 0;
-    ssize_t valread;
-    FILE *fp = NULL;
-
-    printf("Attempting to connect to Server at %s:%d\n", SERVER_IP, PORT);
 
     // Create a socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -35,6 +60,7 @@ int main()
         return -1;
     }
 
+    memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(PORT);
 
@@ -42,105 +68,600 @@ int main()
     if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0)
     {
         printf("\nInvalid address/ Address not supported \n");
+        close(sock);
         return -1;
     }
 
-    // 1. Client connects to the server
     if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
     {
         perror("Connection Failed");
+        close(sock);
         return -1;
     }
-    printf("Successfully connected to the server.\n");
+    return sock;
+}
+
+/**
+ * @brief Sends a range request and parses the 'OK:<length> <file_size>[ options]'
+ *        header. Body bytes that arrive together with the header are left in 'buf'.
+ *        With -T the body is requested encrypted: '*tls' receives its keys, and
+ *        the header is read without taking any record bytes off the socket, so
+ *        the kernel can decrypt from there.
+ * @return Number of body bytes already in 'buf', or -1 on error.
+ */
+static ssize_t request_range(int sock, const char *filename, long long offset, long long length,
+                             char *buf, size_t buf_size, long long *range_len, long long *file_size,
+                             int *codec, int *checksum, TlsKey **tls)
+{
+    char request[1100];
+    size_t have = 0;
+    char *newline = NULL;
+    int consumed = 0;
+    uint8_t client_nonce[TLS_NONCE_LEN], server_nonce[TLS_NONCE_LEN];
+    char tls_option[8 + 2 * TLS_NONCE_LEN] = "";
 
-    // 2. Client sends the desired filename (Protocol Step 1)
-    if (send(sock, REQUEST_FILE, strlen(REQUEST_FILE), 0) < 0)
+    *tls = NULL;
+    if (tls_psk != NULL)
     {
-        perror("Error sending filename");
-        goto cleanup;
+        if (getrandom(client_nonce, sizeof(client_nonce), 0) != sizeof(client_nonce))
+        {
+            perror("Error generating TLS nonce");
+            return -1;
+        }
+        strcpy(tls_option, " tls:");
+        for (int i = 0; i < TLS_NONCE_LEN; i++)
+        {
+            sprintf(tls_option + 5 + 2 * i, "%02x", client_nonce[i]);
+        }
     }
-    printf("Requested file: '%s'\n", REQUEST_FILE);
 
-    // 3. Client waits for server response (Protocol Step 2: OK:<size> or ERROR:...)
-    if ((valread = recv(sock, header_buffer, sizeof(header_buffer) - 1, 0)) <= 0)
+    // Protocol Step 1: 'GET <filename> <offset> <length>[ lz][ crc][ tls:<nonce>]\n'
+    int request_len = snprintf(request, sizeof(request), "GET %s %lld %lld%s%s%s\n", filename, offset, length,
+                               use_compression ? " lz" : "", use_checksum ? " crc" : "", tls_option);
+    if (send(sock, request, request_len, 0) < 0)
     {
-        printf("Connection closed or error during header reception.\n");
-        goto cleanup;
+        perror("Error sending range request");
+        return -1;
     }
-    header_buffer[valread] = '\0'; // Null-terminate
 
-    if (strncmp(header_buffer, "ERROR:", 6) == 0)
+    // Protocol Step 2: read up to the newline that terminates the header
+    while (newline == NULL && have < buf_size - 1)
     {
-        printf("Server returned an error: %s\n", header_buffer);
-        goto cleanup;
+        ssize_t n = recv(sock, buf + have, buf_size - 1 - have, tls_psk ? MSG_PEEK : 0);
+        if (n > 0 && tls_psk)
+        {
+            // Take only the header; the records behind it stay queued
+            char *end = memchr(buf + have, '\n', n);
+            n = recv(sock, buf + have, end ? end + 1 - (buf + have) : n, MSG_WAITALL);
+        }
+        if (n <= 0)
+        {
+            printf("Connection closed or error during header reception.\n");
+            return -1;
+        }
+        have += n;
+        buf[have] = '\0';
+        newline = memchr(buf, '\n', have);
+        if (newline == NULL && strncmp(buf, "ERROR:", 6) == 0)
+        {
+            break; // Error responses are not newline-terminated
+        }
     }
 
-    if (strncmp(header_buffer, "OK:", 3) != 0)
+    if (strncmp(buf, "ERROR:", 6) == 0)
     {
-        printf("Unexpected server response header: %s\n", header_buffer);
-        goto cleanup;
+        printf("Server returned an error: %s\n", buf);
+        return -1;
+    }
+    if (newline == NULL || sscanf(buf, "OK:%lld %lld%n", range_len, file_size, &consumed) < 2)
+    {
+        printf("Unexpected server response header: %s\n", buf);
+        return -1;
     }
 
-    // Parse file size from the header
-    if (sscanf(header_buffer, "OK:%lld", &file_size) != 1)
+    // Options the server honoured are echoed after the sizes
+    size_t header_len = newline + 1 - buf;
+    char options[64] = "", *saveptr, *option;
+    snprintf(options, sizeof(options), "%.*s", (int)(newline - buf - consumed), buf + consumed);
+    *codec = CODEC_NONE;
+    *checksum = 0;
+    for (option = strtok_r(options, " \r", &saveptr); option != NULL; option = strtok_r(NULL, " \r", &saveptr))
     {
-        printf("Error parsing file size from header: %s\n", header_buffer);
-        goto cleanup;
+        if (strcmp(option, "lz") == 0)
+        {
+            *codec = CODEC_LZ;
+        }
+        else if (strcmp(option, "crc") == 0)
+        {
+            *checksum = 1;
+        }
+        else if (strncmp(option, "tls:", 4) == 0 && tls_psk != NULL && *tls == NULL && strlen(option) == 4 + 2 * TLS_NONCE_LEN)
+        {
+            unsigned v;
+            int ok = 1;
+            for (int i = 0; i < TLS_NONCE_LEN && ok; i++)
+            {
+                ok = sscanf(option + 4 + 2 * i, "%2x", &v) == 1;
+                server_nonce[i] = (uint8_t)v;
+            }
+            if (ok && (*tls = malloc(sizeof(TlsKey))) != NULL)
+            {
+                tls_derive_key(tls_psk, tls_psk_len, client_nonce, server_nonce, *tls);
+            }
+        }
+    }
+    if (tls_psk != NULL && *tls == NULL)
+    {
+        printf("Server did not agree to encrypt the body (is it running with -T?).\n");
+        return -1;
     }
 
-    printf("Server acknowledged file. Total size to receive: %lld bytes.\n", file_size);
-    printf("Receiving file and saving as: %s\n", SAVE_AS_FILE);
+    memmove(buf, newline + 1, have - header_len);
+    return have - header_len;
+}
+
+// Buffered reader over a socket, starting with bytes that came with the header
+struct stream_reader
+{
+    int sock;
+    char *buf;
+    size_t start, end, cap;
+    TlsKey *tls;     // Userspace TLS: records are opened into 'buf' one at a time
+    uint8_t *cipher; // Received record bytes not yet opened
+    size_t cipher_start, cipher_end;
+    TcpTune tune;    // Grows the receive buffer to the measured path
+};
 
-    // Open file for writing
-    fp = fopen(SAVE_AS_FILE, "wb");
-    if (fp == NULL)
+/**
+ * @brief Refills the (drained) reader: straight from the socket, or with the
+ *        next record's plaintext under userspace TLS.
+ * @return 0 on success, -1 on EOF/error or a record that fails authentication.
+ */
+static int reader_fill(struct stream_reader *r)
+{
+    ssize_t n;
+
+    tcp_tune_update(&r->tune);
+    if (r->tls == NULL)
     {
-        perror("Error opening file to save data");
+        if ((n = recv(r->sock, r->buf, r->cap, 0)) <= 0)
+        {
+            return -1;
+        }
+        r->start = 0;
+        r->end = n;
+        return 0;
+    }
+    for (;;)
+    {
+        size_t have = r->cipher_end - r->cipher_start;
+        if (have >= TLS_HEADER_LEN)
+        {
+            size_t record = tls_record_len(r->cipher + r->cipher_start);
+            if (record > TLS_RECORD_WIRE_MAX)
+            {
+                printf("\nOversized TLS record from the server.\n");
+                return -1;
+            }
+            if (have >= record)
+            {
+                long plain = tls_open_record(r->tls, r->cipher + r->cipher_start, record, (uint8_t *)r->buf);
+                if (plain < 0)
+                {
+                    printf("\nTLS record failed authentication (wrong key or corrupted data).\n");
+                    return -1;
+                }
+                r->cipher_start += record;
+                r->start = 0;
+                r->end = plain;
+                if (plain > 0)
+                {
+                    return 0;
+                }
+                continue;
+            }
+        }
+        if (r->cipher_start > 0)
+        {
+            memmove(r->cipher, r->cipher + r->cipher_start, have);
+            r->cipher_start = 0;
+            r->cipher_end = have;
+        }
+        if ((n = recv(r->sock, r->cipher + r->cipher_end, STREAM_BUFFER_SIZE - r->cipher_end, 0)) <= 0)
+        {
+            return -1;
+        }
+        r->cipher_end += n;
+    }
+}
+
+/**
+ * @brief Reads exactly 'len' bytes through the reader.
+ * @return 0 on success, -1 on EOF/error.
+ */
+static int reader_read(struct stream_reader *r, void *dst, size_t len)
+{
+    char *out = (char *)dst;
+    while (len > 0)
+    {
+        if (r->start == r->end && reader_fill(r) < 0)
+        {
+            return -1;
+        }
+        size_t take = (r->end - r->start < len) ? r->end - r->start : len;
+        memcpy(out, r->buf + r->start, take);
+        r->start += take;
+        out += take;
+        len -= take;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives a range sent as compressed frames, decoding one block at a
+ *        time, and pwrite()s the raw bytes into place.
+ * @return 0 on success, -1 on error.
+ */
+static int receive_compressed(struct range_task *task, struct stream_reader *reader)
+{
+    uint8_t header[LZ_FRAME_HEADER];
+    uint8_t *frame = malloc(LZ_BLOCK_SIZE), *raw = malloc(LZ_BLOCK_SIZE);
+    int result = -1;
+
+    if (frame == NULL || raw == NULL)
+    {
+        perror("malloc failed for codec buffers");
+        goto done;
+    }
+    while (task->received < task->length)
+    {
+        size_t raw_len;
+        int stored;
+        long payload, n;
+
+        if (reader_read(reader, header, sizeof(header)) < 0 ||
+            (payload = lz_frame_payload(header, &raw_len, &stored)) < 0 ||
+            (long long)raw_len > task->length - task->received ||
+            reader_read(reader, frame, payload) < 0 ||
+            (n = lz_decode_frame(frame, payload, raw_len, stored, raw)) < 0)
+        {
+            printf("\nCompressed stream broken or corrupt (range at %lld).\n", task->offset);
+            goto done;
+        }
+        if (pwrite(task->out_fd, raw, n, task->offset + task->received) != n)
+        {
+            perror("Error writing received data");
+            goto done;
+        }
+        task->crc = crc32c_update(task->crc, raw, n);
+        task->received += n;
+        __atomic_add_fetch(&total_received, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&total_wire, sizeof(header) + payload, __ATOMIC_RELAXED);
+    }
+    result = 0;
+
+done:
+    free(frame);
+    free(raw);
+    return result;
+}
+
+/**
+ * @brief Stream thread: fetches one range and pwrite()s it into place.
+ * @param arg Pointer to the range_task.
+ * @return NULL
+ */
+static void *fetch_range(void *arg)
+{
+    struct range_task *task = (struct range_task *)arg;
+    char *buf = malloc(STREAM_BUFFER_SIZE);
+    long long range_len, file_size;
+    struct stream_reader reader = {0};
+    TlsKey *tls = NULL;
+    ssize_t n;
+    int sock = -1, codec, checksum;
+
+    if (buf == NULL)
+    {
+        perror("malloc failed for stream buffer");
+        return NULL;
+    }
+    if ((sock = connect_to_server()) < 0)
+    {
+        goto cleanup;
+    }
+    if ((n = request_range(sock, task->filename, task->offset, task->length, buf, STREAM_BUFFER_SIZE,
+                           &range_len, &file_size, &codec, &checksum, &tls)) < 0)
+    {
+        goto cleanup;
+    }
+    if (range_len != task->length)
+    {
+        printf("Server returned %lld bytes for a %lld byte range.\n", range_len, task->length);
         goto cleanup;
     }
 
-    // 4. Client receives file data (Protocol Step 3)
-    while (bytes_received < file_size)
+    // Protocol Step 3: body bytes, written at their position in the output file
+    reader = (struct stream_reader){.sock = sock, .buf = buf, .end = n, .cap = STREAM_BUFFER_SIZE};
+    tcp_tune_init(&reader.tune, sock, TCP_TUNE_RECV);
+    if (tls != NULL)
+    {
+        // Let the kernel decrypt if it can (recv() then returns plaintext), else do it here
+        int err = tls_kernel_enable(sock, TLS_RX, tls);
+        if (!__atomic_exchange_n(&tls_mode_reported, 1, __ATOMIC_RELAXED))
+        {
+            if (err == 0)
+            {
+                printf("Body encrypted; decrypting with kTLS.\n");
+            }
+            else
+            {
+                printf("Body encrypted; decrypting in userspace, %s (kTLS unavailable: %s).\n", aesgcm_impl_name(),
+                       strerror(-err));
+            }
+        }
+        if (err < 0)
+        {
+            reader.tls = tls;
+            tls = NULL;
+            if ((reader.cipher = malloc(STREAM_BUFFER_SIZE)) == NULL)
+            {
+                perror("malloc failed for TLS buffer");
+                goto cleanup;
+            }
+        }
+    }
+    if (codec == CODEC_LZ)
+    {
+        if (receive_compressed(task, &reader) < 0)
+        {
+            goto cleanup;
+        }
+    }
+    while (task->received < task->length)
+    {
+        if (reader.start == reader.end && reader_fill(&reader) < 0)
+        {
+            printf("\nConnection closed prematurely or error occurred (range at %lld).\n", task->offset);
+            goto cleanup;
+        }
+        n = reader.end - reader.start;
+        if (n > task->length - task->received)
+        {
+            n = task->length - task->received;
+        }
+        if (pwrite(task->out_fd, buf + reader.start, n, task->offset + task->received) != n)
+        {
+            perror("Error writing received data");
+            goto cleanup;
+        }
+        task->crc = crc32c_update(task->crc, buf + reader.start, n);
+        reader.start += n;
+        task->received += n;
+        __atomic_add_fetch(&total_received, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&total_wire, n, __ATOMIC_RELAXED);
+    }
+
+    // Protocol Step 4 (crc option): the server's CRC32C of the range follows the body
+    if (checksum)
+    {
+        uint8_t trailer[4];
+        if (reader_read(&reader, trailer, sizeof(trailer)) < 0)
+        {
+            printf("\nConnection closed before the checksum (range at %lld).\n", task->offset);
+            goto cleanup;
+        }
+        uint32_t expected = trailer[0] | (uint32_t)trailer[1] << 8 | (uint32_t)trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+        if (expected != task->crc)
+        {
+            printf("\nChecksum mismatch in range at %lld: server %08x, received %08x.\n", task->offset,
+                   expected, task->crc);
+            goto cleanup;
+        }
+    }
+    else if (use_checksum)
+    {
+        printf("\nServer did not send a checksum (range at %lld); size check only.\n", task->offset);
+    }
+    task->ok = 1;
+
+cleanup:
+    if (sock >= 0)
+    {
+        close(sock);
+    }
+    free(tls);
+    free(reader.tls);
+    free(reader.cipher);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Downloads 'filename' over 'streams' parallel connections, one byte
+ *        range each, into 'save_as'.
+ * @return 0 on success, -1 on error.
+ */
+static int parallel_download(const char *filename, const char *save_as, int streams)
+{
+    char probe_buf[BUFFER_SIZE];
+    long long range_len, file_size;
+    int codec, checksum;
+    TlsKey *tls;
+    struct range_task tasks[MAX_STREAMS];
+    pthread_t threads[MAX_STREAMS];
+    struct timespec start, end;
+    int sock, out_fd, failed = 0;
+
+    // 1. Size probe: an empty range returns the header only
+    if ((sock = connect_to_server()) < 0)
+    {
+        return -1;
+    }
+    printf("Successfully connected to the server.\n");
+    if (request_range(sock, filename, 0, 0, probe_buf, sizeof(probe_buf), &range_len, &file_size, &codec, &checksum,
+                      &tls) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    free(tls);
+    close(sock);
+
+    // Don't bother splitting small files into tiny ranges
+    if (streams > (file_size + MIN_RANGE_SIZE - 1) / MIN_RANGE_SIZE)
     {
-        long long remaining_bytes = file_size - bytes_received;
-        // Receive up to BUFFER_SIZE or the remaining amount
-        ssize_t bytes_to_recv = (remaining_bytes < BUFFER_SIZE) ? remaining_bytes : BUFFER_SIZE;
+        streams = (file_size + MIN_RANGE_SIZE - 1) / MIN_RANGE_SIZE;
+    }
+    if (streams < 1)
+    {
+        streams = 1;
+    }
 
-        valread = recv(sock, file_buffer, bytes_to_recv, 0);
+    printf("Server acknowledged file. Total size to receive: %lld bytes over %d stream(s).\n", file_size, streams);
+    printf("Receiving file and saving as: %s\n", save_as);
 
-        if (valread <= 0)
+    // 2. Size the output file up front so every stream can pwrite() its range in place
+    out_fd = open(save_as, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ftruncate(out_fd, file_size) < 0)
+    {
+        perror("Error opening file to save data");
+        if (out_fd >= 0)
         {
-            printf("\nConnection closed prematurely or error occurred.\n");
-            break;
+            close(out_fd);
         }
+        return -1;
+    }
 
-        // Write received data to file
-        fwrite(file_buffer, 1, valread, fp);
-        bytes_received += valread;
+    // 3. One thread and one connection per range
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long range_size = file_size / streams;
+    for (int i = 0; i < streams; i++)
+    {
+        tasks[i].filename = filename;
+        tasks[i].out_fd = out_fd;
+        tasks[i].offset = i * range_size;
+        tasks[i].length = (i == streams - 1) ? file_size - tasks[i].offset : range_size;
+        tasks[i].received = 0;
+        tasks[i].crc = 0;
+        tasks[i].ok = 0;
+        if (pthread_create(&threads[i], NULL, fetch_range, &tasks[i]) != 0)
+        {
+            perror("pthread_create failed");
+            streams = i;
+            failed = 1;
+            break;
+        }
+    }
 
-        // Simple progress indicator (optional)
-        double progress = ((double)bytes_received / file_size) * 100.0;
-        printf("Progress: %.2f%% (%lld/%lld bytes)\r", progress, bytes_received, file_size);
-        fflush(stdout); // Force print
+    // 4. Report progress until every stream is done
+    for (int i = 0; i < streams; i++)
+    {
+        while (pthread_tryjoin_np(threads[i], NULL) != 0)
+        {
+            long long done = __atomic_load_n(&total_received, __ATOMIC_RELAXED);
+            printf("Progress: %.2f%% (%lld/%lld bytes)\r", file_size ? 100.0 * done / file_size : 100.0, done, file_size);
+            fflush(stdout); // Force print
+            usleep(100000);
+        }
+        if (!tasks[i].ok)
+        {
+            failed = 1;
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(out_fd);
 
-    printf("\nFile transfer complete! Received %lld bytes.\n", bytes_received);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("\nFile transfer complete! Received %lld bytes in %.3f s (%.1f MB/s).\n",
+           total_received, seconds, seconds > 0 ? total_received / 1e6 / seconds : 0.0);
+    if (use_compression)
+    {
+        printf("Compression: %lld bytes on the wire (ratio %.2fx).\n", total_wire,
+               total_wire ? (double)total_received / total_wire : 0.0);
+    }
 
-    if (bytes_received == file_size)
+    if (!failed && total_received == file_size)
     {
         printf("Verification successful: Received size matches expected size.\n");
+        if (use_checksum)
+        {
+            // Every range was checked on arrival; chain them into the whole-file CRC
+            uint32_t crc = tasks[0].crc;
+            for (int i = 1; i < streams; i++)
+            {
+                crc = crc32c_combine(crc, tasks[i].crc, tasks[i].length);
+            }
+            printf("Checksums verified: %d range(s), file CRC32C %08x (%s).\n", streams, crc, crc32c_impl_name());
+        }
+        return 0;
+    }
+    if (total_received == file_size)
+    {
+        printf("Verification failed: one or more ranges were incomplete or corrupt.\n");
     }
     else
     {
-        printf("Warning: Expected %lld bytes but received %lld bytes.\n", file_size, bytes_received);
+        printf("Warning: Expected %lld bytes but received %lld bytes.\n", file_size, total_received);
     }
+    return -1;
+}
 
-cleanup:
-    if (fp != NULL)
+/**
+ * @brief Initializes and runs the TCP client for file transfer.
+ */
+int main(int argc, char *argv[])
+{
+    const char *filename = REQUEST_FILE;
+    const char *save_as = SAVE_AS_FILE;
+    int streams = 1;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "f:o:n:zkT:")) != -1)
     {
-        fclose(fp);
+        switch (ch)
+        {
+        case 'k':
+            use_checksum = 0;
+            break;
+        case 'z':
+            use_compression = 1;
+            break;
+        case 'f':
+            filename = optarg;
+            break;
+        case 'o':
+            save_as = optarg;
+            break;
+        case 'n':
+            streams = atoi(optarg);
+            break;
+        case 'T':
+            if (tls_load_psk(optarg, &tls_psk, &tls_psk_len) < 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f file] [-o save_as] [-n streams] [-z] [-k] [-T keyfile]\n", argv[0]);
+            fprintf(stderr, "  -n  fetch the file as N byte ranges over N parallel connections (max %d)\n", MAX_STREAMS);
+            fprintf(stderr, "  -z  negotiate lz compression of the body\n");
+            fprintf(stderr, "  -k  skip the end-to-end CRC32C check of each range\n");
+            fprintf(stderr, "  -T  shared key file (same as the server's): receive the body encrypted\n");
+            return EXIT_FAILURE;
+        }
     }
-    // 5. Client closes the connection
-    close(sock);
-    return 0;
-}
\ No newline at end of file
+    if (streams < 1)
+    {
+        streams = 1;
+    }
+    if (streams > MAX_STREAMS)
+    {
+        streams = MAX_STREAMS;
+    }
+
+    printf("Attempting to connect to Server at %s:%d\n", SERVER_IP, PORT);
+    printf("Requested file: '%s'\n", filename);
+
+    return parallel_download(filename, save_as, streams) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,233 +1,2715 @@
+#define _GNU_SOURCE // splice(), RUSAGE_THREAD
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <signal.h>
 #include <pthread.h>
+#include "../common/lzcodec.h"
+#include "../common/crc32c.h"
+#include "../common/tls.h"
+#include "../common/metrics.h"
+#include "../common/log.h"
+#include "../common/tcptune.h"
+#include "../common/bufpool.h"
 
 #define PORT 65432
-#define BUFFER_SIZE 4096
 #define TRANSFER_FILE "source_file.txt"
-#define MAX_PENDING 5
+#define DEFAULT_BACKLOG 1024 // listen() backlog, override with -l
+#define MAX_EVENTS 256       // epoll events handled per epoll_wait() call
+#define REQUEST_MAX 1024     // Longest request line accepted from a client
+#define SENDFILE_CHUNK (1 << 20) // Max bytes handed to one sendfile()/splice() call
+#define DEFAULT_CACHE_MB 256     // File cache budget, override with -c (0 disables the cache)
+#define CACHE_BUCKETS 64         // Hash buckets of the file cache
+#define CACHE_REVALIDATE_NS 1000000000LL // A cached file is stat()ed again at most this often
+#define RATE_QUANTUM (64 * 1024)    // Most body bytes granted at once while a bandwidth limit applies
+#define RATE_MIN_GRANT 4096         // Smaller grants wait for the bucket to refill instead
+#define RATE_BURST_NS 50000000LL    // Token bucket depth: 50 ms of traffic at its rate
+#define RATE_TICK_NS 2000000LL      // Connections out of tokens are retried this often
+#define RATE_IP_BUCKETS 64          // Hash buckets of the per-client-IP token buckets
+#define RATE_MAX_WEIGHTS 64         // 'weight' lines accepted in a limits file
+#define STATS_PORT (PORT + 1)       // Local Prometheus endpoint, override with -S (0 disables it)
 
-// Struct to pass data to the client handling thread
-struct thread_data
+// Data path used to stream the file body to the client
+enum tx_mode
 {
-    int client_socket;
-    struct sockaddr_in client_addr;
+    TX_AUTO,     // sendfile() for regular files, splice() otherwise
+    TX_COPY,     // read() into a user-space buffer, then send()
+    TX_SENDFILE, // Zero-copy sendfile(2)
+    TX_SPLICE    // Zero-copy splice(2) through a pipe
 };
 
+static enum tx_mode tx_mode = TX_AUTO;
+static uint8_t *tls_psk;  // -T: shared key that enables the 'tls' request option
+static size_t tls_psk_len;
+
+// One file held by the cache: its bytes in memory, for the lz encoder and
+// the crc of a body, and an open descriptor, so the body itself still goes
+// out zero-copy with sendfile() from the page cache. The key is the path
+// plus the inode, mtime and size the file had when loaded: when stat()
+// reports anything else, the file has changed and the entry is dropped.
+// Connections sending from an entry hold a reference, so eviction only
+// unlinks it and the last connection frees it.
+struct cache_entry
+{
+    char *path;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int fd;             // Shared by all senders: sendfile()/splice() use explicit offsets
+    char *data;
+    long long checked;  // CLOCK_MONOTONIC ns of the last stat() that matched
+    int refs;           // Connections using the entry, plus one while it is cached
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev, *lru_next; // lru_prev towards the most recently used
+};
+
+// Process-wide file cache shared by all workers, under 'lock'
+struct file_cache
+{
+    pthread_mutex_t lock;
+    long long budget;   // Bytes of file data the cache may hold
+    long long bytes;    // Bytes of file data it holds now
+    int entries;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *lru_head, *lru_tail; // Most and least recently used
+    long long hits, misses, revalidations, invalidations, evictions;
+};
+
+static struct file_cache cache = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                  .budget = (long long)DEFAULT_CACHE_MB << 20};
+static volatile sig_atomic_t cache_report_requested; // Set by SIGUSR1
+
+// Token bucket: holds up to RATE_BURST_NS worth of bytes at its rate and is
+// refilled from the elapsed time whenever it is consulted
+struct token_bucket
+{
+    double tokens;
+    long long last; // CLOCK_MONOTONIC ns of the last refill, 0 until first used (it starts full)
+};
+
+// Bucket shared by all connections from one client address
+struct ip_bucket
+{
+    in_addr_t addr;
+    int refs; // Connections attached to it
+    struct token_bucket bucket;
+    struct ip_bucket *next;
+};
+
+// Bandwidth accounting of one connection
+struct rate_state
+{
+    in_addr_t addr;             // Client address: selects the per-IP bucket and weight
+    struct ip_bucket *ip;       // Attached the first time a per-IP limit applies
+    struct token_bucket bucket; // Per-connection limit
+    unsigned weight;            // Fair-share weight, looked up again after every reload
+    unsigned generation;        // limiter.generation the weight belongs to, 0 = never limited
+    double vtime;               // Virtual time: bytes granted / weight
+    int heap_pos;               // 1-based slot in limiter.waiting, 0 when not waiting for the global bucket
+    int throttled;              // The last rate_take() granted nothing
+};
+
+struct rate_weight
+{
+    in_addr_t addr;
+    unsigned weight;
+};
+
+// Process-wide bandwidth limits shared by all workers, under 'lock'. Rates
+// are body bytes per second, 0 = unlimited. When the global bucket runs dry,
+// the transfers waiting for it are served in virtual time order (start-time
+// fair queuing): every grant advances a transfer's clock by bytes / weight
+// and the one furthest behind goes next, so busy transfers split the global
+// rate in proportion to their weights, while a new or short transfer starts
+// at the current clock and gets its first bytes out right away.
+struct rate_limiter
+{
+    pthread_mutex_t lock;
+    int active;                  // Any limit is set; read without the lock on the fast path
+    double global_rate, ip_rate, conn_rate;
+    struct token_bucket global;
+    struct ip_bucket *ips[RATE_IP_BUCKETS];
+    struct rate_weight weights[RATE_MAX_WEIGHTS]; // Per-client weights (default 1)
+    int nweights;
+    unsigned generation;         // Bumped by every change of the limits
+    struct rate_state **waiting; // Min-heap on vtime, 1-based
+    int nwaiting, waiting_cap;
+    double vclock;               // Virtual time of the latest grant from the global bucket
+    long long granted, global_stalls, local_stalls;
+};
+
+static struct rate_limiter limiter = {.lock = PTHREAD_MUTEX_INITIALIZER, .generation = 1};
+static const char *rate_config_path;               // -R: limits file, read again on SIGHUP
+static volatile sig_atomic_t rate_reload_requested; // Set by SIGHUP
+
+// Counters exported on the stats port (common/metrics.h), indexed by enum server_counter
+enum server_counter
+{
+    M_CONNECTIONS,
+    M_ACTIVE,
+    M_BYTES_IN,
+    M_BYTES_OUT,
+    M_REQ_OK,
+    M_REQ_BAD,
+    M_REQ_NOT_FOUND,
+    M_REQ_RANGE,
+    M_REQ_INTERNAL,
+    M_ERR_ACCEPT,
+    M_ERR_RECV,
+    M_ERR_SEND,
+    M_ERR_RESET,
+    M_TUNED
+};
+
+static const MetricDesc server_counters[] = {
+    {"transfer_server_connections_total", NULL, "Connections accepted", METRIC_COUNTER},
+    {"transfer_server_connections_active", NULL, "Connections open", METRIC_GAUGE},
+    {"transfer_server_received_bytes_total", NULL, "Request bytes received", METRIC_COUNTER},
+    {"transfer_server_sent_bytes_total", NULL, "Header, body and trailer bytes sent", METRIC_COUNTER},
+    {"transfer_server_requests_total", "result=\"ok\"", "Requests by response", METRIC_COUNTER},
+    {"transfer_server_requests_total", "result=\"bad_request\"", "", METRIC_COUNTER},
+    {"transfer_server_requests_total", "result=\"not_found\"", "", METRIC_COUNTER},
+    {"transfer_server_requests_total", "result=\"range_not_satisfiable\"", "", METRIC_COUNTER},
+    {"transfer_server_requests_total", "result=\"internal_error\"", "", METRIC_COUNTER},
+    {"transfer_server_errors_total", "type=\"accept\"", "Connection errors by type", METRIC_COUNTER},
+    {"transfer_server_errors_total", "type=\"recv\"", "", METRIC_COUNTER},
+    {"transfer_server_errors_total", "type=\"send\"", "", METRIC_COUNTER},
+    {"transfer_server_errors_total", "type=\"reset\"", "", METRIC_COUNTER},
+    {"transfer_server_tuned_transfers_total", NULL, "Bodies whose chunk or send buffer was raised for the path",
+     METRIC_COUNTER},
+};
+
+enum server_histogram
+{
+    H_FIRST_BYTE,
+    H_TRANSFER,
+    H_RTT
+};
+
+static const MetricDesc server_histograms[] = {
+    {"transfer_server_first_byte_seconds", NULL, "Time from accept to the first response byte", METRIC_SUMMARY},
+    {"transfer_server_transfer_seconds", NULL, "Time from accept to the last response byte", METRIC_SUMMARY},
+    {"transfer_server_rtt_seconds", NULL, "Minimum round-trip time measured over each body", METRIC_SUMMARY},
+};
+
+// Progress of one file body through the chosen data path. The pump can be
+// resumed after EAGAIN, so the same code serves blocking and non-blocking sockets.
+struct tx_stream
+{
+    int fd;              // Source file
+    int seekable;        // Regular file: use explicit offsets
+    enum tx_mode mode;   // Resolved data path (never TX_AUTO)
+    off_t offset;        // Next file offset to transmit
+    long long remaining; // Bytes not yet taken from the file
+    long long sent;      // Bytes handed to the socket
+    int pipefd[2];       // splice() pipe, created on first use
+    size_t pipe_pending; // Bytes sitting in the pipe
+    char *buf;           // Copy-loop buffer (or encoded frame), allocated on first use
+    size_t buf_cap, buf_len, buf_off;
+    size_t chunk;        // Copy-loop block of a plain body, as tuned for the connection
+    int codec;           // CODEC_LZ: body is sent as compressed frames via the copy loop
+    LzEncoder enc;       // Frame encoder state and raw/wire byte totals
+    char *raw;           // Raw block waiting to be compressed
+    int checksum;        // Compute a CRC32C of the raw bytes
+    uint32_t crc;        // CRC32C of the bytes taken from the file so far
+    const char *crc_src; // Zero-copy paths: the file's bytes for the CRC (cached copy or mmap)
+    off_t crc_base;      // File offset of crc_src[0]
+    size_t crc_map_len;  // Length of crc_src if it is our own mmap, else 0
+    struct cache_entry *cached; // Body comes from this in-memory copy instead of 'fd'
+    TlsKey *tls;         // Userspace TLS: body bytes are sealed into records before send()
+    uint8_t *tls_record; // The sealed record being sent
+    size_t tls_record_len, tls_record_off;
+    struct rate_state *rate; // Bandwidth limits the body is subject to, NULL for none
+};
+
+// Per-connection state machine: request read -> header send -> body stream
+enum conn_state
+{
+    CONN_READ_REQUEST,
+    CONN_SEND_HEADER,
+    CONN_SEND_BODY,
+    CONN_SEND_TRAILER,
+    CONN_DONE
+};
+
+struct connection
+{
+    int sock;
+    struct sockaddr_in addr;
+    enum conn_state state;
+    char request[REQUEST_MAX];
+    size_t request_len;
+    char header[128];
+    size_t header_len, header_sent;
+    TlsKey *tls_key; // 'tls' option: body keys, handed to the kernel or tx once the header is out
+    struct tx_stream tx;
+    struct rate_state rate;
+    struct connection *throttle_next, **throttle_pprev; // On the worker's throttled list while pprev != NULL
+    long long accepted_ns; // CLOCK_MONOTONIC, for the latency histograms
+    TcpTune tune;          // Chunk and send buffer sizing from the measured path
+};
+
+// One reactor thread: its own epoll instance sharing the listening socket
+struct worker
+{
+    pthread_t tid;
+    int id;
+    int epoll_fd;
+    long active; // Connections currently owned by this worker
+    int timer_fd;                  // Ticks every RATE_TICK_NS while connections are throttled
+    int timer_armed;
+    struct connection *throttled;  // Connections waiting for tokens
+    struct connection **retry;     // Scratch array for throttle_tick()
+    size_t retry_cap;
+};
+
+// Connections and their TLS keys live and die on the worker that accepted them
+static __thread Slab conn_slab = SLAB_INIT(sizeof(struct connection));
+static __thread Slab key_slab = SLAB_INIT(sizeof(TlsKey));
+
+static int listen_fd = -1;
+
 // Function prototypes
 void create_dummy_file();
-void *handle_client(void *arg);
+long long send_file_body(int sock, int fd, long long length, TlsKey *tls);
+
+/**
+ * @brief Creates a dummy file for testing the transfer.
+ */
+void create_dummy_file()
+{
+    FILE *fp = fopen(TRANSFER_FILE, "r");
+    if (fp == NULL)
+    {
+        printf("Creating dummy file: %s\n", TRANSFER_FILE);
+        fp = fopen(TRANSFER_FILE, "w");
+        if (fp == NULL)
+        {
+            perror("Failed to create dummy file");
+            return;
+        }
+        fprintf(fp, "This is the content of the file being transferred.\n");
+        fprintf(fp, "Line 2: The quick brown fox jumps over the lazy dog.\n");
+        fprintf(fp, "Line 3: Distributed Systems Practical Work 1 - TCP File Transfer (C version).\n");
+        fclose(fp);
+        printf("File created successfully.\n");
+    }
+    else
+    {
+        printf("Using existing file: %s\n", TRANSFER_FILE);
+        fclose(fp);
+    }
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned cache_hash(const char *path)
+{
+    unsigned h = 2166136261u; // FNV-1a
+    while (*path)
+    {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h % CACHE_BUCKETS;
+}
+
+static void cache_entry_free(struct cache_entry *e)
+{
+    if (e->fd >= 0)
+    {
+        close(e->fd);
+    }
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+/**
+ * @brief Drops a connection's reference; the last one frees an evicted entry.
+ */
+static void cache_release(struct cache_entry *e)
+{
+    pthread_mutex_lock(&cache.lock);
+    int last = --e->refs == 0;
+    pthread_mutex_unlock(&cache.lock);
+    if (last)
+    {
+        cache_entry_free(e);
+    }
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+    if (e->lru_prev)
+    {
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else
+    {
+        cache.lru_head = e->lru_next;
+    }
+    if (e->lru_next)
+    {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else
+    {
+        cache.lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache.lru_head;
+    if (cache.lru_head)
+    {
+        cache.lru_head->lru_prev = e;
+    }
+    cache.lru_head = e;
+    if (cache.lru_tail == NULL)
+    {
+        cache.lru_tail = e;
+    }
+}
+
+/**
+ * @brief Takes an entry out of the cache (lock held). Its memory goes once
+ *        the connections still sending from it are done.
+ * @return 1 if the caller must free the entry now.
+ */
+static int cache_unlink(struct cache_entry *e)
+{
+    struct cache_entry **pp = &cache.buckets[cache_hash(e->path)];
+    while (*pp != e)
+    {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    lru_unlink(e);
+    cache.bytes -= e->size;
+    cache.entries--;
+    return --e->refs == 0;
+}
+
+static struct cache_entry *cache_find(const char *path)
+{
+    struct cache_entry *e = cache.buckets[cache_hash(path)];
+    while (e != NULL && strcmp(e->path, path) != 0)
+    {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+/**
+ * @brief Returns a referenced in-memory copy of 'path', loading it on a miss.
+ *        Entries younger than CACHE_REVALIDATE_NS are served without a
+ *        syscall; older ones are checked with one stat(). Files larger than
+ *        the budget (or not regular) are not cached.
+ * @return The entry (release with cache_release()), or NULL to serve from disk.
+ */
+static struct cache_entry *cache_acquire(const char *path)
+{
+    struct cache_entry *e, *dead = NULL;
+    struct stat st;
+    long long now = monotonic_ns();
+
+    if (cache.budget <= 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if ((e = cache_find(path)) != NULL && now - e->checked < CACHE_REVALIDATE_NS)
+    {
+        e->refs++;
+        cache.hits++;
+        lru_unlink(e);
+        lru_push_front(e);
+        pthread_mutex_unlock(&cache.lock);
+        return e;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if ((e = cache_find(path)) != NULL)
+    {
+        if (e->ino == st.st_ino && e->size == st.st_size && e->mtime.tv_sec == st.st_mtim.tv_sec &&
+            e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            e->checked = now;
+            e->refs++;
+            cache.hits++;
+            cache.revalidations++;
+            lru_unlink(e);
+            lru_push_front(e);
+            pthread_mutex_unlock(&cache.lock);
+            return e;
+        }
+        cache.invalidations++;
+        if (cache_unlink(e))
+        {
+            dead = e;
+        }
+    }
+    cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
+    if (dead)
+    {
+        cache_entry_free(dead);
+    }
+    if (st.st_size > cache.budget)
+    {
+        return NULL;
+    }
+
+    // Load outside the lock so other workers keep serving hits meanwhile
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if ((e = calloc(1, sizeof(*e))) != NULL)
+    {
+        e->fd = fd;
+    }
+    if (e == NULL || fstat(fd, &st) < 0 || st.st_size > cache.budget ||
+        (e->data = malloc(st.st_size > 0 ? st.st_size : 1)) == NULL || (e->path = strdup(path)) == NULL)
+    {
+        if (e)
+        {
+            cache_entry_free(e);
+        }
+        else
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    for (off_t got = 0; got < st.st_size;)
+    {
+        ssize_t n = pread(fd, e->data + got, st.st_size - got, got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            cache_entry_free(e); // Shrank while loading: serve it from disk
+            return NULL;
+        }
+        got += n;
+    }
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+    e->size = st.st_size;
+    e->checked = now;
+    e->refs = 2; // The cache's and the caller's
+
+    pthread_mutex_lock(&cache.lock);
+    struct cache_entry *raced = cache_find(path);
+    if (raced != NULL && raced->ino == e->ino && raced->size == e->size &&
+        raced->mtime.tv_sec == e->mtime.tv_sec && raced->mtime.tv_nsec == e->mtime.tv_nsec)
+    {
+        // Another worker loaded the same version first: use its copy
+        raced->refs++;
+        pthread_mutex_unlock(&cache.lock);
+        cache_entry_free(e);
+        return raced;
+    }
+    dead = NULL;
+    if (raced != NULL && cache_unlink(raced))
+    {
+        dead = raced;
+    }
+    // Evict from the cold end until the new copy fits
+    while (cache.bytes + e->size > cache.budget && cache.lru_tail != NULL)
+    {
+        struct cache_entry *victim = cache.lru_tail;
+        cache.evictions++;
+        if (cache_unlink(victim))
+        {
+            victim->hash_next = dead;
+            dead = victim;
+        }
+    }
+    unsigned bucket = cache_hash(path);
+    e->hash_next = cache.buckets[bucket];
+    cache.buckets[bucket] = e;
+    lru_push_front(e);
+    cache.bytes += e->size;
+    cache.entries++;
+    log_msg("Cache: loaded '%s' (%lld bytes); %lld hits, %lld misses, %lld evictions, %lld of %lld bytes in %d files\n",
+            path, (long long)e->size, cache.hits, cache.misses, cache.evictions, cache.bytes, cache.budget,
+            cache.entries);
+    pthread_mutex_unlock(&cache.lock);
+
+    while (dead != NULL)
+    {
+        struct cache_entry *next = dead->hash_next;
+        cache_entry_free(dead);
+        dead = next;
+    }
+    return e;
+}
+
+/**
+ * @brief Prints the cache counters (on SIGUSR1).
+ */
+static void cache_report(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    long long lookups = cache.hits + cache.misses;
+    printf("Cache: %lld hits (%lld revalidated), %lld misses, %.1f%% hit rate; %lld invalidated, %lld evicted; "
+           "%lld of %lld bytes in %d files\n",
+           cache.hits, cache.revalidations, cache.misses, lookups ? 100.0 * cache.hits / lookups : 0.0,
+           cache.invalidations, cache.evictions, cache.bytes, cache.budget, cache.entries);
+    pthread_mutex_unlock(&cache.lock);
+    fflush(stdout);
+}
+
+static void on_sigusr1(int sig)
+{
+    (void)sig;
+    cache_report_requested = 1;
+}
+
+static void bucket_refill(struct token_bucket *b, double rate, long long now)
+{
+    double burst = rate * RATE_BURST_NS / 1e9;
+
+    if (burst < RATE_QUANTUM)
+    {
+        burst = RATE_QUANTUM;
+    }
+    if (b->last == 0)
+    {
+        b->tokens = burst;
+    }
+    else if ((b->tokens += rate * (now - b->last) / 1e9) > burst)
+    {
+        b->tokens = burst;
+    }
+    b->last = now;
+}
+
+static void rate_heap_set(int pos, struct rate_state *r)
+{
+    limiter.waiting[pos] = r;
+    r->heap_pos = pos;
+}
+
+static void rate_heap_up(int pos)
+{
+    struct rate_state *r = limiter.waiting[pos];
+    while (pos > 1 && limiter.waiting[pos / 2]->vtime > r->vtime)
+    {
+        rate_heap_set(pos, limiter.waiting[pos / 2]);
+        pos /= 2;
+    }
+    rate_heap_set(pos, r);
+}
+
+static void rate_heap_down(int pos)
+{
+    struct rate_state *r = limiter.waiting[pos];
+    for (;;)
+    {
+        int child = 2 * pos;
+        if (child > limiter.nwaiting)
+        {
+            break;
+        }
+        if (child < limiter.nwaiting && limiter.waiting[child + 1]->vtime < limiter.waiting[child]->vtime)
+        {
+            child++;
+        }
+        if (limiter.waiting[child]->vtime >= r->vtime)
+        {
+            break;
+        }
+        rate_heap_set(pos, limiter.waiting[child]);
+        pos = child;
+    }
+    rate_heap_set(pos, r);
+}
+
+/**
+ * @brief Queues a transfer for the global bucket. If the heap cannot grow,
+ *        the transfer simply competes without its place in line.
+ */
+static void rate_heap_push(struct rate_state *r)
+{
+    if (limiter.nwaiting + 1 >= limiter.waiting_cap)
+    {
+        int cap = limiter.waiting_cap ? 2 * limiter.waiting_cap : 64;
+        struct rate_state **grown = realloc(limiter.waiting, cap * sizeof(*grown));
+        if (grown == NULL)
+        {
+            return;
+        }
+        limiter.waiting = grown;
+        limiter.waiting_cap = cap;
+    }
+    limiter.waiting[++limiter.nwaiting] = r;
+    rate_heap_up(limiter.nwaiting);
+}
+
+static void rate_heap_remove(struct rate_state *r)
+{
+    int pos = r->heap_pos;
+    struct rate_state *last = limiter.waiting[limiter.nwaiting--];
+
+    r->heap_pos = 0;
+    if (last == r)
+    {
+        return;
+    }
+    rate_heap_set(pos, last);
+    rate_heap_up(pos);
+    rate_heap_down(last->heap_pos);
+}
+
+/**
+ * @brief Finds or creates the bucket of a client address and takes a
+ *        reference to it (caller holds limiter.lock).
+ * @return The bucket, or NULL if it cannot be allocated.
+ */
+static struct ip_bucket *rate_ip_attach(in_addr_t addr)
+{
+    unsigned slot = (addr * 2654435761u) % RATE_IP_BUCKETS;
+    struct ip_bucket *ip;
+
+    for (ip = limiter.ips[slot]; ip != NULL; ip = ip->next)
+    {
+        if (ip->addr == addr)
+        {
+            break;
+        }
+    }
+    if (ip == NULL)
+    {
+        if ((ip = calloc(1, sizeof(*ip))) == NULL)
+        {
+            return NULL;
+        }
+        ip->addr = addr;
+        ip->next = limiter.ips[slot];
+        limiter.ips[slot] = ip;
+    }
+    ip->refs++;
+    return ip;
+}
+
+static unsigned rate_weight_of(in_addr_t addr)
+{
+    for (int i = 0; i < limiter.nweights; i++)
+    {
+        if (limiter.weights[i].addr == addr)
+        {
+            return limiter.weights[i].weight;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Takes tokens for up to 'want' body bytes from the global, per-IP and
+ *        per-connection buckets. Without limits this is one load and a
+ *        branch; with them, grants are cut to RATE_QUANTUM so transfers
+ *        interleave finely.
+ * @return Bytes the caller may send now; 0 (and r->throttled set) if it must
+ *         wait for a refill.
+ */
+static size_t rate_take(struct rate_state *r, size_t want)
+{
+    if (!__atomic_load_n(&limiter.active, __ATOMIC_RELAXED))
+    {
+        return want;
+    }
+    if (want > RATE_QUANTUM)
+    {
+        want = RATE_QUANTUM;
+    }
+
+    long long now = monotonic_ns();
+    double floor = want < RATE_MIN_GRANT ? want : RATE_MIN_GRANT;
+    double avail = want;
+    int global_short = 0, local_short = 0;
+    size_t grant = 0;
+
+    pthread_mutex_lock(&limiter.lock);
+    if (r->generation != limiter.generation)
+    {
+        r->weight = rate_weight_of(r->addr);
+        r->generation = limiter.generation;
+    }
+    if (limiter.global_rate > 0)
+    {
+        bucket_refill(&limiter.global, limiter.global_rate, now);
+        if (r->heap_pos == 0 && r->vtime < limiter.vclock)
+        {
+            r->vtime = limiter.vclock; // Idle time earns no credit
+        }
+        // A transfer more than a quantum ahead of the one waiting longest lets it go first
+        struct rate_state *first = limiter.nwaiting > 0 ? limiter.waiting[1] : NULL;
+        if (limiter.global.tokens < floor || (first != NULL && first != r && first->vtime + RATE_QUANTUM < r->vtime))
+        {
+            global_short = 1;
+        }
+        else if (avail > limiter.global.tokens)
+        {
+            avail = limiter.global.tokens;
+        }
+    }
+    if (limiter.ip_rate > 0 && (r->ip != NULL || (r->ip = rate_ip_attach(r->addr)) != NULL))
+    {
+        bucket_refill(&r->ip->bucket, limiter.ip_rate, now);
+        if (r->ip->bucket.tokens < floor)
+        {
+            local_short = 1;
+        }
+        else if (avail > r->ip->bucket.tokens)
+        {
+            avail = r->ip->bucket.tokens;
+        }
+    }
+    if (limiter.conn_rate > 0)
+    {
+        bucket_refill(&r->bucket, limiter.conn_rate, now);
+        if (r->bucket.tokens < floor)
+        {
+            local_short = 1;
+        }
+        else if (avail > r->bucket.tokens)
+        {
+            avail = r->bucket.tokens;
+        }
+    }
+
+    if (local_short)
+    {
+        // Held back by its own limits: it must not hold up the global queue
+        if (r->heap_pos != 0)
+        {
+            rate_heap_remove(r);
+        }
+        limiter.local_stalls++;
+    }
+    else if (global_short)
+    {
+        if (r->heap_pos == 0)
+        {
+            rate_heap_push(r);
+        }
+        limiter.global_stalls++;
+    }
+    else
+    {
+        grant = (size_t)avail;
+        if (r->heap_pos != 0)
+        {
+            rate_heap_remove(r);
+        }
+        if (limiter.global_rate > 0)
+        {
+            limiter.global.tokens -= grant;
+            if (limiter.vclock < r->vtime)
+            {
+                limiter.vclock = r->vtime;
+            }
+            r->vtime += (double)grant / r->weight;
+        }
+        if (limiter.ip_rate > 0 && r->ip != NULL)
+        {
+            r->ip->bucket.tokens -= grant;
+        }
+        if (limiter.conn_rate > 0)
+        {
+            r->bucket.tokens -= grant;
+        }
+        limiter.granted += grant;
+    }
+    pthread_mutex_unlock(&limiter.lock);
+    r->throttled = grant == 0;
+    return grant;
+}
+
+/**
+ * @brief Returns tokens of a grant the socket did not take.
+ */
+static void rate_refund(struct rate_state *r, size_t unused)
+{
+    if (unused == 0 || r->generation == 0 || !__atomic_load_n(&limiter.active, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&limiter.lock);
+    if (limiter.global_rate > 0)
+    {
+        limiter.global.tokens += unused;
+        r->vtime -= (double)unused / r->weight;
+    }
+    if (limiter.ip_rate > 0 && r->ip != NULL)
+    {
+        r->ip->bucket.tokens += unused;
+    }
+    if (limiter.conn_rate > 0)
+    {
+        r->bucket.tokens += unused;
+    }
+    limiter.granted -= unused;
+    pthread_mutex_unlock(&limiter.lock);
+}
+
+/**
+ * @brief Leaves the global queue and drops the per-IP bucket reference of a
+ *        closing connection.
+ */
+static void rate_detach(struct rate_state *r)
+{
+    if (r->generation == 0)
+    {
+        return; // Never went past the fast path
+    }
+    pthread_mutex_lock(&limiter.lock);
+    if (r->heap_pos != 0)
+    {
+        rate_heap_remove(r);
+    }
+    if (r->ip != NULL && --r->ip->refs == 0)
+    {
+        struct ip_bucket **link = &limiter.ips[(r->ip->addr * 2654435761u) % RATE_IP_BUCKETS];
+        while (*link != r->ip)
+        {
+            link = &(*link)->next;
+        }
+        *link = r->ip->next;
+        free(r->ip);
+    }
+    r->ip = NULL;
+    pthread_mutex_unlock(&limiter.lock);
+}
+
+/**
+ * @brief Installs new limits and weights; transfers in flight pick them up
+ *        with their next grant.
+ */
+static void rate_set_limits(double global_rate, double ip_rate, double conn_rate, const struct rate_weight *weights,
+                            int nweights)
+{
+    pthread_mutex_lock(&limiter.lock);
+    limiter.global_rate = global_rate;
+    limiter.ip_rate = ip_rate;
+    limiter.conn_rate = conn_rate;
+    if (nweights > 0)
+    {
+        memcpy(limiter.weights, weights, nweights * sizeof(*weights));
+    }
+    limiter.nweights = nweights;
+    limiter.generation++;
+    // Waiting transfers are retried on their next tick and queue up again under the new limits
+    for (int i = 1; i <= limiter.nwaiting; i++)
+    {
+        limiter.waiting[i]->heap_pos = 0;
+    }
+    limiter.nwaiting = 0;
+    __atomic_store_n(&limiter.active, global_rate > 0 || ip_rate > 0 || conn_rate > 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&limiter.lock);
+}
+
+/**
+ * @brief Parses a rate in bytes per second with an optional k, M or G
+ *        (decimal) suffix; 0 means unlimited.
+ * @return 0, or -1 if 'text' is not a rate.
+ */
+static int rate_parse(const char *text, double *rate)
+{
+    char *end;
+    double value = strtod(text, &end);
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value *= 1e3;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1e6;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1e9;
+        end++;
+        break;
+    }
+    if (end == text || *end != '\0' || !(value >= 0))
+    {
+        return -1;
+    }
+    *rate = value;
+    return 0;
+}
+
+/**
+ * @brief Reads a limits file and installs it. One setting per line, '#'
+ *        starts a comment:
+ *   global <rate>           - all transfers together
+ *   ip <rate>               - all transfers of one client address
+ *   conn <rate>             - each transfer
+ *   weight <address> <n>    - fair share of that client's transfers (default 1)
+ *        Settings left out are unlimited. A file with an error changes nothing.
+ * @return 0, or -1 on error.
+ */
+static int rate_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    double rates[3] = {0, 0, 0}; // global, ip, conn
+    struct rate_weight weights[RATE_MAX_WEIGHTS];
+    int nweights = 0, line_no = 0;
+    char line[256];
+
+    if (fp == NULL)
+    {
+        perror("Error opening limits file");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char key[16], arg[64], weight[16];
+        struct in_addr addr;
+        int ok = 0;
+
+        line_no++;
+        line[strcspn(line, "#")] = '\0';
+        int fields = sscanf(line, "%15s %63s %15s", key, arg, weight);
+        if (fields <= 0)
+        {
+            continue;
+        }
+        if (fields == 2 && strcmp(key, "global") == 0)
+        {
+            ok = rate_parse(arg, &rates[0]) == 0;
+        }
+        else if (fields == 2 && strcmp(key, "ip") == 0)
+        {
+            ok = rate_parse(arg, &rates[1]) == 0;
+        }
+        else if (fields == 2 && strcmp(key, "conn") == 0)
+        {
+            ok = rate_parse(arg, &rates[2]) == 0;
+        }
+        else if (fields == 3 && strcmp(key, "weight") == 0 && nweights < RATE_MAX_WEIGHTS &&
+                 inet_pton(AF_INET, arg, &addr) == 1 && atoi(weight) > 0)
+        {
+            weights[nweights].addr = addr.s_addr;
+            weights[nweights++].weight = atoi(weight);
+            ok = 1;
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "%s:%d: invalid limit '%s'\n", path, line_no, key);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    rate_set_limits(rates[0], rates[1], rates[2], weights, nweights);
+    return 0;
+}
+
+static void rate_format(double rate, char *buf, size_t len)
+{
+    if (rate > 0)
+    {
+        snprintf(buf, len, "%.2f MB/s", rate / 1e6);
+    }
+    else
+    {
+        snprintf(buf, len, "unlimited");
+    }
+}
+
+/**
+ * @brief Prints the bandwidth limits and their counters (at startup, on
+ *        SIGUSR1 and after a reload).
+ */
+static void rate_report(void)
+{
+    char global[32], ip[32], conn[32];
+
+    pthread_mutex_lock(&limiter.lock);
+    rate_format(limiter.global_rate, global, sizeof(global));
+    rate_format(limiter.ip_rate, ip, sizeof(ip));
+    rate_format(limiter.conn_rate, conn, sizeof(conn));
+    printf("Bandwidth: global %s, per client IP %s, per connection %s, %d weights; %lld bytes granted, "
+           "%lld stalls on the global limit, %lld on IP/connection limits, %d transfers queued\n",
+           global, ip, conn, limiter.nweights, limiter.granted, limiter.global_stalls, limiter.local_stalls,
+           limiter.nwaiting);
+    pthread_mutex_unlock(&limiter.lock);
+    fflush(stdout);
+}
+
+/**
+ * @brief Adds the file cache and bandwidth limiter counters to a stats scrape.
+ */
+static void server_metrics_extra(MetricsBuf *b)
+{
+    pthread_mutex_lock(&cache.lock);
+    metrics_printf(b,
+                   "# HELP transfer_server_cache_lookups_total File cache lookups by result\n"
+                   "# TYPE transfer_server_cache_lookups_total counter\n"
+                   "transfer_server_cache_lookups_total{result=\"hit\"} %lld\n"
+                   "transfer_server_cache_lookups_total{result=\"miss\"} %lld\n"
+                   "# HELP transfer_server_cache_evictions_total Files evicted from the cache\n"
+                   "# TYPE transfer_server_cache_evictions_total counter\n"
+                   "transfer_server_cache_evictions_total %lld\n"
+                   "# HELP transfer_server_cache_bytes File bytes held by the cache\n"
+                   "# TYPE transfer_server_cache_bytes gauge\n"
+                   "transfer_server_cache_bytes %lld\n",
+                   cache.hits, cache.misses, cache.evictions, cache.bytes);
+    pthread_mutex_unlock(&cache.lock);
+    pthread_mutex_lock(&limiter.lock);
+    metrics_printf(b,
+                   "# HELP transfer_server_rate_stalls_total Body sends held back by a bandwidth limit\n"
+                   "# TYPE transfer_server_rate_stalls_total counter\n"
+                   "transfer_server_rate_stalls_total{limit=\"global\"} %lld\n"
+                   "transfer_server_rate_stalls_total{limit=\"ip_or_connection\"} %lld\n"
+                   "# HELP transfer_server_rate_queued Transfers waiting for the global bandwidth limit\n"
+                   "# TYPE transfer_server_rate_queued gauge\n"
+                   "transfer_server_rate_queued %d\n",
+                   limiter.global_stalls, limiter.local_stalls, limiter.nwaiting);
+    pthread_mutex_unlock(&limiter.lock);
+
+    // Flat while transfers keep running: buffers and connections are recycled
+    BufPoolStats pool;
+    buf_pool_stats(&pool);
+    metrics_printf(b,
+                   "# HELP transfer_server_pool_allocations_total System allocations made by the buffer pool and slabs\n"
+                   "# TYPE transfer_server_pool_allocations_total counter\n"
+                   "transfer_server_pool_allocations_total{kind=\"buffer\"} %llu\n"
+                   "transfer_server_pool_allocations_total{kind=\"hugepage\"} %llu\n"
+                   "transfer_server_pool_allocations_total{kind=\"slab\"} %llu\n"
+                   "# HELP transfer_server_pool_bytes Memory held by the buffer pool and slabs\n"
+                   "# TYPE transfer_server_pool_bytes gauge\n"
+                   "transfer_server_pool_bytes{kind=\"buffer\"} %llu\n"
+                   "transfer_server_pool_bytes{kind=\"slab\"} %llu\n",
+                   (unsigned long long)pool.buffer_allocs, (unsigned long long)pool.hugepage_allocs,
+                   (unsigned long long)pool.slab_allocs, (unsigned long long)pool.buffer_bytes,
+                   (unsigned long long)pool.slab_bytes);
+}
+
+static void on_sighup(int sig)
+{
+    (void)sig;
+    rate_reload_requested = 1;
+}
+
+/**
+ * @brief Maps 'length' bytes of a regular file from 'offset' so a checksummed
+ *        body can stay on sendfile()/splice(): the kernel moves the data, the
+ *        CRC is computed from the same (page-cache) bytes through the mapping.
+ * @return 0, or -1 if the file cannot be mapped.
+ */
+static int tx_stream_map_crc(struct tx_stream *tx, off_t offset, long long length)
+{
+    off_t base = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t len = (size_t)(offset - base + length);
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, tx->fd, base);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+    tx->crc_src = map;
+    tx->crc_base = base;
+    tx->crc_map_len = len;
+    return 0;
+}
+
+/**
+ * @brief Adds the 'n' bytes a zero-copy path just took from the file (ending
+ *        at tx->offset) to the CRC.
+ */
+static void tx_stream_crc_taken(struct tx_stream *tx, size_t n)
+{
+    if (tx->checksum)
+    {
+        tx->crc = crc32c_update(tx->crc, tx->crc_src + (tx->offset - n - tx->crc_base), n);
+    }
+}
+
+/**
+ * @brief Prepares a tx_stream for 'length' bytes of 'fd' from its current offset.
+ *        TX_AUTO resolves to sendfile() for regular files and splice() otherwise;
+ *        a compressed body goes through the copy loop, and so does a
+ *        checksummed one whose file cannot be mapped for its CRC.
+ */
+static void tx_stream_init(struct tx_stream *tx, int fd, long long length, int codec, int checksum)
+{
+    struct stat st;
+
+    memset(tx, 0, sizeof(*tx));
+    tx->fd = fd;
+    tx->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    tx->offset = tx->seekable ? lseek(fd, 0, SEEK_CUR) : 0;
+    tx->remaining = length;
+    tx->pipefd[0] = tx->pipefd[1] = -1;
+    tx->chunk = TCP_TUNE_MIN_CHUNK;
+    tx->mode = tx_mode;
+    if (tx->mode == TX_AUTO)
+    {
+        tx->mode = tx->seekable ? TX_SENDFILE : TX_SPLICE;
+    }
+    tx->codec = codec;
+    tx->checksum = checksum;
+    if (codec != CODEC_NONE)
+    {
+        tx->mode = TX_COPY; // Compression needs the bytes in user space
+    }
+    else if (checksum && tx->mode != TX_COPY && length > 0 &&
+             (!tx->seekable || tx_stream_map_crc(tx, tx->offset, length) < 0))
+    {
+        tx->mode = TX_COPY; // No mapping to take the CRC from
+    }
+}
+
+/**
+ * @brief Prepares a tx_stream for 'length' bytes of a cached file from
+ *        'offset'. Plain and checksummed bodies take the configured data path
+ *        on the cached descriptor (the CRC comes from the cached copy);
+ *        compressed ones are encoded from the copy.
+ */
+static void tx_stream_init_cached(struct tx_stream *tx, struct cache_entry *e, long long offset, long long length,
+                                  int codec, int checksum)
+{
+    memset(tx, 0, sizeof(*tx));
+    tx->fd = e->fd; // Owned by the entry, not the connection
+    tx->seekable = 1;
+    tx->offset = offset;
+    tx->remaining = length;
+    tx->pipefd[0] = tx->pipefd[1] = -1;
+    tx->chunk = TCP_TUNE_MIN_CHUNK;
+    tx->mode = tx_mode == TX_AUTO ? TX_SENDFILE : tx_mode;
+    if (codec != CODEC_NONE)
+    {
+        tx->mode = TX_COPY;
+    }
+    tx->codec = codec;
+    tx->checksum = checksum;
+    tx->crc_src = e->data;
+    tx->cached = e;
+}
+
+/**
+ * @brief Releases the pipe, buffer and cache reference of a tx_stream (not the source fd).
+ */
+static void tx_stream_release(struct tx_stream *tx)
+{
+    if (tx->pipefd[0] >= 0)
+    {
+        close(tx->pipefd[0]);
+        close(tx->pipefd[1]);
+        tx->pipefd[0] = tx->pipefd[1] = -1;
+    }
+    buf_put(tx->buf, tx->buf_cap);
+    buf_put(tx->raw, LZ_BLOCK_SIZE);
+    slab_free(&key_slab, tx->tls);
+    buf_put(tx->tls_record, TLS_RECORD_MAX + TLS_RECORD_OVERHEAD);
+    if (tx->crc_map_len > 0)
+    {
+        munmap((void *)tx->crc_src, tx->crc_map_len);
+    }
+    tx->crc_src = NULL;
+    tx->crc_map_len = 0;
+    tx->buf = NULL;
+    tx->buf_cap = 0;
+    tx->raw = NULL;
+    tx->tls = NULL;
+    tx->tls_record = NULL;
+    if (tx->cached != NULL)
+    {
+        cache_release(tx->cached);
+        tx->cached = NULL;
+    }
+}
+
+/**
+ * @brief Switches a stream to userspace TLS with 'key' (which it takes over).
+ *        sendfile() and splice() never bring the bytes into user space, so
+ *        those streams fall back to the copy loop.
+ * @return 0, or -1 if the record buffer cannot be allocated.
+ */
+static int tx_stream_start_tls(struct tx_stream *tx, TlsKey *key)
+{
+    tx->tls = key;
+    if ((tx->tls_record = buf_get(TLS_RECORD_MAX + TLS_RECORD_OVERHEAD)) == NULL)
+    {
+        log_msg("malloc failed for TLS record: %s\n", strerror(errno));
+        return -1;
+    }
+    if (tx->mode == TX_SENDFILE || tx->mode == TX_SPLICE)
+    {
+        tx->mode = TX_COPY;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends what is left of the sealed TLS record, if any.
+ * @return 1 when nothing is pending, 0 if the socket would block, -1 on error.
+ */
+static int tx_stream_flush(int sock, struct tx_stream *tx)
+{
+    while (tx->tls != NULL && tx->tls_record_off < tx->tls_record_len)
+    {
+        ssize_t n = send(sock, tx->tls_record + tx->tls_record_off, tx->tls_record_len - tx->tls_record_off,
+                         MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+        tx->tls_record_off += n;
+    }
+    return 1;
+}
+
+/**
+ * @brief send() for body and trailer bytes. With userspace TLS the bytes are
+ *        sealed into one record (at most TLS_RECORD_MAX of them are taken);
+ *        a record the socket only partly accepts is finished by the next
+ *        call or by tx_stream_flush().
+ * @return Bytes taken, or -1 with errno set (EAGAIN: try again later).
+ */
+static ssize_t tx_send(int sock, struct tx_stream *tx, const void *data, size_t len)
+{
+    int r;
+
+    if (tx->tls == NULL)
+    {
+        return send(sock, data, len, MSG_NOSIGNAL);
+    }
+    if ((r = tx_stream_flush(sock, tx)) <= 0)
+    {
+        if (r == 0)
+        {
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+    if (len > TLS_RECORD_MAX)
+    {
+        len = TLS_RECORD_MAX;
+    }
+    tx->tls_record_len = tls_seal_record(tx->tls, data, len, tx->tls_record);
+    tx->tls_record_off = 0;
+    return tx_stream_flush(sock, tx) < 0 ? -1 : (ssize_t)len;
+}
+
+/**
+ * @brief Takes bandwidth tokens for up to 'want' body bytes.
+ * @return Bytes the stream may take from its source now, 0 if it is throttled.
+ */
+static size_t tx_take(struct tx_stream *tx, size_t want)
+{
+    return tx->rate != NULL ? rate_take(tx->rate, want) : want;
+}
+
+/**
+ * @brief Hands back the tokens of a grant of which only 'used' (or, after an
+ *        error, none: used < 0) bytes were taken.
+ */
+static void tx_refund(struct tx_stream *tx, size_t granted, ssize_t used)
+{
+    if (tx->rate != NULL && used < (ssize_t)granted)
+    {
+        rate_refund(tx->rate, granted - (used > 0 ? used : 0));
+    }
+}
+
+/**
+ * @brief Pushes as much of the body into 'sock' as it accepts. Partial sends
+ *        are tracked in the stream; sendfile() falls back to splice() and
+ *        splice() to the copy loop if the kernel refuses them before any
+ *        byte has been sent. Bytes are taken from the source only as the
+ *        bandwidth limits grant them.
+ * @return 1 when the body is complete, 0 if the socket would block or the
+ *         stream is throttled, -1 on error.
+ */
+static int tx_stream_pump(int sock, struct tx_stream *tx)
+{
+    ssize_t n;
+
+    while (tx->remaining > 0 || tx->pipe_pending > 0 || tx->buf_off < tx->buf_len)
+    {
+        size_t want = (tx->remaining < SENDFILE_CHUNK) ? (size_t)tx->remaining : SENDFILE_CHUNK;
+
+        switch (tx->mode)
+        {
+        case TX_SENDFILE:
+            if ((want = tx_take(tx, want)) == 0)
+            {
+                return 0;
+            }
+            n = sendfile(sock, tx->fd, tx->seekable ? &tx->offset : NULL, want);
+            tx_refund(tx, want, n);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    return 0;
+                }
+                if (tx->sent == 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                    tx->mode = TX_SPLICE; // Not supported for this source
+                    continue;
+                }
+                log_msg("Error in sendfile: %s\n", strerror(errno));
+                return -1;
+            }
+            if (n == 0)
+            {
+                return -1; // File shrank underneath us
+            }
+            tx_stream_crc_taken(tx, n);
+            tx->remaining -= n;
+            tx->sent += n;
+            break;
+
+        case TX_SPLICE:
+            if (tx->pipefd[0] < 0 && pipe(tx->pipefd) < 0)
+            {
+                log_msg("Error creating splice pipe: %s\n", strerror(errno));
+                tx->mode = TX_COPY;
+                continue;
+            }
+            // Refill the pipe from the file only once the socket has drained it
+            if (tx->pipe_pending == 0)
+            {
+                if ((want = tx_take(tx, want)) == 0)
+                {
+                    return 0;
+                }
+                n = splice(tx->fd, tx->seekable ? (loff_t *)&tx->offset : NULL, tx->pipefd[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                tx_refund(tx, want, n);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (tx->sent == 0 && (errno == EINVAL || errno == ENOSYS))
+                    {
+                        tx->mode = TX_COPY;
+                        continue;
+                    }
+                    log_msg("Error splicing from file: %s\n", strerror(errno));
+                    return -1;
+                }
+                if (n == 0)
+                {
+                    return -1; // Premature EOF
+                }
+                tx_stream_crc_taken(tx, n);
+                tx->pipe_pending = n;
+                tx->remaining -= n;
+            }
+            n = splice(tx->pipefd[0], NULL, sock, NULL, tx->pipe_pending,
+                       SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    return 0;
+                }
+                log_msg("Error splicing to socket: %s\n", strerror(errno));
+                return -1;
+            }
+            tx->pipe_pending -= n;
+            tx->sent += n;
+            break;
+
+        default: // TX_COPY
+            if (tx->buf_off == tx->buf_len)
+            {
+                // Compressed bodies read a whole codec block and send it as one frame;
+                // encrypted ones read a whole record. A plain block grows with the tuned chunk.
+                size_t block = tx->codec ? LZ_BLOCK_SIZE : tx->tls ? TLS_RECORD_MAX : tx->chunk;
+                size_t cap = tx->codec ? LZ_MAX_FRAME : block;
+                if (tx->buf_cap < cap)
+                {
+                    buf_put(tx->buf, tx->buf_cap); // Drained: nothing in it is still unsent
+                    tx->buf_cap = (tx->buf = buf_get(cap)) != NULL ? cap : 0;
+                }
+                if (tx->buf == NULL || (tx->codec && tx->raw == NULL && (tx->raw = buf_get(LZ_BLOCK_SIZE)) == NULL))
+                {
+                    log_msg("malloc failed for copy buffer: %s\n", strerror(errno));
+                    return -1;
+                }
+                char *dst = tx->codec ? tx->raw : tx->buf;
+                const char *src = dst;
+                want = (tx->remaining < (long long)block) ? (size_t)tx->remaining : block;
+                if ((want = tx_take(tx, want)) == 0)
+                {
+                    return 0;
+                }
+                if (tx->cached != NULL)
+                {
+                    // Encode straight from the cached copy; plain bodies still need their own buffer
+                    src = tx->cached->data + tx->offset;
+                    if (!tx->codec)
+                    {
+                        memcpy(dst, src, want);
+                    }
+                    n = want;
+                }
+                else
+                {
+                    n = tx->seekable ? pread(tx->fd, dst, want, tx->offset) : read(tx->fd, dst, want);
+                }
+                tx_refund(tx, want, n);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    return -1;
+                }
+                tx->offset += n;
+                tx->remaining -= n;
+                if (tx->checksum)
+                {
+                    tx->crc = crc32c_update(tx->crc, src, n);
+                }
+                tx->buf_len = tx->codec ? lz_encode_frame(&tx->enc, (const uint8_t *)src, n, (uint8_t *)tx->buf) : (size_t)n;
+                tx->buf_off = 0;
+            }
+            n = tx_send(sock, tx, tx->buf + tx->buf_off, tx->buf_len - tx->buf_off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    return 0;
+                }
+                log_msg("Error sending file data: %s\n", strerror(errno));
+                return -1;
+            }
+            tx->buf_off += n;
+            tx->sent += n;
+            break;
+        }
+    }
+    return tx_stream_flush(sock, tx);
+}
+
+/**
+ * @brief Streams 'length' bytes of 'fd' (from its current offset) to a
+ *        blocking socket using the configured tx_mode, or sealed into TLS
+ *        records with 'tls' (which the stream takes over) if not NULL.
+ * @return Number of bytes sent.
+ */
+long long send_file_body(int sock, int fd, long long length, TlsKey *tls)
+{
+    struct tx_stream tx;
+
+    tx_stream_init(&tx, fd, length, CODEC_NONE, 0);
+    if (tls != NULL && tx_stream_start_tls(&tx, tls) < 0)
+    {
+        return 0;
+    }
+    tx_stream_pump(sock, &tx);
+    tx_stream_release(&tx);
+    return tx.sent;
+}
+
+/**
+ * @brief Takes a connection off its worker's throttled list, if it is on it.
+ */
+static void throttle_remove(struct connection *c)
+{
+    if (c->throttle_pprev == NULL)
+    {
+        return;
+    }
+    *c->throttle_pprev = c->throttle_next;
+    if (c->throttle_next != NULL)
+    {
+        c->throttle_next->throttle_pprev = c->throttle_pprev;
+    }
+    c->throttle_next = NULL;
+    c->throttle_pprev = NULL;
+}
+
+/**
+ * @brief Puts a connection that ran out of tokens on its worker's throttled
+ *        list, starting the worker's tick timer if it was idle. The socket
+ *        is still writable, so no epoll event would ever wake it up again.
+ */
+static void throttle_add(struct worker *w, struct connection *c)
+{
+    if (c->throttle_pprev != NULL)
+    {
+        return;
+    }
+    c->throttle_next = w->throttled;
+    if (w->throttled != NULL)
+    {
+        w->throttled->throttle_pprev = &c->throttle_next;
+    }
+    w->throttled = c;
+    c->throttle_pprev = &w->throttled;
+    if (!w->timer_armed)
+    {
+        struct itimerspec tick = {{0, RATE_TICK_NS}, {0, RATE_TICK_NS}};
+        if (timerfd_settime(w->timer_fd, 0, &tick, NULL) < 0)
+        {
+            perror("timerfd_settime failed");
+        }
+        w->timer_armed = 1;
+    }
+}
+
+/**
+ * @brief Frees a connection and everything it owns.
+ */
+static void conn_close(struct worker *w, struct connection *c)
+{
+    char client_ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &(c->addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+    // Closing the socket also removes it from the epoll set
+    close(c->sock);
+    if (c->tx.fd >= 0 && c->tx.cached == NULL)
+    {
+        close(c->tx.fd);
+    }
+    tx_stream_release(&c->tx);
+    slab_free(&key_slab, c->tls_key);
+    throttle_remove(c);
+    rate_detach(&c->rate);
+    if (c->state == CONN_DONE)
+    {
+        metrics_record(H_TRANSFER, (monotonic_ns() - c->accepted_ns) / 1000);
+    }
+    metrics_dec(M_ACTIVE);
+    log_msg("Connection with %s:%d closed.\n", client_ip, ntohs(c->addr.sin_port));
+    slab_free(&conn_slab, c);
+    w->active--;
+}
+
+/**
+ * @brief Reads the request until a newline, or until the socket is drained
+ *        (legacy clients send the bare filename in one send() without '\n').
+ *        A "GET ..." line is always '\n'-terminated and may arrive split
+ *        across segments, so for it only the newline ends the request.
+ * @return 1 when the request is complete, 0 to wait for more data, -1 on error/EOF.
+ */
+static int conn_read_request(struct connection *c)
+{
+    for (;;)
+    {
+        ssize_t n = recv(c->sock, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                size_t prefix = c->request_len < 4 ? c->request_len : 4;
+                int get_line = c->request_len > 0 && strncmp(c->request, "GET ", prefix) == 0;
+                return c->request_len > 0 && !get_line ? 1 : 0;
+            }
+            log_msg("Error receiving filename: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+        {
+            return c->request_len > 0 ? 1 : -1;
+        }
+        c->request_len += n;
+        c->request[c->request_len] = '\0';
+        metrics_add(M_BYTES_IN, n);
+        if (memchr(c->request, '\n', c->request_len) != NULL || c->request_len == sizeof(c->request) - 1)
+        {
+            return 1;
+        }
+    }
+}
+
+static void hex_encode(const uint8_t *data, size_t len, char *out)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        sprintf(out + 2 * i, "%02x", data[i]);
+    }
+}
+
+/**
+ * @brief Parses exactly 2 * len hex digits.
+ * @return 0, or -1 if 'hex' is anything else.
+ */
+static int hex_decode(const char *hex, uint8_t *out, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned v;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) ||
+            sscanf(hex + 2 * i, "%2x", &v) != 1)
+            return -1;
+        out[i] = (uint8_t)v;
+    }
+    return hex[2 * len] == '\0' ? 0 : -1;
+}
 
 /**
- * @brief Creates a dummy file for testing the transfer.
+ * @brief Validates the request and fills in the response header; opens the
+ *        file and prepares the body stream on success.
+ *
+ * Two request forms are understood:
+ *   '<filename>'                      -> 'OK:<file_size>\n' + whole file (legacy)
+ *   'GET <filename> <offset> <length>' -> 'OK:<length> <file_size>\n' + that byte range
+ * The range length is clamped to the end of the file, so 'GET name 0 0' is a
+ * size probe with an empty body. A GET may append options, which the header
+ * echoes when honoured ('OK:<length> <file_size> lz crc'):
+ *   lz  - the range is sent as compressed frames (see common/lzcodec.h)
+ *   crc - the body is followed by the CRC32C of the raw range bytes, as 4
+ *         little-endian bytes, so the client can verify what it stored
+ *   tls:<client nonce> - (with -T) everything after the header is sent as
+ *         TLS records (common/tls.h); the echo carries the server's nonce
  */
-void create_dummy_file()
+static void conn_prepare_response(struct connection *c)
 {
-    FILE *fp = fopen(TRANSFER_FILE, "r");
-    if (fp == NULL)
+    struct stat file_stat;
+    int file_fd;
+    char filename[REQUEST_MAX];
+    long long offset = 0, length = -1; // length -1: legacy whole-file request
+    int is_range = 0, codec = CODEC_NONE, checksum = 0, consumed = 0, tls = 0;
+    uint8_t client_nonce[TLS_NONCE_LEN], server_nonce[TLS_NONCE_LEN];
+    char tls_option[8 + 2 * TLS_NONCE_LEN] = "";
+
+    c->request[strcspn(c->request, "\r\n")] = '\0';
+    c->state = CONN_SEND_HEADER;
+
+    if (strncmp(c->request, "GET ", 4) == 0)
     {
-        printf("Creating dummy file: %s\n", TRANSFER_FILE);
-        fp = fopen(TRANSFER_FILE, "w");
-        if (fp == NULL)
+        is_range = 1;
+        if (sscanf(c->request, "GET %1023s %lld %lld%n", filename, &offset, &length, &consumed) < 3 ||
+            offset < 0 || length < 0)
         {
-            perror("Failed to create dummy file");
+            c->header_len = snprintf(c->header, sizeof(c->header), "ERROR:Bad Request");
+            metrics_inc(M_REQ_BAD);
+            log_msg("Sent error response: Malformed range request '%s'.\n", c->request);
             return;
         }
-        fprintf(fp, "This is the content of the file being transferred.\n");
-        fprintf(fp, "Line 2: The quick brown fox jumps over the lazy dog.\n");
-        fprintf(fp, "Line 3: Distributed Systems Practical Work 1 - TCP File Transfer (C version).\n");
-        fclose(fp);
-        printf("File created successfully.\n");
+        char *saveptr, *option = strtok_r(c->request + consumed, " ", &saveptr);
+        for (; option != NULL; option = strtok_r(NULL, " ", &saveptr))
+        {
+            if (strcmp(option, "lz") == 0)
+            {
+                codec = CODEC_LZ;
+            }
+            else if (strcmp(option, "crc") == 0)
+            {
+                checksum = 1; // Unknown options are ignored, not echoed
+            }
+            else if (strncmp(option, "tls:", 4) == 0 && tls_psk != NULL &&
+                     hex_decode(option + 4, client_nonce, TLS_NONCE_LEN) == 0)
+                tls = 1;
+        }
+        log_msg("Client requested file: '%s' bytes %lld+%lld%s%s%s\n", filename, offset, length,
+                codec == CODEC_LZ ? " (lz)" : "", checksum ? " (crc)" : "", tls ? " (tls)" : "");
     }
     else
     {
-        printf("Using existing file: %s\n", TRANSFER_FILE);
-        fclose(fp);
+        snprintf(filename, sizeof(filename), "%s", c->request);
+        log_msg("Client requested file: '%s'\n", filename);
+    }
+
+    // Check if the requested file is the one we serve
+    if (strcmp(filename, TRANSFER_FILE) != 0)
+    {
+        // File not found response
+        c->header_len = snprintf(c->header, sizeof(c->header), "ERROR:File Not Found");
+        metrics_inc(M_REQ_NOT_FOUND);
+        log_msg("Sent error response: File not found.\n");
+        return;
+    }
+
+    // Popular files come from the in-memory cache; the rest (and everything
+    // with -c 0) is opened per request. fstat on the open descriptor so size and data agree.
+    struct cache_entry *cached = cache_acquire(TRANSFER_FILE);
+    file_fd = -1;
+    if (cached != NULL)
+    {
+        file_stat.st_size = cached->size;
+    }
+    else if ((file_fd = open(TRANSFER_FILE, O_RDONLY)) < 0 || fstat(file_fd, &file_stat) < 0)
+    {
+        log_msg("Error opening file: %s\n", strerror(errno));
+        if (file_fd >= 0)
+        {
+            close(file_fd);
+        }
+        c->header_len = snprintf(c->header, sizeof(c->header), "ERROR:Internal Server Error");
+        metrics_inc(M_REQ_INTERNAL);
+        return;
+    }
+
+    if (!is_range)
+    {
+        // Protocol: Send 'OK:<file_size>\n' (the newline tells the client where the body starts)
+        c->header_len = snprintf(c->header, sizeof(c->header), "OK:%lld\n", (long long)file_stat.st_size);
+        length = file_stat.st_size;
+    }
+    else
+    {
+        if (offset > file_stat.st_size)
+        {
+            if (cached != NULL)
+            {
+                cache_release(cached);
+            }
+            else
+            {
+                close(file_fd);
+            }
+            c->header_len = snprintf(c->header, sizeof(c->header), "ERROR:Range Not Satisfiable");
+            metrics_inc(M_REQ_RANGE);
+            log_msg("Sent error response: Range starts past end of file.\n");
+            return;
+        }
+        if (length > file_stat.st_size - offset)
+        {
+            length = file_stat.st_size - offset;
+        }
+        if (tls && (getrandom(server_nonce, sizeof(server_nonce), 0) != sizeof(server_nonce) ||
+                    (c->tls_key = slab_alloc(&key_slab)) == NULL))
+        {
+            log_msg("Error setting up TLS: %s\n", strerror(errno));
+            tls = 0; // Not echoed: the client refuses a plaintext body
+        }
+        if (tls)
+        {
+            tls_derive_key(tls_psk, tls_psk_len, client_nonce, server_nonce, c->tls_key);
+            strcpy(tls_option, " tls:");
+            hex_encode(server_nonce, TLS_NONCE_LEN, tls_option + 5);
+        }
+        // Protocol: Send 'OK:<length> <file_size>[ lz][ crc][ tls:<nonce>]\n', then the requested range
+        c->header_len = snprintf(c->header, sizeof(c->header), "OK:%lld %lld%s%s%s\n", length,
+                                 (long long)file_stat.st_size, codec == CODEC_LZ ? " lz" : "", checksum ? " crc" : "",
+                                 tls_option);
+    }
+
+    metrics_inc(M_REQ_OK);
+    if (cached != NULL)
+    {
+        tx_stream_init_cached(&c->tx, cached, offset, length, codec, checksum);
+    }
+    else
+    {
+        lseek(file_fd, offset, SEEK_SET);
+        tx_stream_init(&c->tx, file_fd, length, codec, checksum);
     }
+    c->tx.rate = &c->rate;
 }
 
 /**
- * @brief Handles a single client connection and file transfer.
- * @param arg Pointer to thread_data structure containing client info.
- * @return NULL
+ * @brief Encrypts everything after the header: kTLS when the kernel has it,
+ *        so sendfile() and splice() keep working, otherwise userspace records.
+ * @return 0, or -1 on error.
  */
-void *handle_client(void *arg)
+static int conn_start_tls(struct connection *c)
 {
-    struct thread_data *data = (struct thread_data *)arg;
-    int client_socket = data->client_socket;
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(data->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+    TlsKey *key = c->tls_key;
+    int err;
 
-    printf("Connected by %s:%d\n", client_ip, ntohs(data->client_addr.sin_port));
+    c->tls_key = NULL;
+    if ((err = tls_kernel_enable(c->sock, TLS_TX, key)) == 0)
+    {
+        log_msg("Encrypting the body with kTLS.\n");
+        slab_free(&key_slab, key);
+        return 0;
+    }
+    log_msg("Encrypting the body in userspace, %s (kTLS unavailable: %s).\n", aesgcm_impl_name(), strerror(-err));
+    return tx_stream_start_tls(&c->tx, key);
+}
 
-    char filename_buffer[1024];
-    long long file_size = 0;
-    struct stat file_stat;
-    FILE *fp = NULL;
-    ssize_t bytes_read, bytes_sent;
-    char file_buffer[BUFFER_SIZE];
-    char header_buffer[64];
+/**
+ * @brief Publishes what the tuner measured and chose for a finished body:
+ *        the path RTT goes into the metrics, the whole picture into the log.
+ */
+static void conn_report_tuning(struct connection *c)
+{
+    char line[160];
 
-    // 1. Server waits for filename request (Protocol Step 1)
-    if (recv(client_socket, filename_buffer, sizeof(filename_buffer) - 1, 0) <= 0)
+    c->tune.next_ns = 0; // Take a last sample, so short bodies are measured too
+    tcp_tune_update(&c->tune);
+    if (c->tune.rtt_us > 0)
+    {
+        metrics_record(H_RTT, c->tune.rtt_us);
+    }
+    if (c->tune.raised > 0)
     {
-        perror("Error receiving filename or connection closed");
-        goto cleanup;
+        metrics_inc(M_TUNED);
     }
-    filename_buffer[sizeof(filename_buffer) - 1] = '\0'; // Null-terminate
-    printf("Client requested file: '%s'\n", filename_buffer);
+    tcp_tune_format(&c->tune, line, sizeof(line));
+    log_msg("Transport: %s\n", line);
+}
 
-    // Check if the requested file is the one we serve
-    if (strcmp(filename_buffer, TRANSFER_FILE) != 0)
+/**
+ * @brief Runs the connection state machine until it finishes or would block.
+ * @return 1 when the connection is finished, 0 to wait for readiness, -1 on error.
+ */
+static int conn_advance(struct connection *c)
+{
+    ssize_t n;
+    long long sent;
+    int r;
+
+    for (;;)
     {
-        // File not found response
-        snprintf(header_buffer, sizeof(header_buffer), "ERROR:File Not Found");
-        send(client_socket, header_buffer, strlen(header_buffer), 0);
-        printf("Sent error response: File not found.\n");
-        goto cleanup;
+        switch (c->state)
+        {
+        case CONN_READ_REQUEST:
+            // 1. Server waits for filename request (Protocol Step 1)
+            if ((r = conn_read_request(c)) <= 0)
+            {
+                return r;
+            }
+            conn_prepare_response(c);
+            break;
+
+        case CONN_SEND_HEADER:
+            // 2. Server sends file size or error (Protocol Step 2); MSG_MORE lets the
+            //    header share a segment with the first body bytes
+            n = send(c->sock, c->header + c->header_sent, c->header_len - c->header_sent,
+                     MSG_NOSIGNAL | (c->tx.remaining > 0 || c->tx.checksum ? MSG_MORE : 0));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    return 0;
+                }
+                log_msg("Error sending header: %s\n", strerror(errno));
+                return -1;
+            }
+            if (c->header_sent == 0)
+            {
+                metrics_record(H_FIRST_BYTE, (monotonic_ns() - c->accepted_ns) / 1000);
+            }
+            c->header_sent += n;
+            metrics_add(M_BYTES_OUT, n);
+            if (c->header_sent == c->header_len)
+            {
+                if (c->tx.fd >= 0)
+                {
+                    log_msg("Sent OK response with size: %lld%s\n", c->tx.remaining, c->tx.cached ? " (cached)" : "");
+                    if (c->tls_key != NULL && conn_start_tls(c) < 0)
+                    {
+                        return -1;
+                    }
+                    c->state = CONN_SEND_BODY;
+                }
+                else
+                {
+                    c->state = CONN_DONE;
+                }
+            }
+            break;
+
+        case CONN_SEND_BODY:
+            // 3. Server sends file data (Protocol Step 3)
+            tcp_tune_update(&c->tune);
+            c->tx.chunk = c->tune.chunk;
+            sent = c->tx.sent;
+            r = tx_stream_pump(c->sock, &c->tx);
+            metrics_add(M_BYTES_OUT, c->tx.sent - sent);
+            if (r <= 0)
+            {
+                return r;
+            }
+            if (c->tx.codec)
+            {
+                log_msg("Successfully sent %lld bytes as %lld compressed bytes (File Transfer Complete).\n",
+                        c->tx.enc.raw_bytes, c->tx.sent);
+            }
+            else
+            {
+                log_msg("Successfully sent %lld bytes (File Transfer Complete).\n", c->tx.sent);
+            }
+            conn_report_tuning(c);
+            c->state = CONN_DONE;
+            if (c->tx.checksum)
+            {
+                // The header buffer is free again: reuse it for the CRC trailer
+                for (int i = 0; i < 4; i++)
+                {
+                    c->header[i] = (char)(c->tx.crc >> (8 * i));
+                }
+                c->header_len = 4;
+                c->header_sent = 0;
+                c->state = CONN_SEND_TRAILER;
+            }
+            break;
+
+        case CONN_SEND_TRAILER:
+            if (c->header_sent == c->header_len)
+            {
+                // With userspace TLS the trailer's record may still be partly unsent
+                if ((r = tx_stream_flush(c->sock, &c->tx)) <= 0)
+                {
+                    return r;
+                }
+                c->state = CONN_DONE;
+                break;
+            }
+            n = tx_send(c->sock, &c->tx, c->header + c->header_sent, c->header_len - c->header_sent);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN)
+                {
+                    return 0;
+                }
+                log_msg("Error sending checksum: %s\n", strerror(errno));
+                return -1;
+            }
+            c->header_sent += n;
+            metrics_add(M_BYTES_OUT, n);
+            break;
+
+        case CONN_DONE:
+            // 4. Server closes the connection (recv() on client will return EOF)
+            return 1;
+        }
+    }
+}
+
+/**
+ * @brief Accepts every pending connection and registers it with this worker.
+ */
+static void accept_connections(struct worker *w)
+{
+    for (;;)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int sock = accept4(listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                log_msg("accept failed: %s\n", strerror(errno)); // EMFILE etc.: retry on the next readiness event
+                metrics_inc(M_ERR_ACCEPT);
+            }
+            return;
+        }
+
+        struct connection *c = slab_alloc(&conn_slab);
+        if (c == NULL)
+        {
+            log_msg("malloc failed for connection: %s\n", strerror(errno));
+            close(sock);
+            continue;
+        }
+        c->sock = sock;
+        c->addr = addr;
+        c->rate.addr = addr.sin_addr.s_addr;
+        c->accepted_ns = monotonic_ns();
+        c->state = CONN_READ_REQUEST;
+        tcp_tune_init(&c->tune, sock, TCP_TUNE_SEND);
+        c->tx.fd = -1;
+        c->tx.pipefd[0] = c->tx.pipefd[1] = -1;
+
+        // Edge-triggered: we are told about every transition to readable/writable
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0)
+        {
+            log_msg("epoll_ctl failed for connection: %s\n", strerror(errno));
+            close(sock);
+            slab_free(&conn_slab, c);
+            continue;
+        }
+        w->active++;
+        metrics_inc(M_CONNECTIONS);
+        metrics_inc(M_ACTIVE);
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        log_msg("Connected by %s:%d (worker %d)\n", client_ip, ntohs(addr.sin_port), w->id);
     }
+}
 
-    // Open file and get size
-    if (stat(TRANSFER_FILE, &file_stat) < 0)
+/**
+ * @brief Runs a connection until it finishes, would block or is throttled.
+ * @return Nonzero if the connection was closed.
+ */
+static int conn_run(struct worker *w, struct connection *c)
+{
+    c->rate.throttled = 0;
+    int r = conn_advance(c);
+    if (r != 0)
+    {
+        if (r < 0)
+        {
+            metrics_inc(c->state == CONN_READ_REQUEST ? M_ERR_RECV : M_ERR_SEND);
+        }
+        conn_close(w, c);
+        return 1;
+    }
+    if (c->rate.throttled)
     {
-        perror("Error getting file stats");
-        snprintf(header_buffer, sizeof(header_buffer), "ERROR:Internal Server Error");
-        send(client_socket, header_buffer, strlen(header_buffer), 0);
-        goto cleanup;
+        throttle_add(w, c);
     }
-    file_size = file_stat.st_size;
+    return 0;
+}
 
-    fp = fopen(TRANSFER_FILE, "rb");
-    if (fp == NULL)
+static int compare_vtime(const void *a, const void *b)
+{
+    double x = (*(struct connection *const *)a)->rate.vtime, y = (*(struct connection *const *)b)->rate.vtime;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Timer tick: retries the throttled connections, furthest behind in
+ *        virtual time first, for as long as the refilled buckets grant
+ *        anything. Connections still short of tokens requeue themselves;
+ *        the timer stops once none are left.
+ */
+static void throttle_tick(struct worker *w)
+{
+    uint64_t expirations;
+    int progress = 1;
+
+    if (read(w->timer_fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+    {
+        return;
+    }
+    while (progress && w->throttled != NULL)
+    {
+        size_t count = 0;
+        progress = 0;
+        for (struct connection *c = w->throttled; c != NULL; c = c->throttle_next)
+        {
+            count++;
+        }
+        if (count > w->retry_cap)
+        {
+            struct connection **grown = realloc(w->retry, count * sizeof(*grown));
+            if (grown == NULL)
+            {
+                log_msg("malloc failed for throttled connections: %s\n", strerror(errno));
+                return;
+            }
+            w->retry = grown;
+            w->retry_cap = count;
+        }
+        count = 0;
+        while (w->throttled != NULL)
+        {
+            w->retry[count++] = w->throttled;
+            throttle_remove(w->throttled);
+        }
+        qsort(w->retry, count, sizeof(*w->retry), compare_vtime);
+        for (size_t i = 0; i < count; i++)
+        {
+            long long remaining = w->retry[i]->tx.remaining;
+            struct connection *c = w->retry[i];
+            if (conn_run(w, c) || c->tx.remaining != remaining)
+            {
+                progress = 1;
+            }
+        }
+    }
+    if (w->throttled == NULL)
     {
-        perror("Error opening file");
-        snprintf(header_buffer, sizeof(header_buffer), "ERROR:Internal Server Error");
-        send(client_socket, header_buffer, strlen(header_buffer), 0);
-        goto cleanup;
+        struct itimerspec stop = {{0, 0}, {0, 0}};
+        timerfd_settime(w->timer_fd, 0, &stop, NULL);
+        w->timer_armed = 0;
     }
+}
+
+/**
+ * @brief Reactor loop of one worker thread.
+ * @param arg Pointer to the worker.
+ * @return NULL
+ */
+static void *worker_main(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
 
-    // 2. Server sends file size (Protocol Step 2)
-    // Protocol: Send 'OK:<file_size>'
-    snprintf(header_buffer, sizeof(header_buffer), "OK:%lld", file_size);
-    if (send(client_socket, header_buffer, strlen(header_buffer), 0) < 0)
+    // EPOLLEXCLUSIVE wakes a single worker per incoming connection
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    {
+        perror("epoll_ctl failed for listening socket");
+        return NULL;
+    }
+    // The tick timer is told apart from connections by pointing at the worker
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev) < 0)
     {
-        perror("Error sending header");
-        goto cleanup;
+        perror("epoll_ctl failed for tick timer");
+        return NULL;
     }
-    printf("Sent OK response with size: %lld\n", file_size);
 
-    // 3. Server sends file data (Protocol Step 3)
-    long long total_bytes_sent = 0;
-    while (total_bytes_sent < file_size && (bytes_read = fread(file_buffer, 1, BUFFER_SIZE, fp)) > 0)
+    while (1)
     {
-        bytes_sent = send(client_socket, file_buffer, bytes_read, 0);
-        if (bytes_sent < 0)
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+        int wait_errno = errno; // The reports below may clobber it
+        if (cache_report_requested)
+        {
+            cache_report_requested = 0;
+            cache_report();
+            rate_report();
+        }
+        if (rate_reload_requested)
         {
-            perror("Error sending file data");
+            rate_reload_requested = 0;
+            if (rate_config_path == NULL)
+            {
+                printf("SIGHUP ignored: no limits file (-R).\n");
+            }
+            else if (rate_load(rate_config_path) == 0)
+            {
+                rate_report();
+            }
+            fflush(stdout);
+        }
+        if (n < 0)
+        {
+            if (wait_errno == EINTR)
+            {
+                continue;
+            }
+            errno = wait_errno;
+            perror("epoll_wait failed");
             break;
         }
-        total_bytes_sent += bytes_sent;
+
+        int tick = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct connection *c = events[i].data.ptr;
+            if (c == NULL)
+            {
+                accept_connections(w);
+                continue;
+            }
+            if (events[i].data.ptr == w)
+            {
+                tick = 1; // After the batch: the tick may close connections that still have events in it
+                continue;
+            }
+            if (events[i].events & EPOLLERR)
+            {
+                metrics_inc(M_ERR_RESET);
+                conn_close(w, c);
+                continue;
+            }
+            conn_run(w, c);
+        }
+        if (tick)
+        {
+            throttle_tick(w);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Benchmark receiver: reads and discards everything until EOF.
+ * @param arg Pointer to the connected socket descriptor.
+ * @return NULL
+ */
+static void *bench_drain(void *arg)
+{
+    int sock = *(int *)arg;
+    char sink[1 << 16];
+    while (recv(sock, sink, sizeof(sink), 0) > 0)
+    {
+        ;
+    }
+    return NULL;
+}
+
+// Encryption used by a benchmark row
+enum bench_tls
+{
+    BENCH_PLAIN,
+    BENCH_KTLS, // Kernel TLS, the data path unchanged
+    BENCH_USER  // Userspace AES-GCM records through the copy loop
+};
+
+/**
+ * @brief Sends 'path' over a fresh loopback TCP connection with the given data
+ *        path and encryption, and measures wall time and CPU time of the
+ *        sending thread. The receiver discards the (encrypted) bytes.
+ * @return Bytes sent, -1 on setup error, -2 if kTLS is unavailable.
+ */
+static long long bench_one(const char *path, enum tx_mode mode, enum bench_tls tls, double *wall, double *cpu)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd, rx_fd, tx_fd, file_fd;
+    struct stat st;
+    pthread_t tid;
+    struct timespec t0, t1;
+    struct rusage r0, r1;
+    long long sent;
+    TlsKey *key = NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // Let the kernel pick a free port
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) < 0)
+    {
+        perror("benchmark listener");
+        return -1;
+    }
+    rx_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(rx_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        (tx_fd = accept(listen_fd, NULL, NULL)) < 0)
+    {
+        perror("benchmark connect");
+        close(rx_fd);
+        close(listen_fd);
+        return -1;
+    }
+    close(listen_fd);
+
+    file_fd = open(path, O_RDONLY);
+    if (file_fd < 0 || fstat(file_fd, &st) < 0)
+    {
+        perror("benchmark file");
+        close(tx_fd);
+        close(rx_fd);
+        return -1;
+    }
+
+    if (tls != BENCH_PLAIN)
+    {
+        static const uint8_t psk[16], nonce[TLS_NONCE_LEN];
+        if ((key = slab_alloc(&key_slab)) == NULL)
+        {
+            perror("benchmark key");
+            close(file_fd);
+            close(tx_fd);
+            close(rx_fd);
+            return -1;
+        }
+        tls_derive_key(psk, sizeof(psk), nonce, nonce, key);
+        if (tls == BENCH_KTLS)
+        {
+            int err = tls_kernel_enable(tx_fd, TLS_TX, key);
+            slab_free(&key_slab, key);
+            key = NULL;
+            if (err < 0)
+            {
+                close(file_fd);
+                close(tx_fd);
+                close(rx_fd);
+                errno = -err;
+                return -2;
+            }
+        }
     }
 
-    printf("Successfully sent %lld bytes (File Transfer Complete).\n", total_bytes_sent);
+    pthread_create(&tid, NULL, bench_drain, &rx_fd);
+
+    tx_mode = mode;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    getrusage(RUSAGE_THREAD, &r0);
+    sent = send_file_body(tx_fd, file_fd, st.st_size, key);
+    getrusage(RUSAGE_THREAD, &r1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
 
-cleanup:
-    if (fp != NULL)
+    shutdown(tx_fd, SHUT_WR);
+    pthread_join(tid, NULL);
+    close(tx_fd);
+    close(rx_fd);
+    close(file_fd);
+
+    *wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    *cpu = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec) + (r1.ru_utime.tv_usec - r0.ru_utime.tv_usec) / 1e6 +
+           (r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) + (r1.ru_stime.tv_usec - r0.ru_stime.tv_usec) / 1e6;
+    return sent;
+}
+
+/**
+ * @brief Throughput comparison of the copy loop against sendfile() and splice()
+ *        over loopback, then of plaintext against kTLS and userspace TLS.
+ *        Each row sends 'path' 'rounds' times.
+ */
+static void run_benchmark(const char *path, int rounds)
+{
+    static const struct
     {
-        fclose(fp);
+        enum tx_mode mode;
+        enum bench_tls tls;
+        const char *name;
+    } paths[] = {{TX_COPY, BENCH_PLAIN, "copy"},         {TX_SENDFILE, BENCH_PLAIN, "sendfile"},
+                 {TX_SPLICE, BENCH_PLAIN, "splice"},     {TX_SENDFILE, BENCH_KTLS, "ktls-sendfile"},
+                 {TX_COPY, BENCH_KTLS, "ktls-copy"},     {TX_COPY, BENCH_USER, "tls-user"}};
+
+    printf("Benchmarking data paths with '%s' (%d rounds each, userspace AES-GCM: %s)\n", path, rounds,
+           aesgcm_impl_name());
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    {
+        double total_wall = 0, total_cpu = 0;
+        long long total_bytes = 0;
+        for (int r = 0; r < rounds; r++)
+        {
+            double wall, cpu;
+            long long sent = bench_one(path, paths[i].mode, paths[i].tls, &wall, &cpu);
+            if (sent == -2)
+            {
+                printf("%-13s : kTLS unavailable (%s)\n", paths[i].name, strerror(errno));
+                break;
+            }
+            if (sent < 0)
+            {
+                return;
+            }
+            total_bytes += sent;
+            total_wall += wall;
+            total_cpu += cpu;
+        }
+        if (total_bytes == 0)
+        {
+            continue;
+        }
+        double gb = total_bytes / 1e9;
+        printf("%-13s : %lld bytes in %.3f s -> %8.1f MB/s, sender CPU %.3f s (%.3f s/GB)\n",
+               paths[i].name, total_bytes, total_wall, total_bytes / 1e6 / total_wall,
+               total_cpu, gb > 0 ? total_cpu / gb : 0.0);
     }
-    // 4. Server closes the connection (recv() on client will return EOF)
-    close(client_socket);
-    free(data);
-    printf("Connection with %s:%d closed.\n", client_ip, ntohs(data->client_addr.sin_port));
-    pthread_exit(NULL);
 }
 
 /**
- * @brief Initializes and runs the TCP server.
+ * @brief Prints command line usage.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m auto|copy|sendfile|splice] [-w workers] [-l backlog] [-c cache_mb] [-T keyfile]\n"
+                    "          [-G rate] [-I rate] [-C rate] [-R limits_file] [-S stats_port] [-L lines_per_sec] [-H]\n"
+                    "       %s -b file [-r rounds]\n", prog, prog);
+    fprintf(stderr, "  -m  data path for file bodies (default: auto)\n");
+    fprintf(stderr, "  -w  number of epoll worker threads (default: one per online CPU)\n");
+    fprintf(stderr, "  -l  listen() backlog (default: %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -c  memory budget of the file cache in MB; 0 serves every request from disk (default: %d)\n",
+            DEFAULT_CACHE_MB);
+    fprintf(stderr, "      (SIGUSR1 prints its hit/miss counters)\n");
+    fprintf(stderr, "  -T  shared key file: clients may ask for the body to be encrypted (kTLS, or userspace AES-GCM)\n");
+    fprintf(stderr, "  -G  bandwidth limit of all transfers together, bytes/s with optional k/M/G suffix (default: none)\n");
+    fprintf(stderr, "  -I  bandwidth limit per client IP address (default: none)\n");
+    fprintf(stderr, "  -C  bandwidth limit per connection (default: none)\n");
+    fprintf(stderr, "  -R  limits file (global/ip/conn rates, per-client fair-share weights); overrides -G/-I/-C\n");
+    fprintf(stderr, "      and is read again on SIGHUP\n");
+    fprintf(stderr, "  -S  local port serving Prometheus metrics over HTTP; 0 disables it (default: %d)\n", STATS_PORT);
+    fprintf(stderr, "  -L  connection log lines per second before lines are dropped; 0 = no limit (default: %d)\n",
+            LOG_DEFAULT_RATE);
+    fprintf(stderr, "  -H  carve transfer buffers out of reserved 2 MB hugepages (vm.nr_hugepages)\n");
+    fprintf(stderr, "  -b  benchmark all data paths, plaintext and encrypted, by sending 'file' over loopback, then exit\n");
+    fprintf(stderr, "  -r  benchmark rounds per data path (default: 5)\n");
+}
+
+/**
+ * @brief Initializes the listening socket and runs the worker reactors.
  */
-int main()
+int main(int argc, char *argv[])
 {
-    int server_fd, new_socket;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
     int opt = 1;
+    const char *bench_file = NULL;
+    int bench_rounds = 5;
+    int backlog = DEFAULT_BACKLOG;
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    double rates[3] = {0, 0, 0}; // -G, -I, -C
+    int stats_port = STATS_PORT;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "m:w:l:c:T:G:I:C:R:S:L:Hb:r:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'm':
+            if (strcmp(optarg, "auto") == 0)
+            {
+                tx_mode = TX_AUTO;
+            }
+            else if (strcmp(optarg, "copy") == 0)
+            {
+                tx_mode = TX_COPY;
+            }
+            else if (strcmp(optarg, "sendfile") == 0)
+            {
+                tx_mode = TX_SENDFILE;
+            }
+            else if (strcmp(optarg, "splice") == 0)
+            {
+                tx_mode = TX_SPLICE;
+            }
+            else
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            num_workers = atol(optarg);
+            break;
+        case 'l':
+            backlog = atoi(optarg);
+            break;
+        case 'c':
+            cache.budget = atoll(optarg) << 20;
+            break;
+        case 'T':
+            if (tls_load_psk(optarg, &tls_psk, &tls_psk_len) < 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'G':
+        case 'I':
+        case 'C':
+            if (rate_parse(optarg, &rates[ch == 'G' ? 0 : ch == 'I' ? 1 : 2]) < 0)
+            {
+                fprintf(stderr, "Invalid rate '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            rate_config_path = optarg;
+            break;
+        case 'S':
+            stats_port = atoi(optarg);
+            break;
+        case 'L':
+            log_set_rate(atof(optarg));
+            break;
+        case 'H':
+            buf_pool_hugepages(1);
+            break;
+        case 'b':
+            bench_file = optarg;
+            break;
+        case 'r':
+            bench_rounds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (num_workers < 1)
+    {
+        num_workers = 1;
+    }
+    if (backlog < 1)
+    {
+        backlog = DEFAULT_BACKLOG;
+    }
+    rate_set_limits(rates[0], rates[1], rates[2], NULL, 0);
+    if (rate_config_path != NULL && rate_load(rate_config_path) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Peers that disconnect mid-transfer must not kill the server (sendfile/splice raise SIGPIPE)
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1; // kill -USR1 prints the file cache counters
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = on_sighup; // kill -HUP rereads the limits file
+    sigaction(SIGHUP, &sa, NULL);
+
+    if (bench_file != NULL)
+    {
+        run_benchmark(bench_file, bench_rounds);
+        return 0;
+    }
 
     create_dummy_file();
 
-    // Create a socket (AF_INET for IPv4, SOCK_STREAM for TCP)
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    // Every connection costs a descriptor (two while a file is open): lift the soft limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Create a non-blocking socket (AF_INET for IPv4, SOCK_STREAM for TCP)
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
     {
         perror("socket failed");
         exit(EXIT_FAILURE);
     }
 
     // Prevent "Address already in use" errors after quick restarts
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
     {
         perror("setsockopt failed");
         exit(EXIT_FAILURE);
     }
 
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY; // Listen on any interface
     address.sin_port = htons(PORT);
 
     // Bind the socket
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
     {
         perror("bind failed");
         exit(EXIT_FAILURE);
     }
 
     // Listen for incoming connections
-    if (listen(server_fd, MAX_PENDING) < 0)
+    if (listen(listen_fd, backlog) < 0)
     {
         perror("listen failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d. Waiting for connections...\n", PORT);
-
-    while (1)
+    printf("Server listening on port %d with %ld workers (backlog %d, file cache %lld MB). Waiting for connections...\n",
+           PORT, num_workers, backlog, cache.budget >> 20);
+    if (limiter.active)
+    {
+        rate_report();
+    }
+    metrics_define(server_counters, sizeof(server_counters) / sizeof(server_counters[0]), server_histograms,
+                   sizeof(server_histograms) / sizeof(server_histograms[0]), server_metrics_extra);
+    if (stats_port > 0)
     {
-        printf("Waiting for a connection...\n");
-        struct thread_data *data = (struct thread_data *)malloc(sizeof(struct thread_data));
-        if (data == NULL)
+        if (metrics_serve(stats_port) == 0)
         {
-            perror("malloc failed for thread data");
-            continue;
+            printf("Metrics on http://127.0.0.1:%d/metrics\n", stats_port);
         }
-
-        data->client_socket = accept(server_fd, (struct sockaddr *)&(data->client_addr), (socklen_t *)&addrlen);
-        if (data->client_socket < 0)
+        else
         {
-            perror("accept failed");
-            free(data);
-            continue;
+            perror("Cannot open the stats port");
         }
+    }
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, (void *)data) != 0)
+    struct worker *workers = calloc(num_workers, sizeof(struct worker));
+    if (workers == NULL)
+    {
+        perror("malloc failed for workers");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < num_workers; i++)
+    {
+        workers[i].id = i;
+        if ((workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
         {
-            perror("pthread_create failed");
-            close(data->client_socket);
-            free(data);
+            perror("epoll_create1 failed");
+            exit(EXIT_FAILURE);
         }
-        else
+        if ((workers[i].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
         {
-            // Detach thread so resources are automatically released when it finishes
-            pthread_detach(tid);
+            perror("timerfd_create failed");
+            exit(EXIT_FAILURE);
         }
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // SIGUSR1 and SIGHUP must interrupt a worker's epoll_wait(), not the parked main thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Workers run forever; joining keeps the main thread parked
+    for (long i = 0; i < num_workers; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
     }
 
-    // This part is unreachable, but included for completeness
-    close(server_fd);
+    close(listen_fd);
+    free(workers);
     return 0;
-}
\ No newline at end of file
+}
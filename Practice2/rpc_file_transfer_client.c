@@ -4,17 +4,55 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include "../common/sha256.h"
+#include "../common/lzcodec.h"
+#include "../common/crc32c.h"
+#include "../common/uring.h"
+#include "../common/delta.h"
+#include "../common/wire.h"
+#include "../common/tcptune.h"
+#include "../common/bufpool.h"
 
 // --- Configuration ---
 #define HOST "127.0.0.1"
 #define PORT 65432
-#define CHUNK_SIZE 4096
 #define FILENAME_MAX_LEN 256
+#define MAX_ATTEMPTS 8           // Upload attempts before giving up
+#define BACKOFF_INITIAL_MS 500   // First retry delay, doubled after every failure
+#define BACKOFF_MAX_MS 30000     // Upper bound of the retry delay
+#define CDC_MIN_SIZE 4096        // FastCDC chunk size bounds (the server checks min/max)
+#define CDC_AVG_SIZE (16 * 1024)
+#define CDC_MAX_SIZE (64 * 1024)
+#define CDC_MASK_S (~0ULL << 48) // 16 bits: harder cut condition below the average size
+#define CDC_MASK_L (~0ULL << 52) // 12 bits: easier cut condition above it
+#define CRC_BLOCK_SIZE LZ_BLOCK_SIZE // Body bytes covered by each CRC32C (must match the server)
+#define STATUS_CORRUPT 422           // Server saw a checksum mismatch
+#define URING_BUFFERS 8                        // File reads kept in flight by the io_uring path
+#define URING_BUFFER_SIZE (4 * CRC_BLOCK_SIZE) // Bytes per read/send: whole checksum blocks
+#define URING_BLOCKS (URING_BUFFER_SIZE / CRC_BLOCK_SIZE)
+#define MMAP_WINDOW (256 * CRC_BLOCK_SIZE)     // File bytes mapped at once by the mmap path
+#define BATCH_END 0xffffffffu                  // BatchStatus index that closes an UploadBatch
+#define BATCH_INLINE (256 * 1024)              // Batch files up to this size go out in one sendmsg()
+#define WIRE_CLIENT_STREAMS 16                 // -F: files uploaded concurrently on the connection
+#define WIRE_CHUNK (64 * 1024)                 // -F: body bytes per DATA frame
+
+static int use_dedup = 0;       // -d: UploadChunked instead of ResumeUpload
+static int use_compression = 0; // -z: negotiate the lz codec for the body
+static int use_checksum = 1;    // Per-block and whole-file CRC32C of the body (-k disables)
+static int use_uring = 0;       // -u: send plain bodies through io_uring
+static int use_mmap = 0;        // -M: send plain bodies straight from a mapping of the file
+static __thread long long data_syscalls = 0; // Syscalls made moving body bytes (this thread)
 
 // --- RPC-like Metadata Structure (Fixed-Size Header) ---
 typedef struct
@@ -24,6 +62,13 @@ typedef struct
     long long filesize; // Use long long for large file sizes
 } Metadata;
 
+// --- Content-Defined Chunking Records (UploadChunked) ---
+typedef struct
+{
+    unsigned char hash[SHA256_DIGEST_LEN]; // SHA-256 of the chunk data
+    unsigned int length;                   // Chunk length in bytes
+} ChunkRef;
+
 // Utility function to receive exactly 'len' bytes
 ssize_t recv_all(int sockfd, void *buf, size_t len)
 {
@@ -42,6 +87,23 @@ ssize_t recv_all(int sockfd, void *buf, size_t len)
     return total;
 }
 
+// Sends exactly 'len' bytes (handles partial sends)
+int send_all(int sockfd, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sockfd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        data_syscalls++;
+        if (n < 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
 // Utility function to get file size
 long long get_file_size(const char *filepath)
 {
@@ -55,52 +117,291 @@ long long get_file_size(const char *filepath)
 
 // --- Client RPC Implementation (Stub) ---
 
-void client_upload_file(const char *filepath)
+// Outcome of one upload attempt
+enum upload_result
 {
-    int sock_fd = 0;
-    struct sockaddr_in serv_addr;
-    long long file_size = get_file_size(filepath);
+    UPLOAD_OK,    // Server answered 201 Created
+    UPLOAD_RETRY, // Transient failure: reconnect and resume
+    UPLOAD_FATAL  // Retrying cannot help
+};
 
-    if (file_size < 0)
+// Status codes after which another attempt may succeed
+int is_retryable_status(int code)
+{
+    // Conflict (previous attempt still held), corrupted body or server error
+    return code == 409 || code == STATUS_CORRUPT || code >= 500;
+}
+
+// Sends the CRC32C of one checksum block and folds the block into the file CRC
+int send_block_crc(int sock_fd, const void *block, size_t len, uint32_t *file_crc)
+{
+    uint32_t crc = crc32c_update(0, block, len);
+    *file_crc = crc32c_combine(*file_crc, crc, len);
+    return send_all(sock_fd, &crc, sizeof(crc));
+}
+
+// CRC32C of the first 'length' bytes of 'file', leaving it positioned there
+// (the server already holds them, but the whole-file checksum covers them too)
+int file_prefix_crc(FILE *file, long long length, uint32_t *crc)
+{
+    char *buffer = malloc(1 << 20);
+    int result = 0;
+
+    *crc = 0;
+    if (buffer == NULL)
     {
-        perror("[Client] Error: File not found or cannot be accessed");
-        return;
+        return -1;
+    }
+    while (length > 0)
+    {
+        size_t n = fread(buffer, 1, length < (1 << 20) ? (size_t)length : (1 << 20), file);
+        if (n == 0)
+        {
+            result = -1;
+            break;
+        }
+        *crc = crc32c_update(*crc, buffer, n);
+        length -= n;
     }
+    free(buffer);
+    return result;
+}
 
-    // Extract filename from full path
-    const char *filename_ptr = strrchr(filepath, '/');
-    if (!filename_ptr)
+// Streams the rest of 'file' as lz frames (one LZ_BLOCK_SIZE block each),
+// each followed by its CRC32C when 'file_crc' is given.
+// Returns the number of bytes put on the wire, or -1 on a send error.
+long long send_compressed(int sock_fd, FILE *file, LzEncoder *enc, uint32_t *file_crc)
+{
+    uint8_t *raw = malloc(LZ_BLOCK_SIZE), *frame = malloc(LZ_MAX_FRAME);
+    long long wire = -1;
+    size_t n;
+
+    if (raw == NULL || frame == NULL)
     {
-        filename_ptr = strrchr(filepath, '\\'); // Handle Windows paths
+        perror("[Client] Failed to allocate codec buffers");
+        goto done;
     }
-    if (!filename_ptr)
+    while ((n = fread(raw, 1, LZ_BLOCK_SIZE, file)) > 0)
     {
-        filename_ptr = filepath;
+        data_syscalls++;
+        size_t frame_len = lz_encode_frame(enc, raw, n, frame);
+        if (send_all(sock_fd, frame, frame_len) < 0 ||
+            (file_crc != NULL && send_block_crc(sock_fd, raw, n, file_crc) < 0))
+        {
+            perror("[Client] Send error");
+            goto done;
+        }
     }
-    else
+    wire = enc->wire_bytes;
+
+done:
+    free(raw);
+    free(frame);
+    return wire;
+}
+
+// io_uring body path: keeps URING_BUFFERS reads of the file in flight into
+// registered buffers and sends them in order, one SENDMSG per buffer that
+// also carries the CRC32C of every block in it (when 'file_crc' is given).
+// Each loop turn submits and reaps everything with one io_uring_enter(), so
+// a 256 KB buffer costs about one syscall instead of 64 read()+send() pairs.
+// Returns bytes of file data sent, -1 on a transfer error, or -2 if io_uring
+// cannot be used here (the caller then takes the blocking loop).
+long long send_file_uring(int sock_fd, int file_fd, long long offset, long long length, uint32_t *file_crc)
+{
+    struct uring ring;
+    struct iovec regs[URING_BUFFERS];
+    struct iovec iov[URING_BUFFERS][2 * URING_BLOCKS];
+    struct msghdr msg[URING_BUFFERS];
+    uint32_t crcs[URING_BUFFERS][URING_BLOCKS];
+    long long got[URING_BUFFERS]; // Bytes read into each buffer, -1 while the read is in flight
+    long long total = (length + URING_BUFFER_SIZE - 1) / URING_BUFFER_SIZE;
+    long long read_seq = 0, send_seq = 0, sent = 0;
+    int files[2] = {file_fd, sock_fd}; // Registered file indexes 0 and 1
+    int inflight = 0, sending = 0, failed = 0, err;
+    char *pool;
+
+    if ((err = uring_init(&ring, 2 * URING_BUFFERS)) < 0)
     {
-        filename_ptr++; // Move past the separator
+        printf("[Client] io_uring unavailable (%s), using blocking I/O.\n", strerror(-err));
+        return -2;
+    }
+    if ((pool = aligned_alloc(4096, URING_BUFFERS * URING_BUFFER_SIZE)) == NULL)
+    {
+        uring_exit(&ring);
+        return -2;
+    }
+    for (int b = 0; b < URING_BUFFERS; b++)
+    {
+        regs[b].iov_base = pool + (size_t)b * URING_BUFFER_SIZE;
+        regs[b].iov_len = URING_BUFFER_SIZE;
+    }
+    if ((err = uring_register_buffers(&ring, regs, URING_BUFFERS)) < 0 ||
+        (err = uring_register_files(&ring, files, 2)) < 0)
+    {
+        printf("[Client] io_uring registration failed (%s), using blocking I/O.\n", strerror(-err));
+        uring_exit(&ring);
+        free(pool);
+        return -2;
     }
 
-    // Check filename length
-    if (strlen(filename_ptr) >= FILENAME_MAX_LEN)
+    while (send_seq < total && !failed)
     {
-        printf("[Client] Error: Filename is too long.\n");
-        return;
+        // Keep every free buffer busy reading ahead
+        while (read_seq < total && read_seq - send_seq < URING_BUFFERS)
+        {
+            int b = read_seq % URING_BUFFERS;
+            long long pos = read_seq * URING_BUFFER_SIZE;
+            unsigned n = length - pos < URING_BUFFER_SIZE ? (unsigned)(length - pos) : URING_BUFFER_SIZE;
+            uring_prep_read_fixed(uring_get_sqe(&ring), 0, regs[b].iov_base, n, offset + pos, b, read_seq << 1);
+            got[b] = -1;
+            read_seq++;
+            inflight++;
+        }
+
+        // Sends stay strictly in file order: one in flight at a time
+        int b = send_seq % URING_BUFFERS;
+        if (!sending && got[b] >= 0)
+        {
+            int parts = 0;
+            for (long long pos = 0; pos < got[b]; pos += CRC_BLOCK_SIZE)
+            {
+                size_t n = got[b] - pos < CRC_BLOCK_SIZE ? (size_t)(got[b] - pos) : CRC_BLOCK_SIZE;
+                iov[b][parts].iov_base = (char *)regs[b].iov_base + pos;
+                iov[b][parts++].iov_len = n;
+                if (file_crc != NULL)
+                {
+                    uint32_t *crc = &crcs[b][pos / CRC_BLOCK_SIZE];
+                    *crc = crc32c_update(0, iov[b][parts - 1].iov_base, n);
+                    *file_crc = crc32c_combine(*file_crc, *crc, n);
+                    iov[b][parts].iov_base = crc;
+                    iov[b][parts++].iov_len = sizeof(*crc);
+                }
+            }
+            memset(&msg[b], 0, sizeof(msg[b]));
+            msg[b].msg_iov = iov[b];
+            msg[b].msg_iovlen = parts;
+            uring_prep_sendmsg(uring_get_sqe(&ring), 1, &msg[b], MSG_WAITALL | MSG_NOSIGNAL, send_seq << 1 | 1);
+            sending = 1;
+            inflight++;
+        }
+
+        if ((err = uring_submit_and_wait(&ring, 1)) < 0)
+        {
+            printf("[Client] io_uring_enter failed: %s\n", strerror(-err));
+            failed = 1;
+            break;
+        }
+        for (struct io_uring_cqe *cqe; (cqe = uring_peek_cqe(&ring)) != NULL; uring_cqe_seen(&ring))
+        {
+            long long seq = (long long)(cqe->user_data >> 1);
+            int slot = seq % URING_BUFFERS;
+            inflight--;
+            if ((cqe->user_data & 1) == 0)
+            {
+                long long pos = seq * URING_BUFFER_SIZE;
+                long long want = length - pos < URING_BUFFER_SIZE ? length - pos : URING_BUFFER_SIZE;
+                if (cqe->res != want)
+                {
+                    printf("[Client] io_uring read failed: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short read");
+                    failed = 1;
+                }
+                got[slot] = cqe->res;
+                continue;
+            }
+            size_t expected = 0;
+            for (size_t i = 0; i < msg[slot].msg_iovlen; i++)
+            {
+                expected += msg[slot].msg_iov[i].iov_len;
+            }
+            if (cqe->res < 0 || (size_t)cqe->res != expected)
+            {
+                printf("[Client] Send error: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short send");
+                failed = 1;
+            }
+            sent += got[slot];
+            sending = 0;
+            send_seq++;
+        }
     }
 
-    // 1. Build RPC request for UploadFile (Metadata)
-    Metadata metadata;
-    memset(&metadata, 0, sizeof(Metadata));
-    strncpy(metadata.method, "UploadFile", sizeof(metadata.method) - 1);
-    strncpy(metadata.filename, filename_ptr, sizeof(metadata.filename) - 1);
-    metadata.filesize = file_size;
+    // The kernel may still be filling or reading buffers: wait before freeing them
+    while (inflight > 0 && uring_submit_and_wait(&ring, 1) == 0)
+    {
+        for (; uring_peek_cqe(&ring) != NULL; uring_cqe_seen(&ring))
+        {
+            inflight--;
+        }
+    }
+    data_syscalls += ring.enters;
+    uring_exit(&ring);
+    free(pool);
+    return failed ? -1 : sent;
+}
+
+// mmap body path: sends straight out of a read-only mapping of the file, so
+// body bytes are never copied into a user buffer (no read() at all). Only
+// MMAP_WINDOW bytes are mapped at a time, each advised MADV_SEQUENTIAL for
+// aggressive read-ahead, which bounds the address space and resident memory
+// used for files larger than RAM. Windows hold whole checksum blocks, so the
+// CRC32C framing is the same as the other paths.
+// Returns bytes of file data sent, -1 on a transfer error, or -2 if the file
+// cannot be mapped (the caller then takes the blocking loop).
+long long send_file_mmap(int sock_fd, int file_fd, long long offset, long long length, uint32_t *file_crc)
+{
+    long long page = sysconf(_SC_PAGESIZE);
+    long long sent = 0;
+
+    while (sent < length)
+    {
+        long long pos = offset + sent;
+        long long start = pos & ~(page - 1); // mmap offsets must be page aligned
+        long long window = length - sent < MMAP_WINDOW ? length - sent : MMAP_WINDOW;
+        size_t span = (size_t)(pos - start + window);
+        char *map = mmap(NULL, span, PROT_READ, MAP_SHARED, file_fd, start);
+        data_syscalls++;
+        if (map == MAP_FAILED)
+        {
+            if (sent == 0)
+            {
+                printf("[Client] mmap unavailable (%s), using blocking I/O.\n", strerror(errno));
+                return -2;
+            }
+            perror("[Client] mmap failed");
+            return -1;
+        }
+        madvise(map, span, MADV_SEQUENTIAL);
+
+        for (long long done = 0; done < window; done += CRC_BLOCK_SIZE)
+        {
+            const char *block = map + (pos - start) + done;
+            size_t n = window - done < CRC_BLOCK_SIZE ? (size_t)(window - done) : CRC_BLOCK_SIZE;
+            if (send_all(sock_fd, block, n) < 0 ||
+                (file_crc != NULL && send_block_crc(sock_fd, block, n, file_crc) < 0))
+            {
+                perror("[Client] Send error");
+                munmap(map, span);
+                return -1;
+            }
+        }
+        munmap(map, span);
+        sent += window;
+    }
+    return sent;
+}
+
+// One ResumeUpload call: the server answers with the offset it already has
+// and only the missing tail of the file is sent.
+enum upload_result upload_attempt(const char *filepath, Metadata *metadata)
+{
+    int sock_fd = 0;
+    struct sockaddr_in serv_addr;
 
     // 2. Create socket
     if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         perror("[Client] Socket creation failed");
-        return;
+        return UPLOAD_RETRY;
     }
 
     memset(&serv_addr, 0, sizeof(serv_addr));
@@ -112,7 +413,7 @@ void client_upload_file(const char *filepath)
     {
         perror("[Client] Invalid address/ Address not supported");
         close(sock_fd);
-        return;
+        return UPLOAD_FATAL;
     }
 
     // 3. Connect to the server
@@ -120,64 +421,224 @@ void client_upload_file(const char *filepath)
     {
         perror("[Client] Connection failed");
         close(sock_fd);
-        return;
+        return UPLOAD_RETRY;
     }
     printf("[Client] Connected to server at %s:%d\n", HOST, PORT);
 
     // 4. Send RPC metadata/request
-    if (send(sock_fd, &metadata, sizeof(Metadata), 0) < 0)
+    if (send(sock_fd, metadata, sizeof(Metadata), MSG_NOSIGNAL) < 0)
     {
         perror("[Client] Failed to send metadata");
         close(sock_fd);
-        return;
+        return UPLOAD_RETRY;
     }
 
-    // 5. Wait for Server Acknowledgment (Status Code)
-    int ack_code;
+    // 5. Wait for Server Acknowledgment (Status Code), then the resume offset
+    int ack_code = 0;
+    long long resume_offset = 0;
     if (recv_all(sock_fd, &ack_code, sizeof(ack_code)) <= 0 || ack_code != 200)
     {
         printf("[Client] Server not ready or sent invalid acknowledgment (%d).\n", ack_code);
         close(sock_fd);
-        return;
+        return (ack_code == 0 || is_retryable_status(ack_code)) ? UPLOAD_RETRY : UPLOAD_FATAL;
+    }
+    if (recv_all(sock_fd, &resume_offset, sizeof(resume_offset)) <= 0 ||
+        resume_offset < 0 || resume_offset > metadata->filesize)
+    {
+        printf("[Client] Server sent no valid resume offset.\n");
+        close(sock_fd);
+        return UPLOAD_RETRY;
     }
 
-    // 6. Stream file data (The core data transfer)
-    printf("[Client] Sending file '%s' (%lld bytes)...\n", metadata.filename, metadata.filesize);
+    // A request with options is answered with the codec the server accepted
+    int codec = CODEC_NONE;
+    if ((use_compression || use_checksum) && recv_all(sock_fd, &codec, sizeof(codec)) <= 0)
+    {
+        printf("[Client] Server did not confirm the codec.\n");
+        close(sock_fd);
+        return UPLOAD_RETRY;
+    }
+    int checksum = 0;
+    if (use_checksum && recv_all(sock_fd, &checksum, sizeof(checksum)) <= 0)
+    {
+        printf("[Client] Server did not confirm checksums.\n");
+        close(sock_fd);
+        return UPLOAD_RETRY;
+    }
 
+    // 6. Stream file data (The core data transfer)
     FILE *file = fopen(filepath, "rb");
     if (!file)
     {
         perror("[Client] Failed to open file for reading");
         close(sock_fd);
-        return;
+        return UPLOAD_FATAL;
+    }
+    uint32_t file_crc = 0;
+    if (resume_offset > 0)
+    {
+        printf("[Client] Server already has %lld bytes, resuming.\n", resume_offset);
+        if (!checksum)
+        {
+            fseeko(file, resume_offset, SEEK_SET);
+        }
+        else if (file_prefix_crc(file, resume_offset, &file_crc) < 0)
+        {
+            perror("[Client] Failed to read the file");
+            fclose(file);
+            close(sock_fd);
+            return UPLOAD_FATAL;
+        }
     }
+    printf("[Client] Sending file '%s' (%lld of %lld bytes)...\n",
+           metadata->filename, metadata->filesize - resume_offset, metadata->filesize);
 
-    char buffer[CHUNK_SIZE];
-    size_t bytes_read;
+    char *buffer = NULL;
+    size_t bytes_read, block_fill = 0;
+    TcpTune tune;
     long long bytes_sent = 0;
-    clock_t start_time = clock();
+    LzEncoder enc = {0};
+    uint32_t block_crc = 0;
+    long long syscalls_before = data_syscalls;
+    int body_sent = 0; // Set once a codec or io_uring path has sent the body
+    struct timespec start_time, end_time; // Wall clock: clock() is process CPU time
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-    while ((bytes_read = fread(buffer, 1, CHUNK_SIZE, file)) > 0)
+    if (codec == CODEC_LZ)
     {
-        ssize_t sent = 0;
-        // Ensure all bytes read are sent (handle partial sends)
-        while (sent < bytes_read)
+        if ((bytes_sent = send_compressed(sock_fd, file, &enc, checksum ? &file_crc : NULL)) < 0)
         {
-            ssize_t n = send(sock_fd, buffer + sent, bytes_read - sent, 0);
-            if (n < 0)
+            fclose(file);
+            close(sock_fd);
+            return UPLOAD_RETRY;
+        }
+        printf("[Client] lz: %lld bytes sent as %lld (ratio %.2fx).\n", enc.raw_bytes, enc.wire_bytes,
+               enc.wire_bytes ? (double)enc.raw_bytes / enc.wire_bytes : 0.0);
+        body_sent = 1;
+    }
+    else if (use_uring)
+    {
+        bytes_sent = send_file_uring(sock_fd, fileno(file), resume_offset, metadata->filesize - resume_offset,
+                                     checksum ? &file_crc : NULL);
+        if (bytes_sent == -1)
+        {
+            fclose(file);
+            close(sock_fd);
+            return UPLOAD_RETRY;
+        }
+        if (bytes_sent == -2)
+        {
+            use_uring = 0; // Not available: stay on the blocking loop from now on
+            bytes_sent = 0;
+        }
+        else
+        {
+            body_sent = 1;
+        }
+    }
+    else if (use_mmap)
+    {
+        bytes_sent = send_file_mmap(sock_fd, fileno(file), resume_offset, metadata->filesize - resume_offset,
+                                    checksum ? &file_crc : NULL);
+        if (bytes_sent == -1)
+        {
+            fclose(file);
+            close(sock_fd);
+            return UPLOAD_RETRY;
+        }
+        if (bytes_sent == -2)
+        {
+            use_mmap = 0;
+            bytes_sent = 0;
+        }
+        else
+        {
+            body_sent = 1;
+        }
+    }
+
+    // The blocking loop reads as much as the tuner says the path can use. The
+    // socket is corked so each 4-byte block CRC shares a segment with the data.
+    tcp_tune_init(&tune, sock_fd, TCP_TUNE_SEND);
+    if (!body_sent && (buffer = buf_get(TCP_TUNE_MAX_CHUNK)) == NULL)
+    {
+        perror("[Client] Failed to allocate send buffer");
+        fclose(file);
+        close(sock_fd);
+        return UPLOAD_RETRY;
+    }
+    if (!body_sent)
+    {
+        tcp_tune_cork(sock_fd, 1);
+    }
+    while (!body_sent && (bytes_read = fread(buffer, 1, tune.chunk, file)) > 0)
+    {
+        size_t done = 0;
+        data_syscalls++;
+        // Send the chunk one checksum block at a time (the whole chunk without checksums)
+        while (done < bytes_read)
+        {
+            size_t piece = bytes_read - done;
+            if (checksum && piece > CRC_BLOCK_SIZE - block_fill)
+            {
+                piece = CRC_BLOCK_SIZE - block_fill;
+            }
+            if (send_all(sock_fd, buffer + done, piece) < 0)
             {
                 perror("[Client] Send error");
+                buf_put(buffer, TCP_TUNE_MAX_CHUNK);
                 fclose(file);
                 close(sock_fd);
-                return;
+                return UPLOAD_RETRY;
+            }
+            bytes_sent += piece;
+
+            // Every CRC_BLOCK_SIZE bytes (and at the end) the block's CRC32C follows
+            if (checksum)
+            {
+                block_crc = crc32c_update(block_crc, buffer + done, piece);
+                block_fill += piece;
+            }
+            done += piece;
+            if (checksum && block_fill == CRC_BLOCK_SIZE)
+            {
+                file_crc = crc32c_combine(file_crc, block_crc, block_fill);
+                if (send_all(sock_fd, &block_crc, sizeof(block_crc)) < 0)
+                {
+                    perror("[Client] Send error");
+                    buf_put(buffer, TCP_TUNE_MAX_CHUNK);
+                    fclose(file);
+                    close(sock_fd);
+                    return UPLOAD_RETRY;
+                }
+                block_crc = 0;
+                block_fill = 0;
             }
-            sent += n;
-            bytes_sent += n;
         }
+        tcp_tune_update(&tune);
+    }
+    buf_put(buffer, TCP_TUNE_MAX_CHUNK);
+    if (block_fill > 0)
+    {
+        file_crc = crc32c_combine(file_crc, block_crc, block_fill);
+    }
+
+    // The last partial block's CRC32C, then the whole-file CRC32C close a checksummed body
+    if ((block_fill > 0 && send_all(sock_fd, &block_crc, sizeof(block_crc)) < 0) ||
+        (checksum && send_all(sock_fd, &file_crc, sizeof(file_crc)) < 0))
+    {
+        perror("[Client] Send error");
+        fclose(file);
+        close(sock_fd);
+        return UPLOAD_RETRY;
     }
 
-    clock_t end_time = clock();
-    double time_taken = (double)(end_time - start_time) / CLOCKS_PER_SEC;
+    tcp_tune_cork(sock_fd, 0); // Flush the last partial segment
+    tune.next_ns = 0;          // Take a last sample, so short bodies are measured too
+    tcp_tune_update(&tune);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double time_taken = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
 
     // 7. Signal EOF (Shutdown write side)
     if (shutdown(sock_fd, SHUT_WR) < 0)
@@ -188,7 +649,7 @@ void client_upload_file(const char *filepath)
     fclose(file);
 
     // 8. Receive final RPC response (UploadStatus Code)
-    int response_code;
+    int response_code = 0;
     if (recv_all(sock_fd, &response_code, sizeof(response_code)) <= 0)
     {
         printf("\n[Client] Did not receive final status from server.\n");
@@ -198,7 +659,15 @@ void client_upload_file(const char *filepath)
         if (response_code == 201)
         {
             printf("\n[Client] SUCCESS: File received successfully (HTTP 201 Created).\n");
-            printf("[Client] Sent %lld bytes in %.2f seconds.\n", bytes_sent, time_taken);
+            printf("[Client] Sent %lld bytes in %.2f seconds (%lld data syscalls%s).\n", bytes_sent, time_taken,
+                   data_syscalls - syscalls_before,
+                   body_sent && codec == CODEC_NONE ? (use_uring ? ", io_uring" : ", mmap") : "");
+            if (!body_sent)
+            {
+                char line[160];
+                tcp_tune_format(&tune, line, sizeof(line));
+                printf("[Client] Transport: %s\n", line);
+            }
         }
         else
         {
@@ -207,17 +676,1849 @@ void client_upload_file(const char *filepath)
     }
 
     close(sock_fd);
+    if (response_code == 201)
+    {
+        return UPLOAD_OK;
+    }
+    return (response_code == 0 || is_retryable_status(response_code)) ? UPLOAD_RETRY : UPLOAD_FATAL;
 }
 
-int main(int argc, char const *argv[])
+// --- Content-Defined Chunking (FastCDC) ---
+// Boundaries come from a rolling gear hash over the data itself, so an
+// insertion early in a file only changes the chunks around it and the rest
+// still match what the server already stores.
+
+static uint64_t gear_table[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Fills the gear table with fixed pseudo-random values (splitmix64); client
+// and any future chunker must agree on them for boundaries to line up
+void gear_init(void)
 {
-    if (argc != 2)
+    uint64_t x = 0x6a09e667f3bcc909ULL;
+    for (int i = 0; i < 256; i++)
     {
-        fprintf(stderr, "Usage: %s <path_to_file_to_send>\n", argv[0]);
-        return EXIT_FAILURE;
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
     }
+}
 
-    client_upload_file(argv[1]);
+// Returns the length of the next chunk in p[0..n); 'n' must be at least
+// CDC_MAX_SIZE unless this is the tail of the file
+size_t fastcdc_cut(const unsigned char *p, size_t n)
+{
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_SIZE, normal = CDC_AVG_SIZE, max = CDC_MAX_SIZE;
 
-    return 0;
-}
\ No newline at end of file
+    if (n <= CDC_MIN_SIZE)
+    {
+        return n;
+    }
+    if (max > n)
+    {
+        max = n;
+    }
+    if (normal > max)
+    {
+        normal = max;
+    }
+    for (; i < normal; i++)
+    {
+        hash = (hash << 1) + gear_table[p[i]];
+        if (!(hash & CDC_MASK_S))
+        {
+            return i + 1;
+        }
+    }
+    for (; i < max; i++)
+    {
+        hash = (hash << 1) + gear_table[p[i]];
+        if (!(hash & CDC_MASK_L))
+        {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+// Splits a file into content-defined chunks; fills a malloc'd ChunkRef array
+// and the matching file offsets. Returns the chunk count, or -1 on error.
+long long chunk_file(FILE *file, ChunkRef **refs_out, long long **offsets_out)
+{
+    size_t buf_size = 16 * CDC_MAX_SIZE, have = 0, pos = 0;
+    unsigned char *buf = malloc(buf_size);
+    long long count = 0, cap = 1024, offset = 0;
+    ChunkRef *refs = malloc(cap * sizeof(ChunkRef));
+    long long *offsets = malloc(cap * sizeof(long long));
+    int eof = 0;
+
+    pthread_once(&gear_once, gear_init);
+    if (buf == NULL || refs == NULL || offsets == NULL)
+    {
+        goto fail;
+    }
+
+    while (1)
+    {
+        // Keep at least one maximum-size chunk in the buffer until EOF
+        if (!eof && have - pos < CDC_MAX_SIZE)
+        {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            size_t n = fread(buf + have, 1, buf_size - have, file);
+            have += n;
+            eof = n == 0 || feof(file);
+            if (ferror(file))
+            {
+                goto fail;
+            }
+        }
+        if (pos == have)
+        {
+            break;
+        }
+
+        size_t len = fastcdc_cut(buf + pos, have - pos);
+        if (count == cap)
+        {
+            cap *= 2;
+            ChunkRef *r = realloc(refs, cap * sizeof(ChunkRef));
+            long long *o = realloc(offsets, cap * sizeof(long long));
+            if (r)
+            {
+                refs = r;
+            }
+            if (o)
+            {
+                offsets = o;
+            }
+            if (!r || !o)
+            {
+                goto fail;
+            }
+        }
+        sha256(buf + pos, len, refs[count].hash);
+        refs[count].length = len;
+        offsets[count] = offset;
+        count++;
+        offset += len;
+        pos += len;
+    }
+
+    free(buf);
+    *refs_out = refs;
+    *offsets_out = offsets;
+    return count;
+
+fail:
+    perror("[Client] Chunking failed");
+    free(buf);
+    free(refs);
+    free(offsets);
+    return -1;
+}
+
+// One UploadChunked call: offer every chunk hash, send only the chunks the
+// server's store is missing, and report how much the dedup saved.
+enum upload_result dedup_upload_attempt(const char *filepath, Metadata *metadata)
+{
+    ChunkRef *refs = NULL;
+    long long *offsets = NULL;
+    unsigned char *need = NULL;
+    char *buffer = NULL;
+    long long count, sent_chunks = 0, sent_bytes = 0;
+    enum upload_result result = UPLOAD_RETRY;
+    int sock_fd = -1;
+    int ack_code = 0, response_code = 0;
+    struct sockaddr_in serv_addr;
+
+    // 1. Chunk and hash the file
+    FILE *file = fopen(filepath, "rb");
+    if (!file)
+    {
+        perror("[Client] Failed to open file for reading");
+        return UPLOAD_FATAL;
+    }
+    if ((count = chunk_file(file, &refs, &offsets)) < 0)
+    {
+        fclose(file);
+        return UPLOAD_FATAL;
+    }
+    need = calloc((count + 7) / 8 + 1, 1);
+    buffer = malloc(CDC_MAX_SIZE);
+    if (need == NULL || buffer == NULL)
+    {
+        result = UPLOAD_FATAL;
+        goto cleanup;
+    }
+
+    // 2. Connect and send the RPC request followed by the chunk list
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, HOST, &serv_addr.sin_addr);
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("[Client] Connection failed");
+        goto cleanup;
+    }
+    printf("[Client] Connected to server at %s:%d\n", HOST, PORT);
+
+    if (send_all(sock_fd, metadata, sizeof(Metadata)) < 0)
+    {
+        goto cleanup;
+    }
+    if (recv_all(sock_fd, &ack_code, sizeof(ack_code)) <= 0 || ack_code != 200)
+    {
+        printf("[Client] Server not ready or sent invalid acknowledgment (%d).\n", ack_code);
+        result = (ack_code == 0 || is_retryable_status(ack_code)) ? UPLOAD_RETRY : UPLOAD_FATAL;
+        goto cleanup;
+    }
+    if (send_all(sock_fd, &count, sizeof(count)) < 0 ||
+        send_all(sock_fd, refs, count * sizeof(ChunkRef)) < 0)
+    {
+        goto cleanup;
+    }
+
+    // 3. The server answers with a bitmap of the chunks it needs, or rejects
+    //    the list (too many chunks for its memory cap) with the final status alone
+    ssize_t got = count > 0 ? recv(sock_fd, need, (count + 7) / 8, MSG_WAITALL) : 0;
+    if (count > 0 && got != (count + 7) / 8)
+    {
+        if (got == sizeof(response_code))
+        {
+            memcpy(&response_code, need, sizeof(response_code));
+            printf("[Client] FAILURE: Server rejected the chunk list with status %d.\n", response_code);
+            result = is_retryable_status(response_code) ? UPLOAD_RETRY : UPLOAD_FATAL;
+        }
+        else
+        {
+            printf("[Client] Server did not send the missing-chunk list.\n");
+        }
+        goto cleanup;
+    }
+
+    // 4. Send only those chunks, in list order
+    for (long long i = 0; i < count; i++)
+    {
+        if (!(need[i / 8] & (1 << (i % 8))))
+        {
+            continue;
+        }
+        if (fseeko(file, offsets[i], SEEK_SET) < 0 ||
+            fread(buffer, 1, refs[i].length, file) != refs[i].length)
+        {
+            perror("[Client] Failed to read chunk");
+            result = UPLOAD_FATAL;
+            goto cleanup;
+        }
+        if (send_all(sock_fd, buffer, refs[i].length) < 0)
+        {
+            perror("[Client] Send error");
+            goto cleanup;
+        }
+        sent_chunks++;
+        sent_bytes += refs[i].length;
+    }
+
+    // 5. Final RPC response (UploadStatus Code)
+    if (recv_all(sock_fd, &response_code, sizeof(response_code)) <= 0)
+    {
+        printf("[Client] Did not receive final status from server.\n");
+        goto cleanup;
+    }
+    if (response_code != 201)
+    {
+        printf("[Client] FAILURE: Server returned status code %d.\n", response_code);
+        result = is_retryable_status(response_code) ? UPLOAD_RETRY : UPLOAD_FATAL;
+        goto cleanup;
+    }
+
+    printf("[Client] SUCCESS: File received successfully (HTTP 201 Created).\n");
+    printf("[Client] Dedup: %lld of %lld chunks already stored; sent %lld of %lld bytes, saved %lld bytes",
+           count - sent_chunks, count, sent_bytes, metadata->filesize, metadata->filesize - sent_bytes);
+    if (sent_bytes > 0)
+    {
+        printf(" (dedup ratio %.2fx).\n", (double)metadata->filesize / sent_bytes);
+    }
+    else
+    {
+        printf(" (nothing new to send).\n");
+    }
+    result = UPLOAD_OK;
+
+cleanup:
+    if (sock_fd >= 0)
+    {
+        close(sock_fd);
+    }
+    fclose(file);
+    free(refs);
+    free(offsets);
+    free(need);
+    free(buffer);
+    return result;
+}
+
+// Uploads 'filepath' under 'upload_name' (NULL = the file's own name),
+// resuming after failures with exponential backoff.
+// Returns 0 when the server confirmed the upload (201), -1 otherwise.
+int client_upload_file(const char *filepath, const char *upload_name)
+{
+    long long file_size = get_file_size(filepath);
+
+    if (file_size < 0)
+    {
+        perror("[Client] Error: File not found or cannot be accessed");
+        return -1;
+    }
+
+    // Extract filename from full path
+    const char *filename_ptr = strrchr(filepath, '/');
+    if (!filename_ptr)
+    {
+        filename_ptr = strrchr(filepath, '\\'); // Handle Windows paths
+    }
+    if (!filename_ptr)
+    {
+        filename_ptr = filepath;
+    }
+    else
+    {
+        filename_ptr++; // Move past the separator
+    }
+
+    if (upload_name != NULL)
+    {
+        filename_ptr = upload_name;
+    }
+
+    // Check filename length
+    if (strlen(filename_ptr) >= FILENAME_MAX_LEN)
+    {
+        printf("[Client] Error: Filename is too long.\n");
+        return -1;
+    }
+
+    // 1. Build RPC request for ResumeUpload (Metadata); for a file the server
+    //    has never seen it behaves exactly like UploadFile
+    Metadata metadata;
+    memset(&metadata, 0, sizeof(Metadata));
+    // Dedup chunks carry their own SHA-256, so options only apply to ResumeUpload
+    if (use_dedup)
+    {
+        strncpy(metadata.method, "UploadChunked", sizeof(metadata.method) - 1);
+    }
+    else
+    {
+        snprintf(metadata.method, sizeof(metadata.method), "ResumeUpload%s%s", use_compression ? ";lz" : "",
+                 use_checksum ? ";crc" : "");
+    }
+    strncpy(metadata.filename, filename_ptr, sizeof(metadata.filename) - 1);
+    metadata.filesize = file_size;
+
+    int backoff_ms = BACKOFF_INITIAL_MS;
+    struct timespec seed_time;
+    clock_gettime(CLOCK_MONOTONIC, &seed_time);
+    // Differs per process and per uploader thread (-c), so delays don't line up
+    unsigned int jitter_seed = (unsigned int)(seed_time.tv_nsec ^ (getpid() << 16) ^ (uintptr_t)&seed_time);
+    for (int attempt = 1; attempt <= MAX_ATTEMPTS; attempt++)
+    {
+        enum upload_result result = use_dedup ? dedup_upload_attempt(filepath, &metadata)
+                                              : upload_attempt(filepath, &metadata);
+        if (result == UPLOAD_OK)
+        {
+            return 0;
+        }
+        if (result == UPLOAD_FATAL || attempt == MAX_ATTEMPTS)
+        {
+            break;
+        }
+
+        // Jittered exponential backoff so many clients don't reconnect in lockstep
+        int delay_ms = backoff_ms / 2 + rand_r(&jitter_seed) % (backoff_ms / 2 + 1);
+        printf("[Client] Attempt %d failed, retrying in %d ms...\n", attempt, delay_ms);
+        usleep(delay_ms * 1000);
+        backoff_ms = (backoff_ms * 2 > BACKOFF_MAX_MS) ? BACKOFF_MAX_MS : backoff_ms * 2;
+    }
+
+    printf("[Client] Giving up on '%s'.\n", metadata.filename);
+    return -1;
+}
+
+// --- Batch Uploads (UploadBatch) ---
+// -b: every regular file of a directory (or every path listed in a file,
+// one per line) goes over one connection. Records (Metadata, body, CRC32C)
+// are streamed back to back while a second thread collects the in-order
+// BatchStatus answers, so no file waits for the previous one's round trip.
+
+typedef struct
+{
+    uint32_t index; // Record number within the batch, or BATCH_END
+    int32_t code;
+} BatchStatus;
+
+typedef struct
+{
+    int sock_fd;
+    char **paths;         // Every listed file
+    long long *record;    // Record number -> index into 'paths' (filled before the record is sent)
+    long long assigned;   // Entries of 'record' filled so far (written by the sender)
+    long long ok, failed; // Answers so far
+    int final_code;       // Status of the whole batch, 0 if the server never sent one
+} BatchCollector;
+
+void *batch_collect(void *arg)
+{
+    BatchCollector *c = (BatchCollector *)arg;
+    BatchStatus status;
+
+    while (recv_all(c->sock_fd, &status, sizeof(status)) > 0)
+    {
+        if (status.index == BATCH_END)
+        {
+            c->final_code = status.code;
+            break;
+        }
+        if (status.index >= __atomic_load_n(&c->assigned, __ATOMIC_ACQUIRE))
+        {
+            printf("[Client] Status for unknown batch record %u from the server.\n", status.index);
+            break;
+        }
+        if (status.code == 201)
+        {
+            c->ok++;
+            continue;
+        }
+        c->failed++;
+        printf("[Client] '%s' failed with status %d.\n", c->paths[c->record[status.index]], status.code);
+    }
+    return NULL;
+}
+
+// Sends every byte described by 'iov' (advancing it over partial sends)
+int sendmsg_all(int sock_fd, struct iovec *iov, int count)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    while (count > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        data_syscalls++;
+        if (n < 0)
+        {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Paths of the regular files in directory 'path', or the lines of list file 'path'
+char **batch_list(const char *path, long long *count)
+{
+    long long capacity = 1024;
+    char **paths = malloc(capacity * sizeof(char *)), line[4096];
+    struct stat st;
+
+    *count = 0;
+    if (stat(path, &st) < 0)
+    {
+        perror("[Client] Cannot open batch source");
+        free(paths);
+        return NULL;
+    }
+    DIR *dir = S_ISDIR(st.st_mode) ? opendir(path) : NULL;
+    FILE *list = S_ISDIR(st.st_mode) ? NULL : fopen(path, "r");
+    if (dir == NULL && list == NULL)
+    {
+        perror("[Client] Cannot open batch source");
+        free(paths);
+        return NULL;
+    }
+    while (1)
+    {
+        if (dir != NULL)
+        {
+            struct dirent *entry = readdir(dir);
+            if (entry == NULL)
+            {
+                break;
+            }
+            snprintf(line, sizeof(line), "%s/%s", path, entry->d_name);
+            if (stat(line, &st) < 0 || !S_ISREG(st.st_mode))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            if (fgets(line, sizeof(line), list) == NULL)
+            {
+                break;
+            }
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0')
+            {
+                continue;
+            }
+        }
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            paths = realloc(paths, capacity * sizeof(char *));
+        }
+        if (paths == NULL || (paths[*count] = strdup(line)) == NULL)
+        {
+            perror("[Client] Failed to allocate batch list");
+            exit(EXIT_FAILURE);
+        }
+        (*count)++;
+    }
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+    else
+    {
+        fclose(list);
+    }
+    return paths;
+}
+
+// Sends one batch record: header, body and (with checksums) its CRC32C. Files
+// up to BATCH_INLINE bytes go out in a single sendmsg() with their header.
+// Returns 0, 1 if the file could not be read (nothing was sent), or -1 if
+// the connection failed or the file changed size mid-record.
+int send_batch_record(int sock_fd, const char *path, char *buffer, int checksum, long long *bytes)
+{
+    Metadata record;
+    struct stat st;
+    struct iovec iov[3];
+    uint32_t crc = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    memset(&record, 0, sizeof(record));
+    strncpy(record.method, "UploadFile", sizeof(record.method) - 1);
+    strncpy(record.filename, name, sizeof(record.filename) - 1);
+    record.filesize = st.st_size;
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    int parts = 1;
+    for (long long done = 0; done < record.filesize || parts > 0;)
+    {
+        long long want = record.filesize - done < BATCH_INLINE ? record.filesize - done : BATCH_INLINE;
+        ssize_t n = want > 0 ? read(fd, buffer, want) : 0;
+        data_syscalls += want > 0;
+        if (n != want)
+        {
+            printf("[Client] '%s' changed while being sent; aborting the batch.\n", path);
+            close(fd);
+            return -1;
+        }
+        done += n;
+        if (n > 0)
+        {
+            iov[parts].iov_base = buffer;
+            iov[parts++].iov_len = n;
+            if (checksum)
+            {
+                crc = crc32c_update(crc, buffer, n);
+            }
+        }
+        if (checksum && done == record.filesize)
+        {
+            iov[parts].iov_base = &crc;
+            iov[parts++].iov_len = sizeof(crc);
+        }
+        if (sendmsg_all(sock_fd, iov, parts) < 0)
+        {
+            perror("[Client] Send error");
+            close(fd);
+            return -1;
+        }
+        parts = 0;
+    }
+    close(fd);
+    *bytes += record.filesize;
+    return 0;
+}
+
+// Uploads every file of 'source' over one connection and reports files/s
+int run_batch(const char *source)
+{
+    long long count, bytes = 0, sent = 0, skipped = 0;
+    char **paths = batch_list(source, &count);
+    BatchCollector collector;
+    pthread_t collector_thread;
+    struct sockaddr_in serv_addr;
+    struct timespec start, end;
+    Metadata request;
+    int sock_fd, ack_code = 0, codec = CODEC_NONE, checksum = 0, aborted = 0;
+
+    if (paths == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, HOST, &serv_addr.sin_addr);
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("[Client] Connection failed");
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&request, 0, sizeof(request));
+    snprintf(request.method, sizeof(request.method), "UploadBatch%s", use_checksum ? ";crc" : "");
+    request.filesize = count;
+    if (send(sock_fd, &request, sizeof(request), MSG_NOSIGNAL) < 0 ||
+        recv_all(sock_fd, &ack_code, sizeof(ack_code)) <= 0 || ack_code != 200 ||
+        (use_checksum && (recv_all(sock_fd, &codec, sizeof(codec)) <= 0 ||
+                          recv_all(sock_fd, &checksum, sizeof(checksum)) <= 0)))
+    {
+        printf("[Client] Server refused the batch (%d).\n", ack_code);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    printf("[Client] Uploading %lld files from '%s' in one batch%s...\n", count, source,
+           checksum ? " (crc32c)" : "");
+
+    char *buffer = malloc(BATCH_INLINE);
+    memset(&collector, 0, sizeof(collector));
+    collector.sock_fd = sock_fd;
+    collector.paths = paths;
+    collector.record = malloc((count ? count : 1) * sizeof(long long));
+    if (buffer == NULL || collector.record == NULL ||
+        pthread_create(&collector_thread, NULL, batch_collect, &collector) != 0)
+    {
+        perror("[Client] Failed to start the batch");
+        exit(EXIT_FAILURE);
+    }
+
+    for (long long i = 0; i < count && !aborted; i++)
+    {
+        collector.record[sent] = i;
+        __atomic_store_n(&collector.assigned, sent + 1, __ATOMIC_RELEASE);
+        int result = send_batch_record(sock_fd, paths[i], buffer, checksum, &bytes);
+        aborted = result < 0;
+        sent += result == 0;
+        skipped += result == 1;
+    }
+    if (!aborted)
+    {
+        memset(&request, 0, sizeof(request));
+        strncpy(request.method, "EndBatch", sizeof(request.method) - 1);
+        send_all(sock_fd, &request, sizeof(request));
+    }
+    else
+    {
+        shutdown(sock_fd, SHUT_WR); // The server sees a broken record and closes the batch
+    }
+    pthread_join(collector_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(sock_fd);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("[Client] Batch status %d: %lld of %lld files stored, %lld failed, %lld unreadable.\n",
+           collector.final_code, collector.ok, count, collector.failed, skipped);
+    printf("[Client] Sent %lld files (%lld bytes) in %.2f seconds: %.0f files/s, %.1f MB/s (%lld data syscalls).\n",
+           sent, bytes, seconds, seconds > 0 ? sent / seconds : 0.0, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+           data_syscalls);
+
+    for (long long i = 0; i < count; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    free(collector.record);
+    free(buffer);
+    return collector.final_code == 201 && skipped == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --- Tree Sync (SyncTree) ---
+// -s: brings OUTPUT_DIR/<directory name>/ on the server in line with a local
+// tree, sending only what changed. For each file the server first sends the
+// block signatures of its copy; the client slides a rolling checksum over
+// the new file to find those blocks and sends a delta of literal runs and
+// block references. Files are handed out to -j workers, each with its own
+// connection, so the rolling search here and the signature hashing on the
+// server run in parallel.
+
+typedef struct
+{
+    int32_t status;        // 200: signatures follow; 400: bad path; 500: server error
+    int32_t block_size;
+    long long block_count; // Signatures that follow; the last block may be short
+    long long old_size;    // Bytes of the server's current copy (0 if none)
+} SyncHeader;
+
+typedef struct
+{
+    const char *root;      // Local directory
+    const char *tree;      // Its name on the server
+    char **files;          // Regular files under 'root', relative to it
+    long long count;
+    long long next;        // Next file to hand out (atomic)
+    long long synced, failed, bytes, literal_bytes; // Totals (atomic)
+} SyncJob;
+
+// Delta tokens are batched into one buffer so short literals and runs of
+// block references don't each cost a send()
+typedef struct
+{
+    int sock_fd;
+    char buffer[4 * DELTA_LITERAL_MAX];
+    size_t used;
+    long long literal_bytes;
+} DeltaOut;
+
+static int delta_flush(DeltaOut *out)
+{
+    int result = send_all(out->sock_fd, out->buffer, out->used);
+    out->used = 0;
+    return result;
+}
+
+static int delta_token(DeltaOut *out, int32_t token, const unsigned char *data, size_t len)
+{
+    if (out->used + sizeof(token) + len > sizeof(out->buffer) && delta_flush(out) < 0)
+    {
+        return -1;
+    }
+    memcpy(out->buffer + out->used, &token, sizeof(token));
+    if (len > 0)
+    {
+        memcpy(out->buffer + out->used + sizeof(token), data, len);
+    }
+    out->used += sizeof(token) + len;
+    return 0;
+}
+
+static int delta_literal(DeltaOut *out, const unsigned char *data, long long len)
+{
+    for (long long done = 0; done < len; done += DELTA_LITERAL_MAX)
+    {
+        int32_t n = len - done < DELTA_LITERAL_MAX ? (int32_t)(len - done) : DELTA_LITERAL_MAX;
+        if (delta_token(out, n, data + done, n) < 0)
+        {
+            return -1;
+        }
+        out->literal_bytes += n;
+    }
+    return 0;
+}
+
+// Sends the delta of 'data' against the server's signatures, then the end
+// token and the file's CRC32C. Full blocks may match anywhere; the short
+// last block of the old copy can only match the very end of the new file.
+// Returns literal bytes sent, or -1 on a send error.
+long long sync_send_delta(int sock_fd, const unsigned char *data, long long size, const SyncHeader *h,
+                          const BlockSig *sigs)
+{
+    long long block = h->block_size, full = h->old_size / block, tail = h->old_size % block;
+    long long pos = 0, literal_start = 0, end = size;
+    size_t mask = 1;
+    DeltaOut *out = malloc(sizeof(DeltaOut));
+    long long *head, *next;
+
+    // Hash index over the weak checksums of the full blocks
+    while (mask < 2 * (size_t)full)
+    {
+        mask <<= 1;
+    }
+    head = malloc(mask * sizeof(long long));
+    next = malloc((full ? full : 1) * sizeof(long long));
+    if (out == NULL || head == NULL || next == NULL)
+    {
+        perror("[Client] Failed to allocate delta state");
+        exit(EXIT_FAILURE);
+    }
+    mask--;
+    memset(head, 0xff, (mask + 1) * sizeof(long long)); // All -1: empty
+    for (long long i = full - 1; i >= 0; i--)
+    {
+        next[i] = head[sigs[i].weak & mask];
+        head[sigs[i].weak & mask] = i; // Lower blocks first, like the old file
+    }
+    out->sock_fd = sock_fd;
+    out->used = 0;
+    out->literal_bytes = 0;
+
+    Rollsum sum;
+    int rolling = 0, failed = 0;
+    while (full > 0 && pos + block <= size && !failed)
+    {
+        unsigned char strong[DELTA_STRONG_LEN];
+        int have_strong = 0;
+        long long match = -1;
+
+        if (!rolling)
+        {
+            rollsum_init(&sum, data + pos, block);
+            rolling = 1;
+        }
+        uint32_t weak = rollsum_digest(&sum);
+        for (long long i = head[weak & mask]; i >= 0; i = next[i])
+        {
+            if (sigs[i].weak != weak)
+            {
+                continue;
+            }
+            if (!have_strong)
+            {
+                delta_strong(data + pos, block, strong);
+                have_strong = 1;
+            }
+            if (memcmp(strong, sigs[i].strong, DELTA_STRONG_LEN) == 0)
+            {
+                match = i;
+                break;
+            }
+        }
+        if (match >= 0)
+        {
+            failed = delta_literal(out, data + literal_start, pos - literal_start) < 0 ||
+                     delta_token(out, (int32_t)(-match - 1), NULL, 0) < 0;
+            pos += block;
+            literal_start = pos;
+            rolling = 0;
+            continue;
+        }
+        if (pos + block < size)
+        {
+            rollsum_roll(&sum, data[pos], data[pos + block]);
+        }
+        pos++;
+    }
+
+    // The old copy's short last block, if the new file still ends with it
+    if (tail > 0 && size - tail >= literal_start)
+    {
+        unsigned char strong[DELTA_STRONG_LEN];
+        Rollsum last;
+        rollsum_init(&last, data + size - tail, tail);
+        if (rollsum_digest(&last) == sigs[full].weak)
+        {
+            delta_strong(data + size - tail, tail, strong);
+            if (memcmp(strong, sigs[full].strong, DELTA_STRONG_LEN) == 0)
+            {
+                end = size - tail;
+            }
+        }
+    }
+    uint32_t crc = crc32c_update(0, data, size);
+    failed = failed || delta_literal(out, data + literal_start, end - literal_start) < 0 ||
+             (end < size && delta_token(out, (int32_t)(-full - 1), NULL, 0) < 0) ||
+             delta_token(out, 0, (const unsigned char *)&crc, sizeof(crc)) < 0 || delta_flush(out) < 0;
+
+    long long literal_bytes = out->literal_bytes;
+    free(out);
+    free(head);
+    free(next);
+    return failed ? -1 : literal_bytes;
+}
+
+// Appends the regular files under root/rel (recursively) to the job
+static void sync_walk(SyncJob *job, const char *rel, long long *capacity)
+{
+    char path[4096], child[4096];
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s%s%s", job->root, rel[0] ? "/" : "", rel);
+    if ((dir = opendir(path)) == NULL)
+    {
+        perror(path);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name) >= (int)sizeof(child) ||
+            snprintf(path, sizeof(path), "%s/%s", job->root, child) >= (int)sizeof(path))
+        {
+            printf("[Client] Skipping '%s%s%s': path too long\n", rel, rel[0] ? "/" : "", entry->d_name);
+            continue; // A truncated path would name some other file
+        }
+        if (lstat(path, &st) < 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            sync_walk(job, child, capacity);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+        {
+            continue; // Symlinks and special files are not synced
+        }
+        if (job->count == *capacity)
+        {
+            *capacity = *capacity ? 2 * *capacity : 1024;
+            job->files = realloc(job->files, *capacity * sizeof(char *));
+        }
+        if (job->files == NULL || (job->files[job->count] = strdup(child)) == NULL)
+        {
+            perror("[Client] Failed to allocate file list");
+            exit(EXIT_FAILURE);
+        }
+        job->count++;
+    }
+    closedir(dir);
+}
+
+// Syncs one file over an open SyncTree connection; returns 0 if the server
+// stored it, 1 if this file failed, or -1 if the connection is unusable
+static int sync_one(int sock_fd, SyncJob *job, const char *rel)
+{
+    char path[4096];
+    Metadata request;
+    SyncHeader header;
+    BlockSig *sigs = NULL;
+    unsigned char *data = NULL;
+    struct stat st;
+    int fd, code = 0, result = 1;
+
+    snprintf(path, sizeof(path), "%s/%s", job->root, rel);
+    if (strlen(rel) >= FILENAME_MAX_LEN || (fd = open(path, O_RDONLY)) < 0)
+    {
+        printf("[Client] Skipping '%s': %s\n", rel, strlen(rel) >= FILENAME_MAX_LEN ? "name too long" : strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+    {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    if (data != NULL)
+    {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    memset(&request, 0, sizeof(request));
+    strncpy(request.method, "SyncFile", sizeof(request.method) - 1);
+    strncpy(request.filename, rel, sizeof(request.filename) - 1);
+    request.filesize = st.st_size;
+    if (send_all(sock_fd, &request, sizeof(request)) < 0 || recv_all(sock_fd, &header, sizeof(header)) <= 0)
+    {
+        printf("[Client] Sync connection lost at '%s'.\n", rel);
+        result = -1;
+        goto done;
+    }
+    if (header.status != 200)
+    {
+        printf("[Client] Server refused '%s' (%d).\n", rel, header.status);
+        goto done;
+    }
+    // Signatures follow: they must describe the old copy exactly
+    if (header.block_size < DELTA_MIN_BLOCK || header.block_size > DELTA_MAX_BLOCK || header.block_count < 0 ||
+        header.block_count != (header.old_size + header.block_size - 1) / header.block_size)
+    {
+        printf("[Client] Malformed sync header for '%s'.\n", rel);
+        result = -1;
+        goto done;
+    }
+    if ((sigs = malloc((header.block_count ? header.block_count : 1) * sizeof(BlockSig))) == NULL ||
+        (header.block_count > 0 && recv_all(sock_fd, sigs, header.block_count * sizeof(BlockSig)) <= 0))
+    {
+        result = -1;
+        goto done;
+    }
+
+    long long literal_bytes = sync_send_delta(sock_fd, data, st.st_size, &header, sigs);
+    if (literal_bytes < 0 || recv_all(sock_fd, &code, sizeof(code)) <= 0)
+    {
+        printf("[Client] Sync connection lost at '%s'.\n", rel);
+        result = -1;
+        goto done;
+    }
+    if (code != 201)
+    {
+        printf("[Client] '%s' failed with status %d.\n", rel, code);
+        goto done;
+    }
+    __atomic_add_fetch(&job->bytes, (long long)st.st_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->literal_bytes, literal_bytes, __ATOMIC_RELAXED);
+    result = 0;
+
+done:
+    free(sigs);
+    if (data != NULL)
+    {
+        munmap(data, st.st_size);
+    }
+    return result;
+}
+
+void *sync_worker(void *arg)
+{
+    SyncJob *job = (SyncJob *)arg;
+    struct sockaddr_in serv_addr;
+    Metadata request;
+    int sock_fd, ack_code = 0, nodelay = 1;
+    long long i;
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, HOST, &serv_addr.sin_addr);
+    memset(&request, 0, sizeof(request));
+    strncpy(request.method, "SyncTree", sizeof(request.method) - 1);
+    strncpy(request.filename, job->tree, sizeof(request.filename) - 1);
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 ||
+        send_all(sock_fd, &request, sizeof(request)) < 0 || recv_all(sock_fd, &ack_code, sizeof(ack_code)) <= 0 ||
+        ack_code != 200)
+    {
+        printf("[Client] Server refused the sync (%d).\n", ack_code);
+        if (sock_fd >= 0)
+        {
+            close(sock_fd);
+        }
+        return NULL; // The other workers take the remaining files
+    }
+    // Requests and deltas are batched already; each one is awaited, so Nagle only adds delay
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        int result = sync_one(sock_fd, job, job->files[i]);
+        __atomic_add_fetch(result == 0 ? &job->synced : &job->failed, 1, __ATOMIC_RELAXED);
+        if (result < 0)
+        {
+            close(sock_fd);
+            return NULL;
+        }
+    }
+
+    memset(&request, 0, sizeof(request));
+    strncpy(request.method, "EndSync", sizeof(request.method) - 1);
+    if (send_all(sock_fd, &request, sizeof(request)) == 0)
+    {
+        recv_all(sock_fd, &ack_code, sizeof(ack_code));
+    }
+    close(sock_fd);
+    return NULL;
+}
+
+// Syncs the tree under 'root' with 'workers' parallel connections
+int run_sync(const char *root, int workers)
+{
+    char resolved[4096];
+    SyncJob job;
+    long long capacity = 0;
+    struct timespec start, end;
+
+    if (realpath(root, resolved) == NULL)
+    {
+        perror(root);
+        return EXIT_FAILURE;
+    }
+    memset(&job, 0, sizeof(job));
+    job.root = resolved;
+    job.tree = strrchr(resolved, '/') + 1;
+    if (job.tree[0] == '\0')
+    {
+        printf("[Client] Cannot sync the root directory.\n");
+        return EXIT_FAILURE;
+    }
+    if (workers < 1)
+    {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    sync_walk(&job, "", &capacity);
+    printf("[Client] Syncing %lld files under '%s' with %d workers...\n", job.count, resolved, workers);
+
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int w = 0; w < workers; w++)
+    {
+        if (pthread_create(&threads[w], NULL, sync_worker, &job) != 0)
+        {
+            perror("[Client] Failed to start sync worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int w = 0; w < workers; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long long unsent = job.count - job.synced - job.failed; // Left over when every connection failed
+    printf("[Client] Synced %lld of %lld files in %.2f seconds (%lld failed, %lld not attempted).\n", job.synced,
+           job.count, seconds, job.failed, unsent > 0 ? unsent : 0);
+    printf("[Client] %lld bytes brought up to date with %lld literal bytes (%.1f%%, %.1f MB/s effective).\n",
+           job.bytes, job.literal_bytes, job.bytes ? 100.0 * job.literal_bytes / job.bytes : 0.0,
+           seconds > 0 ? job.bytes / seconds / 1e6 : 0.0);
+
+    for (long long i = 0; i < job.count; i++)
+    {
+        free(job.files[i]);
+    }
+    free(job.files);
+    free(threads);
+    return job.synced == job.count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --- Framed Protocol Uploads (common/wire.h) ---
+// -F: uploads every file of a directory (or list file, as for -b) as
+// concurrent streams on one framed connection. Up to WIRE_CLIENT_STREAMS
+// files are open at once and their DATA frames are interleaved round-robin,
+// so a large file never holds up the small ones behind it. Frames are packed
+// into one output buffer, and a collector thread reads the STATUS frames.
+// Stream N carries the N-th listed file.
+
+typedef struct
+{
+    int sock_fd;
+    char **paths;
+    long long count; // Entries of 'paths'; stream N is paths[N - 1]
+    long long ok, failed;
+    int goaway; // Server closed the session cleanly
+} WireCollector;
+
+typedef struct
+{
+    int fd; // -1: slot free
+    long long stream;
+    long long left;
+    uint32_t crc;
+} WireSlot;
+
+typedef struct
+{
+    int sock_fd;
+    uint8_t buffer[4 * WIRE_CHUNK];
+    size_t used;
+} WireOut;
+
+static int wire_out_flush(WireOut *out)
+{
+    int result = send_all(out->sock_fd, out->buffer, out->used);
+    out->used = 0;
+    return result;
+}
+
+// Room for a frame header and 'payload' bytes at the end of the buffer
+static uint8_t *wire_out_reserve(WireOut *out, size_t payload)
+{
+    if (out->used + WIRE_MAX_HEADER + payload > sizeof(out->buffer) && wire_out_flush(out) < 0)
+    {
+        return NULL;
+    }
+    return out->buffer + out->used;
+}
+
+void *wire_collect(void *arg)
+{
+    WireCollector *c = (WireCollector *)arg;
+    uint8_t buffer[4096];
+    size_t start = 0, end = 0;
+    WireHeader h = {0, 0, 0};
+    int n;
+
+    while (!c->goaway)
+    {
+        if ((n = wire_parse_header(buffer + start, end - start, &h)) > 0 && end - start >= n + h.length)
+        {
+            uint64_t code = 0;
+            if (h.opcode == WIRE_STATUS && (h.stream == 0 || h.stream > (uint64_t)c->count))
+            {
+                printf("[Client] Status for unknown stream %llu from the server.\n", (unsigned long long)h.stream);
+                break;
+            }
+            if (h.opcode == WIRE_GOAWAY)
+            {
+                c->goaway = 1;
+            }
+            else if (h.opcode == WIRE_STATUS && wire_get_varint(buffer + start + n, h.length, &code) > 0)
+            {
+                if (code == 201)
+                {
+                    c->ok++;
+                }
+                else
+                {
+                    c->failed++;
+                    printf("[Client] '%s' failed with status %llu.\n", c->paths[h.stream - 1], (unsigned long long)code);
+                }
+            }
+            start += n + h.length;
+            continue;
+        }
+        if (n < 0 || h.length > sizeof(buffer) / 2)
+        {
+            printf("[Client] Malformed frame from the server.\n");
+            break;
+        }
+        memmove(buffer, buffer + start, end - start);
+        end -= start;
+        start = 0;
+        ssize_t got = recv(c->sock_fd, buffer + end, sizeof(buffer) - end, 0);
+        if (got <= 0)
+        {
+            break;
+        }
+        end += got;
+    }
+    return NULL;
+}
+
+// Uploads every file of 'source' as interleaved streams of one framed connection
+int run_framed(const char *source)
+{
+    long long count, next = 0, bytes = 0, skipped = 0, active = 0;
+    char **paths = batch_list(source, &count);
+    WireCollector collector;
+    WireSlot slots[WIRE_CLIENT_STREAMS];
+    pthread_t collector_thread;
+    struct sockaddr_in serv_addr;
+    struct timespec start, end;
+    uint8_t preface[1 + WIRE_MAX_VARINT];
+    uint64_t version = 0;
+    int sock_fd, failed = 0;
+
+    if (paths == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, HOST, &serv_addr.sin_addr);
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("[Client] Connection failed");
+        return EXIT_FAILURE;
+    }
+
+    // Preface both ways: the server answers with the version to use
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    preface[0] = WIRE_MAGIC;
+    size_t preface_len = 1 + wire_put_varint(preface + 1, WIRE_VERSION);
+    if (send_all(sock_fd, preface, preface_len) < 0 || recv_all(sock_fd, preface, 2) <= 0 ||
+        preface[0] != WIRE_MAGIC || preface[1] >= 0x80 ||
+        wire_get_varint(preface + 1, 1, &version) != 1 || version < WIRE_MIN_VERSION || version > WIRE_VERSION)
+    {
+        printf("[Client] Server does not speak the framed protocol (version %llu).\n", (unsigned long long)version);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    printf("[Client] Uploading %lld files from '%s' as framed streams (v%llu, up to %d at once)%s...\n", count,
+           source, (unsigned long long)version, WIRE_CLIENT_STREAMS, use_checksum ? " (crc32c)" : "");
+
+    memset(&collector, 0, sizeof(collector));
+    collector.sock_fd = sock_fd;
+    collector.paths = paths;
+    collector.count = count;
+    if (pthread_create(&collector_thread, NULL, wire_collect, &collector) != 0)
+    {
+        perror("[Client] Failed to start the status collector");
+        exit(EXIT_FAILURE);
+    }
+
+    WireOut *out = malloc(sizeof(WireOut));
+    if (out == NULL)
+    {
+        perror("[Client] Failed to allocate frame buffer");
+        exit(EXIT_FAILURE);
+    }
+    out->sock_fd = sock_fd;
+    out->used = 0;
+    for (int i = 0; i < WIRE_CLIENT_STREAMS; i++)
+    {
+        slots[i].fd = -1;
+    }
+
+    while (!failed && (active > 0 || next < count))
+    {
+        // Open streams for the next files while there are free slots
+        for (int i = 0; i < WIRE_CLIENT_STREAMS && next < count && !failed; i++)
+        {
+            struct stat st;
+            uint8_t *p;
+            const char *name = strrchr(paths[next], '/') ? strrchr(paths[next], '/') + 1 : paths[next];
+            size_t name_len = strlen(name);
+
+            if (slots[i].fd >= 0)
+            {
+                continue;
+            }
+            if ((slots[i].fd = open(paths[next], O_RDONLY)) < 0 || fstat(slots[i].fd, &st) < 0 ||
+                name_len >= FILENAME_MAX_LEN)
+            {
+                perror(paths[next]);
+                if (slots[i].fd >= 0)
+                {
+                    close(slots[i].fd);
+                }
+                slots[i].fd = -1;
+                skipped++;
+                next++;
+                continue;
+            }
+            slots[i].stream = ++next; // Stream N is paths[N - 1]
+            slots[i].left = st.st_size;
+            slots[i].crc = 0;
+            active++;
+
+            uint8_t payload[2 * WIRE_MAX_VARINT];
+            size_t len = wire_put_varint(payload, (uint64_t)st.st_size);
+            len += wire_put_varint(payload + len, use_checksum ? WIRE_FLAG_CRC : 0);
+            if ((p = wire_out_reserve(out, len + name_len)) == NULL)
+            {
+                failed = 1;
+                break;
+            }
+            p += wire_put_header(p, WIRE_OPEN, slots[i].stream, len + name_len);
+            memcpy(p, payload, len);
+            memcpy(p + len, name, name_len);
+            out->used = p + len + name_len - out->buffer;
+        }
+
+        // One DATA frame per open stream, then END for the ones that are done
+        for (int i = 0; i < WIRE_CLIENT_STREAMS && !failed; i++)
+        {
+            uint8_t *p;
+            if (slots[i].fd < 0)
+            {
+                continue;
+            }
+            size_t want = slots[i].left < WIRE_CHUNK ? (size_t)slots[i].left : WIRE_CHUNK;
+            if (want > 0)
+            {
+                if ((p = wire_out_reserve(out, want)) == NULL)
+                {
+                    failed = 1;
+                    break;
+                }
+                p += wire_put_header(p, WIRE_DATA, slots[i].stream, want);
+                if (read(slots[i].fd, p, want) != (ssize_t)want)
+                {
+                    printf("[Client] '%s' changed while being sent; aborting.\n", paths[slots[i].stream - 1]);
+                    failed = 1;
+                    break;
+                }
+                data_syscalls++;
+                if (use_checksum)
+                {
+                    slots[i].crc = crc32c_update(slots[i].crc, p, want);
+                }
+                out->used = p + want - out->buffer;
+                slots[i].left -= want;
+                bytes += want;
+            }
+            if (slots[i].left == 0)
+            {
+                if ((p = wire_out_reserve(out, 4)) == NULL)
+                {
+                    failed = 1;
+                    break;
+                }
+                p += wire_put_header(p, WIRE_END, slots[i].stream, use_checksum ? 4 : 0);
+                if (use_checksum)
+                {
+                    p += wire_put_u32(p, slots[i].crc);
+                }
+                out->used = p - out->buffer;
+                close(slots[i].fd);
+                slots[i].fd = -1;
+                active--;
+            }
+        }
+    }
+    if (!failed)
+    {
+        uint8_t *p = wire_out_reserve(out, 0);
+        failed = p == NULL;
+        if (p != NULL)
+        {
+            out->used += wire_put_header(p, WIRE_GOAWAY, 0, 0);
+        }
+    }
+    if (failed || wire_out_flush(out) < 0)
+    {
+        shutdown(sock_fd, SHUT_WR); // The server abandons the open streams
+    }
+    pthread_join(collector_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(sock_fd);
+    for (int i = 0; i < WIRE_CLIENT_STREAMS; i++)
+    {
+        if (slots[i].fd >= 0)
+        {
+            close(slots[i].fd);
+        }
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long long sent = count - skipped;
+    printf("[Client] Session %s: %lld of %lld files stored, %lld failed, %lld unreadable.\n",
+           collector.goaway ? "complete" : "aborted", collector.ok, count, collector.failed, skipped);
+    printf("[Client] Sent %lld files (%lld bytes) in %.2f seconds: %.0f files/s, %.1f MB/s (%lld data syscalls).\n",
+           sent, bytes, seconds, seconds > 0 ? sent / seconds : 0.0, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+           data_syscalls);
+
+    for (long long i = 0; i < count; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    free(out);
+    return collector.goaway && collector.ok == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --- Concurrent Upload Benchmark ---
+
+typedef struct
+{
+    const char *filepath;
+    int id;
+    int rounds;
+    int failures;
+    long long syscalls; // Data syscalls made by this worker's uploads
+} BenchWorker;
+
+// One benchmark client: uploads the file 'rounds' times as "<name>.<id>" so
+// concurrent uploads never write the same output file on the server.
+void *bench_client(void *arg)
+{
+    BenchWorker *w = (BenchWorker *)arg;
+    const char *base = strrchr(w->filepath, '/');
+    char upload_name[FILENAME_MAX_LEN];
+
+    base = base ? base + 1 : w->filepath;
+    snprintf(upload_name, sizeof(upload_name), "%.200s.%d", base, w->id);
+    for (int r = 0; r < w->rounds; r++)
+    {
+        if (client_upload_file(w->filepath, upload_name) != 0)
+        {
+            w->failures++;
+        }
+    }
+    w->syscalls = data_syscalls;
+    return NULL;
+}
+
+// Runs 'clients' simultaneous uploaders and reports aggregate throughput.
+// Repeat against servers started with different -w values to see core scaling.
+int run_benchmark(const char *filepath, int clients, int rounds)
+{
+    long long file_size = get_file_size(filepath);
+    BenchWorker *workers = calloc(clients, sizeof(BenchWorker));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    struct timespec start, end;
+    int failures = 0;
+    long long syscalls = 0;
+
+    if (file_size < 0 || workers == NULL || threads == NULL)
+    {
+        perror("[Bench] Setup failed");
+        free(workers);
+        free(threads);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < clients; i++)
+    {
+        workers[i] = (BenchWorker){filepath, i, rounds, 0, 0};
+        pthread_create(&threads[i], NULL, bench_client, &workers[i]);
+    }
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+        failures += workers[i].failures;
+        syscalls += workers[i].syscalls;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long long uploads = (long long)clients * rounds - failures;
+    double mbytes = uploads * (double)file_size / 1e6;
+    printf("\n[Bench] %d clients x %d uploads of %lld bytes: %lld ok, %d failed\n",
+           clients, rounds, file_size, uploads, failures);
+    printf("[Bench] Wall time %.3f s, aggregate %.1f MB/s, %.1f uploads/s\n",
+           seconds, mbytes / seconds, uploads / seconds);
+    printf("[Bench] Body path: %s, %lld data syscalls (%.1f per MB)\n", use_uring ? "io_uring" : use_mmap ? "mmap" : "blocking",
+           syscalls, mbytes > 0 ? syscalls / mbytes : 0.0);
+
+    free(workers);
+    free(threads);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --- Codec Benchmark ---
+
+// Measures lz compression ratio and speed on 'filepath' and derives the
+// effective upload throughput at several link speeds: with compression the
+// pipeline delivers min(link * ratio, compress speed, decompress speed).
+int run_codec_benchmark(const char *filepath)
+{
+    static const double links_mbit[] = {100, 1000, 10000, 25000};
+    uint8_t *raw = malloc(LZ_BLOCK_SIZE), *frame = malloc(LZ_MAX_FRAME), *out = malloc(LZ_BLOCK_SIZE);
+    FILE *file = fopen(filepath, "rb");
+    LzEncoder enc = {0};
+    double encode_s = 0, decode_s = 0;
+    struct timespec t0, t1, t2;
+    size_t n;
+
+    if (raw == NULL || frame == NULL || out == NULL || file == NULL)
+    {
+        perror("[Bench] Setup failed");
+        return EXIT_FAILURE;
+    }
+    while ((n = fread(raw, 1, LZ_BLOCK_SIZE, file)) > 0)
+    {
+        size_t raw_len;
+        int stored;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        lz_encode_frame(&enc, raw, n, frame);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        long payload = lz_frame_payload(frame, &raw_len, &stored);
+        if (payload < 0 || lz_decode_frame(frame + LZ_FRAME_HEADER, payload, raw_len, stored, out) != (long)n ||
+            memcmp(out, raw, n) != 0)
+        {
+            printf("[Bench] Round-trip mismatch!\n");
+            return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        encode_s += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        decode_s += (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    }
+    fclose(file);
+    free(raw);
+    free(frame);
+    free(out);
+
+    double mb = enc.raw_bytes / 1e6;
+    double ratio = enc.wire_bytes ? (double)enc.raw_bytes / enc.wire_bytes : 1.0;
+    double enc_speed = encode_s > 0 ? mb / encode_s : 1e12, dec_speed = decode_s > 0 ? mb / decode_s : 1e12;
+    printf("[Bench] %s: %.1f MB, lz ratio %.2fx, compress %.0f MB/s, decompress %.0f MB/s\n",
+           filepath, mb, ratio, enc_speed, dec_speed);
+    printf("[Bench] %10s %14s %14s %8s\n", "link", "plain MB/s", "lz MB/s", "gain");
+    for (size_t i = 0; i < sizeof(links_mbit) / sizeof(links_mbit[0]); i++)
+    {
+        double link = links_mbit[i] / 8; // MB/s
+        double eff = link * ratio;
+        if (eff > enc_speed)
+        {
+            eff = enc_speed;
+        }
+        if (eff > dec_speed)
+        {
+            eff = dec_speed;
+        }
+        printf("[Bench] %7.0f Mb %14.1f %14.1f %7.2fx\n", links_mbit[i], link, eff, eff / link);
+    }
+    return EXIT_SUCCESS;
+}
+
+// --- Checksum Benchmark ---
+
+// Times CRC32C over in-memory buffers with the dispatched implementation and
+// the portable fallback, and shows how much of one core each needs to keep
+// up with a 10 Gb/s link (1.25 GB/s).
+int run_checksum_benchmark(void)
+{
+    static const size_t block_sizes[] = {4096, CRC_BLOCK_SIZE, 1 << 20};
+    const size_t total = 512u << 20; // Bytes checksummed per measurement
+    const size_t buffer_size = 16u << 20;
+    unsigned char *buffer = malloc(buffer_size);
+
+    if (buffer == NULL)
+    {
+        perror("[Bench] malloc failed");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < buffer_size; i++)
+    {
+        buffer[i] = (unsigned char)(i * 2654435761u >> 13);
+    }
+
+    printf("[Bench] CRC32C, %zu MB per run; dispatched implementation: %s\n", total >> 20, crc32c_impl_name());
+    printf("[Bench] %10s %16s %12s %16s %12s\n", "block", "dispatched GB/s", "core@10Gb", "fallback GB/s", "core@10Gb");
+    for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+    {
+        double gbps[2];
+        for (int impl = 0; impl < 2; impl++)
+        {
+            struct timespec t0, t1;
+            volatile uint32_t sink = 0;
+            size_t block = block_sizes[b], off = 0;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t done = 0; done < total; done += block)
+            {
+                sink ^= impl == 0 ? crc32c_update(0, buffer + off, block) : crc32c_sw(0, buffer + off, block);
+                off = (off + block) % buffer_size;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            gbps[impl] = total / 1e9 / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+        }
+        printf("[Bench] %8zu B %16.2f %11.1f%% %16.2f %11.1f%%\n", block_sizes[b], gbps[0], 125.0 / gbps[0],
+               gbps[1], 125.0 / gbps[1]);
+    }
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+// Framed headers vs. the legacy Metadata header: bytes on the wire, and the
+// work to turn each into a dispatched request (for Metadata: the copy out
+// of the receive buffer, option parsing and the method strcmp chain)
+int run_parse_benchmark(void)
+{
+    static const char *methods[] = {"UploadFile", "ResumeUpload;crc", "ResumeUpload;lz;crc", "UploadChunked",
+                                    "UploadBatch;crc", "SyncTree"};
+    const int count = 1 << 16, rounds = 256; // 16M headers per measurement
+    uint8_t *frames = malloc((size_t)count * WIRE_MAX_HEADER);
+    Metadata *records = malloc(256 * sizeof(Metadata));
+    struct timespec t0, t1;
+    volatile uint64_t sink = 0;
+    size_t frame_bytes = 0;
+    double seconds[3];
+
+    if (frames == NULL || records == NULL)
+    {
+        perror("[Bench] malloc failed");
+        return EXIT_FAILURE;
+    }
+
+    // Encode: mostly 64 KB DATA frames on up to 1000 streams, plus OPEN/END
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r = 0; r < rounds; r++)
+    {
+        frame_bytes = 0;
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t opcode = i % 8 == 0 ? WIRE_OPEN : i % 8 == 7 ? WIRE_END : WIRE_DATA;
+            frame_bytes += wire_put_header(frames + frame_bytes, opcode, 1 + i % 1000,
+                                           opcode == WIRE_DATA ? WIRE_CHUNK : 4 + i % 200);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    seconds[0] = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    // Parse them back
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r = 0; r < rounds; r++)
+    {
+        size_t off = 0;
+        for (int i = 0; i < count; i++)
+        {
+            WireHeader h = {0, 0, 0};
+            int n = wire_parse_header(frames + off, frame_bytes - off, &h);
+            sink += h.opcode + h.stream + h.length;
+            off += n;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    seconds[1] = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    // Legacy: what handle_client does with each Metadata it receives
+    for (int i = 0; i < 256; i++)
+    {
+        memset(&records[i], 0, sizeof(Metadata));
+        strncpy(records[i].method, methods[i % 6], sizeof(records[i].method) - 1);
+        snprintf(records[i].filename, sizeof(records[i].filename), "file_%d.bin", i);
+        records[i].filesize = 65536;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            Metadata m;
+            char *options, *option, *saveptr;
+            int codec = CODEC_NONE, checksum = 0, method = -1;
+
+            memcpy(&m, &records[i & 255], sizeof(m));
+            m.method[sizeof(m.method) - 1] = '\0';
+            m.filename[sizeof(m.filename) - 1] = '\0';
+            if ((options = strchr(m.method, ';')) != NULL)
+            {
+                *options++ = '\0';
+                for (option = strtok_r(options, ";", &saveptr); option != NULL; option = strtok_r(NULL, ";", &saveptr))
+                {
+                    if (strcmp(option, "lz") == 0)
+                    {
+                        codec = CODEC_LZ;
+                    }
+                    else if (strcmp(option, "crc") == 0)
+                    {
+                        checksum = 1;
+                    }
+                }
+            }
+            for (int k = 0; k < 6 && method < 0; k++)
+            {
+                if (strncmp(m.method, methods[k], strcspn(methods[k], ";") + 1) == 0 ||
+                    strcmp(m.method, methods[k]) == 0)
+                    method = k;
+            }
+            sink += method + codec + checksum + m.filesize;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    seconds[2] = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    double headers = (double)count * rounds;
+    printf("[Bench] Request header handling, %.1fM headers per run\n", headers / 1e6);
+    printf("[Bench] %-22s %14s %10s %12s\n", "format", "bytes/header", "ns/header", "M headers/s");
+    printf("[Bench] %-22s %14.2f %10.2f %12.1f\n", "framed encode", (double)frame_bytes / count,
+           seconds[0] * 1e9 / headers, headers / seconds[0] / 1e6);
+    printf("[Bench] %-22s %14.2f %10.2f %12.1f\n", "framed parse", (double)frame_bytes / count,
+           seconds[1] * 1e9 / headers, headers / seconds[1] / 1e6);
+    printf("[Bench] %-22s %14zu %10.2f %12.1f\n", "Metadata parse+dispatch", sizeof(Metadata),
+           seconds[2] * 1e9 / headers, headers / seconds[2] / 1e6);
+    free(frames);
+    free(records);
+    return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = 0, rounds = 1;
+    int ch;
+
+    int codec_bench = 0, batch = 0, framed = 0, sync = 0, sync_workers = 0;
+    while ((ch = getopt(argc, argv, "c:n:j:bsFdzZkKPuM")) != -1)
+    {
+        switch (ch)
+        {
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'M':
+            use_mmap = 1;
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 's':
+            sync = 1;
+            break;
+        case 'j':
+            sync_workers = atoi(optarg);
+            break;
+        case 'k':
+            use_checksum = 0;
+            break;
+        case 'K':
+            return run_checksum_benchmark();
+        case 'P':
+            return run_parse_benchmark();
+        case 'F':
+            framed = 1;
+            break;
+        case 'z':
+            use_compression = 1;
+            break;
+        case 'Z':
+            codec_bench = 1;
+            break;
+        case 'd':
+            use_dedup = 1;
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            rounds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        default:
+            optind = argc + 1; // Force the usage message below
+            break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-d | -z | -u | -M] [-k] [-c clients [-n uploads_per_client]] [-Z] <path_to_file_to_send>\n", argv[0]);
+        fprintf(stderr, "       %s -b | -F [-k] <directory | file_list>\n", argv[0]);
+        fprintf(stderr, "       %s -s [-j workers] <directory>\n", argv[0]);
+        fprintf(stderr, "       %s -K | -P\n", argv[0]);
+        fprintf(stderr, "  -d  dedup upload: send only content-defined chunks the server does not have\n");
+        fprintf(stderr, "  -z  compress the body with the built-in lz codec\n");
+        fprintf(stderr, "  -u  send the body through io_uring (read-ahead, registered buffers, batched submits)\n");
+        fprintf(stderr, "  -M  send the body straight from an mmap of the file (windowed, MADV_SEQUENTIAL)\n");
+        fprintf(stderr, "  -b  batch: upload every file of the directory (or listed one per line) over one\n");
+        fprintf(stderr, "      connection, streaming without waiting for acks, and report files/s\n");
+        fprintf(stderr, "  -F  framed protocol: upload the files as interleaved streams on one connection\n");
+        fprintf(stderr, "  -s  sync the directory tree to the server's copy, sending only changed blocks (rsync-style)\n");
+        fprintf(stderr, "  -j  parallel sync connections/hashing workers (default: one per online CPU)\n");
+        fprintf(stderr, "  -k  skip the per-block and whole-file CRC32C checks\n");
+        fprintf(stderr, "  -Z  benchmark: lz ratio/speed on the file and effective throughput per link speed\n");
+        fprintf(stderr, "  -K  benchmark: CRC32C speed (SIMD and fallback) against a 10 Gb/s link\n");
+        fprintf(stderr, "  -P  benchmark: framed header encode/parse speed against the Metadata header\n");
+        fprintf(stderr, "  -c  benchmark: run this many simultaneous uploaders and report aggregate throughput\n");
+        return EXIT_FAILURE;
+    }
+
+    if (codec_bench)
+    {
+        return run_codec_benchmark(argv[optind]);
+    }
+    if (batch)
+    {
+        return run_batch(argv[optind]);
+    }
+    if (framed)
+    {
+        return run_framed(argv[optind]);
+    }
+    if (sync)
+    {
+        return run_sync(argv[optind], sync_workers);
+    }
+    if (clients > 0)
+    {
+        return run_benchmark(argv[optind], clients, rounds);
+    }
+
+    return client_upload_file(argv[optind], NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,19 +1,141 @@
+#define _GNU_SOURCE // O_DIRECT, fallocate()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "../common/sha256.h"
+#include "../common/lzcodec.h"
+#include "../common/crc32c.h"
+#include "../common/uring.h"
+#include "../common/delta.h"
+#include "../common/wire.h"
+#include "../common/metrics.h"
+#include "../common/log.h"
+#include "../common/tcptune.h"
+#include "../common/bufpool.h"
 
 // --- Configuration ---
 #define PORT 65432
 #define CHUNK_SIZE 4096
 #define FILENAME_MAX_LEN 256
 #define OUTPUT_DIR "received_files"
+#define LISTEN_BACKLOG 128
+#define DEFAULT_CONN_MEM (64 * 1024) // Default per-connection memory cap (bytes)
+#define PART_SUFFIX ".part"           // Upload in progress
+#define JOURNAL_SUFFIX ".journal"     // Committed offset of the matching .part file
+#define JOURNAL_INTERVAL (8LL << 20)  // Sync and journal the .part file every 8 MB
+#define CRC_BLOCK_SIZE LZ_BLOCK_SIZE  // Body bytes covered by each CRC32C ("crc" option)
+#define STATUS_CORRUPT 422            // Body failed its checksum; the client should resend
+#define URING_BUFFERS 4               // io_uring path: buffers cycling through recv -> write
+#define MMAP_WINDOW (16LL << 20)      // mmap path: bytes of the .part file mapped at once
+#define DIRECT_BUFFERS 4              // O_DIRECT path: buffers cycling through recv -> write
+#define DIRECT_ALIGN 4096             // O_DIRECT offset, length and memory alignment
+#define BATCH_END 0xffffffffu         // BatchStatus index that closes an UploadBatch
+#define BATCH_STATUS_QUEUE 256        // Statuses held back before a forced flush
+#define WIRE_MAX_STREAMS 64           // Framed protocol: streams open at once per connection
+#define WIRE_MAX_CONTROL 512          // Largest OPEN/END/GOAWAY payload accepted
+#define CHUNK_STORE_DIR OUTPUT_DIR "/.chunks"       // Content-addressed chunks: .chunks/<2 hex>/<64 hex>
+#define MANIFEST_DIR OUTPUT_DIR "/.manifests"       // Per-file list of ChunkRef records
+#define CDC_MIN_SIZE 4096                           // Chunk size bounds shared with the client
+#define CDC_MAX_SIZE (64 * 1024)
+#define STATS_PORT (PORT + 1)                       // Local Prometheus endpoint (-S, 0 disables it)
+
+// --- Server Settings (set from the command line) ---
+static long num_workers = 0;                 // Worker threads (0 = one per online CPU)
+static int use_reuseport = 0;                // One SO_REUSEPORT listener per worker
+static size_t conn_mem_cap = DEFAULT_CONN_MEM; // Receive buffer + kernel socket buffer cap per connection
+static int use_uring = 0;                    // -u: receive plain bodies through io_uring
+static int use_mmap = 0;                     // -M: receive plain bodies straight into a mapping of the file
+static int use_direct = 0;                   // -D: write plain bodies with O_DIRECT, bypassing the page cache
+static int stats_port = STATS_PORT;          // -S: port of the local metrics endpoint
+
+// --- Metrics (common/metrics.h) ---
+enum server_counter
+{
+    M_CONNECTIONS,
+    M_ACTIVE,
+    M_BYTES_IN,
+    M_STATUS_OK,
+    M_STATUS_BAD,
+    M_STATUS_CONFLICT,
+    M_STATUS_CORRUPT,
+    M_STATUS_FAILED,
+    M_ERR_ACCEPT,
+    M_ERR_RECV,
+    M_ERR_WRITE,
+    M_BUF_LIMITED
+};
+
+static const MetricDesc server_counters[] = {
+    {"rpc_server_connections_total", NULL, "Connections accepted", METRIC_COUNTER},
+    {"rpc_server_connections_active", NULL, "Connections being served", METRIC_GAUGE},
+    {"rpc_server_received_bytes_total", NULL, "Bytes received from clients", METRIC_COUNTER},
+    {"rpc_server_uploads_total", "status=\"ok\"", "Uploads (files, batch entries, streams) by final status",
+     METRIC_COUNTER},
+    {"rpc_server_uploads_total", "status=\"bad_request\"", "", METRIC_COUNTER},
+    {"rpc_server_uploads_total", "status=\"conflict\"", "", METRIC_COUNTER},
+    {"rpc_server_uploads_total", "status=\"corrupt\"", "", METRIC_COUNTER},
+    {"rpc_server_uploads_total", "status=\"failed\"", "", METRIC_COUNTER},
+    {"rpc_server_errors_total", "type=\"accept\"", "Connection errors by type", METRIC_COUNTER},
+    {"rpc_server_errors_total", "type=\"recv\"", "", METRIC_COUNTER},
+    {"rpc_server_errors_total", "type=\"write\"", "", METRIC_COUNTER},
+    {"rpc_server_buffer_limited_uploads_total", NULL, "Uploads whose path wanted a larger receive buffer than -m allows",
+     METRIC_COUNTER},
+};
+
+enum server_histogram
+{
+    H_CONNECTION,
+    H_RTT
+};
+
+static const MetricDesc server_histograms[] = {
+    {"rpc_server_connection_seconds", NULL, "Time from accept to the final status", METRIC_SUMMARY},
+    {"rpc_server_rtt_seconds", NULL, "Minimum round-trip time measured over each upload body", METRIC_SUMMARY},
+};
+
+// Buffer pool and slab usage: flat while uploads keep running
+static void server_metrics_extra(MetricsBuf *b)
+{
+    BufPoolStats pool;
+
+    buf_pool_stats(&pool);
+    metrics_printf(b,
+                   "# HELP rpc_server_pool_allocations_total System allocations made by the buffer pool and slabs\n"
+                   "# TYPE rpc_server_pool_allocations_total counter\n"
+                   "rpc_server_pool_allocations_total{kind=\"buffer\"} %llu\n"
+                   "rpc_server_pool_allocations_total{kind=\"hugepage\"} %llu\n"
+                   "rpc_server_pool_allocations_total{kind=\"slab\"} %llu\n"
+                   "# HELP rpc_server_pool_bytes Memory held by the buffer pool and slabs\n"
+                   "# TYPE rpc_server_pool_bytes gauge\n"
+                   "rpc_server_pool_bytes{kind=\"buffer\"} %llu\n"
+                   "rpc_server_pool_bytes{kind=\"slab\"} %llu\n",
+                   (unsigned long long)pool.buffer_allocs, (unsigned long long)pool.hugepage_allocs,
+                   (unsigned long long)pool.slab_allocs, (unsigned long long)pool.buffer_bytes,
+                   (unsigned long long)pool.slab_bytes);
+}
+
+// Counts a status sent to the client under its uploads_total label
+static void count_status(int code)
+{
+    metrics_inc(code == 200 || code == 201 ? M_STATUS_OK
+                : code == 400              ? M_STATUS_BAD
+                : code == 409              ? M_STATUS_CONFLICT
+                : code == STATUS_CORRUPT   ? M_STATUS_CORRUPT
+                                           : M_STATUS_FAILED);
+}
 
 // --- RPC-like Metadata Structure (Fixed-Size Header) ---
 typedef struct
@@ -23,40 +145,1654 @@ typedef struct
     long long filesize; // Use long long for large file sizes
 } Metadata;
 
-// Utility function to receive exactly 'len' bytes
-ssize_t recv_all(int sockfd, void *buf, size_t len)
+// --- Content-Defined Chunking Records (UploadChunked) ---
+typedef struct
+{
+    unsigned char hash[SHA256_DIGEST_LEN]; // SHA-256 of the chunk data
+    unsigned int length;                   // Chunk length in bytes
+} ChunkRef;
+
+// Utility function to receive exactly 'len' bytes
+ssize_t recv_all(int sockfd, void *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t n;
+    while (total < len)
+    {
+        n = recv(sockfd, buf + total, len - total, 0);
+        if (n <= 0)
+        {
+            // Error or connection closed
+            return n;
+        }
+        metrics_add(M_BYTES_IN, n);
+        total += n;
+    }
+    return total;
+}
+
+// Sends exactly 'len' bytes (handles partial sends)
+int send_all(int sockfd, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sockfd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// --- Resumable Upload Journal ---
+// An upload is written to "<name>.part". "<name>.journal" records how many
+// bytes of it are known to be on disk, so a broken upload can continue from
+// there (ResumeUpload) instead of from byte zero. The journal is also the
+// per-file lock that keeps two clients from writing the same upload.
+
+typedef struct
+{
+    char magic[8];       // JOURNAL_MAGIC
+    long long filesize;  // Size of the finished file (identifies the upload)
+    long long committed; // Bytes of the .part file that were synced to disk
+    uint32_t crc;        // CRC32C of those bytes, so a resumed upload can still be verified whole
+} UploadJournal;
+
+#define JOURNAL_MAGIC "RPCJRNL2"
+
+// Every '/'-separated part must be non-empty and neither "." nor "..", so
+// names can never leave the tree
+static int sync_name_ok(const char *name)
+{
+    while (1)
+    {
+        size_t n = strcspn(name, "/");
+        if (n == 0 || (n == 1 && name[0] == '.') || (n == 2 && name[0] == '.' && name[1] == '.'))
+        {
+            return 0;
+        }
+        if (name[n] == '\0')
+        {
+            return 1;
+        }
+        name += n + 1;
+    }
+}
+
+// Uploaded files live directly in OUTPUT_DIR: a single, valid path part
+static int upload_name_ok(const char *name)
+{
+    return sync_name_ok(name) && strchr(name, '/') == NULL;
+}
+
+// Builds "<OUTPUT_DIR>/<filename><suffix>"
+void build_output_path(char *out, size_t out_size, const char *filename, const char *suffix)
+{
+    snprintf(out, out_size, "%s/%s%s", OUTPUT_DIR, filename, suffix);
+}
+
+// Reads the journal; returns 0 if it holds a valid record for 'filesize'
+int journal_load(int journal_fd, long long filesize, UploadJournal *journal)
+{
+    if (pread(journal_fd, journal, sizeof(*journal), 0) != sizeof(*journal) ||
+        memcmp(journal->magic, JOURNAL_MAGIC, sizeof(journal->magic)) != 0 ||
+        journal->filesize != filesize)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Makes the first 'committed' bytes of the .part file durable, then records them
+int journal_commit(int part_fd, int journal_fd, long long filesize, long long committed, uint32_t crc)
+{
+    UploadJournal journal;
+
+    memset(&journal, 0, sizeof(journal));
+    memcpy(journal.magic, JOURNAL_MAGIC, sizeof(journal.magic));
+    journal.filesize = filesize;
+    journal.committed = committed;
+    journal.crc = crc;
+
+    // Data first: the journal must never point past what is on disk
+    if (fdatasync(part_fd) < 0 ||
+        pwrite(journal_fd, &journal, sizeof(journal), 0) != sizeof(journal) ||
+        fdatasync(journal_fd) < 0)
+    {
+        log_msg("[Server] Failed to commit upload journal: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// --- Content-Addressed Chunk Store ---
+// UploadChunked clients announce the SHA-256 of every content-defined chunk;
+// only chunks missing from the store are transferred, then the file is
+// rebuilt from the manifest.
+
+static long long store_logical_bytes = 0;  // Bytes of all chunked uploads
+static long long store_physical_bytes = 0; // Bytes actually added to the store
+
+// Builds ".chunks/<first byte>/<full hash>" for a chunk
+void chunk_path(const unsigned char *hash, char *out, size_t out_size)
+{
+    char hex[2 * SHA256_DIGEST_LEN + 1];
+    sha256_hex(hash, hex);
+    snprintf(out, out_size, "%s/%.2s/%s", CHUNK_STORE_DIR, hex, hex);
+}
+
+int chunk_exists(const unsigned char *hash)
+{
+    char path[sizeof(CHUNK_STORE_DIR) + 2 * SHA256_DIGEST_LEN + 8];
+    chunk_path(hash, path, sizeof(path));
+    return access(path, F_OK) == 0;
+}
+
+// Stores a verified chunk; the temp file + rename keeps concurrent writers safe
+int chunk_store(const unsigned char *hash, const char *data, size_t len)
+{
+    char path[sizeof(CHUNK_STORE_DIR) + 2 * SHA256_DIGEST_LEN + 8];
+    char tmp_path[sizeof(path) + 32];
+    int fd;
+
+    chunk_path(hash, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%.*s", (int)(strrchr(path, '/') - path), path);
+    mkdir(tmp_path, 0777); // Fan-out directory
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%lx", path, (unsigned long)pthread_self());
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ||
+        write(fd, data, len) != (ssize_t)len)
+    {
+        log_msg("[Server] Failed to write chunk: %s\n", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp_path, path);
+}
+
+// Reassembles 'output_path' from the chunk store following 'refs'
+int rebuild_from_manifest(const char *output_path, const ChunkRef *refs, long long count, char *buffer)
+{
+    char tmp_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 32];
+    char path[sizeof(CHUNK_STORE_DIR) + 2 * SHA256_DIGEST_LEN + 8];
+    int out_fd, in_fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.rebuild.%lx", output_path, (unsigned long)pthread_self());
+    if ((out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        log_msg("[Server] Failed to create rebuilt file: %s\n", strerror(errno));
+        return -1;
+    }
+    for (long long i = 0; i < count; i++)
+    {
+        chunk_path(refs[i].hash, path, sizeof(path));
+        if ((in_fd = open(path, O_RDONLY)) < 0 ||
+            read(in_fd, buffer, refs[i].length) != (ssize_t)refs[i].length ||
+            write(out_fd, buffer, refs[i].length) != (ssize_t)refs[i].length)
+        {
+            log_msg("[Server] Failed to rebuild file from chunks: %s\n", strerror(errno));
+            if (in_fd >= 0)
+            {
+                close(in_fd);
+            }
+            close(out_fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        close(in_fd);
+    }
+    close(out_fd);
+    return rename(tmp_path, output_path);
+}
+
+// Records the manifest (the file's ChunkRef list) next to the chunk store
+void write_manifest(const char *filename, const ChunkRef *refs, long long count)
+{
+    char path[sizeof(MANIFEST_DIR) + FILENAME_MAX_LEN + 2];
+    int fd;
+
+    mkdir(MANIFEST_DIR, 0777);
+    snprintf(path, sizeof(path), "%s/%s", MANIFEST_DIR, filename);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ||
+        write(fd, refs, count * sizeof(ChunkRef)) != (ssize_t)(count * sizeof(ChunkRef)))
+    {
+        log_msg("[Server] Failed to write manifest: %s\n", strerror(errno));
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// UploadChunked: <count><ChunkRef x count> -> missing-chunk bitmap -> missing chunk data -> status
+int handle_chunked_upload(int conn_fd, Metadata *metadata)
+{
+    long long count, total = 0;
+    ChunkRef *refs = NULL;
+    unsigned char *need = NULL;
+    long long *slots = NULL;
+    char *buffer = NULL;
+    long long missing = 0, new_bytes = 0;
+    size_t slot_count = 2;
+    int status = 500;
+
+    // 1. Receive the chunk list and validate it against the announced size
+    if (recv_all(conn_fd, &count, sizeof(count)) <= 0 || count < 0 ||
+        count > metadata->filesize / CDC_MIN_SIZE + 1)
+    {
+        log_msg("[Server] Invalid chunk count.\n");
+        return 400;
+    }
+    // The list, its bitmap and the hash set below count against the memory cap
+    if (count <= (long long)(conn_mem_cap / sizeof(ChunkRef)))
+    {
+        while (slot_count < 2 * (size_t)count)
+        {
+            slot_count <<= 1;
+        }
+    }
+    if (count > (long long)(conn_mem_cap / sizeof(ChunkRef)) ||
+        count * sizeof(ChunkRef) + (count + 7) / 8 + slot_count * sizeof(long long) > conn_mem_cap)
+    {
+        log_msg("[Server] Chunk list of %lld chunks exceeds the per-connection memory cap (%zu bytes).\n", count,
+                conn_mem_cap);
+        return 400;
+    }
+    refs = malloc((count ? count : 1) * sizeof(ChunkRef));
+    need = calloc((count + 7) / 8 + 1, 1);
+    buffer = buf_get(CDC_MAX_SIZE);
+    if (refs == NULL || need == NULL || buffer == NULL)
+    {
+        log_msg("[Server] Failed to allocate chunk list: %s\n", strerror(errno));
+        goto cleanup;
+    }
+    if (count > 0 && recv_all(conn_fd, refs, count * sizeof(ChunkRef)) <= 0)
+    {
+        goto cleanup;
+    }
+    for (long long i = 0; i < count; i++)
+    {
+        if (refs[i].length == 0 || refs[i].length > CDC_MAX_SIZE)
+        {
+            status = 400;
+            goto cleanup;
+        }
+        total += refs[i].length;
+    }
+    if (total != metadata->filesize)
+    {
+        log_msg("[Server] Chunk list covers %lld bytes, expected %lld.\n", total, metadata->filesize);
+        status = 400;
+        goto cleanup;
+    }
+
+    // 2. Ask only for chunks the store lacks, and only once per distinct hash
+    //    (open-addressing set of requested chunk indices, keyed by the hash)
+    if ((slots = malloc(slot_count * sizeof(long long))) == NULL)
+    {
+        log_msg("[Server] Failed to allocate chunk set: %s\n", strerror(errno));
+        goto cleanup;
+    }
+    memset(slots, 0xff, slot_count * sizeof(long long)); // All -1: empty
+    mkdir(CHUNK_STORE_DIR, 0777);
+    for (long long i = 0; i < count; i++)
+    {
+        size_t slot;
+        memcpy(&slot, refs[i].hash, sizeof(slot));
+        for (slot &= slot_count - 1; slots[slot] >= 0; slot = (slot + 1) & (slot_count - 1))
+        {
+            if (memcmp(refs[slots[slot]].hash, refs[i].hash, SHA256_DIGEST_LEN) == 0)
+            {
+                break;
+            }
+        }
+        if (slots[slot] >= 0 || chunk_exists(refs[i].hash))
+        {
+            continue; // Already requested earlier in this file, or already stored
+        }
+        slots[slot] = i;
+        need[i / 8] |= 1 << (i % 8);
+        missing++;
+    }
+    if (send_all(conn_fd, need, (count + 7) / 8) < 0)
+    {
+        goto cleanup;
+    }
+
+    // 3. Receive, verify and store the missing chunks in list order
+    for (long long i = 0; i < count; i++)
+    {
+        unsigned char digest[SHA256_DIGEST_LEN];
+        if (!(need[i / 8] & (1 << (i % 8))))
+        {
+            continue;
+        }
+        if (recv_all(conn_fd, buffer, refs[i].length) <= 0)
+        {
+            log_msg("[Server] Connection lost while receiving chunks.\n");
+            metrics_inc(M_ERR_RECV);
+            goto cleanup;
+        }
+        sha256(buffer, refs[i].length, digest);
+        if (memcmp(digest, refs[i].hash, SHA256_DIGEST_LEN) != 0)
+        {
+            log_msg("[Server] Chunk %lld failed hash verification.\n", i);
+            status = 400;
+            goto cleanup;
+        }
+        if (chunk_store(refs[i].hash, buffer, refs[i].length) < 0)
+        {
+            goto cleanup;
+        }
+        new_bytes += refs[i].length;
+    }
+
+    // 4. Rebuild the file and keep its manifest
+    char output_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 2];
+    build_output_path(output_path, sizeof(output_path), metadata->filename, "");
+    if (rebuild_from_manifest(output_path, refs, count, buffer) < 0)
+    {
+        goto cleanup;
+    }
+    write_manifest(metadata->filename, refs, count);
+    status = 201;
+
+    long long logical = __atomic_add_fetch(&store_logical_bytes, total, __ATOMIC_RELAXED);
+    long long physical = __atomic_add_fetch(&store_physical_bytes, new_bytes, __ATOMIC_RELAXED);
+    log_msg("[Server] Rebuilt '%s' from %lld chunks (%lld transferred). Upload dedup: %lld of %lld bytes saved.\n",
+            metadata->filename, count, missing, total - new_bytes, total);
+    log_msg("[Server] Store dedup ratio %.2fx (%lld logical / %lld stored bytes).\n",
+            physical ? (double)logical / physical : 0.0, logical, physical);
+
+cleanup:
+    free(refs);
+    free(need);
+    free(slots);
+    buf_put(buffer, CDC_MAX_SIZE);
+    return status;
+}
+
+// --- Batch Uploads (UploadBatch) ---
+// Many small files over one connection. After the ack the client streams
+// records back to back, each a Metadata header ("UploadFile", name, size)
+// followed by the body and, with "crc", the body's CRC32C, without waiting
+// for answers. Records are stored in order and each gets a BatchStatus;
+// statuses are queued and flushed only when no more input is waiting, so a
+// burst of tiny files costs one send() for the lot. An "EndBatch" record
+// closes the batch and is answered with index BATCH_END and the overall code.
+
+typedef struct
+{
+    uint32_t index; // Record number within the batch, or BATCH_END
+    int32_t code;   // 201, STATUS_CORRUPT or 500 (overall: 201 only if all were stored)
+} BatchStatus;
+
+// Buffered reader over the connection, plus the statuses not yet sent
+typedef struct
+{
+    int fd;
+    char *buffer;
+    size_t size, start, end; // Unread input is buffer[start, end)
+    BatchStatus queue[BATCH_STATUS_QUEUE];
+    int queued;
+} BatchStream;
+
+static int batch_flush(BatchStream *s)
+{
+    size_t len = s->queued * sizeof(BatchStatus), sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(s->fd, (char *)s->queue + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    s->queued = 0;
+    return 0;
+}
+
+static int batch_status(BatchStream *s, uint32_t index, int code)
+{
+    if (index != BATCH_END)
+    {
+        count_status(code);
+    }
+    s->queue[s->queued].index = index;
+    s->queue[s->queued++].code = code;
+    return s->queued == BATCH_STATUS_QUEUE ? batch_flush(s) : 0;
+}
+
+// Refills the buffer; the queued statuses go out first if the read would block
+static int batch_fill(BatchStream *s)
+{
+    ssize_t n = recv(s->fd, s->buffer, s->size, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (batch_flush(s) < 0)
+        {
+            return -1;
+        }
+        n = recv(s->fd, s->buffer, s->size, 0);
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    metrics_add(M_BYTES_IN, n);
+    s->start = 0;
+    s->end = n;
+    return 0;
+}
+
+static int batch_read(BatchStream *s, void *dst, size_t len)
+{
+    while (len > 0)
+    {
+        if (s->start == s->end && batch_fill(s) < 0)
+        {
+            return -1;
+        }
+        size_t n = len < s->end - s->start ? len : s->end - s->start;
+        memcpy(dst, s->buffer + s->start, n);
+        s->start += n;
+        dst = (char *)dst + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Stores one record's body through a temp file + rename. Returns its status,
+// or -1 if the connection broke (the stream cannot be resynchronised).
+static int batch_store(BatchStream *s, const Metadata *record, int checksum)
+{
+    char output_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 2];
+    char tmp_path[sizeof(output_path) + 32];
+    long long left = record->filesize;
+    uint32_t crc = 0, expected;
+    int fd = -1, failed = 0, bad_name = !upload_name_ok(record->filename);
+
+    // The body is consumed below even when it cannot be stored
+    if (!bad_name)
+    {
+        build_output_path(output_path, sizeof(output_path), record->filename, "");
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%lx", output_path, (unsigned long)pthread_self());
+        if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+            failed = 1;
+        }
+    }
+    while (left > 0)
+    {
+        if (s->start == s->end && batch_fill(s) < 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                unlink(tmp_path);
+            }
+            return -1;
+        }
+        size_t n = left < (long long)(s->end - s->start) ? (size_t)left : s->end - s->start;
+        if (checksum)
+        {
+            crc = crc32c_update(crc, s->buffer + s->start, n);
+        }
+        if (fd >= 0 && !failed && write(fd, s->buffer + s->start, n) != (ssize_t)n)
+        {
+            failed = 1;
+        }
+        s->start += n;
+        left -= n;
+    }
+    if (fd >= 0 && close(fd) < 0)
+    {
+        failed = 1;
+    }
+    if (checksum && batch_read(s, &expected, sizeof(expected)) < 0)
+    {
+        if (fd >= 0)
+        {
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+
+    if (bad_name)
+    {
+        log_msg("[Server] Rejected file name '%s' in batch.\n", record->filename);
+        return 400;
+    }
+    int code = failed ? 500 : checksum && expected != crc ? STATUS_CORRUPT : 201;
+    if (code == 201 && rename(tmp_path, output_path) < 0)
+    {
+        code = 500;
+    }
+    if (code != 201)
+    {
+        unlink(tmp_path);
+    }
+    return code;
+}
+
+// UploadBatch: records until "EndBatch"; answers every record, then closes
+void handle_batch_upload(int conn_fd, int checksum)
+{
+    BatchStream s;
+    Metadata record;
+    uint32_t count = 0, failures = 0;
+    long long bytes = 0;
+    int ended = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.fd = conn_fd;
+    s.size = conn_mem_cap / 2 < CHUNK_SIZE ? CHUNK_SIZE : conn_mem_cap / 2;
+    if ((s.buffer = buf_get(s.size)) == NULL)
+    {
+        log_msg("[Server] Failed to allocate batch buffer: %s\n", strerror(errno));
+        close(conn_fd);
+        return;
+    }
+
+    while (batch_read(&s, &record, sizeof(record)) == 0)
+    {
+        record.method[sizeof(record.method) - 1] = '\0';
+        record.filename[sizeof(record.filename) - 1] = '\0';
+        if (strcmp(record.method, "EndBatch") == 0)
+        {
+            ended = 1;
+            break;
+        }
+        if (strcmp(record.method, "UploadFile") != 0 || record.filesize < 0 || count == BATCH_END)
+        {
+            log_msg("[Server] Invalid batch record %u ('%s'); closing the batch.\n", count, record.method);
+            break; // Framing is lost: nothing after this can be parsed
+        }
+        int code = batch_store(&s, &record, checksum);
+        if (code < 0)
+        {
+            break;
+        }
+        failures += code != 201;
+        bytes += record.filesize;
+        if (batch_status(&s, count++, code) < 0)
+        {
+            break;
+        }
+    }
+
+    log_msg("[Server] Batch %s: %u files, %lld bytes, %u failed.\n", ended ? "complete" : "aborted", count, bytes,
+            failures);
+    if (batch_status(&s, BATCH_END, ended && failures == 0 ? 201 : ended ? 500 : 400) == 0)
+    {
+        batch_flush(&s);
+    }
+    buf_put(s.buffer, s.size);
+    close(conn_fd);
+    log_msg("[Server] Connection closed.\n");
+}
+
+// --- Tree Sync (SyncTree) ---
+// Keeps OUTPUT_DIR/<tree>/ in step with a client's directory tree while only
+// moving what changed. For every file the client announces ("SyncFile",
+// relative path, size) the server answers with a SyncHeader and the block
+// signatures of its current copy (none if it has none). The client replies
+// with a delta: tokens n > 0 carry n literal bytes, n < 0 copy old block
+// -n - 1, and 0 ends it, followed by the CRC32C of the new file. The new file
+// is rebuilt from the old copy and the literals into a temp file that
+// replaces the old one once the CRC matches, so a failed sync leaves the old
+// copy intact. Each connection has its own worker, so a client syncing over
+// several connections gets signatures hashed and files rebuilt in parallel.
+// "EndSync" closes the session.
+
+typedef struct
+{
+    int32_t status;        // 200: signatures follow; 400: bad path; 500: server error
+    int32_t block_size;
+    long long block_count; // Signatures that follow; the last block may be short
+    long long old_size;    // Bytes of the server's current copy (0 if none)
+} SyncHeader;
+
+// Builds OUTPUT_DIR/<tree>/<rel> and creates its parent directories
+static int sync_path(char *out, size_t out_size, const char *tree, const char *rel)
+{
+    if (!sync_name_ok(rel) || snprintf(out, out_size, "%s/%s/%s", OUTPUT_DIR, tree, rel) >= (int)out_size)
+    {
+        return -1;
+    }
+    for (char *p = out + sizeof(OUTPUT_DIR); (p = strchr(p, '/')) != NULL; p++)
+    {
+        *p = '\0';
+        mkdir(out, 0777);
+        *p = '/';
+    }
+    return 0;
+}
+
+// Signatures of every block of 'fd', or NULL if it cannot be read
+static BlockSig *sync_signatures(int fd, const SyncHeader *h, char *buffer)
+{
+    BlockSig *sigs = malloc((h->block_count ? h->block_count : 1) * sizeof(BlockSig));
+
+    for (long long i = 0; sigs != NULL && i < h->block_count; i++)
+    {
+        long long offset = i * h->block_size;
+        size_t n = h->old_size - offset < h->block_size ? (size_t)(h->old_size - offset) : (size_t)h->block_size;
+        Rollsum sum;
+        if (pread(fd, buffer, n, offset) != (ssize_t)n)
+        {
+            free(sigs);
+            return NULL;
+        }
+        rollsum_init(&sum, (unsigned char *)buffer, n);
+        sigs[i].weak = rollsum_digest(&sum);
+        delta_strong(buffer, n, sigs[i].strong);
+    }
+    return sigs;
+}
+
+// Applies one delta from the connection, writing the new file to 'out_fd'.
+// Returns 201, STATUS_CORRUPT (CRC mismatch) or 500 (disk error), or -1 if
+// the delta is malformed or the connection broke.
+static int sync_apply(int conn_fd, int old_fd, int out_fd, const SyncHeader *h, long long new_size, char *buffer,
+                      long long *literal_bytes)
+{
+    long long written = 0;
+    uint32_t crc = 0, expected;
+    int32_t token;
+    int failed = out_fd < 0;
+
+    while (recv_all(conn_fd, &token, sizeof(token)) > 0 && token != 0)
+    {
+        size_t n;
+        if (token > 0)
+        {
+            if (token > DELTA_LITERAL_MAX || recv_all(conn_fd, buffer, token) <= 0)
+            {
+                return -1;
+            }
+            n = token;
+            *literal_bytes += n;
+        }
+        else
+        {
+            long long offset = (-(long long)token - 1) * h->block_size;
+            if (offset >= h->old_size)
+            {
+                return -1;
+            }
+            n = h->old_size - offset < h->block_size ? (size_t)(h->old_size - offset) : (size_t)h->block_size;
+            if (pread(old_fd, buffer, n, offset) != (ssize_t)n)
+            {
+                failed = 1; // Keep reading: the stream must stay in sync
+            }
+        }
+        if (written + (long long)n > new_size)
+        {
+            return -1;
+        }
+        crc = crc32c_update(crc, buffer, n);
+        if (!failed && write(out_fd, buffer, n) != (ssize_t)n)
+        {
+            failed = 1;
+        }
+        written += n;
+    }
+    if (token != 0 || recv_all(conn_fd, &expected, sizeof(expected)) <= 0 || written != new_size)
+    {
+        return -1;
+    }
+    return failed ? 500 : expected != crc ? STATUS_CORRUPT : 201;
+}
+
+// SyncTree: serves SyncFile requests for OUTPUT_DIR/<tree> until "EndSync"
+int handle_sync_tree(int conn_fd, const char *tree)
+{
+    size_t buffer_size = DELTA_MAX_BLOCK > DELTA_LITERAL_MAX ? DELTA_MAX_BLOCK : DELTA_LITERAL_MAX;
+    char *buffer = buf_get(buffer_size);
+    long long files = 0, bytes = 0, literal_bytes = 0;
+    int status = 400;
+    Metadata record;
+
+    if (buffer == NULL)
+    {
+        log_msg("[Server] Failed to allocate sync buffer: %s\n", strerror(errno));
+        return 500;
+    }
+    while (recv_all(conn_fd, &record, sizeof(record)) > 0)
+    {
+        char path[FILENAME_MAX_LEN * 2 + sizeof(OUTPUT_DIR) + 2];
+        char tmp_path[sizeof(path) + 32];
+        SyncHeader header;
+        BlockSig *sigs = NULL;
+        struct stat st;
+        int old_fd = -1, out_fd = -1;
+
+        record.method[sizeof(record.method) - 1] = '\0';
+        record.filename[sizeof(record.filename) - 1] = '\0';
+        if (strcmp(record.method, "EndSync") == 0)
+        {
+            status = 200;
+            break;
+        }
+        if (strcmp(record.method, "SyncFile") != 0 || record.filesize < 0)
+        {
+            log_msg("[Server] Invalid sync request '%s'.\n", record.method);
+            break;
+        }
+
+        // 1. Signatures of the current copy, if there is one
+        memset(&header, 0, sizeof(header));
+        header.status = 200;
+        if (sync_path(path, sizeof(path), tree, record.filename) < 0)
+        {
+            header.status = 400;
+        }
+        else if ((old_fd = open(path, O_RDONLY)) >= 0 && fstat(old_fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            header.old_size = st.st_size;
+        }
+        header.block_size = delta_block_size(header.old_size);
+        header.block_count = (header.old_size + header.block_size - 1) / header.block_size;
+        if (header.status == 200 && header.block_count > 0 && (sigs = sync_signatures(old_fd, &header, buffer)) == NULL)
+        {
+            header.status = 500;
+        }
+        if (header.status == 200)
+        {
+            snprintf(tmp_path, sizeof(tmp_path), "%s.sync.%lx", path, (unsigned long)pthread_self());
+            if ((out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+            {
+                header.status = 500;
+            }
+        }
+        if (header.status != 200)
+        {
+            header.block_count = 0; // No signatures follow, and no old copy to describe
+            header.old_size = 0;
+        }
+        if (send_all(conn_fd, &header, sizeof(header)) < 0 ||
+            send_all(conn_fd, sigs, header.block_count * sizeof(BlockSig)) < 0)
+        {
+            header.status = -1;
+        }
+        free(sigs);
+
+        // 2. Rebuild from the delta, then replace the old copy
+        int code = header.status;
+        if (header.status == 200)
+        {
+            code = sync_apply(conn_fd, old_fd, out_fd, &header, record.filesize, buffer, &literal_bytes);
+            if (close(out_fd) < 0 && code == 201)
+            {
+                code = 500;
+            }
+            if (code == 201 && rename(tmp_path, path) < 0)
+            {
+                code = 500;
+            }
+            if (code != 201)
+            {
+                unlink(tmp_path);
+            }
+        }
+        if (old_fd >= 0)
+        {
+            close(old_fd);
+        }
+        if (code < 0 || (header.status == 200 && send_all(conn_fd, &code, sizeof(code)) < 0))
+        {
+            break; // The stream is out of step or gone
+        }
+        files += code == 201;
+        bytes += code == 201 ? record.filesize : 0;
+    }
+
+    log_msg("[Server] Synced %lld files into '%s/%s': %lld bytes, %lld received as literals.\n", files, OUTPUT_DIR,
+            tree, bytes, literal_bytes);
+    buf_put(buffer, buffer_size);
+    return status;
+}
+
+// --- Framed Protocol (common/wire.h) ---
+// A connection that opens with WIRE_MAGIC speaks the framed protocol: any
+// number of uploads, each a stream of OPEN, DATA... and END frames, may be
+// interleaved on it. Each finished stream gets a STATUS frame. Control
+// frames are parsed whole from the receive buffer; DATA payloads are written
+// out as they arrive, so the buffer stays within the per-connection memory
+// cap whatever the frame size. As with UploadBatch, STATUS frames are
+// queued and flushed when the next read would block. Bodies go to a temp
+// file that is renamed into place on END.
+
+typedef struct
+{
+    int used;
+    uint64_t id;
+    int fd; // -1 if the file could not be created (the body is still consumed)
+    int flags;
+    long long size, received;
+    uint32_t crc;
+    char path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 2];
+    char tmp_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 34];
+} WireStream;
+
+typedef struct
+{
+    int fd;
+    uint8_t *in;
+    size_t in_size, start, end; // Unparsed input is in[start, end)
+    uint8_t out[4096];
+    size_t out_used;
+    WireStream streams[WIRE_MAX_STREAMS];
+    long long stored, failed, bytes;
+} WireConn;
+
+// A worker serves one connection at a time, so each keeps its own slab
+static __thread Slab wire_slab = SLAB_INIT(sizeof(WireConn));
+
+static int wire_flush(WireConn *c)
+{
+    int result = send_all(c->fd, c->out, c->out_used);
+    c->out_used = 0;
+    return result;
+}
+
+// Reads more input behind what is buffered; queued frames go out first if
+// the read would block. Returns -1 on EOF or error.
+static int wire_fill(WireConn *c)
+{
+    if (c->start > 0)
+    {
+        memmove(c->in, c->in + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    ssize_t n = recv(c->fd, c->in + c->end, c->in_size - c->end, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (wire_flush(c) < 0)
+        {
+            return -1;
+        }
+        n = recv(c->fd, c->in + c->end, c->in_size - c->end, 0);
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    metrics_add(M_BYTES_IN, n);
+    c->end += n;
+    return 0;
+}
+
+static int wire_queue_status(WireConn *c, uint64_t stream, int code)
+{
+    uint8_t payload[WIRE_MAX_VARINT];
+    size_t len = wire_put_varint(payload, (uint64_t)code);
+
+    count_status(code);
+    if (c->out_used + WIRE_MAX_HEADER + len > sizeof(c->out) && wire_flush(c) < 0)
+    {
+        return -1;
+    }
+    c->out_used += wire_put_header(c->out + c->out_used, WIRE_STATUS, stream, len);
+    memcpy(c->out + c->out_used, payload, len);
+    c->out_used += len;
+    return 0;
+}
+
+static WireStream *wire_find(WireConn *c, uint64_t id)
+{
+    for (int i = 0; i < WIRE_MAX_STREAMS; i++)
+    {
+        if (c->streams[i].used && c->streams[i].id == id)
+        {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void wire_discard(WireStream *st)
+{
+    if (st->fd >= 0)
+    {
+        close(st->fd);
+        unlink(st->tmp_path);
+    }
+    st->used = 0;
+}
+
+// OPEN: varint size, varint flags, then the file name. Returns -1 on a protocol error.
+static int wire_open(WireConn *c, uint64_t id, const uint8_t *p, size_t len)
+{
+    uint64_t size, flags;
+    int a, b;
+    WireStream *st = NULL;
+
+    if (wire_find(c, id) != NULL || (a = wire_get_varint(p, len, &size)) <= 0 ||
+        (b = wire_get_varint(p + a, len - a, &flags)) <= 0 || len - a - b >= FILENAME_MAX_LEN ||
+        (long long)size < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < WIRE_MAX_STREAMS && st == NULL; i++)
+    {
+        st = c->streams[i].used ? NULL : &c->streams[i];
+    }
+    if (st == NULL)
+    {
+        return -1; // More streams than the client may have open
+    }
+
+    char name[FILENAME_MAX_LEN];
+    memcpy(name, p + a + b, len - a - b);
+    name[len - a - b] = '\0';
+    memset(st, 0, sizeof(*st));
+    st->used = 1;
+    st->id = id;
+    st->flags = (int)flags;
+    st->size = (long long)size;
+    st->fd = -1;
+    if (upload_name_ok(name))
+    {
+        build_output_path(st->path, sizeof(st->path), name, "");
+        snprintf(st->tmp_path, sizeof(st->tmp_path), "%s.tmp.%lx", st->path, (unsigned long)pthread_self());
+        st->fd = open(st->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    return 0;
+}
+
+// END: checks the body, publishes it and queues the stream's STATUS
+static int wire_end(WireConn *c, WireStream *st, const uint8_t *p, size_t len)
+{
+    int code = 201;
+
+    if (st->received != st->size || ((st->flags & WIRE_FLAG_CRC) && len != 4))
+    {
+        code = 400;
+    }
+    else if (st->fd < 0)
+    {
+        code = 500;
+    }
+    else if ((st->flags & WIRE_FLAG_CRC) && wire_get_u32(p) != st->crc)
+    {
+        code = STATUS_CORRUPT;
+    }
+
+    if (st->fd >= 0 && close(st->fd) < 0 && code == 201)
+    {
+        code = 500;
+    }
+    if (code == 201 && rename(st->tmp_path, st->path) < 0)
+    {
+        code = 500;
+    }
+    if (code != 201 && st->fd >= 0)
+    {
+        unlink(st->tmp_path);
+    }
+    st->used = 0;
+
+    c->stored += code == 201;
+    c->failed += code != 201;
+    c->bytes += code == 201 ? st->size : 0;
+    return wire_queue_status(c, st->id, code);
+}
+
+void handle_framed_connection(int conn_fd)
+{
+    WireConn *c = slab_alloc(&wire_slab);
+    size_t in_size = conn_mem_cap / 2 < CHUNK_SIZE ? CHUNK_SIZE : conn_mem_cap / 2;
+    WireStream *data_stream = NULL; // Stream of the DATA payload being consumed
+    long long data_left = 0;
+    uint64_t version = 0;
+    int goaway = 0, vlen;
+
+    if (c == NULL || (c->in = buf_get(in_size)) == NULL)
+    {
+        log_msg("[Server] Failed to allocate framed connection: %s\n", strerror(errno));
+        slab_free(&wire_slab, c);
+        close(conn_fd);
+        return;
+    }
+    c->fd = conn_fd;
+    c->in_size = in_size;
+    mkdir(OUTPUT_DIR, 0777);
+
+    // 1. Preface: magic and the client's highest version; answer with the one to use
+    while ((vlen = c->end > 1 ? wire_get_varint(c->in + 1, c->end - 1, &version) : 0) == 0 && wire_fill(c) == 0)
+    {
+    }
+    if (vlen > 0)
+    {
+        c->start = 1 + vlen;
+        version = version < WIRE_VERSION ? version : WIRE_VERSION;
+        c->out[c->out_used++] = WIRE_MAGIC;
+        c->out_used += wire_put_varint(c->out + c->out_used, version >= WIRE_MIN_VERSION ? version : WIRE_VERSION);
+    }
+    if (vlen <= 0 || version < WIRE_MIN_VERSION)
+    {
+        log_msg("[Server] Framed connection with no usable protocol version.\n");
+        wire_flush(c);
+        goto done;
+    }
+
+    // 2. Frames until GOAWAY
+    while (!goaway)
+    {
+        WireHeader h;
+        int n;
+
+        if (data_left > 0)
+        {
+            if (c->start == c->end && wire_fill(c) < 0)
+            {
+                break;
+            }
+            size_t take = c->end - c->start < (size_t)data_left ? c->end - c->start : (size_t)data_left;
+            if (data_stream->fd >= 0 && write(data_stream->fd, c->in + c->start, take) != (ssize_t)take)
+            {
+                close(data_stream->fd); // Reported as 500 at END
+                unlink(data_stream->tmp_path);
+                data_stream->fd = -1;
+            }
+            if (data_stream->flags & WIRE_FLAG_CRC)
+            {
+                data_stream->crc = crc32c_update(data_stream->crc, c->in + c->start, take);
+            }
+            data_stream->received += take;
+            c->start += take;
+            data_left -= take;
+            continue;
+        }
+
+        if ((n = wire_parse_header(c->in + c->start, c->end - c->start, &h)) == 0)
+        {
+            if (wire_fill(c) < 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (n < 0)
+        {
+            log_msg("[Server] Malformed frame header.\n");
+            break;
+        }
+        if (h.opcode == WIRE_DATA)
+        {
+            if ((data_stream = wire_find(c, h.stream)) == NULL ||
+                data_stream->received + (long long)h.length > data_stream->size)
+            {
+                log_msg("[Server] DATA frame for unknown stream %llu or past its size.\n",
+                        (unsigned long long)h.stream);
+                break;
+            }
+            c->start += n;
+            data_left = h.length;
+            continue;
+        }
+
+        // Control frames are handled once their whole payload is buffered
+        if (h.length > WIRE_MAX_CONTROL)
+        {
+            log_msg("[Server] Oversized control frame (opcode %llu).\n", (unsigned long long)h.opcode);
+            break;
+        }
+        if (c->end - c->start < n + h.length)
+        {
+            if (wire_fill(c) < 0)
+            {
+                break;
+            }
+            continue;
+        }
+        const uint8_t *payload = c->in + c->start + n;
+        WireStream *st;
+        int error = 0;
+        if (h.opcode == WIRE_OPEN)
+        {
+            error = wire_open(c, h.stream, payload, h.length);
+        }
+        else if (h.opcode == WIRE_END)
+        {
+            error = (st = wire_find(c, h.stream)) == NULL || wire_end(c, st, payload, h.length) < 0;
+        }
+        else if (h.opcode == WIRE_GOAWAY)
+        {
+            goaway = 1;
+        }
+        else
+        {
+            error = 1;
+        }
+        if (error)
+        {
+            log_msg("[Server] Protocol error on stream %llu (opcode %llu).\n", (unsigned long long)h.stream,
+                    (unsigned long long)h.opcode);
+            break;
+        }
+        c->start += n + h.length;
+    }
+
+    // 3. Streams left open are abandoned; GOAWAY is answered once all statuses are out
+    for (int i = 0; i < WIRE_MAX_STREAMS; i++)
+    {
+        if (c->streams[i].used)
+        {
+            wire_discard(&c->streams[i]);
+            c->failed++;
+        }
+    }
+    if (goaway && c->out_used + WIRE_MAX_HEADER <= sizeof(c->out))
+    {
+        c->out_used += wire_put_header(c->out + c->out_used, WIRE_GOAWAY, 0, 0);
+    }
+    wire_flush(c);
+    log_msg("[Server] Framed connection (v%llu) %s: %lld streams stored (%lld bytes), %lld failed.\n",
+            (unsigned long long)version, goaway ? "complete" : "aborted", c->stored, c->bytes, c->failed);
+
+done:
+    buf_put(c->in, in_size);
+    slab_free(&wire_slab, c);
+    close(conn_fd);
+    log_msg("[Server] Connection closed.\n");
+}
+
+// --- Server RPC Implementation (Skeleton) ---
+
+// Receives the next piece of the body into 'buffer'. Plain bodies are read
+// as they arrive; CODEC_LZ bodies are read one whole frame at a time (via
+// 'frame') and decoded, so a broken connection never yields half a block.
+// Returns raw bytes produced, 0 on EOF, -1 on error or corrupt frame.
+ssize_t receive_body(int conn_fd, int codec, char *buffer, size_t buffer_size, uint8_t *frame, long long remaining)
+{
+    uint8_t header[LZ_FRAME_HEADER];
+    size_t raw_len;
+    int stored;
+    long payload;
+
+    if (codec == CODEC_NONE)
+    {
+        size_t to_receive = (remaining > (long long)buffer_size) ? buffer_size : (size_t)remaining;
+        ssize_t received = recv(conn_fd, buffer, to_receive, 0);
+        if (received > 0)
+        {
+            metrics_add(M_BYTES_IN, received);
+        }
+        return received;
+    }
+
+    ssize_t n = recv_all(conn_fd, header, sizeof(header));
+    if (n <= 0)
+    {
+        return n;
+    }
+    if ((payload = lz_frame_payload(header, &raw_len, &stored)) < 0 || (long long)raw_len > remaining)
+    {
+        log_msg("[Server] Corrupt compressed frame.\n");
+        return -1;
+    }
+    if ((n = recv_all(conn_fd, frame, payload)) <= 0)
+    {
+        return n;
+    }
+    return lz_decode_frame(frame, payload, raw_len, stored, (uint8_t *)buffer);
+}
+
+// --- io_uring Receive Path ---
+// Plain bodies can be received through io_uring: the RECV into the next
+// buffer is submitted together with the WRITE_FIXED of the previous one, so
+// the disk write overlaps the network and every buffer costs one
+// io_uring_enter() instead of a recv() plus a write(). The socket and the
+// .part file are registered files 0 and 1.
+
+#define URING_OP_RECV (1ULL << 32) // user_data tag; the low bits hold the buffer index
+
+typedef struct
+{
+    struct uring ring;
+    char *buffers[URING_BUFFERS];
+    size_t buffer_size;
+    int busy[URING_BUFFERS];       // Write of this buffer still in flight
+    size_t pending[URING_BUFFERS]; // Length of that write
+    int writes;              // Writes in flight
+    int next;                // Buffer the next RECV goes into
+    int failed;              // A write failed or came up short
+} UringReceiver;
+
+// Sets up the ring over 'pool' (URING_BUFFERS * buffer_size bytes); returns 0 or -errno
+int uring_receiver_init(UringReceiver *u, int conn_fd, int file_fd, char *pool, size_t buffer_size)
+{
+    struct iovec iov[URING_BUFFERS];
+    int files[2] = {conn_fd, file_fd};
+    int err;
+
+    memset(u, 0, sizeof(*u));
+    if ((err = uring_init(&u->ring, 2 * URING_BUFFERS)) < 0)
+    {
+        return err;
+    }
+    u->buffer_size = buffer_size;
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        u->buffers[i] = pool + (size_t)i * buffer_size;
+        iov[i].iov_base = u->buffers[i];
+        iov[i].iov_len = buffer_size;
+    }
+    if ((err = uring_register_buffers(&u->ring, iov, URING_BUFFERS)) < 0 ||
+        (err = uring_register_files(&u->ring, files, 2)) < 0)
+    {
+        uring_exit(&u->ring);
+    }
+    return err;
+}
+
+// Waits for completions until the RECV (if 'recv_result' is given) has
+// finished, or until 'buffer' is free again (if it is >= 0), or until no
+// write is in flight. Returns 0, or -1 if io_uring_enter() fails.
+static int uring_receiver_wait(UringReceiver *u, ssize_t *recv_result, int buffer)
+{
+    int recv_done = recv_result == NULL;
+
+    for (;;)
+    {
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&u->ring)) != NULL)
+        {
+            if (cqe->user_data & URING_OP_RECV)
+            {
+                *recv_result = cqe->res;
+                recv_done = 1;
+            }
+            else
+            {
+                int index = (int)cqe->user_data;
+                if (cqe->res < 0 || (size_t)cqe->res != u->pending[index])
+                {
+                    u->failed = 1;
+                }
+                u->busy[index] = 0;
+                u->writes--;
+            }
+            uring_cqe_seen(&u->ring);
+        }
+        if (recv_result != NULL ? recv_done : buffer >= 0 ? !u->busy[buffer] : u->writes == 0)
+        {
+            return 0;
+        }
+        if (uring_submit_and_wait(&u->ring, 1) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+// Receives up to 'want' bytes into the next free buffer, also submitting any
+// queued write. Returns bytes received (0 on EOF, -1 on error); '*data'
+// points at them until the matching uring_receiver_write().
+ssize_t uring_receiver_recv(UringReceiver *u, size_t want, char **data)
+{
+    ssize_t result = -1;
+    int b = u->next;
+
+    if (u->busy[b] && uring_receiver_wait(u, NULL, b) < 0)
+    {
+        return -1;
+    }
+    if (want > u->buffer_size)
+    {
+        want = u->buffer_size;
+    }
+    uring_prep_recv(uring_get_sqe(&u->ring), 0, u->buffers[b], want, 0, URING_OP_RECV);
+    if (uring_submit_and_wait(&u->ring, 1) < 0 || uring_receiver_wait(u, &result, -1) < 0)
+    {
+        return -1;
+    }
+    if (result < 0)
+    {
+        errno = -result;
+        return -1;
+    }
+    metrics_add(M_BYTES_IN, result);
+    *data = u->buffers[b];
+    return result;
+}
+
+// Queues the write of the buffer just received at 'offset'; it is submitted
+// together with the next RECV (or by uring_receiver_drain)
+void uring_receiver_write(UringReceiver *u, size_t len, long long offset)
+{
+    int b = u->next;
+
+    uring_prep_write_fixed(uring_get_sqe(&u->ring), 1, u->buffers[b], len, offset, b, b);
+    u->pending[b] = len;
+    u->busy[b] = 1;
+    u->writes++;
+    u->next = (b + 1) % URING_BUFFERS;
+}
+
+// Waits for every queued write; returns -1 if any of them failed
+int uring_receiver_drain(UringReceiver *u)
+{
+    if (uring_receiver_wait(u, NULL, -1) < 0)
+    {
+        u->failed = 1;
+    }
+    return u->failed ? -1 : 0;
+}
+
+// --- mmap Receive Path ---
+// Plain bodies can also be received straight into a shared mapping of the
+// .part file: recv() copies from the socket into the page cache, with no
+// user buffer and no write(). The file first gets its final size from
+// posix_fallocate(), so a full disk is an error here instead of a SIGBUS on
+// some later store. Only MMAP_WINDOW bytes are mapped at a time (advised
+// MADV_SEQUENTIAL), which bounds resident memory for files larger than RAM;
+// fdatasync() in journal_commit() flushes dirty mapped pages like written ones.
+
+typedef struct
+{
+    int fd;
+    long long filesize;
+    char *map;           // Current window, NULL if none
+    long long map_start; // File offset of map[0] (page aligned)
+    size_t map_len;
+} MmapReceiver;
+
+// Allocates the whole file up front; returns 0 or -errno
+int mmap_receiver_init(MmapReceiver *m, int file_fd, long long filesize)
+{
+    memset(m, 0, sizeof(*m));
+    m->fd = file_fd;
+    m->filesize = filesize;
+    int err = filesize > 0 ? posix_fallocate(file_fd, 0, filesize) : 0;
+    return -err;
+}
+
+// Receives up to 'want' bytes into the mapping at file offset 'offset',
+// remapping when it leaves the current window; '*data' points at them.
+// Returns bytes received, 0 on EOF, -1 on error.
+ssize_t mmap_receiver_recv(MmapReceiver *m, int conn_fd, long long offset, size_t want, char **data)
+{
+    if (m->map == NULL || offset >= m->map_start + (long long)m->map_len)
+    {
+        long long page = sysconf(_SC_PAGESIZE);
+        if (m->map != NULL)
+        {
+            munmap(m->map, m->map_len);
+        }
+        m->map_start = offset & ~(page - 1);
+        m->map_len = m->filesize - m->map_start < MMAP_WINDOW ? (size_t)(m->filesize - m->map_start) : MMAP_WINDOW;
+        m->map = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, m->map_start);
+        if (m->map == MAP_FAILED)
+        {
+            m->map = NULL;
+            return -1;
+        }
+        madvise(m->map, m->map_len, MADV_SEQUENTIAL);
+    }
+
+    size_t room = (size_t)(m->map_start + (long long)m->map_len - offset);
+    *data = m->map + (offset - m->map_start);
+    ssize_t received = recv(conn_fd, *data, want < room ? want : room, 0);
+    if (received > 0)
+    {
+        metrics_add(M_BYTES_IN, received);
+    }
+    return received;
+}
+
+void mmap_receiver_close(MmapReceiver *m)
+{
+    if (m->map != NULL)
+    {
+        munmap(m->map, m->map_len);
+        m->map = NULL;
+    }
+}
+
+// --- O_DIRECT Receive Path ---
+// Written bodies normally sit in the page cache until memory pressure pushes
+// them out, evicting everything else on the way; an ingest server gains
+// nothing from caching files it will not read again. With -D plain bodies
+// are received into DIRECT_ALIGN-aligned buffers and each full buffer is
+// written with O_DIRECT through a second descriptor of the .part file,
+// straight to the disk. Writes are queued on an io_uring (without one they
+// are plain pwrite()s), so the next buffer is being received while the
+// previous ones are written; the socket only waits for the disk when every
+// buffer is still in flight.
+//
+// O_DIRECT wants aligned offsets and lengths. A resume at an unaligned
+// offset reads back the partial block in front of it first; the last,
+// partial buffer is written padded to the block size and the file is then
+// truncated to its real length. The file is preallocated (without changing
+// its size) from the announced size, so it lands in few extents and a full
+// disk shows up before any data is received.
+
+typedef struct
+{
+    int fd; // The .part file, opened with O_DIRECT
+    struct uring ring;
+    int ring_active; // 0: writes are synchronous pwrite()s
+    char *buffers[DIRECT_BUFFERS];
+    size_t buffer_size;             // A multiple of DIRECT_ALIGN
+    long long base[DIRECT_BUFFERS]; // File offset of each buffer's first byte
+    size_t pending[DIRECT_BUFFERS]; // Length of the write in flight, 0 if none
+    int writes;                     // Writes in flight
+    int cur;                        // Buffer being received into
+    size_t fill;                    // Bytes of file data in it
+    int failed;                     // A write failed or came up short
+    long long written;              // Write requests issued, for the log
+} DirectReceiver;
+
+// Opens 'path' for O_DIRECT over 'pool' (DIRECT_BUFFERS * buffer_size bytes),
+// ready to continue at 'offset'; returns 0 or -errno (the caller falls back
+// to buffered writes)
+int direct_receiver_init(DirectReceiver *d, const char *path, char *pool, size_t buffer_size, long long offset,
+                         long long filesize)
+{
+    struct iovec iov[DIRECT_BUFFERS];
+    int err;
+
+    memset(d, 0, sizeof(*d));
+    d->ring.fd = -1;
+    if ((d->fd = open(path, O_RDWR | O_DIRECT)) < 0)
+    {
+        return -errno; // EINVAL: the filesystem (tmpfs, ...) has no direct I/O
+    }
+    if (filesize > offset && fallocate(d->fd, FALLOC_FL_KEEP_SIZE, offset, filesize - offset) < 0 &&
+        errno != EOPNOTSUPP)
+    {
+        err = -errno;
+        close(d->fd);
+        return err;
+    }
+    d->buffer_size = buffer_size;
+    for (int i = 0; i < DIRECT_BUFFERS; i++)
+    {
+        d->buffers[i] = pool + (size_t)i * buffer_size;
+        iov[i].iov_base = d->buffers[i];
+        iov[i].iov_len = buffer_size;
+    }
+
+    // Head fix-up: the aligned block holding 'offset' keeps its first bytes
+    d->base[0] = offset & ~(long long)(DIRECT_ALIGN - 1);
+    d->fill = (size_t)(offset - d->base[0]);
+    if (d->fill > 0 && pread(d->fd, d->buffers[0], DIRECT_ALIGN, d->base[0]) < (ssize_t)d->fill)
+    {
+        err = errno ? -errno : -EIO;
+        close(d->fd);
+        return err;
+    }
+
+    if ((err = uring_init(&d->ring, DIRECT_BUFFERS)) == 0)
+    {
+        if ((err = uring_register_buffers(&d->ring, iov, DIRECT_BUFFERS)) < 0 ||
+            (err = uring_register_files(&d->ring, &d->fd, 1)) < 0)
+        {
+            uring_exit(&d->ring);
+        }
+    }
+    d->ring_active = err == 0;
+    if (!d->ring_active)
+    {
+        log_msg("[Server] io_uring unavailable (%s), O_DIRECT writes are synchronous.\n", strerror(-err));
+    }
+    return 0;
+}
+
+// Reaps write completions until buffer 'b' is free (b >= 0) or until no
+// write is in flight (b < 0)
+static void direct_receiver_wait(DirectReceiver *d, int b)
 {
-    size_t total = 0;
-    ssize_t n;
-    while (total < len)
+    while (b >= 0 ? d->pending[b] > 0 : d->writes > 0)
     {
-        n = recv(sockfd, buf + total, len - total, 0);
-        if (n <= 0)
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&d->ring)) != NULL)
         {
-            // Error or connection closed
-            return n;
+            int index = (int)cqe->user_data;
+            if (cqe->res < 0 || (size_t)cqe->res != d->pending[index])
+            {
+                d->failed = 1;
+            }
+            d->pending[index] = 0;
+            d->writes--;
+            uring_cqe_seen(&d->ring);
+        }
+        if ((b >= 0 ? d->pending[b] > 0 : d->writes > 0) && uring_submit_and_wait(&d->ring, 1) < 0)
+        {
+            d->failed = 1;
+            return;
         }
-        total += n;
     }
-    return total;
 }
 
-// --- Server RPC Implementation (Skeleton) ---
+// Writes the first 'len' bytes of buffer 'b', padded to the block size
+static void direct_receiver_write(DirectReceiver *d, int b, size_t len)
+{
+    len = (len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    d->written++;
+    if (!d->ring_active)
+    {
+        d->failed |= pwrite(d->fd, d->buffers[b], len, d->base[b]) != (ssize_t)len;
+        return;
+    }
+    uring_prep_write_fixed(uring_get_sqe(&d->ring), 0, d->buffers[b], len, d->base[b], b, b);
+    d->pending[b] = len;
+    d->writes++;
+    if (uring_submit_and_wait(&d->ring, 0) < 0)
+    {
+        d->failed = 1;
+    }
+}
+
+// Receives up to 'want' bytes into the current buffer, first queueing its
+// write and moving on if it is full. Returns bytes received (0 on EOF, -1
+// on error); '*data' points at them.
+ssize_t direct_receiver_recv(DirectReceiver *d, int conn_fd, size_t want, char **data)
+{
+    if (d->fill == d->buffer_size)
+    {
+        int next = (d->cur + 1) % DIRECT_BUFFERS;
+        direct_receiver_write(d, d->cur, d->fill);
+        direct_receiver_wait(d, next);
+        d->base[next] = d->base[d->cur] + (long long)d->buffer_size;
+        d->cur = next;
+        d->fill = 0;
+    }
+    if (d->failed)
+    {
+        errno = EIO;
+        return -1;
+    }
+    size_t room = d->buffer_size - d->fill;
+    *data = d->buffers[d->cur] + d->fill;
+    ssize_t received = recv(conn_fd, *data, want < room ? want : room, 0);
+    if (received > 0)
+    {
+        d->fill += received;
+        metrics_add(M_BYTES_IN, received);
+    }
+    return received;
+}
+
+// Puts everything received so far on the disk (the partial buffer padded;
+// it is written again once it fills). Returns -1 if any write failed.
+int direct_receiver_sync(DirectReceiver *d)
+{
+    if (d->fill > 0)
+    {
+        direct_receiver_write(d, d->cur, d->fill);
+    }
+    if (d->ring_active)
+    {
+        direct_receiver_wait(d, -1);
+    }
+    return d->failed ? -1 : 0;
+}
+
+// Flushes the tail, cuts the padding off at 'size' and closes; returns -1 if
+// any write failed
+int direct_receiver_close(DirectReceiver *d, long long size)
+{
+    int result = direct_receiver_sync(d);
+
+    if (ftruncate(d->fd, size) < 0)
+    {
+        result = -1;
+    }
+    if (d->ring_active)
+    {
+        uring_exit(&d->ring);
+    }
+    close(d->fd);
+    return result;
+}
+
+// Sends the final RPC response (UploadStatus) and closes the connection
+void finish_client(int conn_fd, int response_code)
+{
+    count_status(response_code);
+    send(conn_fd, &response_code, sizeof(response_code), MSG_NOSIGNAL);
+    close(conn_fd);
+    log_msg("[Server] Connection closed.\n");
+}
 
 void handle_client(int conn_fd, struct sockaddr_in *client_addr)
 {
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
-    printf("[Server] Connection established with %s:%d\n", client_ip, ntohs(client_addr->sin_port));
+    log_msg("[Server] Connection established with %s:%d\n", client_ip, ntohs(client_addr->sin_port));
 
     Metadata metadata;
     ssize_t bytes_read;
+    unsigned char first;
+
+    // Framed protocol clients announce themselves with a byte no method name starts with
+    if (recv(conn_fd, &first, 1, MSG_PEEK) == 1 && first == WIRE_MAGIC)
+    {
+        handle_framed_connection(conn_fd);
+        return;
+    }
 
     // 1. Receive RPC method call (Metadata Header)
     bytes_read = recv_all(conn_fd, &metadata, sizeof(Metadata));
     if (bytes_read <= 0)
     {
-        perror("[Server] Error receiving metadata or connection closed");
+        log_msg("[Server] Error receiving metadata or connection closed: %s\n", strerror(errno));
+        metrics_inc(M_ERR_RECV);
         close(conn_fd);
         return;
     }
@@ -65,59 +1801,296 @@ void handle_client(int conn_fd, struct sockaddr_in *client_addr)
     metadata.method[sizeof(metadata.method) - 1] = '\0';
     metadata.filename[sizeof(metadata.filename) - 1] = '\0';
 
-    if (strcmp(metadata.method, "UploadFile") != 0)
+    // Options after ';' in the method name (e.g. "ResumeUpload;lz;crc") request a
+    // codec and/or per-block CRC32C checksums of the body
+    char *options = strchr(metadata.method, ';');
+    int codec = CODEC_NONE, checksum = 0;
+    if (options != NULL)
     {
-        printf("[Server] Invalid RPC method: %s\n", metadata.method);
-        // In a real system, send an error response back.
-        close(conn_fd);
+        char *saveptr, *option;
+        *options++ = '\0';
+        for (option = strtok_r(options, ";", &saveptr); option != NULL; option = strtok_r(NULL, ";", &saveptr))
+        {
+            if (strcmp(option, "lz") == 0)
+            {
+                codec = CODEC_LZ;
+            }
+            else if (strcmp(option, "crc") == 0)
+            {
+                checksum = 1;
+            }
+        }
+    }
+
+    // UploadFile starts from byte zero; ResumeUpload continues a journaled upload;
+    // UploadChunked only transfers chunks missing from the dedup store;
+    // UploadBatch streams many files over this connection; SyncTree updates a
+    // directory tree with deltas
+    int resume = strcmp(metadata.method, "ResumeUpload") == 0;
+    int chunked = strcmp(metadata.method, "UploadChunked") == 0;
+    int batch = strcmp(metadata.method, "UploadBatch") == 0;
+    int sync = strcmp(metadata.method, "SyncTree") == 0;
+    if (!resume && !chunked && !batch && !sync && strcmp(metadata.method, "UploadFile") != 0)
+    {
+        log_msg("[Server] Invalid RPC method: %s\n", metadata.method);
+        finish_client(conn_fd, 400); // Bad Request
         return;
     }
 
-    printf("[Server] Received RPC request: %s. File: '%s', Size: %lld bytes\n",
-           metadata.method, metadata.filename, metadata.filesize);
+    log_msg("[Server] Received RPC request: %s. File: '%s', Size: %lld bytes\n",
+            metadata.method, metadata.filename, metadata.filesize);
 
-    // 2. Send acknowledgment to start streaming (Status Code 200/OK)
-    int ack_code = 200;
-    send(conn_fd, &ack_code, sizeof(ack_code), 0);
+    if (chunked)
+    {
+        int ack_code = upload_name_ok(metadata.filename) ? 200 : 400;
+        send(conn_fd, &ack_code, sizeof(ack_code), MSG_NOSIGNAL);
+        if (ack_code != 200)
+        {
+            log_msg("[Server] Rejected file name '%s'.\n", metadata.filename);
+            close(conn_fd);
+            return;
+        }
+        mkdir(OUTPUT_DIR, 0777);
+        finish_client(conn_fd, handle_chunked_upload(conn_fd, &metadata));
+        return;
+    }
 
-    // 3. Handle file streaming (The core data transfer)
-    long long received_size = 0;
-    char buffer[CHUNK_SIZE];
-    char output_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 2]; // +2 for '/' and '\0'
-    int fd;
+    if (sync)
+    {
+        int ack_code = sync_name_ok(metadata.filename) ? 200 : 400;
+        send(conn_fd, &ack_code, sizeof(ack_code), MSG_NOSIGNAL);
+        if (ack_code != 200)
+        {
+            close(conn_fd);
+            return;
+        }
+        // Every reply is one small write awaited by the client: don't let Nagle hold it
+        int nodelay = 1;
+        setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        mkdir(OUTPUT_DIR, 0777);
+        finish_client(conn_fd, handle_sync_tree(conn_fd, metadata.filename));
+        return;
+    }
+
+    if (batch)
+    {
+        int ack_code = 200, no_codec = CODEC_NONE; // Batch bodies are always sent plain
+        mkdir(OUTPUT_DIR, 0777);
+        send(conn_fd, &ack_code, sizeof(ack_code), MSG_NOSIGNAL);
+        if (options != NULL)
+        {
+            send(conn_fd, &no_codec, sizeof(no_codec), MSG_NOSIGNAL);
+            if (checksum)
+            {
+                send(conn_fd, &checksum, sizeof(checksum), MSG_NOSIGNAL);
+            }
+        }
+        handle_batch_upload(conn_fd, checksum);
+        return;
+    }
+
+    char output_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + 2];                          // +2 for '/' and '\0'
+    char part_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + sizeof(PART_SUFFIX) + 1];       // '/' + suffix with '\0'
+    char journal_path[FILENAME_MAX_LEN + sizeof(OUTPUT_DIR) + sizeof(JOURNAL_SUFFIX) + 1];
+    int journal_fd, fd;
+    long long resume_offset = 0;
+    uint32_t resume_crc = 0;
+    UploadJournal journal;
 
     // Create output directory if it doesn't exist
     mkdir(OUTPUT_DIR, 0777);
 
-    // Construct output file path
-    snprintf(output_path, sizeof(output_path), "%s/%s", OUTPUT_DIR, metadata.filename);
+    build_output_path(output_path, sizeof(output_path), metadata.filename, "");
+    build_output_path(part_path, sizeof(part_path), metadata.filename, PART_SUFFIX);
+    build_output_path(journal_path, sizeof(journal_path), metadata.filename, JOURNAL_SUFFIX);
+
+    // 2. Lock the upload through its journal; a second writer gets 409 Conflict
+    if ((journal_fd = open(journal_path, O_RDWR | O_CREAT, 0666)) < 0)
+    {
+        log_msg("[Server] Failed to open upload journal: %s\n", strerror(errno));
+        finish_client(conn_fd, 500);
+        return;
+    }
+    if (flock(journal_fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        log_msg("[Server] Upload of '%s' already in progress.\n", metadata.filename);
+        close(journal_fd);
+        finish_client(conn_fd, 409);
+        return;
+    }
+
+    // 3. Work out where to continue: the committed offset, if the journal matches this file
+    struct stat part_stat;
+    if (resume && journal_load(journal_fd, metadata.filesize, &journal) == 0 &&
+        stat(part_path, &part_stat) == 0)
+    {
+        resume_offset = journal.committed;
+        resume_crc = journal.crc;
+        if (resume_offset > part_stat.st_size)
+        {
+            resume_offset = resume_crc = 0; // .part lost data the journal vouched for
+        }
+    }
+
+    // Open the .part file; anything past the committed offset is discarded
+    if ((fd = open(part_path, O_RDWR | O_CREAT | (resume_offset == 0 ? O_TRUNC : 0), 0666)) < 0 ||
+        ftruncate(fd, resume_offset) < 0 || lseek(fd, resume_offset, SEEK_SET) < 0)
+    {
+        log_msg("[Server] Failed to open output file: %s\n", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        close(journal_fd);
+        finish_client(conn_fd, 500);
+        return;
+    }
+
+    // 4. Send acknowledgment to start streaming (Status Code 200/OK);
+    //    ResumeUpload also gets the offset the client must continue from, and a
+    //    request with options gets the codec the body must be sent with, then
+    //    (if it asked for "crc") whether checksums are on
+    int ack_code = 200;
+    send(conn_fd, &ack_code, sizeof(ack_code), MSG_NOSIGNAL);
+    if (resume)
+    {
+        send(conn_fd, &resume_offset, sizeof(resume_offset), MSG_NOSIGNAL);
+        if (resume_offset > 0)
+        {
+            log_msg("[Server] Resuming '%s' at offset %lld.\n", metadata.filename, resume_offset);
+        }
+    }
+    if (options != NULL)
+    {
+        send(conn_fd, &codec, sizeof(codec), MSG_NOSIGNAL);
+        if (checksum)
+        {
+            send(conn_fd, &checksum, sizeof(checksum), MSG_NOSIGNAL);
+        }
+    }
+
+    // 5. Handle file streaming (The core data transfer). With checksums the body
+    //    is split into CRC_BLOCK_SIZE blocks, each followed by its CRC32C, and
+    //    the whole-file CRC32C comes last; only verified bytes are journaled.
+    long long received_size = resume_offset;
+    long long next_commit = resume_offset + JOURNAL_INTERVAL;
+    long long verified_size = resume_offset; // Bytes whose block checksum matched
+    uint32_t file_crc = resume_crc, verified_crc = resume_crc, block_crc = 0;
+    size_t block_fill = 0;
+    int corrupt = 0; // 1: a block failed its checksum, 2: the whole file did
+    size_t buffer_size = conn_mem_cap / 2; // Half user-space buffer, half kernel receive buffer
+    size_t buffer_alloc;
+    char *buffer, *data;
+    uint8_t *frame = NULL;
+    int write_failed = 0;
+    DirectReceiver direct;
+    int direct_active = use_direct && codec == CODEC_NONE;
+    UringReceiver uring;
+    int uring_active = use_uring && !direct_active && codec == CODEC_NONE;
+    MmapReceiver mapped;
+    TcpTune tune; // Measures the path; the receive buffer only grows within the memory cap
+    int mmap_active = use_mmap && !uring_active && !direct_active && codec == CODEC_NONE;
+    int buffers = uring_active ? URING_BUFFERS : direct_active ? DIRECT_BUFFERS : 1;
 
-    // Open file descriptor for writing
-    if ((fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    if (buffer_size < CHUNK_SIZE)
+    {
+        buffer_size = CHUNK_SIZE;
+    }
+    if (codec != CODEC_NONE)
+    {
+        buffer_size = LZ_BLOCK_SIZE; // One decoded block plus one frame, whatever the cap
+        frame = buf_get(LZ_BLOCK_SIZE);
+    }
+    if (buffers > 1)
+    {
+        // The same memory, split into page-aligned buffers that take turns
+        buffer_size = (buffer_size / buffers) & ~(size_t)(CHUNK_SIZE - 1);
+        if (buffer_size < CHUNK_SIZE)
+        {
+            buffer_size = CHUNK_SIZE;
+        }
+    }
+    buffer_alloc = buffers * buffer_size; // Pool buffers are page-aligned
+    buffer = buf_get(buffer_alloc);
+    if (buffer == NULL || (codec != CODEC_NONE && frame == NULL))
     {
-        perror("[Server] Failed to open output file");
+        buf_put(buffer, buffer_alloc);
+        buf_put(frame, LZ_BLOCK_SIZE);
+        log_msg("[Server] Failed to allocate receive buffer: %s\n", strerror(errno));
+        close(fd);
+        close(journal_fd);
         close(conn_fd);
         return;
     }
 
-    printf("[Server] Receiving file '%s'...\n", metadata.filename);
+    if (uring_active)
+    {
+        int err = uring_receiver_init(&uring, conn_fd, fd, buffer, buffer_size);
+        if (err < 0)
+        {
+            log_msg("[Server] io_uring unavailable (%s), using blocking I/O.\n", strerror(-err));
+            uring_active = 0;
+        }
+    }
+    if (direct_active)
+    {
+        int err = direct_receiver_init(&direct, part_path, buffer, buffer_size, resume_offset, metadata.filesize);
+        if (err < 0)
+        {
+            log_msg("[Server] O_DIRECT unavailable for '%s' (%s), using buffered writes.\n", metadata.filename,
+                    strerror(-err));
+            direct_active = 0;
+        }
+    }
+    if (mmap_active)
+    {
+        int err = mmap_receiver_init(&mapped, fd, metadata.filesize);
+        if (err < 0)
+        {
+            log_msg("[Server] Cannot allocate '%s' for mmap (%s), using blocking I/O.\n", metadata.filename,
+                    strerror(-err));
+            mmap_active = 0;
+        }
+    }
+
+    tcp_tune_init(&tune, conn_fd, TCP_TUNE_RECV);
+    tune.limit = conn_mem_cap / 2;
+
+    log_msg("[Server] Receiving file '%s'%s%s%s...\n", metadata.filename, codec == CODEC_LZ ? " (lz compressed)" : "",
+            checksum ? " (crc32c)" : "",
+            uring_active ? " (io_uring)" : mmap_active ? " (mmap)" : direct_active ? " (O_DIRECT)" : "");
 
     while (received_size < metadata.filesize)
     {
-        // Calculate remaining bytes to receive
-        size_t to_receive = (metadata.filesize - received_size > CHUNK_SIZE) ? CHUNK_SIZE : (size_t)(metadata.filesize - received_size);
-
-        // Receive chunk
-        bytes_read = recv(conn_fd, buffer, to_receive, 0);
+        // Receive chunk (decoded if compressed), never past the end of a checksum block
+        long long want = metadata.filesize - received_size;
+        if (checksum && want > (long long)(CRC_BLOCK_SIZE - block_fill))
+        {
+            want = CRC_BLOCK_SIZE - block_fill;
+        }
+        data = buffer;
+        tcp_tune_update(&tune);
+        if (uring_active)
+        {
+            bytes_read = uring_receiver_recv(&uring, want, &data);
+        }
+        else if (mmap_active)
+        {
+            bytes_read = mmap_receiver_recv(&mapped, conn_fd, received_size, want, &data);
+        }
+        else if (direct_active)
+        {
+            bytes_read = direct_receiver_recv(&direct, conn_fd, want, &data);
+        }
+        else
+        {
+            bytes_read = receive_body(conn_fd, codec, buffer, buffer_size, frame, want);
+        }
 
         if (bytes_read < 0)
         {
-            perror("[Server] Error during file reception");
-            // Attempt to clean up partial file
-            close(fd);
-            unlink(output_path);
-            close(conn_fd);
-            return;
+            log_msg("[Server] Error during file reception: %s\n", strerror(errno));
+            break;
         }
         if (bytes_read == 0)
         {
@@ -125,50 +2098,177 @@ void handle_client(int conn_fd, struct sockaddr_in *client_addr)
             break;
         }
 
-        // Write chunk to file
-        if (write(fd, buffer, bytes_read) < 0)
+        // Write chunk to file (io_uring: queued, submitted with the next receive;
+        // mmap: already in place; O_DIRECT: written once its buffer is full)
+        if (uring_active)
         {
-            perror("[Server] Error writing to file");
-            close(fd);
-            unlink(output_path);
-            close(conn_fd);
-            return;
+            uring_receiver_write(&uring, bytes_read, received_size);
+        }
+        else if (!mmap_active && !direct_active && write(fd, buffer, bytes_read) != bytes_read)
+        {
+            log_msg("[Server] Error writing to file: %s\n", strerror(errno));
+            write_failed = 1;
+            break;
         }
 
         received_size += bytes_read;
+        file_crc = crc32c_update(file_crc, data, bytes_read);
+
+        if (checksum)
+        {
+            uint32_t expected;
+            block_crc = crc32c_update(block_crc, data, bytes_read);
+            block_fill += bytes_read;
+            if (block_fill < CRC_BLOCK_SIZE && received_size < metadata.filesize)
+            {
+                continue;
+            }
+            if (recv_all(conn_fd, &expected, sizeof(expected)) <= 0)
+            {
+                break;
+            }
+            if (expected != block_crc)
+            {
+                log_msg("[Server] Checksum mismatch in block ending at %lld of '%s'.\n", received_size, metadata.filename);
+                corrupt = 1;
+                break;
+            }
+            block_crc = 0;
+            block_fill = 0;
+        }
+        verified_size = received_size;
+        verified_crc = file_crc;
+
+        // Periodically make progress durable so a resume never starts from zero
+        if (verified_size >= next_commit)
+        {
+            if ((uring_active && uring_receiver_drain(&uring) < 0) ||
+                (direct_active && direct_receiver_sync(&direct) < 0))
+            {
+                break; // Reported below
+            }
+            journal_commit(fd, journal_fd, metadata.filesize, verified_size, verified_crc);
+            next_commit = verified_size + JOURNAL_INTERVAL;
+        }
     }
 
-    // Clean up resources
-    close(fd);
+    // Publish what the path looked like: a limited buffer means -m is holding it back
+    tune.next_ns = 0;
+    tcp_tune_update(&tune);
+    if (tune.rtt_us > 0)
+    {
+        metrics_record(H_RTT, tune.rtt_us);
+    }
+    if (tune.buf_capped)
+    {
+        metrics_inc(M_BUF_LIMITED);
+    }
+    char tune_line[160];
+    tcp_tune_format(&tune, tune_line, sizeof(tune_line));
+    log_msg("[Server] Transport: %s\n", tune_line);
+
+    // Queued writes must land before anything is published or journaled
+    if (uring_active)
+    {
+        if (uring_receiver_drain(&uring) < 0)
+        {
+            log_msg("[Server] Error writing to file (io_uring).\n");
+            write_failed = 1;
+        }
+        log_msg("[Server] io_uring: %lld submit/wait calls for %lld bytes.\n", uring.ring.enters,
+                received_size - resume_offset);
+        uring_exit(&uring.ring);
+    }
+    if (mmap_active)
+    {
+        mmap_receiver_close(&mapped);
+    }
+    if (direct_active)
+    {
+        if (direct_receiver_close(&direct, received_size) < 0)
+        {
+            log_msg("[Server] Error writing to file (O_DIRECT).\n");
+            write_failed = 1;
+        }
+        log_msg("[Server] O_DIRECT: %lld writes of up to %zu bytes for %lld bytes%s.\n", direct.written,
+                buffer_size, received_size - resume_offset, direct.ring_active ? " (io_uring)" : "");
+    }
+
+    // The whole-file CRC32C also covers bytes kept from earlier attempts
+    int complete = !write_failed && verified_size == metadata.filesize;
+    if (mmap_active && !complete)
+    {
+        ftruncate(fd, received_size); // Drop the preallocated tail nothing was received into
+    }
+    if (checksum && complete)
+    {
+        uint32_t expected;
+        if (recv_all(conn_fd, &expected, sizeof(expected)) <= 0)
+        {
+            complete = 0; // Everything stays committed; a resume only resends the trailer
+        }
+        else if (expected != file_crc)
+        {
+            log_msg("[Server] Whole-file checksum mismatch for '%s' (client %08x, server %08x); discarding upload.\n",
+                    metadata.filename, expected, file_crc);
+            corrupt = 2;
+        }
+    }
+
+    buf_put(buffer, buffer_alloc);
+    buf_put(frame, LZ_BLOCK_SIZE);
 
-    // 4. Send final RPC response (UploadStatus)
+    // 6. Send final RPC response (UploadStatus)
     int response_code;
-    if (received_size == metadata.filesize)
+    if (corrupt == 2)
+    {
+        // The stored prefix does not match the client's file: start over from byte zero
+        unlink(part_path);
+        unlink(journal_path);
+        response_code = STATUS_CORRUPT;
+    }
+    else if (complete)
     {
-        response_code = 201; // Created
-        printf("[Server] Successfully received %lld bytes for '%s'. Transfer Complete.\n",
-               received_size, metadata.filename);
+        // Publish the finished file, then drop the journal (still holding its lock)
+        if (rename(part_path, output_path) == 0)
+        {
+            unlink(journal_path);
+            response_code = 201; // Created
+            log_msg("[Server] Successfully received %lld bytes for '%s'. Transfer Complete.\n",
+                    received_size, metadata.filename);
+        }
+        else
+        {
+            log_msg("[Server] Failed to publish received file: %s\n", strerror(errno));
+            response_code = 500;
+        }
     }
     else
     {
-        response_code = 500; // Internal Error
-        printf("[Server] Transfer failed. Expected %lld, received %lld.\n",
-               metadata.filesize, received_size);
-        // Clean up partial file on failure
-        unlink(output_path);
+        response_code = corrupt == 1 ? STATUS_CORRUPT : 500; // Internal Error
+        if (corrupt != 1)
+        {
+            metrics_inc(write_failed ? M_ERR_WRITE : M_ERR_RECV);
+        }
+        log_msg("[Server] Transfer failed. Expected %lld, received %lld (%lld verified).\n",
+                metadata.filesize, received_size, verified_size);
+        // Keep the partial file: commit what arrived intact so the client can resume
+        if (!write_failed)
+        {
+            journal_commit(fd, journal_fd, metadata.filesize, verified_size, verified_crc);
+        }
     }
 
-    send(conn_fd, &response_code, sizeof(response_code), 0);
-
-    close(conn_fd);
-    printf("[Server] Connection closed.\n");
+    close(fd);
+    close(journal_fd); // Releases the upload lock
+    finish_client(conn_fd, response_code);
 }
 
-void start_server()
+// Creates, binds and listens on the server socket (optionally with SO_REUSEPORT)
+int create_listen_socket(int reuseport)
 {
-    int listen_fd = 0, conn_fd = 0;
-    struct sockaddr_in serv_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    int listen_fd;
+    struct sockaddr_in serv_addr;
 
     // 1. Create socket file descriptor
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -179,13 +2279,18 @@ void start_server()
 
     // Set socket options (optional, allows reuse of address immediately after closure)
     int opt = 1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0))
     {
         perror("[Server] setsockopt failed");
         close(listen_fd);
         exit(EXIT_FAILURE);
     }
 
+    // Cap the kernel receive buffer; accepted sockets inherit it
+    int rcvbuf = conn_mem_cap / 2;
+    setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -200,35 +2305,166 @@ void start_server()
     }
 
     // 3. Listen for incoming connections
-    if (listen(listen_fd, 10) < 0)
+    if (listen(listen_fd, LISTEN_BACKLOG) < 0)
     {
         perror("[Server] listen failed");
         close(listen_fd);
         exit(EXIT_FAILURE);
     }
 
-    printf("[Server] Listening on port %d...\n", PORT);
+    return listen_fd;
+}
+
+// Worker thread: accepts on its listening socket and serves one upload at a time.
+// With a shared socket the kernel hands each connection to an idle worker.
+void *worker_main(void *arg)
+{
+    int listen_fd = (int)(long)arg;
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
 
     while (1)
     {
         // 4. Accept connection
-        conn_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
+        client_len = sizeof(client_addr);
+        int conn_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
         if (conn_fd < 0)
         {
-            perror("[Server] accept failed");
+            log_msg("[Server] accept failed: %s\n", strerror(errno));
+            metrics_inc(M_ERR_ACCEPT);
             continue;
         }
 
         // 5. Handle the client request
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        metrics_inc(M_CONNECTIONS);
+        metrics_inc(M_ACTIVE);
         handle_client(conn_fd, &client_addr);
+        metrics_dec(M_ACTIVE);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        metrics_record(H_CONNECTION, (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+
+    return NULL;
+}
+
+void start_server()
+{
+    int listen_fd = -1;
+
+    if (num_workers < 1)
+    {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (!use_reuseport)
+    {
+        listen_fd = create_listen_socket(0);
+    }
+
+    printf("[Server] Listening on port %d with %ld workers (%s, %zu bytes per connection)...\n",
+           PORT, num_workers, use_reuseport ? "SO_REUSEPORT" : "shared accept", conn_mem_cap);
+    metrics_define(server_counters, sizeof(server_counters) / sizeof(server_counters[0]), server_histograms,
+                   sizeof(server_histograms) / sizeof(server_histograms[0]), server_metrics_extra);
+    if (stats_port > 0)
+    {
+        if (metrics_serve(stats_port) == 0)
+        {
+            printf("[Server] Metrics on http://127.0.0.1:%d/metrics\n", stats_port);
+        }
+        else
+        {
+            perror("[Server] Cannot open the stats port");
+        }
+    }
+    fflush(stdout);
+
+    pthread_t *workers = calloc(num_workers, sizeof(pthread_t));
+    if (workers == NULL)
+    {
+        perror("[Server] Failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < num_workers; i++)
+    {
+        int fd = use_reuseport ? create_listen_socket(1) : listen_fd;
+        if (pthread_create(&workers[i], NULL, worker_main, (void *)(long)fd) != 0)
+        {
+            perror("[Server] Failed to start worker");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // This part is unreachable in the current infinite loop structure
-    close(listen_fd);
+    // Workers never return in the current infinite loop structure
+    for (long i = 0; i < num_workers; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    int ch;
+
+    while ((ch = getopt(argc, argv, "w:m:ruMDS:L:H")) != -1)
+    {
+        switch (ch)
+        {
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'M':
+            use_mmap = 1;
+            break;
+        case 'D':
+            use_direct = 1;
+            break;
+        case 'w':
+            num_workers = atol(optarg);
+            break;
+        case 'm':
+            conn_mem_cap = strtoull(optarg, NULL, 10);
+            if (conn_mem_cap < 2 * CHUNK_SIZE)
+            {
+                conn_mem_cap = 2 * CHUNK_SIZE;
+            }
+            break;
+        case 'r':
+            use_reuseport = 1;
+            break;
+        case 'S':
+            stats_port = atoi(optarg);
+            break;
+        case 'L':
+            log_set_rate(atof(optarg));
+            break;
+        case 'H':
+            buf_pool_hugepages(1);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w workers] [-m conn_mem_bytes] [-r] [-u | -M | -D] [-S stats_port] [-L lines_per_sec] [-H]\n",
+                    argv[0]);
+            fprintf(stderr, "  -w  upload worker threads (default: one per online CPU)\n");
+            fprintf(stderr, "  -m  per-connection memory cap in bytes (default: %d)\n", DEFAULT_CONN_MEM);
+            fprintf(stderr, "      (also bounds dedup chunk lists: about 1000 chunks, ~16 MB of file, per 64 KB)\n");
+            fprintf(stderr, "  -r  give each worker its own SO_REUSEPORT listener\n");
+            fprintf(stderr, "  -u  receive plain bodies through io_uring (falls back to recv/write)\n");
+            fprintf(stderr, "  -M  receive plain bodies straight into an mmap of the file (windowed, preallocated)\n");
+            fprintf(stderr, "  -D  write plain bodies with O_DIRECT, queued on io_uring, bypassing the page cache\n");
+            fprintf(stderr, "      (needs a filesystem with direct I/O; raise -m for larger writes)\n");
+            fprintf(stderr, "  -S  local port serving Prometheus metrics over HTTP; 0 disables it (default: %d)\n",
+                    STATS_PORT);
+            fprintf(stderr, "  -L  connection log lines per second before lines are dropped; 0 = no limit (default: %d)\n",
+                    LOG_DEFAULT_RATE);
+            fprintf(stderr, "  -H  carve receive buffers out of reserved 2 MB hugepages (vm.nr_hugepages)\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A client vanishing mid-reply must not terminate the whole server
+    signal(SIGPIPE, SIG_IGN);
+
     start_server();
     return 0;
-}
\ No newline at end of file
+}
@@ -3,13 +3,28 @@
 #include <string.h>
 #include <mpi.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <stdint.h>
+#include "../common/crc32c.h"
 
-#define CHUNK_SIZE 4096
+#define CHUNK_SIZE 4096             // Lock-step bytes per data message, override with the second argument
+#define PIPELINE_BUFFER (4 << 20)   // Pipelined default bytes per buffer (1-64 MB all work well)
+#define PIPELINE_DEPTH 4            // Pipelined buffers in flight per rank, override with -d
+#define MMAP_WINDOW (64LL << 20)    // Bytes of the file mapped at once with -m (at least depth buffers)
+#define BENCH_ROUNDS 3              // Transfers per configuration with -B
 #define FILENAME_MAX_LEN 256
 #define SERVER_RANK 0
 #define CLIENT_RANK 1
+#define ROOT_RANK 0 // Source of -D distributions
+
+// Message tags
+#define TAG_META 0
+#define TAG_ACK 1
+#define TAG_DATA 2
+#define TAG_STATUS 3
 
 typedef struct
 {
@@ -18,6 +33,21 @@ typedef struct
     long long filesize;
 } Metadata;
 
+// How the body moves. depth 0 is the lock-step loop (blocking send, then
+// read the next chunk); otherwise a ring of 'depth' buffers of 'chunk_size'
+// bytes is driven with MPI_Isend/MPI_Irecv, so file I/O on each rank
+// overlaps the messages still in flight. 'mapped' replaces the ring with
+// slices of a memory-mapped window of the file (see send_mapped). Both ranks
+// parse the same arguments, so they always agree on the mode.
+typedef struct
+{
+    int chunk_size;
+    int depth;
+    int mapped;
+} TransferMode;
+
+static int quiet = 0; // Benchmark rounds print a summary table instead
+
 void create_metadata_type(MPI_Datatype *message_type_ptr)
 {
     int blocklengths[3] = {32, FILENAME_MAX_LEN, 1};
@@ -32,77 +62,1203 @@ void create_metadata_type(MPI_Datatype *message_type_ptr)
     MPI_Type_commit(message_type_ptr);
 }
 
-void run_server(MPI_Datatype meta_type)
+// Ring of transfer buffers; aborts the job if they cannot be allocated,
+// since the peer would otherwise wait forever
+static char **alloc_buffers(const TransferMode *mode, MPI_Request **requests)
+{
+    char **buffers = calloc(mode->depth, sizeof(char *));
+    int ok = buffers != NULL && (*requests = malloc(mode->depth * sizeof(MPI_Request))) != NULL;
+
+    for (int i = 0; ok && i < mode->depth; i++)
+    {
+        (*requests)[i] = MPI_REQUEST_NULL;
+        ok = (buffers[i] = malloc(mode->chunk_size)) != NULL;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Cannot allocate %d buffers of %d bytes\n", mode->depth, mode->chunk_size);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return buffers;
+}
+
+static void free_buffers(char **buffers, MPI_Request *requests, int depth)
+{
+    for (int i = 0; i < depth; i++)
+    {
+        free(buffers[i]);
+    }
+    free(buffers);
+    free(requests);
+}
+
+// Keeps 'depth' receives posted; each completed buffer is written at its
+// file offset while the others fill. Messages from one sender on one tag
+// match receives in posting order, so the k-th receive always holds bytes
+// [k * chunk_size, ...) even when completions arrive out of order. An empty
+// message means the file ended early; the receives it leaves unmatched are
+// cancelled so they cannot swallow the next transfer.
+// Returns the bytes received, or -1 if a write failed.
+static long long receive_pipelined(int fd, long long filesize, const TransferMode *mode)
+{
+    MPI_Request *requests;
+    char **buffers = alloc_buffers(mode, &requests);
+    long long *offsets = malloc(mode->depth * sizeof(long long));
+    long long messages = (filesize + mode->chunk_size - 1) / mode->chunk_size, posted = 0, received = 0;
+    int active = 0, write_failed = 0;
+
+    for (int i = 0; i < mode->depth && posted < messages; i++, posted++, active++)
+    {
+        offsets[i] = posted * mode->chunk_size;
+        MPI_Irecv(buffers[i], mode->chunk_size, MPI_CHAR, CLIENT_RANK, TAG_DATA, MPI_COMM_WORLD, &requests[i]);
+    }
+    while (active > 0)
+    {
+        int index, count;
+        MPI_Status status;
+
+        MPI_Waitany(mode->depth, requests, &index, &status);
+        active--;
+        MPI_Test_cancelled(&status, &count);
+        if (count)
+        {
+            continue;
+        }
+        MPI_Get_count(&status, MPI_CHAR, &count);
+        if (count == 0)
+        {
+            posted = messages;
+            for (int i = 0; i < mode->depth; i++)
+            {
+                if (requests[i] != MPI_REQUEST_NULL)
+                {
+                    MPI_Cancel(&requests[i]); // Already matched ones still complete with data
+                }
+            }
+            continue;
+        }
+        if (pwrite(fd, buffers[index], count, offsets[index]) != count)
+        {
+            write_failed = 1; // Keep draining so the sender can finish
+        }
+        received += count;
+        if (posted < messages)
+        {
+            offsets[index] = posted++ * mode->chunk_size;
+            MPI_Irecv(buffers[index], mode->chunk_size, MPI_CHAR, CLIENT_RANK, TAG_DATA, MPI_COMM_WORLD,
+                      &requests[index]);
+            active++;
+        }
+    }
+    free(offsets);
+    free_buffers(buffers, requests, mode->depth);
+    return write_failed ? -1 : received;
+}
+
+// Reads the next buffer while up to depth - 1 earlier ones are still being
+// sent; a buffer is refilled only once MPI_Waitany hands it back
+static void send_pipelined(FILE *f, long long filesize, const TransferMode *mode)
+{
+    MPI_Request *requests;
+    char **buffers = alloc_buffers(mode, &requests);
+    long long remaining = filesize;
+    int unused = 0, active = 0, truncated = 0;
+
+    while (remaining > 0 || active > 0)
+    {
+        int index;
+        if (remaining > 0 && unused < mode->depth)
+        {
+            index = unused++;
+        }
+        else
+        {
+            MPI_Waitany(mode->depth, requests, &index, MPI_STATUS_IGNORE);
+            active--;
+            if (remaining == 0)
+            {
+                continue;
+            }
+        }
+
+        size_t want = remaining < mode->chunk_size ? (size_t)remaining : (size_t)mode->chunk_size;
+        size_t n = fread(buffers[index], 1, want, f);
+        if (n == 0)
+        {
+            remaining = 0;
+            truncated = 1;
+            continue;
+        }
+        MPI_Isend(buffers[index], (int)n, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD, &requests[index]);
+        remaining -= n;
+        active++;
+    }
+    if (truncated)
+    {
+        MPI_Send(NULL, 0, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD); // File shrank since stat()
+    }
+    free_buffers(buffers, requests, mode->depth);
+}
+
+// Bytes mapped at once by the -m paths: whole buffers, and enough of them
+// to keep 'depth' messages in flight
+static long long mapped_window(const TransferMode *mode)
+{
+    long long window = MMAP_WINDOW / mode->chunk_size * mode->chunk_size;
+    long long ring = (long long)mode->depth * mode->chunk_size;
+    return window > ring ? window : ring;
+}
+
+// Maps [win, end) of the file, from the page boundary at or below 'win';
+// returns NULL if it cannot. '*span' receives the mapped length.
+static char *map_window(int fd, long long win, long long end, int prot, size_t *span)
+{
+    long long start = win & ~((long long)sysconf(_SC_PAGESIZE) - 1);
+    char *map;
+
+    *span = (size_t)(end - start);
+    map = mmap(NULL, *span, prot, MAP_SHARED, fd, start);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(map, *span, MADV_SEQUENTIAL);
+    return map + (win - start);
+}
+
+static void unmap_window(char *base, long long win, size_t span)
+{
+    munmap(base - (win & ((long long)sysconf(_SC_PAGESIZE) - 1)), span);
+}
+
+// -m receive: the output is preallocated to its final size, then one window
+// of it at a time is mapped and 'depth' MPI_Irecvs land straight in the
+// mapping (the page cache), with no staging buffer and no write(). A window
+// is unmapped only after every receive into it has completed, so resident
+// memory stays at one window however large the file. The messages are the
+// same as in the pipelined mode, including an empty one if the file ended
+// early. If the file cannot be allocated or mapped, the window is received
+// through one buffer and pwrite() instead.
+// Returns the bytes received, or -1 if a write failed.
+static long long receive_mapped(int fd, long long filesize, const TransferMode *mode)
+{
+    MPI_Request *requests = malloc(mode->depth * sizeof(MPI_Request));
+    for (int i = 0; i < mode->depth; i++)
+    {
+        requests[i] = MPI_REQUEST_NULL;
+    }
+    long long window = mapped_window(mode), received = 0;
+    int can_map = filesize == 0 || posix_fallocate(fd, 0, filesize) == 0;
+    int ended = 0, write_failed = 0;
+    char *bounce = NULL;
+
+    for (long long win = 0; win < filesize && !ended; win += window)
+    {
+        long long end = win + window < filesize ? win + window : filesize;
+        size_t span;
+        char *base = can_map ? map_window(fd, win, end, PROT_READ | PROT_WRITE, &span) : NULL;
+
+        if (base == NULL)
+        {
+            if (bounce == NULL && (bounce = malloc(mode->chunk_size)) == NULL)
+            {
+                fprintf(stderr, "Cannot allocate a %d-byte buffer\n", mode->chunk_size);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            for (long long pos = win; pos < end && !ended; pos += mode->chunk_size)
+            {
+                MPI_Status status;
+                int count;
+                MPI_Recv(bounce, mode->chunk_size, MPI_CHAR, CLIENT_RANK, TAG_DATA, MPI_COMM_WORLD, &status);
+                MPI_Get_count(&status, MPI_CHAR, &count);
+                ended = count == 0;
+                if (count > 0 && pwrite(fd, bounce, count, pos) != count)
+                {
+                    write_failed = 1;
+                }
+                received += count;
+            }
+            continue;
+        }
+
+        long long pos = win;
+        int unused = 0, active = 0;
+        while ((pos < end && !ended) || active > 0)
+        {
+            int index, count;
+            MPI_Status status;
+
+            if (pos < end && !ended && unused < mode->depth)
+            {
+                index = unused++;
+            }
+            else
+            {
+                MPI_Waitany(mode->depth, requests, &index, &status);
+                active--;
+                MPI_Test_cancelled(&status, &count);
+                if (count)
+                {
+                    continue;
+                }
+                MPI_Get_count(&status, MPI_CHAR, &count);
+                if (count == 0)
+                {
+                    ended = 1;
+                    for (int i = 0; i < mode->depth; i++)
+                    {
+                        if (requests[i] != MPI_REQUEST_NULL)
+                        {
+                            MPI_Cancel(&requests[i]);
+                        }
+                    }
+                    continue;
+                }
+                received += count;
+                if (pos >= end || ended)
+                {
+                    continue;
+                }
+            }
+            int len = end - pos < mode->chunk_size ? (int)(end - pos) : mode->chunk_size;
+            MPI_Irecv(base + (pos - win), len, MPI_CHAR, CLIENT_RANK, TAG_DATA, MPI_COMM_WORLD, &requests[index]);
+            pos += len;
+            active++;
+        }
+        unmap_window(base, win, span);
+    }
+    if (received < filesize && ftruncate(fd, received) < 0)
+    {
+        write_failed = 1; // Drop the preallocated tail of a short transfer
+    }
+    free(bounce);
+    free(requests);
+    return write_failed ? -1 : received;
+}
+
+// -m send: 'depth' MPI_Isends go out straight from a read-only mapping of
+// the current window, so the file is never copied into a user buffer (the
+// transport reads the page cache directly). The window is unmapped once all
+// of its sends completed. A window that cannot be mapped, or that the file
+// no longer covers (touching it would raise SIGBUS), is sent with pread()
+// instead; a short read ends the stream with an empty message as usual.
+static void send_mapped(int fd, long long filesize, const TransferMode *mode)
+{
+    MPI_Request *requests = malloc(mode->depth * sizeof(MPI_Request));
+    for (int i = 0; i < mode->depth; i++)
+    {
+        requests[i] = MPI_REQUEST_NULL;
+    }
+    long long window = mapped_window(mode);
+    int truncated = 0;
+    char *bounce = NULL;
+
+    for (long long win = 0; win < filesize && !truncated; win += window)
+    {
+        long long end = win + window < filesize ? win + window : filesize;
+        struct stat st;
+        size_t span;
+        char *base = fstat(fd, &st) == 0 && st.st_size >= end ? map_window(fd, win, end, PROT_READ, &span) : NULL;
+
+        if (base == NULL)
+        {
+            if (bounce == NULL && (bounce = malloc(mode->chunk_size)) == NULL)
+            {
+                fprintf(stderr, "Cannot allocate a %d-byte buffer\n", mode->chunk_size);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            for (long long pos = win; pos < end && !truncated; pos += mode->chunk_size)
+            {
+                int len = end - pos < mode->chunk_size ? (int)(end - pos) : mode->chunk_size;
+                ssize_t n = pread(fd, bounce, len, pos);
+                if (n > 0)
+                {
+                    MPI_Send(bounce, (int)n, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD);
+                }
+                truncated = n < len;
+            }
+            continue;
+        }
+
+        long long pos = win;
+        int unused = 0, active = 0;
+        while (pos < end || active > 0)
+        {
+            int index;
+            if (pos < end && unused < mode->depth)
+            {
+                index = unused++;
+            }
+            else
+            {
+                MPI_Waitany(mode->depth, requests, &index, MPI_STATUS_IGNORE);
+                active--;
+                if (pos >= end)
+                {
+                    continue;
+                }
+            }
+            int len = end - pos < mode->chunk_size ? (int)(end - pos) : mode->chunk_size;
+            MPI_Isend(base + (pos - win), len, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD, &requests[index]);
+            pos += len;
+            active++;
+        }
+        unmap_window(base, win, span);
+    }
+    if (truncated)
+    {
+        MPI_Send(NULL, 0, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD); // File shrank since stat()
+    }
+    free(bounce);
+    free(requests);
+}
+
+void run_server(MPI_Datatype meta_type, const TransferMode *mode)
 {
     Metadata meta;
     MPI_Status status;
 
     // 1. Receive metadata
-    MPI_Recv(&meta, 1, meta_type, CLIENT_RANK, 0, MPI_COMM_WORLD, &status);
-    printf("[Server] Receiving file: %s (%lld bytes)\n", meta.filename, meta.filesize);
+    MPI_Recv(&meta, 1, meta_type, CLIENT_RANK, TAG_META, MPI_COMM_WORLD, &status);
+    if (!quiet)
+    {
+        printf("[Server] Receiving file: %s (%lld bytes)\n", meta.filename, meta.filesize);
+    }
 
-    // 2. Send ACK (200 OK)
-    int ack = 200;
-    MPI_Send(&ack, 1, MPI_INT, CLIENT_RANK, 1, MPI_COMM_WORLD);
+    // 2. Send ACK (200 OK); a client that could not read its file sends a
+    //    negative size and gets 400 twice (ACK and final status)
+    int ack = meta.filesize < 0 ? 400 : 200;
+    MPI_Send(&ack, 1, MPI_INT, CLIENT_RANK, TAG_ACK, MPI_COMM_WORLD);
+    if (ack != 200)
+    {
+        MPI_Send(&ack, 1, MPI_INT, CLIENT_RANK, TAG_STATUS, MPI_COMM_WORLD);
+        return;
+    }
 
     // 3. Receive file stream
-    FILE *f = fopen("received_output.bin", "wb");
-    char buffer[CHUNK_SIZE];
     long long total_received = 0;
-
-    while (total_received < meta.filesize)
+    if (mode->depth > 0)
     {
-        int count;
-        MPI_Recv(buffer, CHUNK_SIZE, MPI_CHAR, CLIENT_RANK, 2, MPI_COMM_WORLD, &status);
-        MPI_Get_count(&status, MPI_CHAR, &count);
-        fwrite(buffer, 1, count, f);
-        total_received += count;
+        int fd = open("received_output.bin", (mode->mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        if (mode->mapped)
+        {
+            total_received = receive_mapped(fd, meta.filesize, mode);
+        }
+        else
+        {
+            total_received = receive_pipelined(fd, meta.filesize, mode);
+        }
+        if (fd < 0 || close(fd) < 0)
+        {
+            total_received = -1;
+        }
+    }
+    else
+    {
+        FILE *f = fopen("received_output.bin", "wb");
+        char *buffer = malloc(mode->chunk_size);
+
+        while (total_received < meta.filesize)
+        {
+            int count;
+            MPI_Recv(buffer, mode->chunk_size, MPI_CHAR, CLIENT_RANK, TAG_DATA, MPI_COMM_WORLD, &status);
+            MPI_Get_count(&status, MPI_CHAR, &count);
+            if (count == 0)
+            {
+                break; // The sender ran out of file early
+            }
+            fwrite(buffer, 1, count, f);
+            total_received += count;
+        }
+        fclose(f);
+        free(buffer);
     }
-    fclose(f);
 
     // 4. Final status
     int final_status = (total_received == meta.filesize) ? 201 : 500;
-    MPI_Send(&final_status, 1, MPI_INT, CLIENT_RANK, 3, MPI_COMM_WORLD);
-    printf("[Server] Transfer complete. Status: %d\n", final_status);
+    MPI_Send(&final_status, 1, MPI_INT, CLIENT_RANK, TAG_STATUS, MPI_COMM_WORLD);
+    if (!quiet)
+    {
+        printf("[Server] Transfer complete. Status: %d\n", final_status);
+    }
 }
 
-void run_client(MPI_Datatype meta_type, const char *filepath)
+// Returns the transfer time in seconds, or -1 if the upload failed
+double run_client(MPI_Datatype meta_type, const char *filepath, const TransferMode *mode)
 {
     struct stat st;
+    Metadata meta;
+
+    // 1. Send metadata (size -1 if the file cannot be read: the server still
+    //    answers, so it is never left waiting for this client)
+    strncpy(meta.method, "UploadFile", 32);
+    strncpy(meta.filename, filepath, FILENAME_MAX_LEN);
+    meta.filesize = -1;
     if (stat(filepath, &st) != 0)
     {
         perror("File error");
-        return;
     }
-
-    // 1. Send metadata
-    Metadata meta;
-    strncpy(meta.method, "UploadFile", 32);
-    strncpy(meta.filename, filepath, FILENAME_MAX_LEN);
-    meta.filesize = st.st_size;
-    MPI_Send(&meta, 1, meta_type, SERVER_RANK, 0, MPI_COMM_WORLD);
+    else
+    {
+        meta.filesize = st.st_size;
+    }
+    double start = MPI_Wtime();
+    MPI_Send(&meta, 1, meta_type, SERVER_RANK, TAG_META, MPI_COMM_WORLD);
 
     // 2. Wait for ACK
     int ack;
-    MPI_Recv(&ack, 1, MPI_INT, SERVER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Recv(&ack, 1, MPI_INT, SERVER_RANK, TAG_ACK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
     if (ack == 200)
     {
         // 3. Send file data in chunks
         FILE *f = fopen(filepath, "rb");
-        char buffer[CHUNK_SIZE];
-        size_t n;
-        while ((n = fread(buffer, 1, CHUNK_SIZE, f)) > 0)
+        if (mode->mapped)
+        {
+            send_mapped(fileno(f), meta.filesize, mode);
+        }
+        else if (mode->depth > 0)
+        {
+            send_pipelined(f, meta.filesize, mode);
+        }
+        else
         {
-            MPI_Send(buffer, n, MPI_CHAR, SERVER_RANK, 2, MPI_COMM_WORLD);
+            char *buffer = malloc(mode->chunk_size);
+            long long sent = 0;
+            size_t n;
+            while (sent < meta.filesize && (n = fread(buffer, 1, mode->chunk_size, f)) > 0)
+            {
+                MPI_Send(buffer, n, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD);
+                sent += n;
+            }
+            if (sent < meta.filesize)
+            {
+                MPI_Send(NULL, 0, MPI_CHAR, SERVER_RANK, TAG_DATA, MPI_COMM_WORLD); // File shrank since stat()
+            }
+            free(buffer);
         }
         fclose(f);
     }
 
     // 4. Receive final status
     int final_status;
-    MPI_Recv(&final_status, 1, MPI_INT, SERVER_RANK, 3, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    printf("[Client] Upload status: %d\n", final_status);
+    MPI_Recv(&final_status, 1, MPI_INT, SERVER_RANK, TAG_STATUS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    double seconds = MPI_Wtime() - start;
+    if (!quiet)
+    {
+        printf("[Client] Upload status: %d\n", final_status);
+    }
+    if (!quiet && meta.filesize >= 0)
+    {
+        printf("[Client] Sent %lld bytes in %.6f seconds (%.2f MB/s, ", meta.filesize, seconds,
+               seconds > 0 ? meta.filesize / seconds / 1e6 : 0.0);
+        if (mode->mapped)
+        {
+            printf("mmap: %d x %d-byte slices of %lld-byte windows).\n", mode->depth, mode->chunk_size,
+                   mapped_window(mode));
+        }
+        else if (mode->depth > 0)
+        {
+            printf("pipelined: %d x %d-byte buffers).\n", mode->depth, mode->chunk_size);
+        }
+        else
+        {
+            printf("%d-byte chunks).\n", mode->chunk_size);
+        }
+    }
+    return final_status == 201 ? seconds : -1;
+}
+
+// Lock-step loop vs. the pipeline at 1-64 MB buffers and the mmap path, on the same file
+void run_benchmark(MPI_Datatype meta_type, int rank, const char *filepath, int depth)
+{
+    TransferMode modes[] = {{CHUNK_SIZE, 0, 0}, {1 << 20, depth, 0}, {4 << 20, depth, 0}, {16 << 20, depth, 0},
+                            {64 << 20, depth, 0}, {1 << 20, depth, 1}, {4 << 20, depth, 1}};
+    int count = sizeof(modes) / sizeof(modes[0]);
+    double baseline = 0;
+    struct stat st;
+
+    quiet = 1;
+    if (rank == CLIENT_RANK)
+    {
+        stat(filepath, &st);
+        printf("[Bench] %s: %lld bytes, %d rounds per mode (best time counts)\n", filepath, (long long)st.st_size,
+               BENCH_ROUNDS);
+        printf("[Bench] %-10s %12s %6s %10s %8s\n", "mode", "buffer", "depth", "MB/s", "speedup");
+    }
+    for (int m = 0; m < count; m++)
+    {
+        double best = -1;
+        for (int round = 0; round < BENCH_ROUNDS; round++)
+        {
+            if (rank == SERVER_RANK)
+            {
+                run_server(meta_type, &modes[m]);
+            }
+            else if (rank == CLIENT_RANK)
+            {
+                double seconds = run_client(meta_type, filepath, &modes[m]);
+                if (seconds >= 0 && (best < 0 || seconds < best))
+                {
+                    best = seconds;
+                }
+            }
+        }
+        if (rank == CLIENT_RANK)
+        {
+            double rate = best > 0 ? st.st_size / best / 1e6 : 0;
+            if (m == 0)
+            {
+                baseline = rate;
+            }
+            printf("[Bench] %-10s %12d %6d %10.1f %7.2fx\n", modes[m].mapped ? "mmap" : modes[m].depth > 0 ? "pipelined" : "lock-step",
+                   modes[m].chunk_size, modes[m].depth, rate, baseline > 0 ? rate / baseline : 0);
+            fflush(stdout);
+        }
+    }
+}
+
+// Sends one file from ROOT_RANK to every rank of 'comm' with chunked
+// MPI_Ibcast, 'depth' chunks in flight: while chunk k is being written on
+// the leaves, chunk k+1 is already moving down the broadcast tree, so the
+// total time is about (chunks + tree depth) chunk steps, i.e. it grows
+// with log P rather than with the number of receivers. Every other rank
+// writes its own copy and checks it against the root's CRC32C.
+// Returns the elapsed seconds on the root (0 elsewhere), or -1 on failure.
+double run_distribute(MPI_Datatype meta_type, MPI_Comm comm, const char *filepath, const TransferMode *mode)
+{
+    Metadata meta = {"Distribute", "", -1};
+    FILE *in = NULL;
+    int rank, ranks, out = -1, failed = 0;
+    char out_path[64];
+    struct stat st;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &ranks);
+    if (rank == ROOT_RANK && stat(filepath, &st) == 0 && (in = fopen(filepath, "rb")) != NULL)
+    {
+        strncpy(meta.filename, filepath, FILENAME_MAX_LEN - 1);
+        meta.filesize = st.st_size;
+    }
+    MPI_Bcast(&meta, 1, meta_type, ROOT_RANK, comm);
+    if (meta.filesize < 0)
+    {
+        if (rank == ROOT_RANK)
+        {
+            perror("File error");
+        }
+        return -1;
+    }
+    if (rank != ROOT_RANK)
+    {
+        int world_rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+        snprintf(out_path, sizeof(out_path), "received_copy_%d.bin", world_rank);
+        if ((out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        {
+            failed = 1; // Still takes part in every broadcast
+        }
+    }
+
+    MPI_Request *requests;
+    char **buffers = alloc_buffers(mode, &requests);
+    long long chunks = (meta.filesize + mode->chunk_size - 1) / mode->chunk_size;
+    uint32_t crc = 0;
+
+    MPI_Barrier(comm);
+    double start = MPI_Wtime();
+    for (long long k = 0; k < chunks + mode->depth; k++)
+    {
+        int slot = k % mode->depth;
+        long long done = k - mode->depth; // Chunk whose buffer 'slot' is needed back
+
+        if (done >= 0 && done < chunks)
+        {
+            long long offset = done * mode->chunk_size;
+            int len = meta.filesize - offset < mode->chunk_size ? (int)(meta.filesize - offset) : mode->chunk_size;
+            MPI_Wait(&requests[slot], MPI_STATUS_IGNORE);
+            crc = crc32c_update(crc, buffers[slot], len);
+            if (out >= 0 && pwrite(out, buffers[slot], len, offset) != len)
+            {
+                failed = 1;
+            }
+        }
+        if (k < chunks)
+        {
+            long long offset = k * mode->chunk_size;
+            int len = meta.filesize - offset < mode->chunk_size ? (int)(meta.filesize - offset) : mode->chunk_size;
+            if (rank == ROOT_RANK && fread(buffers[slot], 1, len, in) != (size_t)len)
+            {
+                failed = 1; // The broadcast still runs; the root's failure is shared below
+            }
+            MPI_Ibcast(buffers[slot], len, MPI_CHAR, ROOT_RANK, comm, &requests[slot]);
+        }
+    }
+    free_buffers(buffers, requests, mode->depth);
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+    if (out >= 0 && close(out) < 0)
+    {
+        failed = 1;
+    }
+
+    // The root's CRC and status decide whether each copy is good
+    uint32_t root_crc = crc;
+    int root_failed = failed, bad, bad_total;
+    MPI_Bcast(&root_crc, 1, MPI_UINT32_T, ROOT_RANK, comm);
+    MPI_Bcast(&root_failed, 1, MPI_INT, ROOT_RANK, comm);
+    bad = rank != ROOT_RANK && (failed || root_failed || crc != root_crc);
+    if (bad && !quiet)
+    {
+        printf("[Rank %d] Copy %s failed verification.\n", rank, out_path);
+    }
+    MPI_Reduce(&bad, &bad_total, 1, MPI_INT, MPI_SUM, ROOT_RANK, comm);
+    double seconds = MPI_Wtime() - start; // The reduction waits for the slowest rank
+
+    if (rank != ROOT_RANK)
+    {
+        return bad ? -1 : 0;
+    }
+    if (!quiet)
+    {
+        printf("[Root] Distributed '%s' (%lld bytes) to %d ranks in %.6f seconds (%.2f MB/s per copy, "
+               "%.2f MB/s delivered).\n",
+               meta.filename, meta.filesize, ranks - 1, seconds, seconds > 0 ? meta.filesize / seconds / 1e6 : 0.0,
+               seconds > 0 ? meta.filesize * (double)(ranks - 1) / seconds / 1e6 : 0.0);
+        if (root_failed)
+        {
+            printf("[Root] Reading the source file failed.\n");
+        }
+        else if (bad_total > 0)
+        {
+            printf("[Root] %d of %d copies failed verification.\n", bad_total, ranks - 1);
+        }
+        else
+        {
+            printf("[Root] All %d copies verified (CRC32C %08x).\n", ranks - 1, root_crc);
+        }
+    }
+    return root_failed || bad_total > 0 ? -1 : seconds;
+}
+
+// --- Many-to-one ingest (-I) ---
+
+// Per-client state of the ingest server, indexed by source rank
+typedef struct
+{
+    Metadata meta;
+    int fd;
+    long long received;
+    long long posted;   // Data receives posted so far (message k holds bytes k * chunk_size...)
+    long long messages; // Data messages the whole file takes
+    int active;         // Receiving the body
+    int in_flight;      // Posted receives not yet served
+    double start;
+} Upload;
+
+// Receive slots: slot 0 takes new uploads from MPI_ANY_SOURCE, then 'depth'
+// slots per client rank for its body
+typedef struct
+{
+    char *buffer;
+    long long offset;
+    int ready;   // Completed, waiting for the scheduler
+    int count;
+} IngestSlot;
+
+static int ingest_slot(int source, int window, int i)
+{
+    return 1 + (source - 1) * window + i;
+}
+
+static void ingest_post(Upload *u, IngestSlot *slot, MPI_Request *request, int source, const TransferMode *mode)
+{
+    slot->offset = u->posted++ * mode->chunk_size;
+    slot->ready = 0;
+    MPI_Irecv(slot->buffer, mode->chunk_size, MPI_CHAR, source, TAG_DATA, MPI_COMM_WORLD, request);
+    u->in_flight++;
+}
+
+static void ingest_finish(Upload *u, int source, IngestSlot *slots, int window, int status_code)
+{
+    int final_status = status_code;
+
+    if (u->fd >= 0 && close(u->fd) < 0)
+    {
+        final_status = 500;
+    }
+    MPI_Send(&final_status, 1, MPI_INT, source, TAG_STATUS, MPI_COMM_WORLD);
+    for (int i = 0; i < window; i++)
+    {
+        free(slots[ingest_slot(source, window, i)].buffer);
+        slots[ingest_slot(source, window, i)].buffer = NULL;
+    }
+    u->active = 0;
+    if (!quiet)
+    {
+        printf("[Server] Rank %d: '%s' %lld bytes in %.6f seconds, status %d.\n", source, u->meta.filename,
+               u->received, MPI_Wtime() - u->start, final_status);
+    }
+}
+
+// Rank 0 takes uploads from every other rank at once. New uploads are
+// matched with MPI_ANY_SOURCE; each accepted client then gets 'depth'
+// receives of its own, so one client can never hold more than its share of
+// buffers. Completed chunks are served round-robin, at most one per client
+// per pass, so a huge upload proceeds at the same per-chunk rate as the
+// small ones beside it instead of starving them.
+void run_ingest_server(MPI_Datatype meta_type, int size, const TransferMode *mode)
+{
+    int clients = size - 1, window = mode->depth, slot_count = 1 + clients * window;
+    Upload *uploads = calloc(size, sizeof(Upload));
+    IngestSlot *slots = calloc(slot_count, sizeof(IngestSlot));
+    MPI_Request *requests = malloc(slot_count * sizeof(MPI_Request));
+    MPI_Status *statuses = malloc(slot_count * sizeof(MPI_Status));
+    int *indices = malloc(slot_count * sizeof(int));
+    Metadata incoming;
+    int accepted = 0, finished = 0, ready = 0, next = 0;
+    long long total = 0;
+    double start = MPI_Wtime();
+
+    for (int i = 0; i < slot_count; i++)
+    {
+        requests[i] = MPI_REQUEST_NULL;
+    }
+    MPI_Irecv(&incoming, 1, meta_type, MPI_ANY_SOURCE, TAG_META, MPI_COMM_WORLD, &requests[0]);
+
+    while (finished < clients)
+    {
+        int completed;
+
+        // Block only when there is nothing left to serve
+        if (ready == 0)
+        {
+            MPI_Waitsome(slot_count, requests, &completed, indices, statuses);
+        }
+        else
+        {
+            MPI_Testsome(slot_count, requests, &completed, indices, statuses);
+        }
+        for (int i = 0; i < completed && completed != MPI_UNDEFINED; i++)
+        {
+            if (indices[i] > 0)
+            {
+                MPI_Get_count(&statuses[i], MPI_CHAR, &slots[indices[i]].count);
+                slots[indices[i]].ready = 1;
+                ready++;
+                continue;
+            }
+
+            // A new upload
+            int source = statuses[i].MPI_SOURCE, ack = incoming.filesize < 0 ? 400 : 200;
+            Upload *u = &uploads[source];
+            char path[64];
+
+            *u = (Upload){incoming, -1, 0, 0, 0, 0, 0, MPI_Wtime()};
+            snprintf(path, sizeof(path), "received_from_%d.bin", source);
+            if (ack == 200 && (u->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            {
+                ack = 500;
+            }
+            if (!quiet)
+            {
+                printf("[Server] Rank %d uploading: %s (%lld bytes)\n", source, u->meta.filename, u->meta.filesize);
+            }
+            MPI_Send(&ack, 1, MPI_INT, source, TAG_ACK, MPI_COMM_WORLD);
+            if (++accepted < clients)
+            {
+                MPI_Irecv(&incoming, 1, meta_type, MPI_ANY_SOURCE, TAG_META, MPI_COMM_WORLD, &requests[0]);
+            }
+            if (ack != 200)
+            {
+                ingest_finish(u, source, slots, window, ack);
+                finished++;
+                continue;
+            }
+            u->messages = (u->meta.filesize + mode->chunk_size - 1) / mode->chunk_size;
+            u->active = 1;
+            for (int k = 0; k < window; k++)
+            {
+                IngestSlot *slot = &slots[ingest_slot(source, window, k)];
+                slot->buffer = malloc(mode->chunk_size);
+                if (u->posted < u->messages)
+                {
+                    ingest_post(u, slot, &requests[ingest_slot(source, window, k)], source, mode);
+                }
+            }
+            if (u->messages == 0)
+            {
+                ingest_finish(u, source, slots, window, 201);
+                finished++;
+            }
+        }
+
+        // One pass: at most one chunk per client, starting after the client served first last time
+        for (int n = 0; n < clients && ready > 0; n++)
+        {
+            int source = 1 + (next + n) % clients;
+            Upload *u = &uploads[source];
+            for (int k = 0; u->active && k < window; k++)
+            {
+                int index = ingest_slot(source, window, k);
+                IngestSlot *slot = &slots[index];
+                if (!slot->ready)
+                {
+                    continue;
+                }
+
+                slot->ready = 0;
+                ready--;
+                u->in_flight--;
+                if (slot->count == 0)
+                {
+                    // Short file: cancel the receives the terminator left unmatched
+                    u->messages = u->posted;
+                    for (int j = 0; j < window; j++)
+                    {
+                        int other = ingest_slot(source, window, j);
+                        if (requests[other] != MPI_REQUEST_NULL)
+                        {
+                            MPI_Status status;
+                            int cancelled;
+                            MPI_Cancel(&requests[other]);
+                            MPI_Wait(&requests[other], &status);
+                            MPI_Test_cancelled(&status, &cancelled);
+                            if (cancelled)
+                            {
+                                u->in_flight--;
+                            }
+                            else // Matched before the terminator: keep its data
+                            {
+                                MPI_Get_count(&status, MPI_CHAR, &slots[other].count);
+                                slots[other].ready = 1;
+                                ready++;
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    if (pwrite(u->fd, slot->buffer, slot->count, slot->offset) != slot->count)
+                    {
+                        u->meta.filesize = -1; // Reported as 500 when the upload ends
+                    }
+                    u->received += slot->count;
+                    total += slot->count;
+                    if (u->posted < u->messages)
+                    {
+                        ingest_post(u, slot, &requests[index], source, mode);
+                    }
+                }
+                if (u->in_flight == 0 && u->posted >= u->messages)
+                {
+                    ingest_finish(u, source, slots, window, u->received == u->meta.filesize ? 201 : 500);
+                    finished++;
+                }
+                break;
+            }
+        }
+        next = (next + 1) % clients;
+    }
+
+    double seconds = MPI_Wtime() - start;
+    if (!quiet)
+    {
+        printf("[Server] Ingested %lld bytes from %d ranks in %.6f seconds (%.2f MB/s aggregate).\n", total, clients,
+               seconds, seconds > 0 ? total / seconds / 1e6 : 0.0);
+    }
+    free(uploads);
+    free(slots);
+    free(requests);
+    free(statuses);
+    free(indices);
+}
+
+// "%d" in an ingest file name is replaced by the client's rank, so every
+// client can upload a different file
+static void rank_path(char *out, size_t out_size, const char *pattern, int rank)
+{
+    const char *mark = strstr(pattern, "%d");
+
+    if (mark == NULL)
+    {
+        snprintf(out, out_size, "%s", pattern);
+    }
+    else
+    {
+        snprintf(out, out_size, "%.*s%d%s", (int)(mark - pattern), pattern, rank, mark + 2);
+    }
+}
+
+// Rank counts for the scaling benchmarks: doubling, then the whole job
+static int next_rank_count(int ranks, int size)
+{
+    return ranks == size ? size + 1 : ranks * 2 < size ? ranks * 2 : size;
+}
+
+// Distribution time over the first 2, 4, 8 ... ranks of the job, to show
+// how it scales with the number of receivers
+void run_distribute_benchmark(MPI_Datatype meta_type, int rank, int size, const char *filepath,
+                              const TransferMode *mode)
+{
+    double baseline = 0;
+
+    quiet = 1;
+    if (rank == ROOT_RANK)
+    {
+        printf("[Bench] Distributing %s, %d x %d-byte chunks in flight, %d rounds (best counts)\n", filepath,
+               mode->depth, mode->chunk_size, BENCH_ROUNDS);
+        printf("[Bench] %6s %10s %12s %11s\n", "ranks", "seconds", "vs 2 ranks", "tree depth");
+    }
+    for (int ranks = 2; ranks <= size; ranks = next_rank_count(ranks, size))
+    {
+        MPI_Comm comm;
+        double best = -1;
+        int tree_depth = 0; // ceil(log2(ranks))
+
+        while ((1 << tree_depth) < ranks)
+        {
+            tree_depth++;
+        }
+        MPI_Comm_split(MPI_COMM_WORLD, rank < ranks ? 0 : MPI_UNDEFINED, rank, &comm);
+        for (int round = 0; comm != MPI_COMM_NULL && round < BENCH_ROUNDS; round++)
+        {
+            double seconds = run_distribute(meta_type, comm, filepath, mode);
+            if (seconds > 0 && (best < 0 || seconds < best))
+            {
+                best = seconds;
+            }
+        }
+        if (comm != MPI_COMM_NULL)
+        {
+            MPI_Comm_free(&comm);
+        }
+        if (rank == ROOT_RANK)
+        {
+            if (ranks == 2)
+            {
+                baseline = best;
+            }
+            printf("[Bench] %6d %10.4f %11.2fx %11d\n", ranks, best, baseline > 0 ? best / baseline : 0, tree_depth);
+            fflush(stdout);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+}
+
+// Every rank of 'comm' copies its share of the file straight into one
+// shared output with collective MPI-IO, instead of funnelling it through a
+// single writer. The Metadata broadcast from rank 0 fixes the layout: the
+// file is cut into chunk_size blocks dealt round-robin (block b to rank
+// b % P), and each rank's file view shows only its own blocks, so round r
+// is one MPI_File_write_at_all at view offset r * chunk_size. Interleaved
+// blocks are what collective buffering is for: a few aggregator ranks
+// ('aggregators', 0 = library default) gather neighbouring blocks and issue
+// large contiguous writes. The source is read with pread(), as if from a
+// shared file system.
+// Returns the write phase seconds on rank 0 (0 elsewhere), or -1 on failure.
+double run_collective_write(MPI_Datatype meta_type, MPI_Comm comm, const char *filepath, const TransferMode *mode,
+                            int aggregators)
+{
+    Metadata meta = {"CollectiveWrite", "", -1};
+    int rank, ranks, failed = 0;
+    struct stat st;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &ranks);
+    if (rank == ROOT_RANK && stat(filepath, &st) == 0)
+    {
+        strncpy(meta.filename, filepath, FILENAME_MAX_LEN - 1);
+        meta.filesize = st.st_size;
+    }
+    MPI_Bcast(&meta, 1, meta_type, ROOT_RANK, comm);
+    if (meta.filesize < 0)
+    {
+        if (rank == ROOT_RANK)
+        {
+            perror("File error");
+        }
+        return -1;
+    }
+
+    // Collective buffering hints; unknown keys are ignored by the library
+    MPI_Info info;
+    char value[32];
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "collective_buffering", "true");
+    MPI_Info_set(info, "romio_cb_write", "enable");
+    snprintf(value, sizeof(value), "%d", mode->chunk_size);
+    MPI_Info_set(info, "cb_buffer_size", value);
+    if (aggregators > 0)
+    {
+        snprintf(value, sizeof(value), "%d", aggregators);
+        MPI_Info_set(info, "cb_nodes", value);
+    }
+
+    MPI_File fh;
+    if (MPI_File_open(comm, "received_output.bin", MPI_MODE_CREATE | MPI_MODE_WRONLY, info, &fh) != MPI_SUCCESS)
+    {
+        if (rank == ROOT_RANK)
+        {
+            printf("[Root] Cannot open the shared output file.\n");
+        }
+        MPI_Info_free(&info);
+        return -1;
+    }
+    MPI_File_set_size(fh, meta.filesize); // Drops anything left from a longer earlier file
+
+    // View: our block at rank * chunk_size, then skip the other ranks' blocks
+    MPI_Datatype block, filetype;
+    MPI_Type_contiguous(mode->chunk_size, MPI_BYTE, &block);
+    MPI_Type_create_resized(block, 0, (MPI_Aint)mode->chunk_size * ranks, &filetype);
+    MPI_Type_commit(&filetype);
+    MPI_File_set_view(fh, (MPI_Offset)rank * mode->chunk_size, MPI_BYTE, filetype, "native", info);
+
+    int in = open(filepath, O_RDONLY);
+    char *buffer = malloc(mode->chunk_size);
+    long long blocks = (meta.filesize + mode->chunk_size - 1) / mode->chunk_size;
+    long long rounds = (blocks + ranks - 1) / ranks;
+    double write_seconds = 0;
+
+    if (in < 0 || buffer == NULL)
+    {
+        failed = 1; // Still joins every collective call, with nothing to write
+    }
+    MPI_Barrier(comm);
+    double start = MPI_Wtime();
+    for (long long round = 0; round < rounds; round++)
+    {
+        long long b = round * ranks + rank, offset = b * mode->chunk_size;
+        int len = 0, written = 0;
+        MPI_Status status;
+
+        if (!failed && b < blocks)
+        {
+            len = meta.filesize - offset < mode->chunk_size ? (int)(meta.filesize - offset) : mode->chunk_size;
+            if (pread(in, buffer, len, offset) != len)
+            {
+                failed = 1;
+                len = 0;
+            }
+        }
+        double t = MPI_Wtime();
+        if (MPI_File_write_at_all(fh, (MPI_Offset)round * mode->chunk_size, buffer, len, MPI_BYTE, &status) !=
+                MPI_SUCCESS ||
+            MPI_Get_count(&status, MPI_BYTE, &written) != MPI_SUCCESS || written != len)
+        {
+            failed = 1;
+        }
+        write_seconds += MPI_Wtime() - t;
+    }
+
+    if (rank == ROOT_RANK && !quiet)
+    {
+        // What the library kept of the hints
+        const char *keys[] = {"cb_nodes", "cb_buffer_size", "romio_cb_write", "collective_buffering"};
+        MPI_Info used;
+        MPI_File_get_info(fh, &used);
+        printf("[Root] Hints reported by the library:");
+        for (int i = 0; i < 4; i++)
+        {
+            char text[MPI_MAX_INFO_VAL + 1];
+            int found;
+            MPI_Info_get(used, keys[i], MPI_MAX_INFO_VAL, text, &found);
+            if (found)
+            {
+                printf(" %s=%s", keys[i], text);
+            }
+        }
+        printf("\n");
+        MPI_Info_free(&used);
+    }
+    double t = MPI_Wtime();
+    if (MPI_File_close(&fh) != MPI_SUCCESS) // Aggregators flush their last buffers here
+    {
+        failed = 1;
+    }
+    write_seconds += MPI_Wtime() - t;
+    double seconds = MPI_Wtime() - start;
+
+    if (in >= 0)
+    {
+        close(in);
+    }
+    free(buffer);
+    MPI_Type_free(&block);
+    MPI_Type_free(&filetype);
+    MPI_Info_free(&info);
+
+    // The slowest rank sets the pace of a collective write
+    double slowest[2], mine[2] = {write_seconds, seconds};
+    int failures;
+    MPI_Reduce(mine, slowest, 2, MPI_DOUBLE, MPI_MAX, ROOT_RANK, comm);
+    MPI_Reduce(&failed, &failures, 1, MPI_INT, MPI_SUM, ROOT_RANK, comm);
+    if (rank != ROOT_RANK)
+    {
+        return 0;
+    }
+    if (!quiet)
+    {
+        printf("[Root] %d ranks wrote '%s' (%lld bytes, %d-byte blocks) in %.6f seconds: %.2f MB/s aggregate "
+               "write bandwidth, %.2f MB/s end to end.\n",
+               ranks, meta.filename, meta.filesize, mode->chunk_size, slowest[0],
+               slowest[0] > 0 ? meta.filesize / slowest[0] / 1e6 : 0.0,
+               slowest[1] > 0 ? meta.filesize / slowest[1] / 1e6 : 0.0);
+        if (failures > 0)
+        {
+            printf("[Root] %d ranks failed to read or write their blocks.\n", failures);
+        }
+    }
+    return failures > 0 ? -1 : slowest[0];
+}
+
+// Aggregate write bandwidth over the first 1, 2, 4 ... ranks of the job
+void run_collective_write_benchmark(MPI_Datatype meta_type, int rank, int size, const char *filepath,
+                                    const TransferMode *mode, int aggregators)
+{
+    double baseline = 0;
+    struct stat st;
+
+    quiet = 1;
+    if (rank == ROOT_RANK)
+    {
+        stat(filepath, &st);
+        printf("[Bench] Collective write of %s, %d-byte blocks, %d rounds (best counts)\n", filepath,
+               mode->chunk_size, BENCH_ROUNDS);
+        printf("[Bench] %6s %10s %10s %10s\n", "ranks", "seconds", "MB/s", "scaling");
+    }
+    for (int ranks = 1; ranks <= size; ranks = next_rank_count(ranks, size))
+    {
+        MPI_Comm comm;
+        double best = -1;
+
+        MPI_Comm_split(MPI_COMM_WORLD, rank < ranks ? 0 : MPI_UNDEFINED, rank, &comm);
+        for (int round = 0; comm != MPI_COMM_NULL && round < BENCH_ROUNDS; round++)
+        {
+            double seconds = run_collective_write(meta_type, comm, filepath, mode, aggregators);
+            if (seconds > 0 && (best < 0 || seconds < best))
+            {
+                best = seconds;
+            }
+        }
+        if (comm != MPI_COMM_NULL)
+        {
+            MPI_Comm_free(&comm);
+        }
+        if (rank == ROOT_RANK)
+        {
+            double rate = best > 0 ? st.st_size / best / 1e6 : 0;
+            if (ranks == 1)
+            {
+                baseline = rate;
+            }
+            printf("[Bench] %6d %10.4f %10.1f %9.2fx\n", ranks, best, rate, baseline > 0 ? rate / baseline : 0);
+            fflush(stdout);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
 }
 
 int main(int argc, char *argv[])
@@ -120,26 +1276,120 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    // Every rank sees the same arguments, so all ends agree on the mode
+    TransferMode mode = {CHUNK_SIZE, 0, 0};
+    int mapped = 0, pipelined = 0, distribute = 0, collective = 0, ingest = 0, benchmark = 0, depth = PIPELINE_DEPTH;
+    int aggregators = 0, ch;
+    while ((ch = getopt(argc, argv, "pmDWIa:d:B")) != -1)
+    {
+        switch (ch)
+        {
+        case 'p':
+            pipelined = 1;
+            break;
+        case 'm':
+            mapped = pipelined = 1;
+            break;
+        case 'D':
+            distribute = pipelined = 1;
+            break;
+        case 'W':
+            collective = pipelined = 1; // Large blocks by default
+            break;
+        case 'I':
+            ingest = pipelined = 1;
+            break;
+        case 'a':
+            aggregators = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'B':
+            benchmark = 1;
+            break;
+        default:
+            depth = 0; // Reported as a usage error below
+            break;
+        }
+    }
+    if (pipelined)
+    {
+        mode = (TransferMode){PIPELINE_BUFFER, depth, mapped};
+    }
+    if (optind + 1 < argc)
+    {
+        mode.chunk_size = atoi(argv[optind + 1]);
+    }
+    if (optind >= argc || mode.chunk_size <= 0 || depth < 2)
+    {
+        if (rank == 0)
+        {
+            printf("Usage: mpirun -np 2 %s [-p | -m] [-d depth] [-B] <filename> [chunk_bytes]\n", argv[0]);
+            printf("       mpirun -np N %s -D [-d depth] [-B] <filename> [chunk_bytes]\n", argv[0]);
+            printf("       mpirun -np N %s -W [-a aggregators] [-B] <filename> [block_bytes]\n", argv[0]);
+            printf("       mpirun -np N %s -I [-d depth] <filename|name%%d.bin> [chunk_bytes]\n", argv[0]);
+            printf("  -p  pipelined transfer: non-blocking ring of buffers (default %d bytes each)\n",
+                   PIPELINE_BUFFER);
+            printf("  -m  like -p, but messages go straight from/into mmap windows of the files (no copies)\n");
+            printf("  -D  distribute the file from rank %d to every other rank (pipelined broadcast)\n", ROOT_RANK);
+            printf("  -W  all ranks write their blocks of the file into one output with collective MPI-IO\n");
+            printf("  -I  rank 0 ingests uploads from all other ranks at once, serving them round-robin\n");
+            printf("      (%%d in the file name becomes each client's rank)\n");
+            printf("  -a  collective buffering aggregators for -W (default: the library's choice)\n");
+            printf("  -d  buffers in flight per rank (with -I: per client) for -p/-D/-I, at least 2 (default %d)\n",
+                   PIPELINE_DEPTH);
+            printf("  -B  benchmark the lock-step loop against the pipeline at 1-64 MB buffers and -m,\n");
+            printf("      with -D the distribution time over 2, 4 ... N ranks,\n");
+            printf("      with -W the aggregate write bandwidth over 1, 2, 4 ... N ranks\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
     MPI_Datatype meta_type;
     create_metadata_type(&meta_type);
 
-    if (rank == SERVER_RANK)
+    if (ingest && rank == SERVER_RANK)
+    {
+        run_ingest_server(meta_type, size, &mode);
+    }
+    else if (ingest)
+    {
+        char path[FILENAME_MAX_LEN];
+        rank_path(path, sizeof(path), argv[optind], rank);
+        run_client(meta_type, path, &mode);
+    }
+    else if (collective && benchmark)
+    {
+        run_collective_write_benchmark(meta_type, rank, size, argv[optind], &mode, aggregators);
+    }
+    else if (collective)
     {
-        run_server(meta_type);
+        run_collective_write(meta_type, MPI_COMM_WORLD, argv[optind], &mode, aggregators);
+    }
+    else if (distribute && benchmark)
+    {
+        run_distribute_benchmark(meta_type, rank, size, argv[optind], &mode);
+    }
+    else if (distribute)
+    {
+        run_distribute(meta_type, MPI_COMM_WORLD, argv[optind], &mode);
+    }
+    else if (benchmark)
+    {
+        run_benchmark(meta_type, rank, argv[optind], depth);
+    }
+    else if (rank == SERVER_RANK)
+    {
+        run_server(meta_type, &mode);
     }
     else if (rank == CLIENT_RANK)
     {
-        if (argc < 2)
-        {
-            printf("Usage: mpirun -np 2 %s <filename>\n", argv[0]);
-        }
-        else
-        {
-            run_client(meta_type, argv[1]);
-        }
+        run_client(meta_type, argv[optind], &mode);
     }
 
     MPI_Type_free(&meta_type);
     MPI_Finalize();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1276 @@
+// Benchmark harness for the three practices: runs the Practice1 TCP server,
+// the Practice2 RPC server and the Practice3 MPI program over a matrix of file
+// sizes, concurrency levels and chunk sizes, and reports throughput, latency
+// percentiles (p50/p99/p999), CPU seconds per GB and syscall counts.
+//
+// Build the practices first, then:
+//   gcc -O2 bench/transfer_bench.c -o bench/transfer_bench -lpthread
+//   bench/transfer_bench -t p1,p2,mpi -s 1K,1M,64M,1G -c 1,4,16 -b 4K,64K -o results.jsonl
+//   bench/transfer_bench -t p1,p2 -s 256M -c 1 -b 256K -d 0,5,25 -o wan.jsonl
+//
+// Every configuration gets a fresh server, so its rusage covers exactly that
+// run. The TCP clients live in this process (one thread per concurrent
+// client, no process start-up in the numbers) and count their own syscalls
+// exactly. Server syscalls are counted in a separate untimed pass under
+// ptrace (-S), because tracing every syscall would distort the timed runs.
+//
+// What "chunk" means per transport:
+//   p1   client recv() buffer (the server picks its own sendfile/splice sizes)
+//   p2   client pread()+send() size for the body
+//   mpi  bytes per MPI_Send (second argument of the MPI program)
+// MPI jobs time themselves with MPI_Wtime (launch cost excluded); their CPU
+// comes from the whole mpirun tree and their syscalls (-S) from the whole job.
+//
+// With -d the matrix is repeated per emulated latency: netem on the loopback
+// device adds the given one-way delay to every packet (so the RTT is twice
+// it), which shows whether the servers' chunk and socket buffer tuning keeps
+// a long fat path busy. This needs CAP_NET_ADMIN and the tc tool; the qdisc
+// is removed again when the run ends.
+//
+// For p2 the table also shows how much of the received files is still in
+// the page cache when the server stops ("cache MB", mincore() over the
+// output directory): buffered writes leave all of it there, the O_DIRECT
+// path (-D) none. Compare the two on a real disk, with a server memory cap
+// that allows large writes:
+//   bench/transfer_bench -t p2 -s 1G -c 1,4 -w /data/bench -2 "Practice2/server -m 16777216"
+//   bench/transfer_bench -t p2 -s 1G -c 1,4 -w /data/bench -2 "Practice2/server -m 16777216 -D"
+//
+// Results go to stdout as a table and, with -o, as JSON lines: one "run"
+// record describing the machine, then one "result" record per configuration.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+#define HOST "127.0.0.1"
+#define PORT 65432 // Practice1 and Practice2 both listen here, so servers run one at a time
+#define FILENAME_MAX_LEN 256
+#define MAX_LIST 32                  // Entries per -s/-c/-b list
+#define AUTO_BYTES (256LL << 20)     // Default bytes moved per configuration (sets -n)
+#define MAX_AUTO_TRANSFERS 1000      // ... capped at this many transfers per client
+#define CENSUS_TRANSFERS 8           // Transfers in the traced syscall pass
+#define READY_TIMEOUT_MS 10000       // Server start-up limit
+#define NETEM_LIMIT "100000"         // netem queue, in packets: enough for a full window at the largest delay
+
+// Must match the Practice2 RPC header
+typedef struct
+{
+    char method[32];
+    char filename[FILENAME_MAX_LEN];
+    long long filesize;
+} Metadata;
+
+enum transport
+{
+    T_P1,
+    T_P2,
+    T_MPI
+};
+
+static const char *transport_names[] = {"p1", "p2", "mpi"};
+
+// Command line: "binary arg..." per transport
+static char *commands[3] = {"Practice1/server", "Practice2/server", "Practice3/MPI"};
+static const char *work_dir = "/tmp/transfer_bench";
+
+// One configuration of the matrix
+typedef struct
+{
+    enum transport transport;
+    long long size;
+    int concurrency;
+    long long chunk;
+    int transfers; // Per client
+    const char *data_path;
+    double delay_ms; // One-way loopback delay added by netem
+} BenchConfig;
+
+// One concurrent client
+typedef struct
+{
+    const BenchConfig *config;
+    int slot;
+    double *latencies; // config->transfers entries, seconds
+    double busy;       // Sum of latencies
+    long long syscalls;
+    double child_cpu;  // MPI: CPU of the mpirun trees this client waited for
+    int failures;
+} BenchClient;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double rusage_seconds(const struct rusage *ru)
+{
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+// "64K", "1M", "10G" -> bytes; 0 on error
+static long long parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1024 * 1024;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1024.0 * 1024 * 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' && value > 0 ? (long long)value : 0;
+}
+
+// Comma separated list of sizes; returns the count or -1
+static int parse_list(const char *text, long long *out)
+{
+    char *copy = strdup(text), *saveptr, *item;
+    int count = 0;
+
+    for (item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        if (count == MAX_LIST || (out[count] = parse_size(item)) == 0)
+        {
+            free(copy);
+            return -1;
+        }
+        count++;
+    }
+    free(copy);
+    return count;
+}
+
+// Comma separated list of delays in milliseconds (0 allowed); returns the count or -1
+static int parse_delays(const char *text, double *out)
+{
+    char *copy = strdup(text), *saveptr, *item, *end;
+    int count = 0;
+
+    for (item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        if (count == MAX_LIST || (out[count] = strtod(item, &end)) < 0 || *end != '\0')
+        {
+            free(copy);
+            return -1;
+        }
+        count++;
+    }
+    free(copy);
+    return count;
+}
+
+// Splits a command line on spaces (no quoting) into a NULL-terminated argv
+// with room for 'extra' more arguments
+static char **split_command(const char *command, int extra)
+{
+    char **argv = calloc(strlen(command) / 2 + 2 + extra, sizeof(char *));
+    char *copy = strdup(command), *saveptr, *item;
+    int argc = 0;
+
+    for (item = strtok_r(copy, " ", &saveptr); item != NULL; item = strtok_r(NULL, " ", &saveptr))
+    {
+        argv[argc++] = item;
+    }
+    return argv;
+}
+
+// Relative binary paths are resolved before the servers chdir() into the work dir
+static char *absolute_command(const char *command)
+{
+    char binary[PATH_MAX], resolved[PATH_MAX], *out;
+    size_t len = strcspn(command, " ");
+
+    snprintf(binary, sizeof(binary), "%.*s", (int)len, command);
+    if (strchr(binary, '/') == NULL || realpath(binary, resolved) == NULL)
+    {
+        return strdup(command); // Left to PATH (e.g. a wrapper script)
+    }
+    if (asprintf(&out, "%s%s", resolved, command + len) < 0)
+    {
+        return NULL;
+    }
+    return out;
+}
+
+// --- Test data ---
+
+// Creates (once) a file of pseudo-random bytes; the same seed every run
+static int make_data_file(const char *path, long long size)
+{
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size == size)
+    {
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    size_t block = 1 << 20;
+    uint64_t *buffer = malloc(block), state = 0x9e3779b97f4a7c15ULL;
+    for (long long done = 0; done < size;)
+    {
+        for (size_t i = 0; i < block / sizeof(uint64_t); i++)
+        {
+            state ^= state << 13, state ^= state >> 7, state ^= state << 17; // xorshift64
+            buffer[i] = state;
+        }
+        size_t n = size - done < (long long)block ? (size_t)(size - done) : block;
+        if (write(fd, buffer, n) != (ssize_t)n)
+        {
+            free(buffer);
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    free(buffer);
+    return close(fd);
+}
+
+// Removes the regular files in 'dir' (Practice2 output between configurations)
+static void clear_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    if (d == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue; // Also keeps the dedup store out of reach
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+// Bytes of the regular files in 'dir' that are resident in the page cache
+static long long page_cache_bytes(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[PATH_MAX];
+    long page = sysconf(_SC_PAGESIZE);
+    long long resident = 0;
+
+    if (d == NULL)
+    {
+        return 0;
+    }
+    while ((entry = readdir(d)) != NULL)
+    {
+        struct stat st;
+        int fd;
+        if (entry->d_name[0] == '.' ||
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path))
+        {
+            continue; // Hidden, or a name too long to open
+        }
+        if ((fd = open(path, O_RDONLY)) < 0)
+        {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            // Mapping without touching the pages does not fault anything in
+            size_t pages = (st.st_size + page - 1) / page;
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            unsigned char *vec = malloc(pages);
+            if (map != MAP_FAILED && vec != NULL && mincore(map, st.st_size, vec) == 0)
+            {
+                for (size_t i = 0; i < pages; i++)
+                {
+                    resident += (vec[i] & 1) * (long long)page;
+                }
+            }
+            free(vec);
+            if (map != MAP_FAILED)
+            {
+                munmap(map, st.st_size);
+            }
+        }
+        close(fd);
+    }
+    closedir(d);
+    return resident;
+}
+
+// --- Client side (syscalls counted by the caller's counter) ---
+
+static int connect_server(long long *syscalls)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    inet_pton(AF_INET, HOST, &addr.sin_addr);
+    *syscalls += 2;
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const void *data, size_t len, long long *syscalls)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        (*syscalls)++;
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *data, size_t len, long long *syscalls)
+{
+    char *p = data;
+    while (len > 0)
+    {
+        ssize_t n = recv(fd, p, len, 0);
+        (*syscalls)++;
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Practice1: GET the whole file, reading 'chunk' bytes at a time
+static int p1_transfer(const BenchConfig *config, char *buffer, long long *syscalls)
+{
+    char request[64];
+    int fd = connect_server(syscalls);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int len = snprintf(request, sizeof(request), "GET source_file.txt 0 %lld\n", config->size);
+    if (send_all(fd, request, len, syscalls) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Header "OK:<len> <size>...\n", possibly sharing a segment with the body
+    long long received = 0, expected = -1, fill = 0;
+    while (expected < 0 || received < expected)
+    {
+        ssize_t n = recv(fd, buffer + (expected < 0 ? fill : 0), expected < 0 ? config->chunk - fill : config->chunk, 0);
+        (*syscalls)++;
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        if (expected >= 0)
+        {
+            received += n;
+            continue;
+        }
+        fill += n;
+        char *newline = memchr(buffer, '\n', fill);
+        if (newline == NULL)
+        {
+            if (fill == config->chunk)
+            {
+                break; // Header longer than the chunk: not a reply we understand
+            }
+            continue;
+        }
+        if (sscanf(buffer, "OK:%lld", &expected) != 1)
+        {
+            break;
+        }
+        received = fill - (newline + 1 - buffer);
+    }
+    close(fd);
+    (*syscalls)++;
+    return expected == config->size && received == expected ? 0 : -1;
+}
+
+// Practice2: UploadFile, body from pread() in 'chunk' pieces
+static int p2_transfer(const BenchConfig *config, int file_fd, int slot, char *buffer, long long *syscalls)
+{
+    Metadata meta = {0};
+    int code = 0;
+    int fd = connect_server(syscalls);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    strcpy(meta.method, "UploadFile");
+    snprintf(meta.filename, sizeof(meta.filename), "bench_%d.bin", slot);
+    meta.filesize = config->size;
+    if (send_all(fd, &meta, sizeof(meta), syscalls) < 0 || recv_all(fd, &code, sizeof(code), syscalls) < 0 ||
+        code != 200)
+    {
+        close(fd);
+        return -1;
+    }
+    for (long long offset = 0; offset < config->size;)
+    {
+        ssize_t n = pread(file_fd, buffer, config->chunk, offset);
+        (*syscalls)++;
+        if (n <= 0 || send_all(fd, buffer, n, syscalls) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        offset += n;
+    }
+    shutdown(fd, SHUT_WR);
+    int ok = recv_all(fd, &code, sizeof(code), syscalls) == 0 && code == 201;
+    close(fd);
+    *syscalls += 2;
+    return ok ? 0 : -1;
+}
+
+// Launches "mpirun -np 2 <MPI> <file> <chunk>" in 'dir'; returns the pid and
+// the read end of its stdout
+static pid_t spawn_mpi(const BenchConfig *config, const char *dir, int *out_fd)
+{
+    char **argv = split_command(commands[T_MPI], 8);
+    char *mpirun[] = {"mpirun", "-np", "2", "--oversubscribe", geteuid() == 0 ? "--allow-run-as-root" : NULL, NULL};
+    char **full = calloc(16 + strlen(commands[T_MPI]), sizeof(char *));
+    char chunk[32];
+    int pipe_fds[2] = {-1, -1}, n = 0;
+
+    for (int i = 0; mpirun[i] != NULL; i++)
+    {
+        full[n++] = mpirun[i];
+    }
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        full[n++] = argv[i];
+    }
+    snprintf(chunk, sizeof(chunk), "%lld", config->chunk);
+    full[n++] = (char *)config->data_path;
+    full[n++] = chunk;
+
+    if (out_fd != NULL && pipe2(pipe_fds, O_CLOEXEC) < 0) // Not inherited by concurrent jobs
+    {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(out_fd != NULL ? pipe_fds[1] : null_fd, STDOUT_FILENO);
+        dup2(out_fd != NULL ? pipe_fds[1] : null_fd, STDERR_FILENO); // Errors end up in the failure report
+        // Concurrent launchers race on creating a shared session directory
+        // under TMPDIR, so each job gets its own
+        setenv("TMPDIR", dir, 1);
+        if (chdir(dir) < 0)
+        {
+            _exit(127);
+        }
+        execvp(full[0], full);
+        _exit(127);
+    }
+    if (out_fd != NULL)
+    {
+        close(pipe_fds[1]);
+        *out_fd = pipe_fds[0];
+    }
+    free(full);
+    free(argv);
+    return pid;
+}
+
+// One MPI job; the transfer time is what the client rank measured
+static int mpi_transfer(const BenchConfig *config, const char *dir, double *seconds, double *cpu)
+{
+    char output[4096];
+    size_t fill = 0;
+    int out_fd, status;
+    struct rusage ru;
+    double start = now_seconds();
+    pid_t pid = spawn_mpi(config, dir, &out_fd);
+
+    if (pid < 0)
+    {
+        return -1;
+    }
+    for (ssize_t n; fill < sizeof(output) - 1 && (n = read(out_fd, output + fill, sizeof(output) - 1 - fill)) != 0;)
+    {
+        if (n > 0)
+        {
+            fill += n;
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+    output[fill] = '\0';
+    close(out_fd);
+    if (wait4(pid, &status, 0, &ru) < 0)
+    {
+        return -1;
+    }
+    *cpu += rusage_seconds(&ru);
+
+    char *line = strstr(output, "[Client] Sent ");
+    long long bytes;
+    *seconds = now_seconds() - start;
+    if (line != NULL && sscanf(line, "[Client] Sent %lld bytes in %lf", &bytes, seconds) == 2 && bytes == config->size &&
+        strstr(output, "Upload status: 201") != NULL && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        return 0;
+    }
+    fprintf(stderr, "[Bench] MPI job failed (status %d):\n%s", status, output);
+    return -1;
+}
+
+static void *bench_client(void *arg)
+{
+    BenchClient *client = arg;
+    const BenchConfig *config = client->config;
+    char *buffer = malloc(config->chunk);
+    char dir[PATH_MAX];
+    int file_fd = open(config->data_path, O_RDONLY);
+
+    snprintf(dir, sizeof(dir), "%s/mpi_%d", work_dir, client->slot);
+    mkdir(dir, 0755);
+    for (int i = 0; i < config->transfers; i++)
+    {
+        double start = now_seconds(), seconds = 0;
+        int rc;
+
+        switch (config->transport)
+        {
+        case T_P1:
+            rc = p1_transfer(config, buffer, &client->syscalls);
+            break;
+        case T_P2:
+            rc = p2_transfer(config, file_fd, client->slot, buffer, &client->syscalls);
+            break;
+        default:
+            rc = mpi_transfer(config, dir, &seconds, &client->child_cpu);
+            break;
+        }
+        if (config->transport != T_MPI)
+        {
+            seconds = now_seconds() - start;
+        }
+        if (rc < 0)
+        {
+            client->failures++;
+            seconds = NAN;
+        }
+        else
+        {
+            client->busy += seconds;
+        }
+        client->latencies[i] = seconds;
+    }
+    close(file_fd);
+    free(buffer);
+    return NULL;
+}
+
+// --- Servers ---
+
+// Forks 'command' in 'dir' with its output discarded; with 'traced' the child
+// asks to be ptraced by the calling thread before exec
+static pid_t spawn_server(const char *command, const char *dir, int traced)
+{
+    char **argv = split_command(command, 0);
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (chdir(dir) < 0 || (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0))
+        {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    free(argv);
+    return pid;
+}
+
+// --- Emulated latency ---
+
+static int netem_active = 0;
+
+// Runs tc with 'args'; returns its exit status
+static int run_tc(char *const args[])
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        execvp("tc", args);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+    {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Adds 'delay_ms' to every loopback packet, or removes the qdisc for 0
+static int netem_set(double delay_ms)
+{
+    char delay[32];
+
+    if (delay_ms <= 0)
+    {
+        char *del[] = {"tc", "qdisc", "del", "dev", "lo", "root", NULL};
+        if (netem_active)
+        {
+            run_tc(del);
+        }
+        netem_active = 0;
+        return 0;
+    }
+    snprintf(delay, sizeof(delay), "%.3fms", delay_ms);
+    char *replace[] = {"tc", "qdisc", "replace", "dev", "lo", "root", "netem", "delay", delay, "limit", NETEM_LIMIT, NULL};
+    if (run_tc(replace) != 0)
+    {
+        return -1;
+    }
+    netem_active = 1;
+    return 0;
+}
+
+static void netem_clear(void)
+{
+    netem_set(0);
+}
+
+static void netem_signal(int sig)
+{
+    netem_clear();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Polls until the server accepts connections (the probe connection is closed at once)
+static int wait_for_server(pid_t pid)
+{
+    for (int waited = 0; waited < READY_TIMEOUT_MS; waited += 10)
+    {
+        long long ignored = 0;
+        int fd = connect_server(&ignored);
+        if (fd >= 0)
+        {
+            close(fd);
+            usleep(10000); // Let the server finish with the probe
+            return 0;
+        }
+        if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return -1; // Exited during start-up
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Stops a server and returns the CPU seconds it used over its lifetime
+static double stop_server(pid_t pid)
+{
+    struct rusage ru;
+    int status;
+
+    kill(pid, SIGTERM);
+    if (wait4(pid, &status, 0, &ru) < 0)
+    {
+        return NAN;
+    }
+    return rusage_seconds(&ru);
+}
+
+// --- Syscall census under ptrace ---
+
+typedef struct
+{
+    const char *command; // Server command line (NULL: the MPI job of 'config')
+    const char *dir;
+    const BenchConfig *config;
+    pid_t pid;
+    long long stops; // Syscall-entry plus syscall-exit stops, all threads and children
+    int started;     // 1 once the tracee runs, -1 if it could not be traced
+} Census;
+
+// Runs in its own thread: the tracer must be the thread that forked the tracee
+static void *census_tracer(void *arg)
+{
+    Census *census = arg;
+    int status;
+
+    census->pid = census->command != NULL ? spawn_server(census->command, census->dir, 1) : -1;
+    if (census->command == NULL)
+    {
+        // mpirun inherits the request to be traced through a tiny fork-exec shim
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+            {
+                _exit(127);
+            }
+            raise(SIGSTOP);
+            spawn_mpi(census->config, census->dir, NULL);
+            int child_status;
+            wait(&child_status);
+            _exit(WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 1);
+        }
+        census->pid = pid;
+    }
+    if (census->pid < 0 || waitpid(census->pid, &status, __WALL) < 0 || !WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, census->pid, NULL,
+               (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+                              PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL)) < 0)
+    {
+        __atomic_store_n(&census->started, -1, __ATOMIC_RELEASE);
+        if (census->pid > 0)
+        {
+            kill(census->pid, SIGKILL);
+            waitpid(census->pid, NULL, __WALL);
+        }
+        return NULL;
+    }
+    ptrace(PTRACE_SYSCALL, census->pid, NULL, NULL);
+    __atomic_store_n(&census->started, 1, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break; // ECHILD: every tracee is gone
+        }
+        if (!WIFSTOPPED(status))
+        {
+            continue;
+        }
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80))
+        {
+            __atomic_add_fetch(&census->stops, 1, __ATOMIC_RELAXED);
+            sig = 0;
+        }
+        else if (sig == SIGTRAP || sig == SIGSTOP)
+        {
+            sig = 0; // ptrace events and the initial stop of new tasks
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+    }
+    return NULL;
+}
+
+static long long census_syscalls(Census *census)
+{
+    return __atomic_load_n(&census->stops, __ATOMIC_RELAXED) / 2;
+}
+
+// Server (or, for MPI, whole-job) syscalls per transfer; -1 if unavailable
+static double count_server_syscalls(const BenchConfig *config, const char *server_dir)
+{
+    Census census = {.command = config->transport == T_MPI ? NULL : commands[config->transport],
+                     .dir = server_dir,
+                     .config = config};
+    BenchConfig single = *config;
+    pthread_t tracer;
+    char dir[PATH_MAX];
+    double result = -1;
+
+    if (config->transport == T_MPI)
+    {
+        snprintf(dir, sizeof(dir), "%s/mpi_0", work_dir);
+        mkdir(dir, 0755);
+        census.dir = dir;
+    }
+    pthread_create(&tracer, NULL, census_tracer, &census);
+    while (__atomic_load_n(&census.started, __ATOMIC_ACQUIRE) == 0)
+    {
+        usleep(1000);
+    }
+    if (census.started < 0)
+    {
+        pthread_join(tracer, NULL);
+        return -1;
+    }
+
+    if (config->transport == T_MPI)
+    {
+        pthread_join(tracer, NULL); // The job runs one transfer and exits
+        return census_syscalls(&census);
+    }
+    if (wait_for_server(0) == 0)
+    {
+        double latency[CENSUS_TRANSFERS];
+        BenchClient client = {.config = &single, .slot = 0, .latencies = latency};
+
+        single.concurrency = 1;
+        single.transfers = config->transfers < CENSUS_TRANSFERS ? config->transfers : CENSUS_TRANSFERS;
+        long long before = census_syscalls(&census);
+        bench_client(&client);
+        usleep(50000); // Let the server finish closing and logging the last transfer
+        if (client.failures == 0)
+        {
+            result = (double)(census_syscalls(&census) - before) / single.transfers;
+        }
+    }
+    kill(census.pid, SIGKILL);
+    pthread_join(tracer, NULL);
+    return result;
+}
+
+// --- Reporting ---
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of a sorted array
+static double percentile(const double *sorted, int n, double p)
+{
+    if (n == 0)
+    {
+        return NAN;
+    }
+    int rank = (int)ceil(p * n);
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+static void json_number(FILE *out, const char *key, double value, const char *format)
+{
+    fprintf(out, ",\"%s\":", key);
+    if (isnan(value) || value < 0)
+    {
+        fprintf(out, "null");
+    }
+    else
+    {
+        fprintf(out, format, value);
+    }
+}
+
+static void write_run_record(FILE *out, int argc, char **argv)
+{
+    struct utsname uts;
+    char stamp[64];
+    time_t t = time(NULL);
+
+    uname(&uts);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    fprintf(out, "{\"record\":\"run\",\"time\":\"%s\",\"host\":\"%s\",\"kernel\":\"%s %s\",\"cpus\":%ld,\"args\":\"",
+            stamp, uts.nodename, uts.sysname, uts.release, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int i = 1; i < argc; i++)
+    {
+        for (const char *c = argv[i]; *c; c++)
+        {
+            if (*c == '"' || *c == '\\')
+            {
+                fputc('\\', out);
+            }
+            fputc(*c, out);
+        }
+        fputc(i + 1 < argc ? ' ' : '"', out);
+    }
+    if (argc == 1)
+    {
+        fputc('"', out);
+    }
+    fprintf(out, ",\"commands\":{\"p1\":\"%s\",\"p2\":\"%s\",\"mpi\":\"%s\"}}\n", commands[0], commands[1], commands[2]);
+    fflush(out);
+}
+
+// Runs one configuration; returns the number of failed transfers
+static int run_config(BenchConfig *config, int census, FILE *json)
+{
+    int total = config->concurrency * config->transfers;
+    BenchClient *clients = calloc(config->concurrency, sizeof(BenchClient));
+    pthread_t *threads = calloc(config->concurrency, sizeof(pthread_t));
+    double *latencies = calloc(total, sizeof(double));
+    char server_dir[PATH_MAX], output_dir[PATH_MAX + 32];
+    pid_t server = -1;
+    double server_cpu = NAN, server_syscalls = -1, page_cache = -1;
+    struct rusage ru_before, ru_after;
+
+    snprintf(server_dir, sizeof(server_dir), "%s/%s", work_dir, config->transport == T_P1 ? "p1" : "p2");
+    snprintf(output_dir, sizeof(output_dir), "%s/received_files", server_dir);
+    if (config->transport == T_P1)
+    {
+        // The Practice1 server always serves source_file.txt from its working directory
+        char link_path[PATH_MAX + 32];
+        snprintf(link_path, sizeof(link_path), "%s/source_file.txt", server_dir);
+        unlink(link_path);
+        if (symlink(config->data_path, link_path) < 0)
+        {
+            perror("[Bench] symlink");
+        }
+    }
+
+    if (census)
+    {
+        server_syscalls = count_server_syscalls(config, server_dir);
+        clear_dir(output_dir);
+    }
+    if (config->transport != T_MPI)
+    {
+        server = spawn_server(commands[config->transport], server_dir, 0);
+        if (server < 0 || wait_for_server(server) < 0)
+        {
+            fprintf(stderr, "[Bench] %s server did not start (%s)\n", transport_names[config->transport],
+                    commands[config->transport]);
+            if (server > 0)
+            {
+                stop_server(server);
+            }
+            free(clients);
+            free(threads);
+            free(latencies);
+            return total;
+        }
+    }
+
+    getrusage(RUSAGE_SELF, &ru_before);
+    double start = now_seconds();
+    for (int i = 0; i < config->concurrency; i++)
+    {
+        clients[i] = (BenchClient){.config = config, .slot = i, .latencies = latencies + (long)i * config->transfers};
+        pthread_create(&threads[i], NULL, bench_client, &clients[i]);
+    }
+    int failures = 0;
+    long long syscalls = 0;
+    double child_cpu = 0, busiest = 0;
+    for (int i = 0; i < config->concurrency; i++)
+    {
+        pthread_join(threads[i], NULL);
+        failures += clients[i].failures;
+        syscalls += clients[i].syscalls;
+        child_cpu += clients[i].child_cpu;
+        if (clients[i].busy > busiest)
+        {
+            busiest = clients[i].busy;
+        }
+    }
+    double wall = now_seconds() - start;
+    getrusage(RUSAGE_SELF, &ru_after);
+    double client_cpu = rusage_seconds(&ru_after) - rusage_seconds(&ru_before);
+
+    if (server > 0)
+    {
+        server_cpu = stop_server(server);
+        if (config->transport == T_P2)
+        {
+            page_cache = page_cache_bytes(output_dir) / 1e6;
+        }
+        clear_dir(output_dir);
+    }
+    else
+    {
+        server_cpu = child_cpu; // Both MPI ranks and the launcher
+    }
+
+    // Failed transfers are NaN and sort last; percentiles cover the successful ones
+    int ok = total - failures;
+    qsort(latencies, total, sizeof(double), compare_double);
+    for (int i = 0, j = 0; i < total; i++)
+    {
+        if (!isnan(latencies[i]))
+        {
+            latencies[j++] = latencies[i];
+        }
+    }
+    double bytes = (double)ok * config->size;
+    double seconds = config->transport == T_MPI ? busiest : wall; // MPI: exclude launch time
+    double throughput = seconds > 0 ? bytes / seconds / 1e6 : NAN;
+    double cpu_total = client_cpu + server_cpu;
+    double cpu_per_gb = bytes > 0 ? cpu_total / (bytes / 1e9) : NAN;
+    double client_syscalls = config->transport == T_MPI || ok == 0 ? -1 : (double)syscalls / total;
+    double p50 = percentile(latencies, ok, 0.50), p99 = percentile(latencies, ok, 0.99),
+           p999 = percentile(latencies, ok, 0.999);
+
+    char client_text[32] = "-", server_text[32] = "-", cache_text[32] = "-";
+    if (page_cache >= 0)
+    {
+        snprintf(cache_text, sizeof(cache_text), "%.1f", page_cache);
+    }
+    if (client_syscalls >= 0)
+    {
+        snprintf(client_text, sizeof(client_text), "%.0f", client_syscalls);
+    }
+    if (server_syscalls >= 0)
+    {
+        snprintf(server_text, sizeof(server_text), "%.0f", server_syscalls);
+    }
+    printf("%-4s %7.1f %10lld %5d %9lld %6d %4d %10.1f %10.3f %10.3f %10.3f %8.2f %10s %10s %9s\n",
+           transport_names[config->transport], config->delay_ms, config->size, config->concurrency, config->chunk,
+           total, failures,
+           throughput, p50 * 1e3, p99 * 1e3, p999 * 1e3, cpu_per_gb, client_text, server_text, cache_text);
+    fflush(stdout);
+
+    if (json != NULL)
+    {
+        fprintf(json,
+                "{\"record\":\"result\",\"transport\":\"%s\",\"delay_ms\":%.3f,\"size\":%lld,\"concurrency\":%d,"
+                "\"chunk\":%lld,\"transfers\":%d,\"failed\":%d",
+                transport_names[config->transport], config->delay_ms, config->size, config->concurrency,
+                config->chunk, total, failures);
+        json_number(json, "seconds", seconds, "%.6f");
+        json_number(json, "throughput_mb_s", throughput, "%.3f");
+        json_number(json, "p50_ms", p50 * 1e3, "%.4f");
+        json_number(json, "p99_ms", p99 * 1e3, "%.4f");
+        json_number(json, "p999_ms", p999 * 1e3, "%.4f");
+        json_number(json, "cpu_client_s", config->transport == T_MPI ? NAN : client_cpu, "%.4f");
+        json_number(json, "cpu_server_s", server_cpu, "%.4f");
+        json_number(json, "cpu_s_per_gb", cpu_per_gb, "%.4f");
+        json_number(json, "client_syscalls_per_transfer", client_syscalls, "%.1f");
+        json_number(json, "server_syscalls_per_transfer", server_syscalls, "%.1f");
+        json_number(json, "page_cache_mb", page_cache, "%.3f");
+        fprintf(json, "}\n");
+        fflush(json);
+    }
+
+    free(clients);
+    free(threads);
+    free(latencies);
+    return failures;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-t p1,p2,mpi] [-s sizes] [-c clients] [-b chunks] [-n transfers] [-d delays] [-o out.jsonl]\n"
+            "          [-S] [-w work_dir] [-1 p1_command] [-2 p2_command] [-3 mpi_program]\n",
+            prog);
+    fprintf(stderr, "  -t  transports to run (default: p1,p2,mpi)\n");
+    fprintf(stderr, "  -s  file sizes, K/M/G suffixes (default: 1K,1M,64M; up to 10G and beyond)\n");
+    fprintf(stderr, "  -c  concurrent clients / MPI jobs (default: 1,4)\n");
+    fprintf(stderr, "  -b  chunk sizes (default: 4K,64K)\n");
+    fprintf(stderr, "  -n  transfers per client (default: ~%lld MB per configuration, at most %d)\n", AUTO_BYTES >> 20,
+            MAX_AUTO_TRANSFERS);
+    fprintf(stderr, "  -d  one-way loopback delays in ms, added with netem (default: 0; needs CAP_NET_ADMIN)\n");
+    fprintf(stderr, "  -o  append JSON lines to this file\n");
+    fprintf(stderr, "  -S  count server syscalls in an extra traced pass (ptrace)\n");
+    fprintf(stderr, "  -w  scratch directory for data files and server output (default: %s)\n", work_dir);
+    fprintf(stderr, "  -1/-2/-3  commands for the Practice1 server, Practice2 server and MPI program\n");
+    fprintf(stderr, "            (default: %s, %s, %s; arguments allowed, e.g. -2 \"Practice2/server -u\")\n",
+            commands[0], commands[1], commands[2]);
+}
+
+int main(int argc, char *argv[])
+{
+    long long sizes[MAX_LIST] = {1024, 1 << 20, 64 << 20}, chunks[MAX_LIST] = {4096, 65536};
+    long long concurrency[MAX_LIST] = {1, 4};
+    double delays[MAX_LIST] = {0};
+    int n_sizes = 3, n_chunks = 2, n_concurrency = 2, n_delays = 1, transfers = 0, census = 0;
+    int enabled[3] = {1, 1, 1};
+    const char *json_path = NULL;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "t:s:c:b:n:d:o:Sw:1:2:3:")) != -1)
+    {
+        switch (ch)
+        {
+        case 't':
+            enabled[T_P1] = strstr(optarg, "p1") != NULL;
+            enabled[T_P2] = strstr(optarg, "p2") != NULL;
+            enabled[T_MPI] = strstr(optarg, "mpi") != NULL;
+            break;
+        case 's':
+            n_sizes = parse_list(optarg, sizes);
+            break;
+        case 'c':
+            n_concurrency = parse_list(optarg, concurrency);
+            break;
+        case 'b':
+            n_chunks = parse_list(optarg, chunks);
+            break;
+        case 'n':
+            transfers = atoi(optarg);
+            break;
+        case 'd':
+            n_delays = parse_delays(optarg, delays);
+            break;
+        case 'o':
+            json_path = optarg;
+            break;
+        case 'S':
+            census = 1;
+            break;
+        case 'w':
+            work_dir = optarg;
+            break;
+        case '1':
+        case '2':
+        case '3':
+            commands[ch - '1'] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (n_sizes <= 0 || n_chunks <= 0 || n_concurrency <= 0 || n_delays <= 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int t = 0; t < 3; t++)
+    {
+        commands[t] = absolute_command(commands[t]);
+    }
+
+    char path[PATH_MAX];
+    mkdir(work_dir, 0755);
+    snprintf(path, sizeof(path), "%s/p1", work_dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/p2", work_dir);
+    mkdir(path, 0755);
+
+    FILE *json = NULL;
+    if (json_path != NULL && (json = fopen(json_path, "a")) == NULL)
+    {
+        perror("[Bench] Cannot open output file");
+        return EXIT_FAILURE;
+    }
+    if (json != NULL)
+    {
+        write_run_record(json, argc, argv);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    atexit(netem_clear);
+    signal(SIGINT, netem_signal);
+    signal(SIGTERM, netem_signal);
+
+    printf("%-4s %7s %10s %5s %9s %6s %4s %10s %10s %10s %10s %8s %10s %10s %9s\n", "", "delay", "size", "conc", "chunk",
+           "xfers", "fail", "MB/s", "p50 ms", "p99 ms", "p999 ms", "CPU s/GB", "cli sys/x", "srv sys/x", "cache MB");
+    int failures = 0;
+    for (int d = 0; d < n_delays; d++)
+    {
+        if (netem_set(delays[d]) < 0)
+        {
+            fprintf(stderr, "[Bench] Cannot add %.1f ms of delay to lo (needs tc, sch_netem and CAP_NET_ADMIN)\n",
+                    delays[d]);
+            return EXIT_FAILURE;
+        }
+        for (int s = 0; s < n_sizes; s++)
+        {
+            char data_path[PATH_MAX];
+            snprintf(data_path, sizeof(data_path), "%s/data_%lld.bin", work_dir, sizes[s]);
+            if (make_data_file(data_path, sizes[s]) < 0)
+            {
+                perror("[Bench] Cannot create test data");
+                return EXIT_FAILURE;
+            }
+            for (int t = 0; t < 3; t++)
+            {
+                for (int c = 0; enabled[t] && c < n_concurrency; c++)
+                {
+                    for (int b = 0; b < n_chunks; b++)
+                    {
+                        BenchConfig config = {t, sizes[s], (int)concurrency[c], chunks[b], transfers,
+                                              data_path, delays[d]};
+                        if (config.transfers <= 0)
+                        {
+                            long long auto_transfers = AUTO_BYTES / (sizes[s] * concurrency[c]);
+                            config.transfers = auto_transfers < 1                    ? 1
+                                               : auto_transfers > MAX_AUTO_TRANSFERS ? MAX_AUTO_TRANSFERS
+                                                                                     : (int)auto_transfers;
+                            if (t == T_MPI && config.transfers > 4)
+                            {
+                                config.transfers = 4; // Each MPI transfer is a full job launch
+                            }
+                        }
+                        failures += run_config(&config, census, json);
+                    }
+                }
+            }
+        }
+    }
+    if (json != NULL)
+    {
+        fclose(json);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,379 @@
+// Shared transfer buffer pool and object slabs, header-only: #include "../common/bufpool.h"
+//
+// Transfers should not touch the system allocator once a server is warm.
+// buf_get() hands out 4 KB aligned buffers in power-of-two size classes
+// (4 KB to 4 MB) and buf_put() takes them back for the next transfer:
+//
+//  - each thread keeps up to BUF_POOL_CACHE buffers per class, so a
+//    get/put pair on a warm thread is a few loads and stores, no lock;
+//  - threads exchange buffers in batches through a shared depot (one mutex
+//    per class), so a buffer freed on one thread is reused on another;
+//  - only a depot miss allocates. Classes of 2 MB and up are mapped and
+//    marked MADV_HUGEPAGE; smaller ones come from aligned_alloc(), and a
+//    depot holding BUF_POOL_DEPOT buffers of a class frees the rest.
+//
+// buf_pool_hugepages() backs every class with the reserved 2 MB hugepages
+// instead (MAP_HUGETLB, vm.nr_hugepages): small buffers are carved out of
+// shared 2 MB pages, so a few TLB entries cover every buffer in flight.
+// Part of a hugepage cannot be given back, so in this mode the depot keeps
+// whatever it is handed and the pool only ever grows to its peak. When no
+// hugepage is left the pool quietly falls back to ordinary memory.
+//
+// A Slab hands out fixed-size objects (connection state and the like)
+// carved from BUF_SLAB_BYTES blocks that are never returned. A slab belongs
+// to one thread: there is no lock, so give each worker its own.
+//
+// buf_pool_stats() reports how often either had to go to the system; in a
+// steady state those counts stop moving however many transfers run.
+#ifndef COMMON_BUFPOOL_H
+#define COMMON_BUFPOOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define BUF_POOL_MIN_SHIFT 12               // Smallest class: 4 KB
+#define BUF_POOL_CLASSES 11                 // ... up to 4 MB
+#define BUF_POOL_CACHE 8                    // Buffers a thread keeps per class
+#define BUF_POOL_BATCH (BUF_POOL_CACHE / 2) // Buffers moved per depot visit
+#define BUF_POOL_DEPOT 256                  // Buffers the depot keeps per class; more go back to the system
+#define BUF_POOL_HUGE (2UL << 20)           // Hugepage size; classes this large are mapped
+#define BUF_SLAB_BYTES (64 * 1024)          // Objects are carved from blocks this large
+
+typedef struct
+{
+    uint64_t buffer_allocs;   // Buffers allocated from the system
+    uint64_t buffer_frees;    // ... and given back (depot full)
+    uint64_t buffer_bytes;    // Bytes of buffers currently allocated (in use or pooled)
+    uint64_t hugepage_allocs; // 2 MB hugepages mapped for buffers
+    uint64_t slab_allocs;     // Slab blocks allocated
+    uint64_t slab_bytes;
+} BufPoolStats;
+
+typedef struct BufFree
+{
+    struct BufFree *next;
+} BufFree;
+
+typedef struct
+{
+    void *slot[BUF_POOL_CACHE];
+    int count;
+} BufCacheClass;
+
+typedef struct
+{
+    BufCacheClass cls[BUF_POOL_CLASSES];
+} BufCache;
+
+static struct
+{
+    pthread_mutex_t lock[BUF_POOL_CLASSES];
+    BufFree *depot[BUF_POOL_CLASSES]; // Pooled buffers, linked through their first bytes
+    int ndepot[BUF_POOL_CLASSES];
+    int hugetlb;                      // Carve buffers from MAP_HUGETLB pages; never free them
+    pthread_mutex_t arena_lock;
+    char *arena;                      // hugetlb: unused rest of the current 2 MB page
+    size_t arena_left;
+    pthread_once_t once;
+    pthread_key_t key;                // Flushes a thread's cache to the depot when it exits
+    BufPoolStats stats;               // Updated with relaxed atomics, only off the fast path
+} buf_pool = {.once = PTHREAD_ONCE_INIT, .arena_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread BufCache *buf_cache;
+
+// Classes 0..BUF_POOL_CLASSES-1; BUF_POOL_CLASSES for sizes past the largest
+static inline int buf_class(size_t size)
+{
+    int c = 0;
+    while (c < BUF_POOL_CLASSES && ((size_t)1 << (BUF_POOL_MIN_SHIFT + c)) < size)
+    {
+        c++;
+    }
+    return c;
+}
+
+static inline size_t buf_class_size(int c)
+{
+    return (size_t)1 << (BUF_POOL_MIN_SHIFT + c);
+}
+
+static inline void buf_stat_add(uint64_t *counter, uint64_t v)
+{
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+static inline void *buf_map(size_t size, int flags)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// hugetlb: the next 'size' bytes of the current hugepage (sizes are powers
+// of two below BUF_POOL_HUGE, so carving keeps every buffer aligned to its size)
+static inline void *buf_carve(size_t size)
+{
+    void *p = NULL;
+
+    pthread_mutex_lock(&buf_pool.arena_lock);
+    size_t skip = (uintptr_t)buf_pool.arena & (size - 1) ? size - ((uintptr_t)buf_pool.arena & (size - 1)) : 0;
+    if (buf_pool.arena_left < skip + size)
+    {
+        // The tail of the old page is lost; it is smaller than this buffer
+        buf_pool.arena = buf_map(BUF_POOL_HUGE, MAP_HUGETLB);
+        buf_pool.arena_left = buf_pool.arena != NULL ? BUF_POOL_HUGE : 0;
+        skip = 0;
+        if (buf_pool.arena != NULL)
+        {
+            buf_stat_add(&buf_pool.stats.hugepage_allocs, 1);
+        }
+    }
+    if (buf_pool.arena_left >= skip + size)
+    {
+        p = buf_pool.arena + skip;
+        buf_pool.arena += skip + size;
+        buf_pool.arena_left -= skip + size;
+    }
+    pthread_mutex_unlock(&buf_pool.arena_lock);
+    return p;
+}
+
+// Sizes of BUF_POOL_HUGE and up are whole multiples of it
+static inline void *buf_os_alloc(size_t size)
+{
+    void *p = NULL;
+
+    if (buf_pool.hugetlb)
+    {
+        p = size < BUF_POOL_HUGE ? buf_carve(size) : buf_map(size, MAP_HUGETLB);
+        if (p != NULL && size >= BUF_POOL_HUGE)
+        {
+            buf_stat_add(&buf_pool.stats.hugepage_allocs, size / BUF_POOL_HUGE);
+        }
+    }
+    if (p == NULL && size < BUF_POOL_HUGE)
+    {
+        p = aligned_alloc(1 << BUF_POOL_MIN_SHIFT, size);
+    }
+    else if (p == NULL && (p = buf_map(size, 0)) != NULL)
+    {
+        madvise(p, size, MADV_HUGEPAGE); // Only a hint: fine if THP is off
+    }
+    if (p != NULL)
+    {
+        buf_stat_add(&buf_pool.stats.buffer_allocs, 1);
+        buf_stat_add(&buf_pool.stats.buffer_bytes, size);
+    }
+    return p;
+}
+
+static inline void buf_os_free(void *p, size_t size)
+{
+    if (size < BUF_POOL_HUGE)
+    {
+        free(p);
+    }
+    else
+    {
+        munmap(p, size);
+    }
+    buf_stat_add(&buf_pool.stats.buffer_frees, 1);
+    buf_stat_add(&buf_pool.stats.buffer_bytes, -(uint64_t)size);
+}
+
+// Moves up to 'count' buffers of class 'c' between a thread cache and the
+// depot; what the depot cannot hold goes back to the system
+static inline void buf_depot_put(int c, void **slot, int count)
+{
+    pthread_mutex_lock(&buf_pool.lock[c]);
+    while (count > 0 && (buf_pool.ndepot[c] < BUF_POOL_DEPOT || buf_pool.hugetlb))
+    {
+        BufFree *b = slot[--count];
+        b->next = buf_pool.depot[c];
+        buf_pool.depot[c] = b;
+        buf_pool.ndepot[c]++;
+    }
+    pthread_mutex_unlock(&buf_pool.lock[c]);
+    while (count > 0)
+    {
+        buf_os_free(slot[--count], buf_class_size(c));
+    }
+}
+
+static inline int buf_depot_get(int c, void **slot, int count)
+{
+    int n = 0;
+    pthread_mutex_lock(&buf_pool.lock[c]);
+    while (n < count && buf_pool.depot[c] != NULL)
+    {
+        slot[n++] = buf_pool.depot[c];
+        buf_pool.depot[c] = buf_pool.depot[c]->next;
+        buf_pool.ndepot[c]--;
+    }
+    pthread_mutex_unlock(&buf_pool.lock[c]);
+    return n;
+}
+
+static void buf_cache_flush(void *arg)
+{
+    BufCache *cache = arg;
+    for (int c = 0; c < BUF_POOL_CLASSES; c++)
+    {
+        buf_depot_put(c, cache->cls[c].slot, cache->cls[c].count);
+    }
+    free(cache);
+}
+
+static void buf_pool_setup(void)
+{
+    for (int c = 0; c < BUF_POOL_CLASSES; c++)
+    {
+        pthread_mutex_init(&buf_pool.lock[c], NULL);
+    }
+    pthread_key_create(&buf_pool.key, buf_cache_flush);
+}
+
+static inline BufCache *buf_cache_attach(void)
+{
+    pthread_once(&buf_pool.once, buf_pool_setup);
+    if ((buf_cache = calloc(1, sizeof(BufCache))) != NULL)
+    {
+        pthread_setspecific(buf_pool.key, buf_cache);
+    }
+    return buf_cache;
+}
+
+// Backs every class with MAP_HUGETLB pages (see above); call before the
+// first buf_get()
+static inline void buf_pool_hugepages(int on)
+{
+    buf_pool.hugetlb = on;
+}
+
+// A buffer of at least 'size' bytes, 4 KB aligned; NULL if out of memory.
+// Give it back with buf_put() and the same 'size'.
+static inline void *buf_get(size_t size)
+{
+    int c = buf_class(size);
+    BufCache *cache = buf_cache;
+
+    if (c == BUF_POOL_CLASSES)
+    {
+        return buf_os_alloc((size + BUF_POOL_HUGE - 1) & ~(BUF_POOL_HUGE - 1)); // Too large to pool
+    }
+    if (__builtin_expect(cache == NULL, 0) && (cache = buf_cache_attach()) == NULL)
+    {
+        return buf_os_alloc(buf_class_size(c));
+    }
+    BufCacheClass *cls = &cache->cls[c];
+    if (cls->count == 0)
+    {
+        cls->count = buf_depot_get(c, cls->slot, BUF_POOL_BATCH);
+    }
+    return cls->count > 0 ? cls->slot[--cls->count] : buf_os_alloc(buf_class_size(c));
+}
+
+static inline void buf_put(void *p, size_t size)
+{
+    int c = buf_class(size);
+    BufCache *cache = buf_cache;
+
+    if (p == NULL)
+    {
+        return;
+    }
+    if (c == BUF_POOL_CLASSES)
+    {
+        buf_os_free(p, (size + BUF_POOL_HUGE - 1) & ~(BUF_POOL_HUGE - 1));
+        return;
+    }
+    if (__builtin_expect(cache == NULL, 0) && (cache = buf_cache_attach()) == NULL)
+    {
+        buf_depot_put(c, &p, 1);
+        return;
+    }
+    BufCacheClass *cls = &cache->cls[c];
+    if (cls->count == BUF_POOL_CACHE)
+    {
+        // Keep half, so a thread alternating get/put does not visit the depot every time
+        buf_depot_put(c, cls->slot + BUF_POOL_CACHE - BUF_POOL_BATCH, BUF_POOL_BATCH);
+        cls->count -= BUF_POOL_BATCH;
+    }
+    cls->slot[cls->count++] = p;
+}
+
+static inline void buf_pool_stats(BufPoolStats *out)
+{
+    out->buffer_allocs = __atomic_load_n(&buf_pool.stats.buffer_allocs, __ATOMIC_RELAXED);
+    out->buffer_frees = __atomic_load_n(&buf_pool.stats.buffer_frees, __ATOMIC_RELAXED);
+    out->buffer_bytes = __atomic_load_n(&buf_pool.stats.buffer_bytes, __ATOMIC_RELAXED);
+    out->hugepage_allocs = __atomic_load_n(&buf_pool.stats.hugepage_allocs, __ATOMIC_RELAXED);
+    out->slab_allocs = __atomic_load_n(&buf_pool.stats.slab_allocs, __ATOMIC_RELAXED);
+    out->slab_bytes = __atomic_load_n(&buf_pool.stats.slab_bytes, __ATOMIC_RELAXED);
+}
+
+// --- Object slabs ---
+
+typedef struct SlabObject
+{
+    struct SlabObject *next;
+} SlabObject;
+
+typedef struct
+{
+    size_t size;      // Object size, rounded up to a cache line
+    SlabObject *free; // Freed and never-used objects
+} Slab;
+
+// Initializer for a slab of 'object_size' byte objects
+#define SLAB_INIT(object_size) {.size = ((object_size) + 63) & ~(size_t)63}
+
+static inline int slab_grow(Slab *s)
+{
+    size_t count = BUF_SLAB_BYTES / s->size ? BUF_SLAB_BYTES / s->size : 1;
+    char *block = aligned_alloc(64, count * s->size);
+
+    if (block == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = count; i-- > 0;)
+    {
+        SlabObject *o = (SlabObject *)(block + i * s->size);
+        o->next = s->free;
+        s->free = o;
+    }
+    buf_stat_add(&buf_pool.stats.slab_allocs, 1);
+    buf_stat_add(&buf_pool.stats.slab_bytes, count * s->size);
+    return 0;
+}
+
+// A zeroed object, or NULL if out of memory
+static inline void *slab_alloc(Slab *s)
+{
+    SlabObject *o;
+
+    if (s->free == NULL && slab_grow(s) < 0)
+    {
+        return NULL;
+    }
+    o = s->free;
+    s->free = o->next;
+    memset(o, 0, s->size);
+    return o;
+}
+
+static inline void slab_free(Slab *s, void *p)
+{
+    SlabObject *o = p;
+
+    if (o != NULL)
+    {
+        o->next = s->free;
+        s->free = o;
+    }
+}
+
+#endif // COMMON_BUFPOOL_H
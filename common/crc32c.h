@@ -0,0 +1,192 @@
+// CRC32C (Castagnoli), header-only: #include "../common/crc32c.h"
+//
+// x86-64 CPUs with SSE4.2 compute it with the crc32 instruction, three
+// independent streams at a time so the 3-cycle latency is hidden; the
+// streams are merged with a carry-less multiply (PCLMULQDQ). Everything
+// else uses a portable slicing-by-8 table loop. The choice is made once at
+// startup, so callers just use crc32c_update().
+//
+// Values are "finished" CRCs: crc32c_update(0, data, n) is the CRC of data,
+// and crc32c_update(crc32c_update(0, a, na), b, nb) is the CRC of a || b.
+#ifndef COMMON_CRC32C_H
+#define COMMON_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CRC32C_HAVE_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u // Reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+
+static inline uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc; // Little endian: the CRC folds into the first four bytes
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+    }
+    while (len-- > 0)
+    {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_X86
+
+#define CRC32C_STRIDE 8192 // Bytes per stream in the 3-way loop
+
+// x^(8*CRC32C_STRIDE*k - 33) mod P (bit-reflected), k = 2 and 1: multiplying a
+// stream's CRC by these moves it past the following 2 or 1 streams
+static uint64_t crc32c_shift_k1, crc32c_shift_k2;
+
+__attribute__((target("sse4.2,pclmul"))) static inline uint32_t crc32c_shift(uint32_t crc, uint64_t k)
+{
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi64_si128(k), 0);
+    return (uint32_t)_mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul"))) static inline uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t c0 = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC32C_STRIDE)
+    {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC32C_STRIDE; i += 8)
+        {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + CRC32C_STRIDE + i, 8);
+            memcpy(&c, p + 2 * CRC32C_STRIDE + i, 8);
+            c0 = _mm_crc32_u64(c0, a);
+            c1 = _mm_crc32_u64(c1, b);
+            c2 = _mm_crc32_u64(c2, c);
+        }
+        c0 = crc32c_shift((uint32_t)c0, crc32c_shift_k2) ^ crc32c_shift((uint32_t)c1, crc32c_shift_k1) ^ c2;
+        p += 3 * CRC32C_STRIDE;
+        len -= 3 * CRC32C_STRIDE;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    while (len-- > 0)
+    {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    }
+    return ~(uint32_t)c0;
+}
+
+#endif // CRC32C_HAVE_X86
+
+// x^n mod P in reflected form, by square-and-multiply on the raw
+// polynomial (no tables needed, used once at startup)
+static inline uint32_t crc32c_gf_mul(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        if (a & 0x80000000u)
+        {
+            product ^= b;
+        }
+        a <<= 1;
+        b = (b >> 1) ^ ((b & 1) ? CRC32C_POLY : 0);
+    }
+    return product;
+}
+
+static inline uint32_t crc32c_x_pow(uint64_t n)
+{
+    uint32_t result = 0x80000000u, square = 0x40000000u; // 1 and x
+    for (; n > 0; n >>= 1)
+    {
+        if (n & 1)
+        {
+            result = crc32c_gf_mul(result, square);
+        }
+        square = crc32c_gf_mul(square, square);
+    }
+    return result;
+}
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_sw;
+
+// Builds the tables and picks the fastest implementation for this CPU
+__attribute__((constructor)) static void crc32c_setup(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+#ifdef CRC32C_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+    {
+        crc32c_shift_k1 = crc32c_x_pow(8ull * CRC32C_STRIDE - 33);
+        crc32c_shift_k2 = crc32c_x_pow(16ull * CRC32C_STRIDE - 33);
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+// Extends 'crc' (0 for a fresh checksum) with 'len' bytes
+static inline uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+    return crc32c_impl(crc, data, len);
+}
+
+// Name of the implementation in use, for logs and benchmarks
+static inline const char *crc32c_impl_name(void)
+{
+    return crc32c_impl == crc32c_sw ? "slicing-by-8" : "sse4.2+pclmul";
+}
+
+// CRC of A || B from crc(A), crc(B) and the length of B
+static inline uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b)
+{
+    return crc32c_gf_mul(crc32c_x_pow(8 * len_b), crc_a) ^ crc_b;
+}
+
+#endif // COMMON_CRC32C_H
@@ -0,0 +1,82 @@
+// rsync-style delta primitives, header-only: #include "../common/delta.h"
+//
+// The receiver describes its copy of a file as a list of block signatures:
+// a weak rolling checksum that can be slid along the new file one byte at a
+// time in O(1), and a strong hash that confirms a weak match. The sender
+// finds every block of the old copy inside the new file and sends only the
+// bytes in between (literals) plus references to those blocks.
+//
+// The weak checksum is rsync's: two 16-bit running sums over the window,
+// with every byte offset by DELTA_CHAR_OFFSET so runs of zeros still mix.
+// The strong hash is SHA-256 cut to DELTA_STRONG_LEN bytes.
+#ifndef COMMON_DELTA_H
+#define COMMON_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "sha256.h"
+
+#define DELTA_CHAR_OFFSET 31
+#define DELTA_STRONG_LEN 16         // Bytes of SHA-256 kept per block
+#define DELTA_MIN_BLOCK 2048        // Block size bounds; in between it grows with sqrt(file size)
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_LITERAL_MAX (64 * 1024) // Longest literal run in one token
+
+// One block of the receiver's copy; the last block may be shorter
+typedef struct
+{
+    uint32_t weak;
+    unsigned char strong[DELTA_STRONG_LEN];
+} BlockSig;
+
+// Weak checksum of the current window
+typedef struct
+{
+    uint32_t a, b; // Only the low 16 bits of each matter
+    size_t len;
+} Rollsum;
+
+static inline void rollsum_init(Rollsum *r, const unsigned char *p, size_t len)
+{
+    r->a = r->b = 0;
+    r->len = len;
+    for (size_t i = 0; i < len; i++)
+    {
+        r->a += p[i] + DELTA_CHAR_OFFSET;
+        r->b += r->a;
+    }
+}
+
+// Slides the window one byte: 'out' leaves at the front, 'in' joins at the back
+static inline void rollsum_roll(Rollsum *r, unsigned char out, unsigned char in)
+{
+    r->a += in - out;
+    r->b += r->a - (uint32_t)r->len * (out + DELTA_CHAR_OFFSET);
+}
+
+static inline uint32_t rollsum_digest(const Rollsum *r)
+{
+    return (r->b << 16) | (r->a & 0xffff);
+}
+
+static inline void delta_strong(const void *data, size_t len, unsigned char strong[DELTA_STRONG_LEN])
+{
+    unsigned char digest[SHA256_DIGEST_LEN];
+    sha256(data, len, digest);
+    memcpy(strong, digest, DELTA_STRONG_LEN);
+}
+
+// Block size for a receiver copy of 'size' bytes: about sqrt(size), which
+// balances signature bytes against literal bytes per changed region
+static inline int delta_block_size(long long size)
+{
+    long long block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && block * block < size)
+    {
+        block <<= 1;
+    }
+    return (int)block;
+}
+
+#endif // COMMON_DELTA_H
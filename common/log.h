@@ -0,0 +1,167 @@
+// Asynchronous, rate-limited logging, header-only: #include "../common/log.h"
+//
+// log_msg() formats a line on the caller's stack and appends it to a ring
+// buffer; a background thread writes whatever has accumulated to stdout
+// with one fwrite() per batch. Callers never wait on the terminal or a
+// pipe: a line is dropped (and counted) when the ring is full or when more
+// than the configured number of lines per second arrive, and the writer
+// reports how many were suppressed.
+#ifndef COMMON_LOG_H
+#define COMMON_LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_RING_SIZE (256 * 1024) // Bytes of pending lines
+#define LOG_LINE_MAX 512           // Longer lines are truncated
+#define LOG_DEFAULT_RATE 1000      // Lines per second (and burst) before lines are dropped
+#define LOG_DROP_DELAY_S 1         // Longest wait before an idle writer reports dropped lines
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_once_t started;
+    char ring[LOG_RING_SIZE];
+    size_t head, tail;     // Total bytes ever appended / written
+    double rate;           // Lines per second, 0 = unlimited
+    double tokens;
+    long long last_ns;
+    unsigned long long dropped;
+} log_state = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_ONCE_INIT, {0}, 0, 0,
+               LOG_DEFAULT_RATE, LOG_DEFAULT_RATE, 0, 0};
+
+static inline long long log_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *log_writer_main(void *arg)
+{
+    static char batch[64 * 1024];
+    (void)arg;
+
+    pthread_mutex_lock(&log_state.lock);
+    for (;;)
+    {
+        while (log_state.head == log_state.tail && log_state.dropped == 0)
+        {
+            pthread_cond_wait(&log_state.wake, &log_state.lock);
+        }
+        if (log_state.head == log_state.tail)
+        {
+            // Only drops pending: give the burst a second so it is reported once
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += LOG_DROP_DELAY_S;
+            while (log_state.head == log_state.tail &&
+                   pthread_cond_timedwait(&log_state.wake, &log_state.lock, &until) == 0)
+            {
+            }
+        }
+        size_t len = log_state.head - log_state.tail;
+        size_t start = log_state.tail % LOG_RING_SIZE;
+        if (len > sizeof(batch))
+        {
+            len = sizeof(batch);
+        }
+        if (len > LOG_RING_SIZE - start)
+        {
+            len = LOG_RING_SIZE - start; // Up to the wrap; the rest goes in the next batch
+        }
+        memcpy(batch, log_state.ring + start, len);
+        log_state.tail += len;
+        unsigned long long dropped = log_state.head == log_state.tail ? log_state.dropped : 0;
+        log_state.dropped -= dropped;
+        pthread_mutex_unlock(&log_state.lock);
+
+        fwrite(batch, 1, len, stdout);
+        if (dropped > 0)
+        {
+            fprintf(stdout, "[log] %llu lines suppressed\n", dropped);
+        }
+        fflush(stdout);
+        pthread_mutex_lock(&log_state.lock);
+    }
+    return NULL;
+}
+
+static void log_start(void)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_writer_main, NULL) == 0)
+    {
+        pthread_detach(tid);
+    }
+}
+
+// Lines per second let through (and burst size); 0 disables the limit
+static inline void log_set_rate(double lines_per_second)
+{
+    pthread_mutex_lock(&log_state.lock);
+    log_state.rate = lines_per_second;
+    log_state.tokens = lines_per_second;
+    pthread_mutex_unlock(&log_state.lock);
+}
+
+static inline void log_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void log_msg(const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+
+    pthread_once(&log_state.started, log_start);
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+    {
+        return;
+    }
+    if (n >= (int)sizeof(line))
+    {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    long long now = log_now_ns();
+    pthread_mutex_lock(&log_state.lock);
+    if (log_state.rate > 0)
+    {
+        log_state.tokens += log_state.rate * (now - log_state.last_ns) / 1e9;
+        if (log_state.tokens > log_state.rate)
+        {
+            log_state.tokens = log_state.rate;
+        }
+        log_state.last_ns = now;
+    }
+    if ((log_state.rate > 0 && log_state.tokens < 1) || log_state.head - log_state.tail + n > LOG_RING_SIZE)
+    {
+        if (log_state.dropped++ == 0)
+        {
+            pthread_cond_signal(&log_state.wake); // The count is reported even if no line follows
+        }
+    }
+    else
+    {
+        size_t start = log_state.head % LOG_RING_SIZE;
+        size_t first = (size_t)n < LOG_RING_SIZE - start ? (size_t)n : LOG_RING_SIZE - start;
+        memcpy(log_state.ring + start, line, first);
+        memcpy(log_state.ring, line + first, n - first);
+        int idle = log_state.head == log_state.tail;
+        log_state.head += n;
+        log_state.tokens -= 1;
+        if (idle)
+        {
+            pthread_cond_signal(&log_state.wake);
+        }
+    }
+    pthread_mutex_unlock(&log_state.lock);
+}
+
+#endif // COMMON_LOG_H
@@ -0,0 +1,301 @@
+// Built-in fast LZ77 codec (LZ4-style block format) plus the frame format
+// used to stream compressed file bodies. Header-only, no external libraries:
+// #include "../common/lzcodec.h"
+//
+// Stream = sequence of frames, each carrying one block of at most
+// LZ_BLOCK_SIZE raw bytes, so both ends need only bounded memory:
+//   u32 raw_len (little endian)
+//   u32 payload_len | LZ_STORED_FLAG when the block is sent uncompressed
+//   payload
+#ifndef COMMON_LZCODEC_H
+#define COMMON_LZCODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define LZ_BLOCK_SIZE (64 * 1024)                   // Raw bytes per frame
+#define LZ_FRAME_HEADER 8                           // raw_len + payload_len
+#define LZ_MAX_FRAME (LZ_FRAME_HEADER + LZ_BLOCK_SIZE) // Stored frames are never larger than raw
+#define LZ_STORED_FLAG 0x80000000u
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // Block always ends with literals
+#define LZ_MF_LIMIT 12     // No match may start in the last 12 bytes
+
+// Codec identifiers used during negotiation
+#define CODEC_NONE 0
+#define CODEC_LZ 1
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length continuation (runs of 255 plus remainder)
+static inline uint8_t *lz_put_length(uint8_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emits one sequence: literals, then (unless last) a match. Returns NULL if
+// the output would not fit in 'end'.
+static inline uint8_t *lz_emit(uint8_t *op, uint8_t *end, const uint8_t *lit, size_t lit_len,
+                               size_t offset, size_t match_len, int last)
+{
+    uint8_t *token = op++;
+    size_t ml = last ? 0 : match_len - LZ_MIN_MATCH;
+
+    if ((size_t)(end - op) < lit_len + lit_len / 255 + 8 + ml / 255)
+    {
+        return NULL;
+    }
+    *token = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (last ? 0 : (ml < 15 ? ml : 15)));
+    if (lit_len >= 15)
+    {
+        op = lz_put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!last)
+    {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (ml >= 15)
+        {
+            op = lz_put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+// Compresses 'n' bytes; returns the compressed size, or 0 if it does not fit
+// in 'cap' bytes (the caller then stores the block raw).
+static inline size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint8_t *op = dst, *end = dst + cap;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+    if (n > LZ_MF_LIMIT)
+    {
+        size_t limit = n - LZ_MF_LIMIT;
+        while (ip < limit)
+        {
+            uint32_t v = lz_read32(src + ip);
+            uint32_t h = lz_hash(v);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            if (ref < ip && ip - ref <= 65535 && lz_read32(src + ref) == v)
+            {
+                size_t len = LZ_MIN_MATCH;
+                while (ip + len < n - LZ_LAST_LITERALS && src[ref + len] == src[ip + len])
+                {
+                    len++;
+                }
+                if ((op = lz_emit(op, end, src + anchor, ip - anchor, ip - ref, len, 0)) == NULL)
+                {
+                    return 0;
+                }
+                ip += len;
+                anchor = ip;
+            }
+            else
+            {
+                // Accelerate through data that keeps missing
+                ip += 1 + ((ip - anchor) >> 6);
+            }
+        }
+    }
+    if ((op = lz_emit(op, end, src + anchor, n - anchor, 0, 0, 1)) == NULL)
+    {
+        return 0;
+    }
+    return op - dst;
+}
+
+// Decompresses one block; returns the number of bytes produced, or -1 if the
+// input is malformed or would overflow 'cap'.
+static inline long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4, ml = token & 15, offset;
+
+        if (lit == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+        {
+            break; // Last sequence carries literals only
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+        {
+            return -1;
+        }
+        if (ml == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                b = *ip++;
+                ml += b;
+            } while (b == 255);
+        }
+        ml += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < ml)
+        {
+            return -1;
+        }
+        // Byte-wise copy: the match may overlap the bytes it produces
+        for (const uint8_t *m = op - offset; ml > 0; ml--)
+        {
+            *op++ = *m++;
+        }
+    }
+    return op - dst;
+}
+
+// --- Frame encoder ---
+// Blocks that do not shrink by at least 1/16 are sent stored. After repeated
+// misses the encoder stops trying for an exponentially growing number of
+// blocks, so incompressible data costs almost no CPU.
+
+typedef struct
+{
+    unsigned misses;     // Consecutive blocks that did not compress
+    unsigned skip;       // Blocks left to store without trying
+    long long raw_bytes; // Totals for reporting
+    long long wire_bytes;
+} LzEncoder;
+
+static inline void lz_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v, p[1] = (uint8_t)(v >> 8), p[2] = (uint8_t)(v >> 16), p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t lz_get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Encodes up to LZ_BLOCK_SIZE bytes into 'frame' (LZ_MAX_FRAME bytes);
+// returns the total frame length
+static inline size_t lz_encode_frame(LzEncoder *enc, const uint8_t *src, size_t n, uint8_t *frame)
+{
+    size_t payload = 0;
+
+    if (enc->skip > 0)
+    {
+        enc->skip--;
+    }
+    else
+    {
+        payload = lz_compress(src, n, frame + LZ_FRAME_HEADER, n - n / 16);
+        if (payload == 0)
+        {
+            enc->misses++;
+            if (enc->misses >= 4)
+            {
+                unsigned shift = enc->misses - 4 < 8 ? enc->misses - 4 : 8;
+                enc->skip = 1u << shift; // 1, 2, 4 ... 256 blocks
+            }
+        }
+        else
+        {
+            enc->misses = 0;
+        }
+    }
+
+    lz_put32(frame, (uint32_t)n);
+    if (payload == 0)
+    {
+        memcpy(frame + LZ_FRAME_HEADER, src, n);
+        lz_put32(frame + 4, (uint32_t)n | LZ_STORED_FLAG);
+        payload = n;
+    }
+    else
+    {
+        lz_put32(frame + 4, (uint32_t)payload);
+    }
+    enc->raw_bytes += n;
+    enc->wire_bytes += LZ_FRAME_HEADER + payload;
+    return LZ_FRAME_HEADER + payload;
+}
+
+// Parses a frame header; returns the payload length to read next, or -1
+static inline long lz_frame_payload(const uint8_t *header, size_t *raw_len, int *stored)
+{
+    uint32_t raw = lz_get32(header), word = lz_get32(header + 4);
+    uint32_t payload = word & ~LZ_STORED_FLAG;
+
+    *stored = (word & LZ_STORED_FLAG) != 0;
+    *raw_len = raw;
+    if (raw == 0 || raw > LZ_BLOCK_SIZE || payload == 0 || payload > LZ_BLOCK_SIZE || (*stored && payload != raw))
+    {
+        return -1;
+    }
+    return payload;
+}
+
+// Decodes a frame payload into 'out' (LZ_BLOCK_SIZE bytes); returns raw length or -1
+static inline long lz_decode_frame(const uint8_t *payload, size_t payload_len, size_t raw_len, int stored, uint8_t *out)
+{
+    if (stored)
+    {
+        memcpy(out, payload, payload_len);
+        return (long)payload_len;
+    }
+    long n = lz_decompress(payload, payload_len, out, raw_len);
+    return n == (long)raw_len ? n : -1;
+}
+
+#endif // COMMON_LZCODEC_H
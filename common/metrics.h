@@ -0,0 +1,356 @@
+// Lock-free server metrics, header-only: #include "../common/metrics.h"
+//
+// Every thread that records a metric gets its own shard of counters and
+// histograms. Recording is a plain add to memory no other thread writes (a
+// relaxed atomic store, never a locked instruction or a shared cache line);
+// readers sum the shards. A program describes its metrics once with
+// metrics_define() and then refers to them by index.
+//
+// Histograms are HDR-style: each power of two is split into
+// METRICS_SUB_BUCKETS linear buckets, so every sample is known to within
+// 1/METRICS_SUB_BUCKETS (~3%) at any scale, from microseconds to hours, at
+// a fixed cost per sample. Values are recorded in microseconds and exported
+// in seconds.
+//
+// metrics_serve() answers connections on a local port with the current
+// values in the Prometheus text format (plain HTTP, so curl and a
+// Prometheus scrape both work).
+#ifndef COMMON_METRICS_H
+#define COMMON_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_MAX_COUNTERS 32
+#define METRICS_MAX_HISTOGRAMS 4
+#define METRICS_SUB_BITS 5
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_HIST_BUCKETS ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS) // Covers every uint64_t
+#define METRICS_ACCEPT_BACKOFF_MS 100 // Pause after a failed accept() (EMFILE, ENFILE, ...)
+
+typedef enum
+{
+    METRIC_COUNTER, // Only goes up
+    METRIC_GAUGE,   // Goes up and down (inc/dec may happen on different threads)
+    METRIC_SUMMARY  // Histogram, exported as quantiles plus _sum and _count
+} MetricType;
+
+// Consecutive entries with the same name are one metric family with
+// different labels, e.g. {"errors_total", "type=\"recv\"", ...}
+typedef struct
+{
+    const char *name;
+    const char *labels; // Prometheus label pairs without braces, or NULL
+    const char *help;
+    MetricType type;
+} MetricDesc;
+
+typedef struct MetricsShard
+{
+    uint64_t counters[METRICS_MAX_COUNTERS];
+    uint64_t hist[METRICS_MAX_HISTOGRAMS][METRICS_HIST_BUCKETS];
+    uint64_t hist_sum[METRICS_MAX_HISTOGRAMS];
+    struct MetricsShard *next;
+} MetricsShard;
+
+typedef struct
+{
+    char *data;
+    size_t len, cap;
+} MetricsBuf;
+
+static struct
+{
+    pthread_mutex_t lock; // Guards the shard list only
+    const MetricDesc *counters, *histograms;
+    int ncounters, nhistograms;
+    void (*extra)(MetricsBuf *); // Appends program-specific lines to every scrape
+    MetricsShard *shards;
+    uint64_t accept_errors; // Failed accept()s on the metrics port
+} metrics = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread MetricsShard *metrics_shard;
+static MetricsShard metrics_fallback; // Shared by threads whose shard could not be allocated
+
+static inline void metrics_define(const MetricDesc *counters, int ncounters, const MetricDesc *histograms,
+                                  int nhistograms, void (*extra)(MetricsBuf *))
+{
+    metrics.counters = counters;
+    metrics.ncounters = ncounters < METRICS_MAX_COUNTERS ? ncounters : METRICS_MAX_COUNTERS;
+    metrics.histograms = histograms;
+    metrics.nhistograms = nhistograms < METRICS_MAX_HISTOGRAMS ? nhistograms : METRICS_MAX_HISTOGRAMS;
+    metrics.extra = extra;
+}
+
+static MetricsShard *metrics_attach(void)
+{
+    MetricsShard *s = NULL;
+    if (posix_memalign((void **)&s, 64, sizeof(*s)) != 0)
+    {
+        return metrics_shard = &metrics_fallback;
+    }
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&metrics.lock);
+    s->next = metrics.shards;
+    metrics.shards = s;
+    pthread_mutex_unlock(&metrics.lock);
+    return metrics_shard = s;
+}
+
+static inline MetricsShard *metrics_local(void)
+{
+    MetricsShard *s = metrics_shard;
+    return __builtin_expect(s != NULL, 1) ? s : metrics_attach();
+}
+
+// Only the owning thread writes a shard, so a load and a relaxed store
+// suffice; the store keeps concurrent readers from seeing a torn value
+static inline void metrics_add(int id, uint64_t v)
+{
+    uint64_t *c = &metrics_local()->counters[id];
+    __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(int id)
+{
+    metrics_add(id, 1);
+}
+
+static inline void metrics_dec(int id)
+{
+    metrics_add(id, (uint64_t)-1);
+}
+
+static inline int metrics_bucket(uint64_t v)
+{
+    if (v < METRICS_SUB_BUCKETS)
+    {
+        return (int)v;
+    }
+    int shift = 63 - __builtin_clzll(v) - METRICS_SUB_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + (int)((v >> shift) - METRICS_SUB_BUCKETS);
+}
+
+// Highest value that falls into bucket 'b'
+static inline uint64_t metrics_bucket_max(int b)
+{
+    if (b < METRICS_SUB_BUCKETS)
+    {
+        return (uint64_t)b;
+    }
+    int shift = b / METRICS_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(METRICS_SUB_BUCKETS + b % METRICS_SUB_BUCKETS) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void metrics_record(int id, uint64_t micros)
+{
+    MetricsShard *s = metrics_local();
+    uint64_t *b = &s->hist[id][metrics_bucket(micros)];
+    __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->hist_sum[id], s->hist_sum[id] + micros, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_counter_value(int id)
+{
+    uint64_t total = 0;
+    pthread_mutex_lock(&metrics.lock);
+    for (MetricsShard *s = metrics.shards; s != NULL; s = s->next)
+    {
+        total += __atomic_load_n(&s->counters[id], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+    return total + metrics_fallback.counters[id];
+}
+
+static inline void metrics_printf(MetricsBuf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static inline void metrics_printf(MetricsBuf *b, const char *fmt, ...)
+{
+    va_list ap;
+    for (;;)
+    {
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+        {
+            return;
+        }
+        if (b->len + n < b->cap)
+        {
+            b->len += n;
+            return;
+        }
+        size_t cap = b->cap ? 2 * b->cap : 4096;
+        while (cap <= b->len + n)
+        {
+            cap *= 2;
+        }
+        char *grown = realloc(b->data, cap);
+        if (grown == NULL)
+        {
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+}
+
+static inline void metrics_family(MetricsBuf *b, const MetricDesc *d, const MetricDesc *prev)
+{
+    static const char *types[] = {"counter", "gauge", "summary"};
+    if (prev == NULL || strcmp(prev->name, d->name) != 0)
+    {
+        metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, types[d->type]);
+    }
+}
+
+// Appends every metric in the Prometheus text format
+static inline void metrics_render(MetricsBuf *b)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t *merged = calloc(METRICS_HIST_BUCKETS, sizeof(uint64_t));
+
+    for (int i = 0; i < metrics.ncounters; i++)
+    {
+        const MetricDesc *d = &metrics.counters[i];
+        metrics_family(b, d, i > 0 ? d - 1 : NULL);
+        metrics_printf(b, "%s%s%s%s %lld\n", d->name, d->labels ? "{" : "", d->labels ? d->labels : "",
+                       d->labels ? "}" : "", (long long)metrics_counter_value(i));
+    }
+    for (int i = 0; merged != NULL && i < metrics.nhistograms; i++)
+    {
+        const MetricDesc *d = &metrics.histograms[i];
+        uint64_t count = 0, sum = metrics_fallback.hist_sum[i];
+
+        memcpy(merged, metrics_fallback.hist[i], METRICS_HIST_BUCKETS * sizeof(uint64_t));
+        pthread_mutex_lock(&metrics.lock);
+        for (MetricsShard *s = metrics.shards; s != NULL; s = s->next)
+        {
+            for (int k = 0; k < METRICS_HIST_BUCKETS; k++)
+            {
+                merged[k] += __atomic_load_n(&s->hist[i][k], __ATOMIC_RELAXED);
+            }
+            sum += __atomic_load_n(&s->hist_sum[i], __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&metrics.lock);
+        for (int k = 0; k < METRICS_HIST_BUCKETS; k++)
+        {
+            count += merged[k];
+        }
+
+        metrics_family(b, d, i > 0 ? d - 1 : NULL);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        {
+            // Upper edge of the bucket holding the quantile: never under-reports
+            uint64_t rank = (uint64_t)(quantiles[q] * count + 0.5), seen = 0;
+            int k = 0;
+            while (k < METRICS_HIST_BUCKETS - 1 && seen + merged[k] < (rank ? rank : 1))
+            {
+                seen += merged[k++];
+            }
+            metrics_printf(b, "%s{%s%squantile=\"%g\"} %.6f\n", d->name, d->labels ? d->labels : "",
+                           d->labels ? "," : "", quantiles[q], count ? metrics_bucket_max(k) / 1e6 : 0.0);
+        }
+        metrics_printf(b, "%s_sum%s%s%s %.6f\n%s_count%s%s%s %llu\n", d->name, d->labels ? "{" : "",
+                       d->labels ? d->labels : "", d->labels ? "}" : "", sum / 1e6, d->name, d->labels ? "{" : "",
+                       d->labels ? d->labels : "", d->labels ? "}" : "", (unsigned long long)count);
+    }
+    free(merged);
+    metrics_printf(b, "# HELP metrics_accept_errors_total Failed accepts on the metrics port\n"
+                      "# TYPE metrics_accept_errors_total counter\nmetrics_accept_errors_total %llu\n",
+                   (unsigned long long)__atomic_load_n(&metrics.accept_errors, __ATOMIC_RELAXED));
+    if (metrics.extra != NULL)
+    {
+        metrics.extra(b);
+    }
+}
+
+static void *metrics_server_main(void *arg)
+{
+    int listen_fd = (int)(long)arg;
+    struct timeval timeout = {1, 0};
+
+    for (;;)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR)
+            {
+                // Out of descriptors stays that way for a while: don't spin on it
+                __atomic_add_fetch(&metrics.accept_errors, 1, __ATOMIC_RELAXED);
+                usleep(METRICS_ACCEPT_BACKOFF_MS * 1000);
+            }
+            continue;
+        }
+        // A scraper sends an HTTP request first; a bare connection (nc) just gets the body
+        char request[1024];
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+        int http = n >= 4 && memcmp(request, "GET ", 4) == 0;
+
+        MetricsBuf body = {NULL, 0, 0};
+        metrics_render(&body);
+        if (http)
+        {
+            char header[160];
+            int len = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n\r\n", body.len);
+            send(fd, header, len, MSG_NOSIGNAL | MSG_MORE);
+        }
+        for (size_t sent = 0; sent < body.len;)
+        {
+            ssize_t w = send(fd, body.data + sent, body.len - sent, MSG_NOSIGNAL);
+            if (w <= 0)
+            {
+                break;
+            }
+            sent += w;
+        }
+        free(body.data);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Serves the metrics on 127.0.0.1:'port' from a background thread.
+// Returns 0, or -1 with errno set if the port cannot be opened.
+static inline int metrics_serve(int port)
+{
+    struct sockaddr_in addr;
+    pthread_t tid;
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local only: the numbers are not for the world
+    addr.sin_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+        pthread_create(&tid, NULL, metrics_server_main, (void *)(long)fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+#endif // COMMON_METRICS_H
@@ -0,0 +1,144 @@
+// SHA-256 (FIPS 180-4), header-only so every program can still be built
+// from its single .c file: #include "../common/sha256.h"
+#ifndef COMMON_SHA256_H
+#define COMMON_SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SHA256_DIGEST_LEN 32
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t bit_count;
+    unsigned char block[64];
+    size_t block_len;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void sha256_compress(Sha256 *ctx, const unsigned char *p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+    ctx->state[0] += a, ctx->state[1] += b, ctx->state[2] += c, ctx->state[3] += d;
+    ctx->state[4] += e, ctx->state[5] += f, ctx->state[6] += g, ctx->state[7] += h;
+}
+
+static inline void sha256_init(Sha256 *ctx)
+{
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->bit_count = 0;
+    ctx->block_len = 0;
+}
+
+static inline void sha256_update(Sha256 *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    ctx->bit_count += (uint64_t)len * 8;
+    if (ctx->block_len > 0)
+    {
+        size_t take = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+        memcpy(ctx->block + ctx->block_len, p, take);
+        ctx->block_len += take;
+        p += take;
+        len -= take;
+        if (ctx->block_len < 64)
+        {
+            return;
+        }
+        sha256_compress(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+    {
+        sha256_compress(ctx, p);
+    }
+    memcpy(ctx->block, p, len);
+    ctx->block_len = len;
+}
+
+static inline void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    uint64_t bits = ctx->bit_count;
+    unsigned char pad = 0x80;
+    unsigned char len_be[8];
+
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->block_len != 56)
+    {
+        sha256_update(ctx, &pad, 1);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        len_be[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, len_be, 8);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+// One-shot helper
+static inline void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+// Lower-case hex rendering; 'out' needs 2 * SHA256_DIGEST_LEN + 1 bytes
+static inline void sha256_hex(const unsigned char digest[SHA256_DIGEST_LEN], char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_LEN; i++)
+    {
+        out[2 * i] = hex[digest[i] >> 4];
+        out[2 * i + 1] = hex[digest[i] & 15];
+    }
+    out[2 * SHA256_DIGEST_LEN] = '\0';
+}
+
+#endif // COMMON_SHA256_H
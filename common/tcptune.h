@@ -0,0 +1,223 @@
+// TCP chunk size and socket buffer auto-tuning, header-only: #include "../common/tcptune.h"
+//
+// The best write size and socket buffer depend on the path: 4 KB writes and
+// default buffers are fine on loopback and starve a long fat link. A
+// TcpTune samples TCP_INFO while a transfer runs (at most once every
+// TCP_TUNE_INTERVAL_NS), estimates the bandwidth-delay product from the
+// kernel's delivery rate and minimum RTT, and sizes from it:
+//
+//  - the socket buffer (SO_SNDBUF on the sender, SO_RCVBUF on the receiver):
+//    it asks for twice the BDP, which the kernel doubles to cover its own
+//    bookkeeping. The buffer is only ever raised, and only past what the
+//    kernel's autotuning has already reached: setting it turns that
+//    autotuning off for the socket, and below that point the kernel knows
+//    better;
+//  - the chunk the sender hands the kernel per call: a quarter of the BDP,
+//    within [TCP_TUNE_MIN_CHUNK, TCP_TUNE_MAX_CHUNK];
+//  - TCP_NOTSENT_LOWAT, a few chunks: bytes queued beyond what the window
+//    can take are memory that buys nothing, and poll() reports the socket
+//    writable only once another chunk's worth has drained.
+//
+// A caller with a memory budget sets 'limit' after tcp_tune_init(); the
+// buffer then stops there and the report says so.
+//
+// A window-limited connection measures a rate of about window/RTT, so every
+// sample that finds the buffer too small doubles it, until the path rather
+// than the buffer is the bottleneck.
+#ifndef COMMON_TCPTUNE_H
+#define COMMON_TCPTUNE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define TCP_TUNE_INTERVAL_NS 20000000LL  // TCP_INFO is sampled at most this often
+#define TCP_TUNE_MIN_CHUNK (64 * 1024)   // Chunk bounds; the chunk starts at the minimum
+#define TCP_TUNE_MAX_CHUNK (1024 * 1024)
+#define TCP_TUNE_LOWAT_CHUNKS 4          // TCP_NOTSENT_LOWAT, in chunks
+
+enum tcp_tune_role
+{
+    TCP_TUNE_SEND, // Tunes SO_SNDBUF, the chunk and TCP_NOTSENT_LOWAT
+    TCP_TUNE_RECV  // Tunes SO_RCVBUF
+};
+
+// The start of the kernel's struct tcp_info (linux/tcp.h, which clashes with
+// netinet/tcp.h). The kernel only ever appends fields and reports how many
+// bytes it filled in, so an older kernel just leaves the tail unset.
+typedef struct
+{
+    uint8_t state, ca_state, retransmits, probes, backoff, options, wscale, flags;
+    uint32_t rto, ato, snd_mss, rcv_mss;
+    uint32_t unacked, sacked, lost, retrans, fackets;
+    uint32_t last_data_sent, last_ack_sent, last_data_recv, last_ack_recv;
+    uint32_t pmtu, rcv_ssthresh, rtt, rttvar, snd_ssthresh, snd_cwnd, advmss, reordering;
+    uint32_t rcv_rtt, rcv_space;
+    uint32_t total_retrans;
+    uint64_t pacing_rate, max_pacing_rate, bytes_acked, bytes_received;
+    uint32_t segs_out, segs_in;
+    uint32_t notsent_bytes, min_rtt, data_segs_in, data_segs_out;
+    uint64_t delivery_rate;
+} TcpTuneInfo;
+
+typedef struct
+{
+    int fd;
+    int role;
+    size_t chunk;        // Bytes to hand the kernel per call
+    int buf;             // Socket buffer in effect, as getsockopt() reports it
+    int buf_capped;      // The buffer cannot grow further (limit, rmem_max/wmem_max)
+    int limit;           // Largest buffer to ask for, 0 for the kernel's maximum
+    int lowat;           // TCP_NOTSENT_LOWAT in effect, 0 if not set
+    int raised;          // Samples that raised the chunk or the buffer
+    uint32_t rtt_us;     // RTT the last estimate used
+    uint64_t rate;       // Bytes per second at the last sample
+    uint64_t bdp;        // Largest bandwidth-delay product estimated so far
+    uint64_t last_bytes; // Receiver: bytes_received at the previous sample
+    long long last_ns, next_ns;
+} TcpTune;
+
+static inline long long tcp_tune_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int tcp_tune_getbuf(const TcpTune *t)
+{
+    int value = 0;
+    socklen_t len = sizeof(value);
+    getsockopt(t->fd, SOL_SOCKET, t->role == TCP_TUNE_SEND ? SO_SNDBUF : SO_RCVBUF, &value, &len);
+    return value;
+}
+
+static inline void tcp_tune_set_lowat(TcpTune *t)
+{
+    int lowat = (int)(TCP_TUNE_LOWAT_CHUNKS * t->chunk);
+    if (t->role == TCP_TUNE_SEND && lowat != t->lowat &&
+        setsockopt(t->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == 0)
+    {
+        t->lowat = lowat;
+    }
+}
+
+// Holds back (on != 0) or releases partial segments, so small writes such as
+// headers and checksums share segments with the data around them
+static inline void tcp_tune_cork(int fd, int on)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Starts tuning a connected socket. A sender also gets TCP_NODELAY: its
+// writes are chunk-sized anyway, and a short header or trailer should not
+// wait an RTT for the previous segment's ACK (writes that belong together
+// say so with MSG_MORE or tcp_tune_cork())
+static inline void tcp_tune_init(TcpTune *t, int fd, enum tcp_tune_role role)
+{
+    int on = 1;
+
+    memset(t, 0, sizeof(*t));
+    t->fd = fd;
+    t->role = role;
+    t->chunk = TCP_TUNE_MIN_CHUNK;
+    if (role == TCP_TUNE_SEND)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    t->buf = tcp_tune_getbuf(t);
+    tcp_tune_set_lowat(t);
+    t->last_ns = tcp_tune_now_ns();
+    t->next_ns = t->last_ns + TCP_TUNE_INTERVAL_NS;
+}
+
+// Call as the transfer goes; cheap when no sample is due.
+// Returns 1 if the chunk or the socket buffer changed.
+static inline int tcp_tune_update(TcpTune *t)
+{
+    long long now = tcp_tune_now_ns();
+    TcpTuneInfo info;
+    socklen_t len = sizeof(info);
+    uint64_t rate;
+
+    if (now < t->next_ns)
+    {
+        return 0;
+    }
+    t->next_ns = now + TCP_TUNE_INTERVAL_NS;
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(t->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.rtt == 0)
+    {
+        return 0;
+    }
+    int full = len >= offsetof(TcpTuneInfo, delivery_rate) + sizeof(info.delivery_rate);
+    // The minimum RTT is the path; the smoothed one includes our own queueing
+    t->rtt_us = full && info.min_rtt ? info.min_rtt : info.rtt;
+    if (t->role == TCP_TUNE_RECV)
+    {
+        // A receiver has no delivery rate of its own: count bytes between samples
+        rate = full ? (info.bytes_received - t->last_bytes) * 1000000000ULL / (uint64_t)(now - t->last_ns) : 0;
+        t->last_bytes = info.bytes_received;
+    }
+    else
+    {
+        // Older kernels: one congestion window per RTT
+        rate = full ? info.delivery_rate : (uint64_t)info.snd_cwnd * info.snd_mss * 1000000ULL / info.rtt;
+    }
+    t->last_ns = now;
+    if (rate == 0)
+    {
+        return 0;
+    }
+    t->rate = rate;
+
+    uint64_t bdp = rate * t->rtt_us / 1000000;
+    if (bdp <= t->bdp)
+    {
+        return 0;
+    }
+    t->bdp = bdp;
+
+    int changed = 0;
+    size_t chunk = bdp / 4;
+    chunk = chunk < TCP_TUNE_MIN_CHUNK ? TCP_TUNE_MIN_CHUNK : chunk > TCP_TUNE_MAX_CHUNK ? TCP_TUNE_MAX_CHUNK : chunk;
+    chunk = (chunk + 4095) & ~(size_t)4095;
+    if (t->role == TCP_TUNE_SEND && chunk > t->chunk)
+    {
+        t->chunk = chunk;
+        tcp_tune_set_lowat(t);
+        changed = 1;
+    }
+
+    // getsockopt() reports the doubled value; the kernel caps requests at rmem_max/wmem_max
+    uint64_t want = 2 * bdp < (1U << 30) ? 2 * bdp : (1U << 30);
+    int at_limit = t->limit > 0 && want >= (uint64_t)t->limit;
+    want = at_limit ? (uint64_t)t->limit : want;
+    t->buf = tcp_tune_getbuf(t);
+    if (!t->buf_capped && (uint64_t)t->buf < 2 * want)
+    {
+        int value = (int)want, before = t->buf;
+        setsockopt(t->fd, SOL_SOCKET, t->role == TCP_TUNE_SEND ? SO_SNDBUF : SO_RCVBUF, &value, sizeof(value));
+        t->buf = tcp_tune_getbuf(t);
+        t->buf_capped = (uint64_t)t->buf < 2 * want;
+        changed |= t->buf != before;
+    }
+    t->buf_capped |= at_limit; // Raised once more (if at all), then left alone
+    t->raised += changed;
+    return changed;
+}
+
+// One line describing what the tuner measured and chose
+static inline void tcp_tune_format(const TcpTune *t, char *out, size_t len)
+{
+    snprintf(out, len, "rtt %.3f ms, %.1f MB/s, bdp %llu KB, chunk %zu KB, %s %d KB%s", t->rtt_us / 1000.0,
+             t->rate / 1e6, (unsigned long long)(t->bdp / 1024), t->chunk / 1024,
+             t->role == TCP_TUNE_SEND ? "sndbuf" : "rcvbuf", t->buf / 1024, t->buf_capped ? " (at the limit)" : "");
+}
+
+#endif // COMMON_TCPTUNE_H
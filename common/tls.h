@@ -0,0 +1,654 @@
+// Encrypted transport for file bodies, header-only: #include "../common/tls.h"
+//
+// Bodies are sent as TLS 1.3 records with AES-128-GCM (the same record
+// format, nonces and sequence numbers as RFC 8446), so once both ends have
+// the keys the record layer can be handed to the kernel (kTLS, setsockopt
+// SOL_TLS) and sendfile()/splice() keep working on encrypted sockets. When
+// the kernel has no TLS support the same records are built and checked in
+// userspace by the AES-GCM code below (AES-NI + PCLMULQDQ when the CPU has
+// them, portable tables otherwise, picked once at startup like crc32c.h).
+//
+// The handshake is not TLS's: there are no certificates in this tree, so
+// both ends share a key file (PSK) and exchange fresh 16-byte nonces in the
+// plaintext request/response headers. Keys come from HKDF-SHA256 over the
+// PSK with both nonces as salt, so every connection has its own keys and a
+// peer without the PSK fails the first record's tag check.
+#ifndef COMMON_TLS_H
+#define COMMON_TLS_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include "sha256.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define AESGCM_HAVE_X86 1
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define TLS_NONCE_LEN 16       // Handshake nonce sent by each side
+#define TLS_HEADER_LEN 5       // Record header: type, legacy version, length
+#define TLS_TAG_LEN 16
+#define TLS_RECORD_MAX 16384   // Plaintext bytes per record
+#define TLS_RECORD_OVERHEAD (TLS_HEADER_LEN + 1 + TLS_TAG_LEN) // Header, inner content type, tag
+#define TLS_RECORD_WIRE_MAX (TLS_HEADER_LEN + TLS_RECORD_MAX + 256) // Largest record a peer may send
+#define TLS_APPLICATION_DATA 23
+
+// --- AES-128 ---
+
+static const uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76, 0xca, 0x82, 0xc9,
+    0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f,
+    0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15, 0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07,
+    0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3,
+    0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58,
+    0xcf, 0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3,
+    0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec, 0x5f,
+    0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73, 0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+    0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac,
+    0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a,
+    0xae, 0x08, 0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a, 0x70,
+    0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1, 0xf8, 0x98, 0x11,
+    0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf, 0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42,
+    0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
+
+static inline uint8_t aes_xtime(uint8_t x)
+{
+    return (uint8_t)((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+// FIPS 197 key schedule; AESENC takes the round keys in this same byte order
+static inline void aes128_expand(const uint8_t key[16], uint8_t rk[176])
+{
+    uint8_t rcon = 1;
+
+    memcpy(rk, key, 16);
+    for (int i = 16; i < 176; i += 4)
+    {
+        uint8_t t[4];
+        memcpy(t, rk + i - 4, 4);
+        if (i % 16 == 0)
+        {
+            uint8_t u = t[0];
+            t[0] = aes_sbox[t[1]] ^ rcon;
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[u];
+            rcon = aes_xtime(rcon);
+        }
+        for (int j = 0; j < 4; j++)
+        {
+            rk[i + j] = rk[i + j - 16] ^ t[j];
+        }
+    }
+}
+
+static inline void aes128_encrypt_sw(const uint8_t rk[176], const uint8_t in[16], uint8_t out[16])
+{
+    uint8_t s[16], t[16];
+
+    for (int i = 0; i < 16; i++)
+    {
+        s[i] = in[i] ^ rk[i];
+    }
+    for (int round = 1; round <= 10; round++)
+    {
+        // SubBytes + ShiftRows (the state is column-major: s[4 * column + row])
+        for (int c = 0; c < 4; c++)
+        {
+            for (int r = 0; r < 4; r++)
+            {
+                t[4 * c + r] = aes_sbox[s[4 * ((c + r) & 3) + r]];
+            }
+        }
+        if (round < 10) // MixColumns
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                uint8_t *a = t + 4 * c, a0 = a[0], all = a[0] ^ a[1] ^ a[2] ^ a[3];
+                a[0] ^= all ^ aes_xtime(a[0] ^ a[1]);
+                a[1] ^= all ^ aes_xtime(a[1] ^ a[2]);
+                a[2] ^= all ^ aes_xtime(a[2] ^ a[3]);
+                a[3] ^= all ^ aes_xtime(a[3] ^ a0);
+            }
+        }
+        for (int i = 0; i < 16; i++)
+        {
+            s[i] = t[i] ^ rk[16 * round + i];
+        }
+    }
+    memcpy(out, s, 16);
+}
+
+// --- GCM (NIST SP 800-38D), 96-bit IVs only ---
+
+typedef struct
+{
+    uint8_t rk[176];
+    uint8_t h[16]; // E(K, 0): the GHASH key
+} AesGcm;
+
+static inline uint64_t aesgcm_load_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void aesgcm_store_be64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8)
+    {
+        p[i] = (uint8_t)v;
+    }
+}
+
+// CTR keystream from counter block iv || 'counter', XORed into 'len' bytes
+static inline void aesgcm_ctr_sw(const AesGcm *g, const uint8_t iv[12], uint32_t counter, const uint8_t *in,
+                                 uint8_t *out, size_t len)
+{
+    uint8_t block[16], stream[16];
+
+    memcpy(block, iv, 12);
+    for (size_t off = 0; off < len; off += 16, counter++)
+    {
+        block[12] = (uint8_t)(counter >> 24);
+        block[13] = (uint8_t)(counter >> 16);
+        block[14] = (uint8_t)(counter >> 8);
+        block[15] = (uint8_t)counter;
+        aes128_encrypt_sw(g->rk, block, stream);
+        size_t n = len - off < 16 ? len - off : 16;
+        for (size_t i = 0; i < n; i++)
+        {
+            out[off + i] = in[off + i] ^ stream[i];
+        }
+    }
+}
+
+// x = x * h in GF(2^128), bit by bit
+static inline void aesgcm_gmul_sw(uint8_t x[16], const uint8_t h[16])
+{
+    uint64_t zh = 0, zl = 0, vh = aesgcm_load_be64(h), vl = aesgcm_load_be64(h + 8);
+
+    for (int i = 0; i < 128; i++)
+    {
+        if ((x[i >> 3] >> (7 - (i & 7))) & 1)
+        {
+            zh ^= vh;
+            zl ^= vl;
+        }
+        uint64_t lsb = vl & 1;
+        vl = (vl >> 1) | (vh << 63);
+        vh = (vh >> 1) ^ (lsb ? 0xe100000000000000ull : 0);
+    }
+    aesgcm_store_be64(x, zh);
+    aesgcm_store_be64(x + 8, zl);
+}
+
+// GHASH over aad || pad || c || pad || lengths
+static inline void aesgcm_ghash_sw(const AesGcm *g, const uint8_t *aad, size_t aad_len, const uint8_t *c,
+                                   size_t c_len, uint8_t out[16])
+{
+    const uint8_t *parts[2] = {aad, c};
+    size_t lens[2] = {aad_len, c_len};
+    uint8_t x[16] = {0};
+
+    for (int p = 0; p < 2; p++)
+    {
+        for (size_t off = 0; off < lens[p]; off += 16)
+        {
+            size_t n = lens[p] - off < 16 ? lens[p] - off : 16;
+            for (size_t i = 0; i < n; i++)
+            {
+                x[i] ^= parts[p][off + i];
+            }
+            aesgcm_gmul_sw(x, g->h);
+        }
+    }
+    uint8_t lengths[16];
+    aesgcm_store_be64(lengths, (uint64_t)aad_len * 8);
+    aesgcm_store_be64(lengths + 8, (uint64_t)c_len * 8);
+    for (int i = 0; i < 16; i++)
+    {
+        x[i] ^= lengths[i];
+    }
+    aesgcm_gmul_sw(x, g->h);
+    memcpy(out, x, 16);
+}
+
+#ifdef AESGCM_HAVE_X86
+
+#define AESGCM_TARGET __attribute__((target("aes,pclmul,sse4.1")))
+
+// Eight counter blocks in flight so AESENC's latency overlaps
+AESGCM_TARGET static inline void aesgcm_ctr_hw(const AesGcm *g, const uint8_t iv[12], uint32_t counter,
+                                               const uint8_t *in, uint8_t *out, size_t len)
+{
+    uint8_t iv_block[16] = {0};
+    __m128i k[11], b[8];
+
+    for (int i = 0; i < 11; i++)
+    {
+        k[i] = _mm_loadu_si128((const __m128i *)(g->rk + 16 * i));
+    }
+    memcpy(iv_block, iv, 12);
+    const __m128i base = _mm_loadu_si128((const __m128i *)iv_block);
+    for (; len >= 128; len -= 128, in += 128, out += 128) // Fully unrolled: b[] stays in registers
+    {
+#pragma GCC unroll 8
+        for (int j = 0; j < 8; j++, counter++)
+        {
+            b[j] = _mm_xor_si128(_mm_insert_epi32(base, (int)__builtin_bswap32(counter), 3), k[0]);
+        }
+#pragma GCC unroll 9
+        for (int r = 1; r < 10; r++)
+        {
+#pragma GCC unroll 8
+            for (int j = 0; j < 8; j++)
+            {
+                b[j] = _mm_aesenc_si128(b[j], k[r]);
+            }
+        }
+#pragma GCC unroll 8
+        for (int j = 0; j < 8; j++)
+        {
+            b[j] = _mm_aesenclast_si128(b[j], k[10]);
+            _mm_storeu_si128((__m128i *)out + j, _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)in + j)));
+        }
+    }
+    while (len > 0)
+    {
+        int blocks = len >= 128 ? 8 : (int)((len + 15) / 16);
+        for (int j = 0; j < blocks; j++, counter++)
+        {
+            b[j] = _mm_xor_si128(_mm_insert_epi32(base, (int)__builtin_bswap32(counter), 3), k[0]);
+        }
+        for (int r = 1; r < 10; r++)
+        {
+            for (int j = 0; j < blocks; j++)
+            {
+                b[j] = _mm_aesenc_si128(b[j], k[r]);
+            }
+        }
+        for (int j = 0; j < blocks; j++)
+        {
+            b[j] = _mm_aesenclast_si128(b[j], k[10]);
+            if (len >= 16)
+            {
+                _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)in)));
+                in += 16;
+                out += 16;
+                len -= 16;
+            }
+            else
+            {
+                uint8_t stream[16];
+                _mm_storeu_si128((__m128i *)stream, b[j]);
+                for (size_t i = 0; i < len; i++)
+                {
+                    out[i] = in[i] ^ stream[i];
+                }
+                len = 0;
+            }
+        }
+    }
+}
+
+// GF(2^128) multiply on byte-reversed operands, after Intel's "Carry-Less
+// Multiplication and Its Usage for Computing the GCM Mode". The 256-bit
+// product and its reduction are separate steps so that several products can
+// be summed and reduced once.
+AESGCM_TARGET static inline void aesgcm_clmul_hw(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8));
+    *hi = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8));
+}
+
+AESGCM_TARGET static inline __m128i aesgcm_reduce_hw(__m128i lo, __m128i hi)
+{
+    // The product is bit-reflected: shift the 256-bit value left by one
+    __m128i lo_carry = _mm_srli_epi32(lo, 31), hi_carry = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i cross = _mm_srli_si128(lo_carry, 12);
+    hi_carry = _mm_slli_si128(hi_carry, 4);
+    lo_carry = _mm_slli_si128(lo_carry, 4);
+    lo = _mm_or_si128(lo, lo_carry);
+    hi = _mm_or_si128(_mm_or_si128(hi, hi_carry), cross);
+
+    // Reduce modulo x^128 + x^7 + x^2 + x + 1
+    __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i t_hi = _mm_srli_si128(t, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+    __m128i u = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    u = _mm_xor_si128(u, t_hi);
+    lo = _mm_xor_si128(lo, u);
+    return _mm_xor_si128(hi, lo);
+}
+
+AESGCM_TARGET static inline __m128i aesgcm_gmul_hw(__m128i a, __m128i b)
+{
+    __m128i lo, hi;
+    aesgcm_clmul_hw(a, b, &lo, &hi);
+    return aesgcm_reduce_hw(lo, hi);
+}
+
+AESGCM_TARGET static inline void aesgcm_ghash_hw(const AesGcm *g, const uint8_t *aad, size_t aad_len,
+                                                 const uint8_t *c, size_t c_len, uint8_t out[16])
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)g->h), bswap);
+    const uint8_t *parts[2] = {aad, c};
+    size_t lens[2] = {aad_len, c_len};
+    __m128i x = _mm_setzero_si128();
+
+    // Four blocks per step against H^4..H: the multiplies are independent,
+    // so they pipeline, and their sum is reduced once
+    const __m128i h2 = aesgcm_gmul_hw(h, h), h3 = aesgcm_gmul_hw(h2, h), h4 = aesgcm_gmul_hw(h3, h);
+
+    for (int p = 0; p < 2; p++)
+    {
+        size_t off = 0;
+        for (; off + 64 <= lens[p]; off += 64)
+        {
+            const __m128i *q = (const __m128i *)(parts[p] + off);
+            __m128i b0 = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128(q), bswap));
+            __m128i b1 = _mm_shuffle_epi8(_mm_loadu_si128(q + 1), bswap);
+            __m128i b2 = _mm_shuffle_epi8(_mm_loadu_si128(q + 2), bswap);
+            __m128i b3 = _mm_shuffle_epi8(_mm_loadu_si128(q + 3), bswap);
+            __m128i lo[4], hi[4];
+            aesgcm_clmul_hw(b0, h4, &lo[0], &hi[0]);
+            aesgcm_clmul_hw(b1, h3, &lo[1], &hi[1]);
+            aesgcm_clmul_hw(b2, h2, &lo[2], &hi[2]);
+            aesgcm_clmul_hw(b3, h, &lo[3], &hi[3]);
+            x = aesgcm_reduce_hw(_mm_xor_si128(_mm_xor_si128(lo[0], lo[1]), _mm_xor_si128(lo[2], lo[3])),
+                                 _mm_xor_si128(_mm_xor_si128(hi[0], hi[1]), _mm_xor_si128(hi[2], hi[3])));
+        }
+        for (; off + 16 <= lens[p]; off += 16)
+        {
+            __m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(parts[p] + off)), bswap);
+            x = aesgcm_gmul_hw(_mm_xor_si128(x, block), h);
+        }
+        if (off < lens[p])
+        {
+            uint8_t tail[16] = {0};
+            memcpy(tail, parts[p] + off, lens[p] - off);
+            __m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)tail), bswap);
+            x = aesgcm_gmul_hw(_mm_xor_si128(x, block), h);
+        }
+    }
+    __m128i lengths = _mm_set_epi64x((long long)aad_len * 8, (long long)c_len * 8);
+    x = aesgcm_gmul_hw(_mm_xor_si128(x, lengths), h);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(x, bswap));
+}
+
+#endif // AESGCM_HAVE_X86
+
+static void (*aesgcm_ctr_impl)(const AesGcm *, const uint8_t *, uint32_t, const uint8_t *, uint8_t *,
+                               size_t) = aesgcm_ctr_sw;
+static void (*aesgcm_ghash_impl)(const AesGcm *, const uint8_t *, size_t, const uint8_t *, size_t,
+                                 uint8_t *) = aesgcm_ghash_sw;
+
+__attribute__((constructor)) static void aesgcm_setup(void)
+{
+#ifdef AESGCM_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        aesgcm_ctr_impl = aesgcm_ctr_hw;
+        aesgcm_ghash_impl = aesgcm_ghash_hw;
+    }
+#endif
+}
+
+// Name of the implementation in use, for logs and benchmarks
+static inline const char *aesgcm_impl_name(void)
+{
+    return aesgcm_ctr_impl == aesgcm_ctr_sw ? "portable" : "aes-ni+pclmul";
+}
+
+static inline void aesgcm_init(AesGcm *g, const uint8_t key[16])
+{
+    static const uint8_t zero[16];
+    aes128_expand(key, g->rk);
+    aes128_encrypt_sw(g->rk, zero, g->h);
+}
+
+// Encrypts 'len' bytes (in place is fine) and produces the tag
+static inline void aesgcm_seal(const AesGcm *g, const uint8_t iv[12], const uint8_t *aad, size_t aad_len,
+                               const uint8_t *in, uint8_t *out, size_t len, uint8_t tag[16])
+{
+    static const uint8_t zero[16];
+    uint8_t mask[16];
+
+    aesgcm_ctr_impl(g, iv, 2, in, out, len);
+    aesgcm_ghash_impl(g, aad, aad_len, out, len, tag);
+    aesgcm_ctr_impl(g, iv, 1, zero, mask, 16);
+    for (int i = 0; i < 16; i++)
+    {
+        tag[i] ^= mask[i];
+    }
+}
+
+// Checks the tag, then decrypts (in place is fine). Returns 0, or -1 if
+// the tag does not match (nothing is written then).
+static inline int aesgcm_open(const AesGcm *g, const uint8_t iv[12], const uint8_t *aad, size_t aad_len,
+                              const uint8_t *in, uint8_t *out, size_t len, const uint8_t tag[16])
+{
+    static const uint8_t zero[16];
+    uint8_t expected[16], mask[16], diff = 0;
+
+    aesgcm_ghash_impl(g, aad, aad_len, in, len, expected);
+    aesgcm_ctr_impl(g, iv, 1, zero, mask, 16);
+    for (int i = 0; i < 16; i++)
+    {
+        diff |= expected[i] ^ mask[i] ^ tag[i];
+    }
+    if (diff != 0)
+    {
+        return -1;
+    }
+    aesgcm_ctr_impl(g, iv, 2, in, out, len);
+    return 0;
+}
+
+// --- Key schedule: HKDF-SHA256 (RFC 5869) over the PSK ---
+
+static inline void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t len,
+                               uint8_t mac[SHA256_DIGEST_LEN])
+{
+    uint8_t k[64] = {0}, pad[64], inner[SHA256_DIGEST_LEN];
+    Sha256 ctx;
+
+    if (key_len > sizeof(k))
+    {
+        sha256(key, key_len, k);
+    }
+    else
+    {
+        memcpy(k, key, key_len);
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        pad[i] = k[i] ^ 0x36;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, 64);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, inner);
+    for (int i = 0; i < 64; i++)
+    {
+        pad[i] = k[i] ^ 0x5c;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, 64);
+    sha256_update(&ctx, inner, sizeof(inner));
+    sha256_final(&ctx, mac);
+}
+
+// One direction of a connection: key, static IV and record sequence number
+typedef struct
+{
+    AesGcm gcm;
+    uint8_t key[16];
+    uint8_t iv[12];
+    uint64_t seq;
+} TlsKey;
+
+// Keys for the server -> client direction of a connection
+static inline void tls_derive_key(const uint8_t *psk, size_t psk_len, const uint8_t client_nonce[TLS_NONCE_LEN],
+                                  const uint8_t server_nonce[TLS_NONCE_LEN], TlsKey *k)
+{
+    uint8_t salt[2 * TLS_NONCE_LEN], prk[SHA256_DIGEST_LEN], okm[SHA256_DIGEST_LEN];
+    static const uint8_t key_info[] = "s2c key\x01", iv_info[] = "s2c iv\x01";
+
+    memcpy(salt, client_nonce, TLS_NONCE_LEN);
+    memcpy(salt + TLS_NONCE_LEN, server_nonce, TLS_NONCE_LEN);
+    hmac_sha256(salt, sizeof(salt), psk, psk_len, prk); // HKDF-Extract
+    hmac_sha256(prk, sizeof(prk), key_info, sizeof(key_info) - 1, okm); // HKDF-Expand, one block each
+    memcpy(k->key, okm, 16);
+    hmac_sha256(prk, sizeof(prk), iv_info, sizeof(iv_info) - 1, okm);
+    memcpy(k->iv, okm, 12);
+    k->seq = 0;
+    aesgcm_init(&k->gcm, k->key);
+}
+
+// --- Records ---
+
+static inline void tls_record_nonce(const TlsKey *k, uint8_t nonce[12])
+{
+    memcpy(nonce, k->iv, 12);
+    for (int i = 0; i < 8; i++)
+    {
+        nonce[11 - i] ^= (uint8_t)(k->seq >> (8 * i));
+    }
+}
+
+// Total size of the record whose header is at 'p'
+static inline size_t tls_record_len(const uint8_t *p)
+{
+    return TLS_HEADER_LEN + ((size_t)p[3] << 8 | p[4]);
+}
+
+// Seals up to TLS_RECORD_MAX bytes as one application_data record into
+// 'out' (room for len + TLS_RECORD_OVERHEAD). Returns the record size.
+static inline size_t tls_seal_record(TlsKey *k, const void *data, size_t len, uint8_t *out)
+{
+    uint8_t nonce[12];
+    size_t inner = len + 1; // TLSInnerPlaintext: data || content type
+
+    out[0] = TLS_APPLICATION_DATA;
+    out[1] = 0x03;
+    out[2] = 0x03;
+    out[3] = (uint8_t)((inner + TLS_TAG_LEN) >> 8);
+    out[4] = (uint8_t)(inner + TLS_TAG_LEN);
+    memmove(out + TLS_HEADER_LEN, data, len);
+    out[TLS_HEADER_LEN + len] = TLS_APPLICATION_DATA;
+    tls_record_nonce(k, nonce);
+    aesgcm_seal(&k->gcm, nonce, out, TLS_HEADER_LEN, out + TLS_HEADER_LEN, out + TLS_HEADER_LEN, inner,
+                out + TLS_HEADER_LEN + inner);
+    k->seq++;
+    return TLS_HEADER_LEN + inner + TLS_TAG_LEN;
+}
+
+// Opens the complete record at 'record' into 'out' (room for
+// TLS_RECORD_WIRE_MAX bytes). Returns the application data length, or -1
+// if the record is forged, corrupt or not application data.
+static inline long tls_open_record(TlsKey *k, const uint8_t *record, size_t len, uint8_t *out)
+{
+    uint8_t nonce[12];
+
+    if (len < TLS_HEADER_LEN + 1 + TLS_TAG_LEN || len != tls_record_len(record) || record[0] != TLS_APPLICATION_DATA)
+    {
+        return -1;
+    }
+    size_t inner = len - TLS_HEADER_LEN - TLS_TAG_LEN;
+    tls_record_nonce(k, nonce);
+    if (aesgcm_open(&k->gcm, nonce, record, TLS_HEADER_LEN, record + TLS_HEADER_LEN, out, inner,
+                    record + TLS_HEADER_LEN + inner) < 0)
+    {
+        return -1;
+    }
+    k->seq++;
+    while (inner > 0 && out[inner - 1] == 0) // Strip padding, then the real content type
+    {
+        inner--;
+    }
+    if (inner == 0 || out[inner - 1] != TLS_APPLICATION_DATA)
+    {
+        return -1;
+    }
+    return (long)inner - 1;
+}
+
+// Reads the shared key file; at least 16 bytes of it, any content.
+// Returns 0, or -1 with a message printed.
+static inline int tls_load_psk(const char *path, uint8_t **psk, size_t *psk_len)
+{
+    FILE *fp = fopen(path, "rb");
+    uint8_t *buf = malloc(4096);
+    size_t n = 0;
+
+    if (fp == NULL || buf == NULL)
+    {
+        perror(path);
+        if (fp != NULL)
+        {
+            fclose(fp);
+        }
+        free(buf);
+        return -1;
+    }
+    n = fread(buf, 1, 4096, fp);
+    fclose(fp);
+    if (n < 16)
+    {
+        fprintf(stderr, "%s: a TLS key file needs at least 16 bytes\n", path);
+        free(buf);
+        return -1;
+    }
+    *psk = buf;
+    *psk_len = n;
+    return 0;
+}
+
+// Hands the record layer of one direction (TLS_TX or TLS_RX) to the kernel,
+// continuing at the key's sequence number. Returns 0 or -errno (ENOENT or
+// ENOPROTOOPT when the kernel has no TLS module).
+static inline int tls_kernel_enable(int sock, int direction, const TlsKey *k)
+{
+    struct tls12_crypto_info_aes_gcm_128 info;
+
+    memset(&info, 0, sizeof(info));
+    info.info.version = TLS_1_3_VERSION;
+    info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(info.key, k->key, sizeof(info.key));
+    memcpy(info.salt, k->iv, sizeof(info.salt)); // The kernel builds the nonce as salt || iv, XOR seq
+    memcpy(info.iv, k->iv + sizeof(info.salt), sizeof(info.iv));
+    aesgcm_store_be64(info.rec_seq, k->seq);
+    if (setsockopt(sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 && errno != EEXIST)
+    {
+        return -errno;
+    }
+    return setsockopt(sock, SOL_TLS, direction, &info, sizeof(info)) < 0 ? -errno : 0;
+}
+
+#endif // COMMON_TLS_H
@@ -0,0 +1,232 @@
+// Minimal io_uring wrapper on the raw syscalls (no liburing needed), header-only:
+// #include "../common/uring.h"
+//
+// Covers what the transfer loops use: one ring per transfer, registered
+// buffers and files, and a submit-and-wait call that pushes every queued
+// request with a single io_uring_enter(). uring_init() fails with -ENOSYS or
+// -EPERM on kernels (or sandboxes) without io_uring; callers then fall back
+// to their blocking loops.
+#ifndef COMMON_URING_H
+#define COMMON_URING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned sq_entries;
+    unsigned queued;  // SQEs filled in but not yet handed to the kernel
+    long long enters; // io_uring_enter() calls, for syscall accounting
+};
+
+static inline int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+    {
+        return -errno;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ring_size > r->sq_ring_size)
+        {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+    {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ring = r->sq_ring;
+    }
+    else if ((r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                                IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        munmap(r->sq_ring, r->sq_ring_size);
+        goto fail;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        if (r->cq_ring != r->sq_ring)
+        {
+            munmap(r->cq_ring, r->cq_ring_size);
+        }
+        munmap(r->sq_ring, r->sq_ring_size);
+        goto fail;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    return 0;
+
+fail:
+    {
+        int err = -errno;
+        close(r->fd);
+        r->fd = -1;
+        return err;
+    }
+}
+
+static inline void uring_exit(struct uring *r)
+{
+    if (r->fd < 0)
+    {
+        return;
+    }
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring)
+    {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+static inline int uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned count)
+{
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -errno : 0;
+}
+
+static inline int uring_register_files(struct uring *r, const int *fds, unsigned count)
+{
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, count) < 0 ? -errno : 0;
+}
+
+// Next free SQE (zeroed), or NULL if the submission queue is full
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned tail = *r->sq_tail + r->queued;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= r->sq_entries)
+    {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    r->queued++;
+    return sqe;
+}
+
+// Publishes queued SQEs and waits for at least 'wait_nr' completions,
+// all in one io_uring_enter(). Returns 0 or -errno.
+static inline int uring_submit_and_wait(struct uring *r, unsigned wait_nr)
+{
+    unsigned submit = r->queued;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+    r->queued = 0;
+    while (submit > 0 || wait_nr > 0)
+    {
+        r->enters++;
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        submit -= (unsigned)n < submit ? (unsigned)n : submit;
+        wait_nr = 0; // The kernel only returns once enough completions are posted
+    }
+    return 0;
+}
+
+// Oldest unreaped completion, or NULL; release it with uring_cqe_seen()
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// --- Request helpers ('file' is an index into the registered files) ---
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int file, const void *addr, unsigned len,
+                                 unsigned long long offset, unsigned long long user_data)
+{
+    sqe->opcode = (uint8_t)op;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_read_fixed(struct io_uring_sqe *sqe, int file, void *buf, unsigned len,
+                                         unsigned long long offset, int buf_index, unsigned long long user_data)
+{
+    uring_prep_rw(sqe, IORING_OP_READ_FIXED, file, buf, len, offset, user_data);
+    sqe->buf_index = (uint16_t)buf_index;
+}
+
+static inline void uring_prep_write_fixed(struct io_uring_sqe *sqe, int file, const void *buf, unsigned len,
+                                          unsigned long long offset, int buf_index, unsigned long long user_data)
+{
+    uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, file, buf, len, offset, user_data);
+    sqe->buf_index = (uint16_t)buf_index;
+}
+
+static inline void uring_prep_recv(struct io_uring_sqe *sqe, int file, void *buf, unsigned len, int flags,
+                                   unsigned long long user_data)
+{
+    uring_prep_rw(sqe, IORING_OP_RECV, file, buf, len, 0, user_data);
+    sqe->msg_flags = (uint32_t)flags;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int file, const struct msghdr *msg, int flags,
+                                      unsigned long long user_data)
+{
+    uring_prep_rw(sqe, IORING_OP_SENDMSG, file, msg, 1, 0, user_data);
+    sqe->msg_flags = (uint32_t)flags;
+}
+
+#endif // COMMON_URING_H
@@ -0,0 +1,128 @@
+// Framed binary RPC protocol, header-only: #include "../common/wire.h"
+//
+// A connection opens with a preface in each direction: WIRE_MAGIC, then the
+// protocol version as a varint. The client sends the highest version it
+// speaks, and the server answers with the version both will use (or closes
+// the connection). WIRE_MAGIC is not a printable character, so a server can
+// tell a framed connection from a legacy fixed-size Metadata request by the
+// first byte alone.
+//
+// Every frame after that is a header of three LEB128 varints (opcode,
+// stream ID, payload length) followed by the payload. A 64 KB data frame on
+// a small stream ID has a 5-byte header, where the legacy Metadata header
+// is 296 bytes. Each transfer gets its own stream ID, so many of them can
+// be interleaved on one connection.
+#ifndef COMMON_WIRE_H
+#define COMMON_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WIRE_MAGIC 0xf7
+#define WIRE_VERSION 1          // Highest version this code speaks
+#define WIRE_MIN_VERSION 1      // Lowest version it still accepts
+#define WIRE_MAX_VARINT 10      // Bytes in the longest 64-bit varint
+#define WIRE_MAX_HEADER (3 * WIRE_MAX_VARINT)
+#define WIRE_MAX_PAYLOAD (256 * 1024) // Larger frames are a protocol error
+
+// Opcodes. Client -> server: OPEN (varint size, varint flags, file name),
+// DATA (body bytes), END (CRC32C, 4 bytes little-endian, if WIRE_FLAG_CRC),
+// GOAWAY (no more streams). Server -> client: STATUS (varint code) when a
+// stream finishes, and GOAWAY once every status has been sent.
+enum wire_opcode
+{
+    WIRE_OPEN = 1,
+    WIRE_DATA = 2,
+    WIRE_END = 3,
+    WIRE_STATUS = 4,
+    WIRE_GOAWAY = 5,
+};
+
+#define WIRE_FLAG_CRC 1 // OPEN flag: END carries the body's CRC32C
+
+typedef struct
+{
+    uint64_t opcode;
+    uint64_t stream;
+    uint64_t length; // Payload bytes after the header
+} WireHeader;
+
+static inline size_t wire_put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+// Bytes consumed, 0 if 'avail' ends mid-varint, -1 if it is longer than
+// WIRE_MAX_VARINT bytes
+static inline int wire_get_varint(const uint8_t *p, size_t avail, uint64_t *v)
+{
+    if (avail > 0 && p[0] < 0x80) // Fast path: opcodes, small stream IDs
+    {
+        *v = p[0];
+        return 1;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < avail; i++)
+    {
+        if (i == WIRE_MAX_VARINT)
+        {
+            return -1;
+        }
+        value |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (p[i] < 0x80)
+        {
+            *v = value;
+            return (int)i + 1;
+        }
+    }
+    return avail >= WIRE_MAX_VARINT ? -1 : 0;
+}
+
+static inline size_t wire_put_header(uint8_t *p, uint64_t opcode, uint64_t stream, uint64_t length)
+{
+    size_t n = wire_put_varint(p, opcode);
+    n += wire_put_varint(p + n, stream);
+    return n + wire_put_varint(p + n, length);
+}
+
+// Header bytes consumed, 0 if more input is needed, -1 if malformed
+static inline int wire_parse_header(const uint8_t *p, size_t avail, WireHeader *h)
+{
+    int a, b, c;
+    if ((a = wire_get_varint(p, avail, &h->opcode)) <= 0)
+    {
+        return a;
+    }
+    if ((b = wire_get_varint(p + a, avail - a, &h->stream)) <= 0)
+    {
+        return b;
+    }
+    if ((c = wire_get_varint(p + a + b, avail - a - b, &h->length)) <= 0)
+    {
+        return c;
+    }
+    return h->length > WIRE_MAX_PAYLOAD ? -1 : a + b + c;
+}
+
+static inline size_t wire_put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+    return 4;
+}
+
+static inline uint32_t wire_get_u32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#endif // COMMON_WIRE_H